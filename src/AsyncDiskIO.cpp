@@ -0,0 +1,251 @@
+//++
+// AsyncDiskIO.cpp -> CAsyncDiskIO (asynchronous disk image I/O) methods
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the UPE LIBRARY project.  UPELIB is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    UPELIB is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   The emulator's disk controller threads call CDiskImageFile::ReadSector()
+// and friends, and those block until the host file system is done.  That's
+// usually quick, but every so often it isn't and meanwhile the FPGA is left
+// waiting.  CAsyncDiskIO lets a controller thread hand the transfer off to a
+// pool of worker threads instead.  The controller builds an IO_REQUEST, calls
+// Submit(), and goes on about its business.  When the transfer is finished
+// the request either gets a completion callback, or it goes on the completion
+// queue where the controller can find it by calling Poll().
+//
+//   Requests for different disk images run in parallel, so a controller can
+// overlap a seek on one unit with a transfer on another.  Requests for the
+// SAME image, however, are always executed one at a time and in the order
+// they were submitted.  That preserves the usual disk semantics (a read after
+// a write sees the new data) and it also means that stdio images, which have
+// a shared file position, are safe.  Note that the caller should not mix
+// synchronous ReadSector()/WriteSector() calls with asynchronous requests on
+// the same image unless the image uses ACCESS_POSITIONAL or the sector cache.
+//
+//   The request queue is a simple FIFO, protected by a mutex.  Each worker
+// takes the oldest request for an image that isn't already busy.  Workers
+// sleep on their CThread flag when there's nothing to do, and Submit() raises
+// the flags to wake them up.  All the workers are woken for every request -
+// there are only a few of them and this is simpler than keeping track of
+// which ones are idle.  The ones that find nothing to do just go back to
+// sleep.
+//
+//   Since every request goes thru the normal CDiskImageFile methods, it works
+// with any image regardless of the access mode or sector cache.
+//
+// REVISION HISTORY:
+// 16-OCT-26        New file.
+//--
+//000000001111111111222222222233333333334444444444555555555566666666667777777777
+//234567890123456789012345678901234567890123456789012345678901234567890123456789
+#include <stdlib.h>             // exit(), system(), etc ...
+#include <stdint.h>	        // uint8_t, uint32_t, etc ...
+#include <assert.h>             // assert() (what else??)
+#include "UPELIB.hpp"           // UPE library definitions
+#include "LogFile.hpp"          // UPE library message logging facility
+#include "ImageFile.hpp"        // CDiskImageFile sector I/O methods
+#include "AsyncDiskIO.hpp"      // declarations for this module
+
+
+CAsyncDiskIO::CAsyncDiskIO (uint32_t nThreads)
+{
+  //++
+  //   Create the worker thread objects, but DO NOT start them running yet.
+  // Somebody has to call the Start() method for that ...
+  //--
+  assert((nThreads > 0) && (nThreads <= MAXTHREADS));
+  m_fRunning = false;  m_nPending = 0;
+  for (uint32_t i = 0;  i < nThreads;  ++i) {
+    CThread *pThread = DBGNEW CThread(&CAsyncDiskIO::WorkerThread, "disk I/O", 1, 1);
+    pThread->SetParameter(this);
+    m_vecThreads.push_back(pThread);
+  }
+}
+
+
+CAsyncDiskIO::~CAsyncDiskIO()
+{
+  //++
+  // Stop all the worker threads and then delete them ...
+  //--
+  Stop();
+  for (size_t i = 0;  i < m_vecThreads.size();  ++i) delete m_vecThreads[i];
+  m_vecThreads.clear();
+}
+
+
+bool CAsyncDiskIO::Start()
+{
+  //++
+  // Start all the worker threads running ...
+  //--
+  if (m_fRunning) return true;
+  for (size_t i = 0;  i < m_vecThreads.size();  ++i) {
+    if (!m_vecThreads[i]->Begin()) {
+      //   If we can't start them all, then stop the ones we did start.  The
+      // rest never started, so RequestExit() is harmless for them.
+      for (size_t j = 0;  j < i;  ++j) {
+        m_vecThreads[j]->RequestExit();  m_vecThreads[j]->RaiseFlag();
+        m_vecThreads[j]->Wait();
+      }
+      return false;
+    }
+  }
+  m_fRunning = true;
+  return true;
+}
+
+
+void CAsyncDiskIO::Stop()
+{
+  //++
+  //   Stop all the worker threads.  Any requests still in the queue are
+  // executed first, so this may take a while ...
+  //--
+  if (!m_fRunning) return;
+  for (size_t i = 0;  i < m_vecThreads.size();  ++i)
+    m_vecThreads[i]->RequestExit();
+  WakeWorkers();
+  for (size_t i = 0;  i < m_vecThreads.size();  ++i)
+    m_vecThreads[i]->Wait();
+  m_fRunning = false;
+}
+
+
+uint32_t CAsyncDiskIO::GetPendingCount() const
+{
+  //++
+  // Return the number of requests submitted but not yet completed ...
+  //--
+  m_QueueLock.Enter();
+  uint32_t nPending = m_nPending;
+  m_QueueLock.Leave();
+  return nPending;
+}
+
+
+void CAsyncDiskIO::WakeWorkers()
+{
+  //++
+  // Raise the flag for every worker thread ...
+  //--
+  for (size_t i = 0;  i < m_vecThreads.size();  ++i)
+    m_vecThreads[i]->RaiseFlag();
+}
+
+
+bool CAsyncDiskIO::Submit (IO_REQUEST *pRequest)
+{
+  //++
+  //   Add a request to the queue and wake up the workers.  This returns false
+  // only if the worker threads aren't running - errors in the transfer itself
+  // are reported by the fSuccess flag in the completed request.
+  //--
+  assert((pRequest != NULL) && (pRequest->pImage != NULL) && (pRequest->nCount > 0));
+  if (!m_fRunning) return false;
+  pRequest->fSuccess = false;
+  m_QueueLock.Enter();
+  m_qRequests.push_back(pRequest);  ++m_nPending;
+  m_QueueLock.Leave();
+  WakeWorkers();
+  return true;
+}
+
+
+CAsyncDiskIO::IO_REQUEST *CAsyncDiskIO::Poll()
+{
+  //++
+  //   Remove the oldest request from the completion queue and return it, or
+  // return NULL if the completion queue is empty.  Only requests without a
+  // completion callback ever end up here!
+  //--
+  IO_REQUEST *pRequest = NULL;
+  m_QueueLock.Enter();
+  if (!m_qCompleted.empty()) {
+    pRequest = m_qCompleted.front();  m_qCompleted.pop_front();
+  }
+  m_QueueLock.Leave();
+  return pRequest;
+}
+
+
+CAsyncDiskIO::IO_REQUEST *CAsyncDiskIO::NextRequest()
+{
+  //++
+  //   Find the oldest request in the queue for an image that doesn't already
+  // have a request running, remove it from the queue, and mark that image as
+  // busy.  If there aren't any, return NULL.
+  //--
+  IO_REQUEST *pRequest = NULL;
+  m_QueueLock.Enter();
+  for (deque<IO_REQUEST *>::iterator it = m_qRequests.begin();  it != m_qRequests.end();  ++it) {
+    if (m_setBusy.find((*it)->pImage) != m_setBusy.end()) continue;
+    pRequest = *it;  m_qRequests.erase(it);
+    m_setBusy.insert(pRequest->pImage);
+    break;
+  }
+  m_QueueLock.Leave();
+  return pRequest;
+}
+
+
+void CAsyncDiskIO::DoRequest (IO_REQUEST *pRequest)
+{
+  //++
+  //   Do the actual transfer and then complete the request.  Notice that the
+  // image has to be marked not busy BEFORE we call the completion routine,
+  // since that might well submit another request for the same image.  Once
+  // we've done that, the request belongs to the caller again and we can't
+  // touch it.
+  //--
+  CDiskImageFile *pImage = pRequest->pImage;
+  if (pRequest->fWrite)
+    pRequest->fSuccess = pImage->WriteSectors(pRequest->lLBA, pRequest->nCount, pRequest->pData);
+  else
+    pRequest->fSuccess = pImage->ReadSectors(pRequest->lLBA, pRequest->nCount, pRequest->pData);
+  COMPLETION_ROUTINE pCallback = pRequest->pCallback;
+  m_QueueLock.Enter();
+  m_setBusy.erase(pImage);  --m_nPending;
+  if (pCallback == NULL) m_qCompleted.push_back(pRequest);
+  bool fMore = !m_qRequests.empty();
+  m_QueueLock.Leave();
+  //   If there are other requests waiting for this image, some other worker
+  // may have gone back to sleep without them, so wake everybody up again.
+  if (fMore) WakeWorkers();
+  if (pCallback != NULL) (*pCallback)(pRequest);
+}
+
+
+void* THREAD_ATTRIBUTES CAsyncDiskIO::WorkerThread (void *pParam)
+{
+  //++
+  //   This is the worker thread.  It executes requests until there aren't
+  // any more that it can run, and then sleeps until somebody raises its flag.
+  // When an exit is requested we keep going until the queue is empty, so that
+  // no request is ever left hanging.
+  //--
+  assert(pParam != NULL);
+  CThread *pThread = (CThread *) pParam;
+  CAsyncDiskIO *pThis = (CAsyncDiskIO *) pThread->GetParameter();
+  while (true) {
+    IO_REQUEST *pRequest;
+    while ((pRequest = pThis->NextRequest()) != NULL) pThis->DoRequest(pRequest);
+    if (pThread->IsExitRequested() && (pThis->GetPendingCount() == 0)) break;
+    pThread->WaitForFlag(100);
+  }
+  LOGS(DEBUG, "disk I/O thread terminated");
+  return pThread->End();
+}
@@ -0,0 +1,121 @@
+//++
+// AsyncDiskIO.hpp -> CAsyncDiskIO (asynchronous disk image I/O) class
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the UPE LIBRARY project.  UPELIB is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    UPELIB is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   A CAsyncDiskIO object is a pool of background threads that execute disk
+// image read and write requests on behalf of the controller threads, so that
+// the latter never block on the host file system.  See AsyncDiskIO.cpp for
+// all the gory details.
+//
+// REVISION HISTORY:
+// 16-OCT-26        New file.
+//--
+#pragma once
+#include <deque>                // C++ std::deque template
+#include <vector>               // C++ std::vector template
+#include <unordered_set>        // C++ std::unordered_set (a simple list) template
+using std::deque;               // ...
+using std::vector;              // ...
+using std::unordered_set;       // ...
+#include "Thread.hpp"           // needed for THREAD_ATTRIBUTES ...
+#include "Mutex.hpp"            // needed for CMutex ...
+class CDiskImageFile;           // forward reference for IO_REQUEST ...
+
+
+class CAsyncDiskIO {
+  //++
+  //--
+
+  // Constants and defaults ...
+public:
+  enum {
+    DEFAULT_THREADS = 4,        // default number of worker threads
+    MAXTHREADS      = 32,       // maximum number of worker threads
+  };
+
+  //   An IO_REQUEST describes one asynchronous transfer of nCount contiguous
+  // sectors.  The caller allocates the request and fills in everything down
+  // to pContext, and then calls Submit().  The request (and the data buffer!)
+  // belong to us until the request completes, and then fSuccess tells whether
+  // the transfer worked.  If pCallback is not NULL then it's called, from one
+  // of the worker threads, when the request completes.  Otherwise the request
+  // is put on the completion queue and the caller finds it with Poll().
+public:
+  struct _IO_REQUEST;
+  typedef void (*COMPLETION_ROUTINE) (struct _IO_REQUEST *pRequest);
+  struct _IO_REQUEST {
+    CDiskImageFile     *pImage;     // disk image to read or write
+    bool                fWrite;     // TRUE for a write, FALSE for a read
+    uint32_t            lLBA;       // first sector to transfer
+    uint32_t            nCount;     // number of sectors
+    void               *pData;      // buffer, nCount*GetSectorSize() bytes
+    COMPLETION_ROUTINE  pCallback;  // called when done (or NULL to Poll())
+    void               *pContext;   // anything the caller wants to remember
+    bool                fSuccess;   // TRUE if the transfer worked
+  };
+  typedef struct _IO_REQUEST IO_REQUEST;
+
+  // Constructor and destructor ...
+public:
+  CAsyncDiskIO (uint32_t nThreads=DEFAULT_THREADS);
+  virtual ~CAsyncDiskIO();
+  // Disallow copy and assignment operations with CAsyncDiskIO objects...
+private:
+  CAsyncDiskIO (const CAsyncDiskIO &a) = delete;
+  CAsyncDiskIO& operator= (const CAsyncDiskIO &a) = delete;
+
+  // Properties ...
+public:
+  // Return the number of worker threads ...
+  uint32_t GetThreadCount() const {return MKINT32(m_vecThreads.size());}
+  // TRUE if the worker threads are running ...
+  bool IsRunning() const {return m_fRunning;}
+  // Return the number of requests submitted but not yet completed ...
+  uint32_t GetPendingCount() const;
+
+  // Public methods ...
+public:
+  // Start and stop the worker threads ...
+  bool Start();
+  void Stop();
+  // Queue a request for the worker threads ...
+  bool Submit (IO_REQUEST *pRequest);
+  // Remove a completed request from the completion queue (or return NULL) ...
+  IO_REQUEST *Poll();
+
+  // Local methods ...
+protected:
+  // Take the next request we're allowed to run from the queue ...
+  IO_REQUEST *NextRequest();
+  // Execute a request and then complete it ...
+  void DoRequest (IO_REQUEST *pRequest);
+  // Wake up all the idle worker threads ...
+  void WakeWorkers();
+  // The background worker thread ...
+  static void* THREAD_ATTRIBUTES WorkerThread (void *pParam);
+
+  // Local members ...
+protected:
+  vector<CThread *>  m_vecThreads;    // worker threads
+  bool               m_fRunning;      // TRUE if Start() has been called
+  uint32_t           m_nPending;      // requests submitted but not completed
+  deque<IO_REQUEST *> m_qRequests;    // requests waiting for a worker
+  deque<IO_REQUEST *> m_qCompleted;   // completed requests waiting for Poll()
+  unordered_set<CDiskImageFile *> m_setBusy; // images with a request running
+  mutable CMutex     m_QueueLock;     // interlock for all the above
+};
@@ -56,11 +56,15 @@
 #include "UPELIB.hpp"           // UPE library definitions
 #include "SafeCRT.h"		// replacements for Microsoft "safe" CRT functions
 #include "LogFile.hpp"          // UPE library message logging facility
+#include "ImageFile.hpp"        // CImageFile::Flush() for AddImage(), et al
 #include "CheckpointFiles.hpp"  // declarations for this module
 
 
 // Initialize the pointer to the one and only CCheckpointFiles instance ...
 CCheckpointFiles *CCheckpointFiles::m_pCheckpoint = NULL;
+// And the set of image files, which exists whether checkpointing is on or not ...
+CCheckpointFiles::IMAGESET CCheckpointFiles::m_setImages;
+CMutex CCheckpointFiles::m_ImageLock;
 
 
 CCheckpointFiles::CCheckpointFiles (uint32_t dwInterval)
@@ -75,10 +79,20 @@ CCheckpointFiles::CCheckpointFiles (uint32_t dwInterval)
   //   One slight annoyance - be sure to notice that the parameter to this
   // constructor is the checkpoint interval, IN SECONDS, but the m_dwInterval
   // member is the same interval, IN MILLISECONDS!  Sorry about that...
+  //
+  //   The one exception is image files - if any were opened before we were
+  // created, then they're already in m_setImages and they've been waiting for
+  // us.  In that case we start the thread right away, just as AddImage()
+  // would have done.
   //--
   assert((m_pCheckpoint == NULL) && (dwInterval > 0));
-  m_pCheckpoint = this;  m_dwInterval = dwInterval*1000;  m_setFiles.clear();
+  m_dwInterval = dwInterval*1000;  m_setFiles.clear();
   m_CheckpointThread.SetParameter(this);
+  m_pCheckpoint = this;
+  m_ImageLock.Enter();
+  bool fImages = !m_setImages.empty();
+  m_ImageLock.Leave();
+  if (fImages) Start();
 
 }
 
@@ -134,6 +148,12 @@ void* THREAD_ATTRIBUTES CCheckpointFiles::CheckpointThread (void *pParam)
     int nFiles = 0;
     for (iterator it = pThis->begin();  it != pThis->end();  ++it)
       if (Checkpoint(*it)) ++nFiles;
+    //   Image files can be attached and detached by the UI thread at any
+    // time, so we need to hold the lock while we're walking this set ...
+    pThis->m_ImageLock.Enter();
+    for (IMAGESET::iterator it = pThis->m_setImages.begin();  it != pThis->m_setImages.end();  ++it)
+      if ((*it)->Flush()) ++nFiles;
+    pThis->m_ImageLock.Leave();
 //  if (nFiles > 0) LOGF(TRACE, "checkpointed %d files", nFiles);
   }
   LOGS(DEBUG, "file checkpoint thread terminated");
@@ -152,6 +172,36 @@ pair<CCheckpointFiles::iterator, bool> CCheckpointFiles::AddFile(FILE *f)
 }
 
 
+void CCheckpointFiles::AddImage (CImageFile *pImage)
+{
+  //++
+  //   Add an image file to the checkpoint set and, just like AddFile(), start
+  // the background thread if it isn't already running.  This is static and
+  // it's OK to call it even when checkpointing isn't enabled - the image just
+  // waits in the set until somebody creates the CCheckpointFiles object ...
+  //--
+  assert(pImage != NULL);
+  m_ImageLock.Enter();
+  m_setImages.insert(pImage);
+  m_ImageLock.Leave();
+  if (IsEnabled() && !m_pCheckpoint->IsRunning()) m_pCheckpoint->Start();
+}
+
+
+void CCheckpointFiles::RemoveImage (CImageFile *pImage)
+{
+  //++
+  //   Remove an image file from the checkpoint set.  This MUST be called
+  // before the image is closed or destroyed, and holding the lock here
+  // guarantees that the background thread isn't in the middle of flushing
+  // this very image when we return ...
+  //--
+  m_ImageLock.Enter();
+  m_setImages.erase(pImage);
+  m_ImageLock.Leave();
+}
+
+
 void CCheckpointFiles::SetInterval (uint32_t dwInterval)
 {
   //++
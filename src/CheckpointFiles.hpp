@@ -26,6 +26,8 @@
 using std::pair;                // ...
 using std::unordered_set;       // ...
 #include "Thread.hpp"           // needed for THREAD_ATTRIBUTES ...
+#include "Mutex.hpp"            // needed for CMutex ...
+class CImageFile;               // forward reference for AddImage(), et al ...
 
 
 class CCheckpointFiles {
@@ -56,6 +58,17 @@ public:
   iterator begin() {return m_setFiles.begin();}
   iterator end()   {return m_setFiles.end();}
 
+  //   The IMAGE_SET is a similar set of image files.  Some image files (e.g.
+  // memory mapped disk images) need more than a simple fflush() to get their
+  // data onto the disk, so for these we call the CImageFile::Flush() method
+  // instead.  Images are added to this set with the AddImage() method.
+  //
+  //   Unlike the FILE_SET, this one is static and images are always added to
+  // it, even when checkpointing isn't enabled.  That way any images that are
+  // already open when somebody creates the CCheckpointFiles object later are
+  // still checkpointed.
+  typedef unordered_set<CImageFile *> IMAGESET;
+
   // Properties ...
 public:
   // Return TRUE if file checkpointing has been enabled ...
@@ -79,8 +92,10 @@ public:
   // Add or remove files from the collection ...
   pair<iterator, bool> AddFile (FILE *f);
   void RemoveFile (FILE *f) {m_setFiles.erase(f);}
+  // Add or remove image files from the collection ...
+  static void AddImage (CImageFile *pImage);
+  static void RemoveImage (CImageFile *pImage);
 
-  
   // Local methods ...
 protected:
   // Checkpoint just one file ...
@@ -94,4 +109,6 @@ protected:
   FILESET   m_setFiles;         // files we want to checkpoint
   CThread   m_CheckpointThread; // background thread to do the checkpoints
   static CCheckpointFiles *m_pCheckpoint; // the one and CCheckpointFiles instance
+  static IMAGESET m_setImages;  // image files we want to checkpoint
+  static CMutex   m_ImageLock;  // interlock for the m_setImages collection
 };
@@ -0,0 +1,501 @@
+//++
+// CompressedImage.cpp -> CCompressedImage (compressed disk image) methods
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the UPE LIBRARY project.  UPELIB is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    UPELIB is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   Most of the disk images we keep around are distribution packs that are
+// never written, and most of any disk pack is either empty or very repetitive.
+// A compressed image divides the original image into fixed size chunks (64K
+// bytes by default) and compresses each one separately.  An index in the
+// header gives the file offset of every chunk, so any sector can be found
+// without reading anything else.  All zero chunks take up no space at all,
+// and chunks that don't compress are just stored verbatim.
+//
+//   The compression is a simple byte oriented LZ77 scheme using the LZ4 block
+// format - each sequence is a token byte, a run of literals, a two byte back
+// reference offset, and a match length.  It doesn't compress as tightly as
+// zlib, but it expands several times faster and that's what matters here.
+// It's all done right here, so there's no extra library to find on Windows.
+//
+//   Decompressing a chunk takes much longer than reading one sector, so the
+// last few decompressed chunks are cached.  Sequential reads stay in the same
+// chunk for a long time and nearly always hit the cache.
+//
+//   Compressed images are ALWAYS read only.  If you want to write one, open
+// it as the base of a copy on write overlay (see CDiskImageFile::OpenOverlay())
+// and the writes will go to the delta.
+//
+// REVISION HISTORY:
+// 16-OCT-26        New file.
+//--
+//000000001111111111222222222233333333334444444444555555555566666666667777777777
+//234567890123456789012345678901234567890123456789012345678901234567890123456789
+#include <stdlib.h>             // exit(), system(), etc ...
+#include <stdint.h>	        // uint8_t, uint32_t, etc ...
+#include <assert.h>             // assert() (what else??)
+#include <errno.h>              // ENOENT, EACCESS, etc ...
+#include <string.h>             // memcpy(), memset(), etc ...
+#include "UPELIB.hpp"           // UPE library definitions
+#include "SafeCRT.h"		// replacements for Microsoft "safe" CRT functions
+#include "LogFile.hpp"          // UPE library message logging facility
+#include "CompressedImage.hpp"  // declarations for this module
+
+//   Microsoft spells the 64 bit versions of fseek() and ftell() differently,
+// but otherwise they're the same as the POSIX ones ...
+#ifdef _WIN32
+#define fseeko(f,o,w)   _fseeki64(f,o,w)
+#define ftello(f)       _ftelli64(f)
+#endif
+
+//   These are the magic numbers for the LZ4 block format.  Every match is at
+// least MINMATCH bytes, the last LASTLITERALS bytes of a chunk are always
+// literals, and no match may start in the last MFLIMIT bytes.  The hash table
+// used to find matches has 2^HASHLOG entries.
+#define MINMATCH        4
+#define LASTLITERALS    5
+#define MFLIMIT         12
+#define MAXOFFSET       65535
+#define HASHLOG         12
+
+
+CCompressedImage::CCompressedImage (uint32_t nSectorSize, uint32_t nCacheChunks)
+{
+  //++
+  //   The constructor just initializes the members - the cache slots aren't
+  // allocated until Open() knows the chunk size.
+  //--
+  assert((nSectorSize > 0) && (nCacheChunks > 0));
+  m_pFile = NULL;  m_nSectorSize = nSectorSize;
+  m_cbChunk = m_nChunks = 0;  m_llLength = 0;
+  m_llClock = m_llHits = m_llMisses = 0;
+  m_vecSlots.resize(nCacheChunks);
+  for (size_t i = 0;  i < m_vecSlots.size();  ++i) {
+    m_vecSlots[i].nChunk = 0;  m_vecSlots[i].fValid = false;
+    m_vecSlots[i].llLastUsed = 0;  m_vecSlots[i].pabData = NULL;
+  }
+}
+
+
+CCompressedImage::~CCompressedImage()
+{
+  //++
+  //   Free the cache slots.  Note that we DON'T close the file - that belongs
+  // to the CDiskImageFile object.
+  //--
+  for (size_t i = 0;  i < m_vecSlots.size();  ++i) delete[] m_vecSlots[i].pabData;
+}
+
+
+bool CCompressedImage::Error (const char *pszMsg, int nError) const
+{
+  //++
+  // Print a compressed image error message and then always return false ...
+  //--
+  char sz[80];
+  LOGS(ERROR, "error (" << nError << ") " << pszMsg << " compressed image " << m_sFileName);
+  if (nError > 0) {
+    strerror_s(sz, sizeof(sz), nError);
+    LOGS(ERROR, sz);
+  }
+  return false;
+}
+
+
+/*static*/ const char *CCompressedImage::CheckHeader (const COMPRESSED_HEADER &hdr, uint64_t cbFile)
+{
+  //++
+  //   Check a compressed image header for consistency and return NULL if it's
+  // OK, or else a short description of what's wrong with it.  The magic
+  // number alone is only four bytes, and any raw image could start with that
+  // by chance, so everything else has to make sense too.
+  //--
+  if (hdr.lMagic != COMPRESSED_MAGIC) return "bad magic number";
+  if (hdr.lVersion != COMPRESSED_VERSION) return "unknown version";
+  if ((hdr.cbChunk == 0) || (hdr.cbChunk > MAX_CHUNK_SIZE)) return "bad chunk size";
+  if ((hdr.nSectorSize == 0) || ((hdr.cbChunk % hdr.nSectorSize) != 0)) return "bad sector size";
+  if ((uint64_t) hdr.nChunks != (hdr.llLength + hdr.cbChunk - 1) / hdr.cbChunk) return "bad chunk count";
+  if (hdr.lReserved != 0) return "bad reserved field";
+  if (cbFile < sizeof(hdr) + ((uint64_t) hdr.nChunks+1) * sizeof(uint64_t)) return "truncated index";
+  return NULL;
+}
+
+
+/*static*/ bool CCompressedImage::IsCompressed (FILE *pFile, const string &sFileName)
+{
+  //++
+  //   Return TRUE if this file starts with a valid compressed image header.
+  // If the magic number matches but the rest of the header doesn't, then we
+  // say why and treat it as an ordinary image.  The file position is left at
+  // the beginning, either way.
+  //--
+  assert(pFile != NULL);
+  COMPRESSED_HEADER hdr;
+  bool fCompressed = false;
+  rewind(pFile);
+  if (   (fread(&hdr, 1, sizeof(hdr), pFile) == sizeof(hdr))
+      && (hdr.lMagic == COMPRESSED_MAGIC)) {
+    const char *pszReason = "unable to find the file length";
+    if (fseeko(pFile, 0, SEEK_END) == 0)
+      pszReason = CheckHeader(hdr, (uint64_t) ftello(pFile));
+    if (pszReason == NULL) {
+      fCompressed = true;
+    } else {
+      LOGS(WARNING, sFileName << " has a compressed image signature but " << pszReason << " - treating it as a raw image");
+    }
+  }
+  rewind(pFile);
+  return fCompressed;
+}
+
+
+bool CCompressedImage::Open (FILE *pFile, const string &sFileName)
+{
+  //++
+  //   Read and check the header, then read the entire chunk index into memory.
+  // The index has to be in ascending order and can't point past the end of
+  // the file, or else we reject the whole image.
+  //--
+  assert(pFile != NULL);
+  m_pFile = pFile;  m_sFileName = sFileName;
+  COMPRESSED_HEADER hdr;
+  if (fseeko(m_pFile, 0, SEEK_END) != 0) return Error("seeking", errno);
+  uint64_t cbFile = (uint64_t) ftello(m_pFile);
+  rewind(m_pFile);
+  if (fread(&hdr, 1, sizeof(hdr), m_pFile) != sizeof(hdr)) return Error("reading header", errno);
+  const char *pszReason = CheckHeader(hdr, cbFile);
+  if (pszReason != NULL) {
+    LOGS(ERROR, pszReason << " in compressed image " << sFileName);  return false;
+  }
+  if (hdr.nSectorSize != m_nSectorSize)
+    LOGS(WARNING, "compressed image " << sFileName << " has " << hdr.nSectorSize << " byte sectors");
+  m_cbChunk = hdr.cbChunk;  m_nChunks = hdr.nChunks;  m_llLength = hdr.llLength;
+  m_vecIndex.resize((size_t) m_nChunks+1);
+  size_t cbIndex = m_vecIndex.size() * sizeof(uint64_t);
+  if (fread(m_vecIndex.data(), 1, cbIndex, m_pFile) != cbIndex) return Error("reading index", errno);
+  if (m_vecIndex[0] < sizeof(hdr) + cbIndex) return Error("bad index in", 0);
+  for (uint32_t i = 0;  i < m_nChunks;  ++i) {
+    uint64_t cb = m_vecIndex[i+1] - m_vecIndex[i];
+    if ((m_vecIndex[i+1] < m_vecIndex[i]) || (m_vecIndex[i+1] > cbFile) || (cb > m_cbChunk))
+      return Error("bad index in", 0);
+  }
+  for (size_t i = 0;  i < m_vecSlots.size();  ++i) {
+    delete[] m_vecSlots[i].pabData;
+    m_vecSlots[i].pabData = DBGNEW uint8_t[m_cbChunk];  m_vecSlots[i].fValid = false;
+  }
+  m_vecBuffer.resize(m_cbChunk);
+  LOGS(DEBUG, "compressed image " << sFileName << " has " << m_nChunks << " chunks, " << m_llLength << " bytes");
+  return true;
+}
+
+
+size_t CCompressedImage::ChunkLength (uint32_t nChunk) const
+{
+  //++
+  // Return the uncompressed length of a chunk.  Only the last can be short ...
+  //--
+  uint64_t llStart = (uint64_t) nChunk * m_cbChunk;
+  return (size_t) MIN(m_llLength-llStart, (uint64_t) m_cbChunk);
+}
+
+
+bool CCompressedImage::LoadChunk (uint32_t nChunk, uint8_t *pabData)
+{
+  //++
+  //   Read one chunk from the file and decompress it into pabData.  Zero
+  // length chunks are all zeros, and chunks exactly the uncompressed size
+  // were stored verbatim.  Anything past the end of a short last chunk is
+  // zeroed too, so the caller can always use the whole buffer.
+  //--
+  size_t cbData = ChunkLength(nChunk);
+  size_t cbStored = (size_t) (m_vecIndex[nChunk+1] - m_vecIndex[nChunk]);
+  if (cbData < m_cbChunk) memset(pabData+cbData, 0, m_cbChunk-cbData);
+  if (cbStored == 0) {
+    memset(pabData, 0, cbData);  return true;
+  }
+  uint8_t *pabRead = (cbStored == cbData) ? pabData : m_vecBuffer.data();
+  if (fseeko(m_pFile, (off_t) m_vecIndex[nChunk], SEEK_SET) != 0) return Error("seeking", errno);
+  if (fread(pabRead, 1, cbStored, m_pFile) != cbStored) return Error("reading", errno);
+  if (cbStored == cbData) return true;
+  if (!Expand(pabRead, cbStored, pabData, cbData)) return Error("expanding chunk in", 0);
+  return true;
+}
+
+
+const uint8_t *CCompressedImage::GetChunk (uint32_t nChunk)
+{
+  //++
+  //   Return a pointer to the decompressed data for a chunk.  If it's not
+  // already in the cache, then the least recently used slot is reused.  The
+  // pointer is only good until the next call, and the caller must be holding
+  // m_ReadLock!
+  //--
+  CHUNK_SLOT *pVictim = &m_vecSlots[0];
+  for (size_t i = 0;  i < m_vecSlots.size();  ++i) {
+    CHUNK_SLOT *pSlot = &m_vecSlots[i];
+    if (pSlot->fValid && (pSlot->nChunk == nChunk)) {
+      pSlot->llLastUsed = ++m_llClock;  ++m_llHits;
+      return pSlot->pabData;
+    }
+    if (!pSlot->fValid || (pSlot->llLastUsed < pVictim->llLastUsed)) pVictim = pSlot;
+  }
+  ++m_llMisses;
+  pVictim->fValid = false;
+  if (!LoadChunk(nChunk, pVictim->pabData)) return NULL;
+  pVictim->nChunk = nChunk;  pVictim->fValid = true;
+  pVictim->llLastUsed = ++m_llClock;
+  return pVictim->pabData;
+}
+
+
+bool CCompressedImage::Read (uint32_t lLBA, uint32_t nCount, void *pData)
+{
+  //++
+  //   Read nCount contiguous sectors, starting at lLBA.  The run may cross
+  // chunk boundaries, and anything past the end of the original image reads
+  // as zeros, just like an ordinary image file.
+  //--
+  assert(m_pFile != NULL);
+  uint8_t *pab = (uint8_t *) pData;
+  uint64_t llOffset = (uint64_t) lLBA * m_nSectorSize;
+  uint64_t cbLeft = (uint64_t) nCount * m_nSectorSize;
+  m_ReadLock.Enter();
+  while (cbLeft > 0) {
+    if (llOffset >= m_llLength) {
+      memset(pab, 0, (size_t) cbLeft);  break;
+    }
+    uint32_t nChunk = (uint32_t) (llOffset / m_cbChunk);
+    size_t ibChunk = (size_t) (llOffset % m_cbChunk);
+    size_t cb = (size_t) MIN(cbLeft, (uint64_t) (m_cbChunk-ibChunk));
+    const uint8_t *pabChunk = GetChunk(nChunk);
+    if (pabChunk == NULL) {
+      m_ReadLock.Leave();  return false;
+    }
+    memcpy(pab, pabChunk+ibChunk, cb);
+    pab += cb;  llOffset += cb;  cbLeft -= cb;
+  }
+  m_ReadLock.Leave();
+  return true;
+}
+
+
+static inline uint32_t Read32 (const uint8_t *pab)
+{
+  //++
+  // Fetch four (possibly unaligned) bytes ...
+  //--
+  uint32_t l;  memcpy(&l, pab, sizeof(l));  return l;
+}
+
+
+static inline uint32_t Hash32 (uint32_t l)
+{
+  //++
+  // Hash four bytes for the match finder ...
+  //--
+  return ((uint32_t) (l * 2654435761U)) >> (32-HASHLOG);
+}
+
+
+static bool PutLength (uint8_t *&pabOut, const uint8_t *pabEnd, size_t cb)
+{
+  //++
+  //   Write the extra bytes for a literal or match length that didn't fit in
+  // the token - as many 255s as needed, then the remainder ...
+  //--
+  for (;  cb >= 255;  cb -= 255) {
+    if (pabOut >= pabEnd) return false;
+    *pabOut++ = 255;
+  }
+  if (pabOut >= pabEnd) return false;
+  *pabOut++ = (uint8_t) cb;
+  return true;
+}
+
+
+static bool PutSequence (uint8_t *&pabOut, const uint8_t *pabEnd, const uint8_t *pabLiterals,
+                         size_t cbLiterals, size_t nOffset, size_t cbMatch)
+{
+  //++
+  //   Write one LZ4 sequence - the token, the literals, and then the match
+  // offset and length.  If cbMatch is zero then this is the last sequence,
+  // and it has only literals.  Returns false if the output buffer is full.
+  //--
+  if (pabOut >= pabEnd) return false;
+  uint8_t *pToken = pabOut++;
+  *pToken = (uint8_t) (MIN(cbLiterals, (size_t) 15) << 4);
+  if ((cbLiterals >= 15) && !PutLength(pabOut, pabEnd, cbLiterals-15)) return false;
+  if ((size_t) (pabEnd-pabOut) < cbLiterals) return false;
+  memcpy(pabOut, pabLiterals, cbLiterals);  pabOut += cbLiterals;
+  if (cbMatch == 0) return true;
+  if (pabEnd-pabOut < 2) return false;
+  *pabOut++ = (uint8_t) (nOffset & 0xFF);  *pabOut++ = (uint8_t) (nOffset >> 8);
+  cbMatch -= MINMATCH;
+  *pToken |= (uint8_t) MIN(cbMatch, (size_t) 15);
+  if ((cbMatch >= 15) && !PutLength(pabOut, pabEnd, cbMatch-15)) return false;
+  return true;
+}
+
+
+/*static*/ size_t CCompressedImage::Compress (const uint8_t *pabIn, size_t cbIn, uint8_t *pabOut, size_t cbOut)
+{
+  //++
+  //   Compress cbIn bytes into pabOut and return the compressed length.  If
+  // the result won't fit in cbOut bytes then return zero, and the caller will
+  // store the chunk verbatim instead.  This is a greedy LZ77 - for every
+  // position we look up the last place the same four bytes occurred and, if
+  // it's close enough, take the longest match we can get there.
+  //--
+  uint32_t aHash[1 << HASHLOG];
+  memset(aHash, 0, sizeof(aHash));
+  uint8_t *pabNext = pabOut;  const uint8_t *pabEnd = pabOut + cbOut;
+  size_t ib = 0, ibAnchor = 0;
+  if (cbIn > MFLIMIT) {
+    size_t ibLimit = cbIn - MFLIMIT;
+    while (ib < ibLimit) {
+      uint32_t lSequence = Read32(pabIn+ib);
+      uint32_t h = Hash32(lSequence);
+      size_t ibRef = aHash[h];  aHash[h] = (uint32_t) ib;
+      if ((ibRef >= ib) || (ib-ibRef > MAXOFFSET) || (Read32(pabIn+ibRef) != lSequence)) {
+        ++ib;  continue;
+      }
+      size_t cbMatch = MINMATCH;
+      while ((ib+cbMatch < cbIn-LASTLITERALS) && (pabIn[ibRef+cbMatch] == pabIn[ib+cbMatch])) ++cbMatch;
+      if (!PutSequence(pabNext, pabEnd, pabIn+ibAnchor, ib-ibAnchor, ib-ibRef, cbMatch)) return 0;
+      ib += cbMatch;  ibAnchor = ib;
+    }
+  }
+  if (!PutSequence(pabNext, pabEnd, pabIn+ibAnchor, cbIn-ibAnchor, 0, 0)) return 0;
+  return (size_t) (pabNext - pabOut);
+}
+
+
+/*static*/ bool CCompressedImage::Expand (const uint8_t *pabIn, size_t cbIn, uint8_t *pabOut, size_t cbOut)
+{
+  //++
+  //   Expand a compressed chunk.  The result must be exactly cbOut bytes.
+  // Every length and offset is checked, so a corrupted image file can give
+  // us garbage data but it can't make us run off the end of a buffer.
+  //--
+  size_t ibIn = 0, ibOut = 0;
+  while (ibIn < cbIn) {
+    uint8_t bToken = pabIn[ibIn++];
+    size_t cbLiterals = bToken >> 4;
+    if (cbLiterals == 15) {
+      uint8_t b;
+      do {
+        if (ibIn >= cbIn) return false;
+        b = pabIn[ibIn++];  cbLiterals += b;
+      } while (b == 255);
+    }
+    if ((cbLiterals > cbIn-ibIn) || (cbLiterals > cbOut-ibOut)) return false;
+    memcpy(pabOut+ibOut, pabIn+ibIn, cbLiterals);
+    ibIn += cbLiterals;  ibOut += cbLiterals;
+    if (ibIn == cbIn) break;
+    if (cbIn-ibIn < 2) return false;
+    size_t nOffset = pabIn[ibIn] | (pabIn[ibIn+1] << 8);  ibIn += 2;
+    if ((nOffset == 0) || (nOffset > ibOut)) return false;
+    size_t cbMatch = bToken & 0xF;
+    if (cbMatch == 15) {
+      uint8_t b;
+      do {
+        if (ibIn >= cbIn) return false;
+        b = pabIn[ibIn++];  cbMatch += b;
+      } while (b == 255);
+    }
+    cbMatch += MINMATCH;
+    if (cbMatch > cbOut-ibOut) return false;
+    //   The match can overlap the output (e.g. a run of the same byte has an
+    // offset of one) so this has to be copied a byte at a time ...
+    for (size_t i = 0;  i < cbMatch;  ++i, ++ibOut) pabOut[ibOut] = pabOut[ibOut-nOffset];
+  }
+  return ibOut == cbOut;
+}
+
+
+/*static*/ bool CCompressedImage::CompressImage (const string &sRawFile, const string &sCompressedFile, uint32_t nSectorSize, uint32_t cbChunk)
+{
+  //++
+  //   Convert an ordinary (simh style) disk image to a compressed image.  The
+  // chunk size must be a multiple of the sector size.  The new file is
+  // overwritten if it already exists!  The header and the index are written
+  // last, after all the chunks, so a partial file is never mistaken for a
+  // valid image.
+  //--
+  assert((nSectorSize > 0) && (cbChunk > 0));
+  if (((cbChunk % nSectorSize) != 0) || (cbChunk > MAX_CHUNK_SIZE)) {
+    LOGS(ERROR, "invalid chunk size " << cbChunk << " for " << sCompressedFile);
+    return false;
+  }
+  if (IsSameFile(sRawFile.c_str(), sCompressedFile.c_str())) {
+    LOGS(ERROR, "can't compress " << sRawFile << " onto itself");  return false;
+  }
+  FILE *pRaw = fopen(sRawFile.c_str(), "rb");
+  if (pRaw == NULL) {
+    LOGS(ERROR, "error (" << errno << ") opening " << sRawFile);  return false;
+  }
+  FILE *pNew = fopen(sCompressedFile.c_str(), "wb");
+  if (pNew == NULL) {
+    LOGS(ERROR, "error (" << errno << ") creating " << sCompressedFile);
+    fclose(pRaw);  return false;
+  }
+  if (fseeko(pRaw, 0, SEEK_END) != 0) {
+    LOGS(ERROR, "error (" << errno << ") seeking " << sRawFile);
+    fclose(pNew);  fclose(pRaw);  return false;
+  }
+  uint64_t llLength = (uint64_t) ftello(pRaw);
+  rewind(pRaw);
+  COMPRESSED_HEADER hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.lMagic = COMPRESSED_MAGIC;  hdr.lVersion = COMPRESSED_VERSION;
+  hdr.nSectorSize = nSectorSize;  hdr.cbChunk = cbChunk;  hdr.llLength = llLength;
+  hdr.nChunks = (uint32_t) ((llLength + cbChunk - 1) / cbChunk);
+  vector<uint64_t> vecIndex((size_t) hdr.nChunks+1, 0);
+  uint64_t llOffset = sizeof(hdr) + vecIndex.size()*sizeof(uint64_t);
+  vector<uint8_t> vecIn(cbChunk), vecOut(cbChunk);
+  bool fOK = (fseeko(pNew, (off_t) llOffset, SEEK_SET) == 0);
+  for (uint32_t i = 0;  fOK && (i < hdr.nChunks);  ++i) {
+    vecIndex[i] = llOffset;
+    size_t cbData = (size_t) MIN(llLength - (uint64_t) i*cbChunk, (uint64_t) cbChunk);
+    if (fread(vecIn.data(), 1, cbData, pRaw) != cbData) {
+      fOK = false;  break;
+    }
+    //   All zero chunks aren't stored at all.  Otherwise try to compress the
+    // chunk, and store it verbatim if that doesn't make it any smaller.
+    if ((vecIn[0] == 0) && (memcmp(vecIn.data(), vecIn.data()+1, cbData-1) == 0)) continue;
+    size_t cbStored = Compress(vecIn.data(), cbData, vecOut.data(), cbData-1);
+    const uint8_t *pabStored = vecOut.data();
+    if (cbStored == 0) {
+      cbStored = cbData;  pabStored = vecIn.data();
+    }
+    if (fwrite(pabStored, 1, cbStored, pNew) != cbStored) fOK = false;
+    llOffset += cbStored;
+  }
+  vecIndex[hdr.nChunks] = llOffset;
+  if (fOK) {
+    rewind(pNew);
+    fOK = (fwrite(&hdr, 1, sizeof(hdr), pNew) == sizeof(hdr))
+       && (fwrite(vecIndex.data(), sizeof(uint64_t), vecIndex.size(), pNew) == vecIndex.size());
+  }
+  if (fclose(pNew) != 0) fOK = false;
+  fclose(pRaw);
+  if (fOK) {
+    LOGS(DEBUG, "compressed " << sRawFile << " (" << llLength << " bytes) to " << sCompressedFile << " (" << llOffset << " bytes)");
+  } else {
+    LOGS(ERROR, "error (" << errno << ") compressing " << sRawFile << " to " << sCompressedFile);
+  }
+  return fOK;
+}
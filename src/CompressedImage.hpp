@@ -0,0 +1,143 @@
+//++
+// CompressedImage.hpp -> CCompressedImage (compressed disk image) class
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the UPE LIBRARY project.  UPELIB is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    UPELIB is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   A CCompressedImage object reads sectors from a compressed, read only,
+// disk image file.  CDiskImageFile::Open() recognizes compressed images and
+// creates one of these automatically, so the rest of the world never knows
+// the difference.  The static CompressImage() method converts an ordinary
+// image file to the compressed format.  See CompressedImage.cpp for details.
+//
+// REVISION HISTORY:
+// 16-OCT-26        New file.
+//--
+#pragma once
+#include <stdio.h>              // FILE, fread(), etc ...
+#include <string>               // C++ std::string class, et al ...
+#include <vector>               // C++ std::vector template
+using std::string;              // ...
+using std::vector;              // ...
+#include "Mutex.hpp"            // needed for CMutex ...
+
+
+class CCompressedImage {
+  //++
+  //--
+
+  // Constants ...
+public:
+  enum {
+    COMPRESSED_MAGIC    = 0x5A435055UL, // "UPCZ" - magic number in the header
+    COMPRESSED_VERSION  = 1,            // current file format version
+    DEFAULT_CHUNK_SIZE  = 64*1024,      // default uncompressed chunk size
+    MAX_CHUNK_SIZE      = 1024*1024,    // largest chunk size we'll accept
+    DEFAULT_CACHE_CHUNKS= 16,           // decompressed chunks to keep around
+  };
+
+  //   A compressed image file starts with this header, and right after it
+  // comes the chunk index - nChunks+1 64 bit file offsets.  Chunk i occupies
+  // the bytes from index[i] up to index[i+1].  If that's zero bytes, then the
+  // chunk is all zeros.  If it's exactly the uncompressed chunk size, then
+  // the chunk is stored verbatim, and anything else is compressed.
+protected:
+  struct _COMPRESSED_HEADER {
+    uint32_t  lMagic;           // always COMPRESSED_MAGIC
+    uint32_t  lVersion;         // file format version
+    uint32_t  nSectorSize;      // sector size of the original image
+    uint32_t  cbChunk;          // uncompressed size of every chunk
+    uint64_t  llLength;         // length of the original image, in bytes
+    uint32_t  nChunks;          // number of chunks in the image
+    uint32_t  lReserved;        // (unused - always zero)
+  };
+  typedef struct _COMPRESSED_HEADER COMPRESSED_HEADER;
+
+  //   Each slot in the chunk cache holds one decompressed chunk.  There are
+  // only a few slots, so they're just searched linearly and the least
+  // recently used one is replaced on a miss.
+  struct _CHUNK_SLOT {
+    uint32_t  nChunk;           // chunk number in this slot
+    bool      fValid;           // TRUE if this slot contains anything
+    uint64_t  llLastUsed;       // "time" this slot was last used
+    uint8_t  *pabData;          // decompressed chunk data
+  };
+  typedef struct _CHUNK_SLOT CHUNK_SLOT;
+
+  // Constructor and destructor ...
+public:
+  CCompressedImage (uint32_t nSectorSize, uint32_t nCacheChunks=DEFAULT_CACHE_CHUNKS);
+  virtual ~CCompressedImage();
+private:
+  // Disallow copy and assignment operations with CCompressedImage objects...
+  CCompressedImage (const CCompressedImage &c) = delete;
+  CCompressedImage& operator= (const CCompressedImage &c) = delete;
+
+  // Public properties ...
+public:
+  // Return the length of the original, uncompressed, image ...
+  uint64_t GetImageLength() const {return m_llLength;}
+  // Return the chunk size and count ...
+  uint32_t GetChunkSize() const {return m_cbChunk;}
+  uint32_t GetChunkCount() const {return m_nChunks;}
+  // Return the chunk cache statistics ...
+  uint64_t GetHits() const {return m_llHits;}
+  uint64_t GetMisses() const {return m_llMisses;}
+
+  // Public methods ...
+public:
+  // Return TRUE if the file is a compressed image ...
+  static bool IsCompressed (FILE *pFile, const string &sFileName);
+  // Read the header and chunk index from an open file ...
+  bool Open (FILE *pFile, const string &sFileName);
+  // Read a run of contiguous sectors ...
+  bool Read (uint32_t lLBA, uint32_t nCount, void *pData);
+  // Convert an ordinary image file to the compressed format ...
+  static bool CompressImage (const string &sRawFile, const string &sCompressedFile,
+                             uint32_t nSectorSize, uint32_t cbChunk=DEFAULT_CHUNK_SIZE);
+  //   Compress or expand a single chunk.  These are public because compressed
+  // tapes (see CCompressedTape) use exactly the same compression ...
+  static size_t Compress (const uint8_t *pabIn, size_t cbIn, uint8_t *pabOut, size_t cbOut);
+  static bool Expand (const uint8_t *pabIn, size_t cbIn, uint8_t *pabOut, size_t cbOut);
+
+  // Local methods ...
+protected:
+  // Check a header and return NULL or the reason it's invalid ...
+  static const char *CheckHeader (const COMPRESSED_HEADER &hdr, uint64_t cbFile);
+  // Find a chunk in the cache, or read and decompress it ...
+  const uint8_t *GetChunk (uint32_t nChunk);
+  bool LoadChunk (uint32_t nChunk, uint8_t *pabData);
+  // Return the uncompressed size of a chunk (the last one may be short) ...
+  size_t ChunkLength (uint32_t nChunk) const;
+  // Print an error message and return false ...
+  bool Error (const char *pszMsg, int nError) const;
+
+  // Local members ...
+protected:
+  FILE       *m_pFile;          // the compressed image file (owned by CDiskImageFile!)
+  string      m_sFileName;      // name of the compressed image
+  uint32_t    m_nSectorSize;    // sector size used for reading
+  uint32_t    m_cbChunk;        // uncompressed size of each chunk
+  uint32_t    m_nChunks;        // number of chunks in the image
+  uint64_t    m_llLength;       // length of the original image
+  vector<uint64_t> m_vecIndex;  // file offset of every chunk
+  vector<CHUNK_SLOT> m_vecSlots;// decompressed chunk cache
+  vector<uint8_t> m_vecBuffer;  // buffer for reading compressed chunks
+  uint64_t    m_llClock;        // "time" for LRU replacement
+  uint64_t    m_llHits;         // number of chunk cache hits
+  uint64_t    m_llMisses;       // number of chunk cache misses
+  CMutex      m_ReadLock;       // serializes access to the file and the cache
+};
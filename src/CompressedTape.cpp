@@ -0,0 +1,631 @@
+//++
+// CompressedTape.cpp -> CCompressedTape (compressed tape image) methods
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the UPE LIBRARY project.  UPELIB is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    UPELIB is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   Archived tape images are big, and most of them compress very well.  A
+// compressed tape holds exactly the same bytes as the original TAP file, but
+// they're divided into blocks of (by default) about 64K and each block is
+// compressed separately.  Blocks always end on a record boundary, so reading
+// any one record, in either direction, means decompressing only one block
+// (the only exception is a record too big to fit in MAX_BLOCK_SIZE, which
+// has to be split).
+// The block index at the end of the file gives the tape offset and the file
+// offset of every block, so any part of the tape can be found with a binary
+// search and one read.  The compression itself is the same LZ4 style scheme
+// that CCompressedImage uses for disk images.
+//
+//   The tape's record index (see CTapeImageFile::BuildIndex()) is saved in
+// the same file, right after the block index, so a compressed tape can be
+// spaced over without decompressing anything at all.
+//
+//   Unlike compressed disk images, compressed tapes can be written.  Tapes
+// are only ever written at the end (anything after the current position is
+// discarded), so the last, partial, block is kept uncompressed in memory and
+// records are added to it.  When it gets big enough it's compressed and
+// written, and Flush() writes it out too (but keeps it, since there may be
+// more records coming).  While the file is being changed the header says
+// there's no block index, and if the program dies before the next Flush()
+// then the blocks are found by following the little header in front of each
+// one.
+//
+//   CTapeImageFile does all the tape stuff - this class knows nothing about
+// records except where they end.  Reads are just byte ranges of the original
+// TAP file, and the tape code parses them exactly as if they came from the
+// file itself.
+//
+// REVISION HISTORY:
+// 16-OCT-26        New file.
+//--
+//000000001111111111222222222233333333334444444444555555555566666666667777777777
+//234567890123456789012345678901234567890123456789012345678901234567890123456789
+#include <stdlib.h>             // exit(), system(), etc ...
+#include <stdint.h>	        // uint8_t, uint32_t, etc ...
+#include <assert.h>             // assert() (what else??)
+#include <errno.h>              // ENOENT, EACCESS, etc ...
+#include <string.h>             // memcpy(), memset(), etc ...
+#ifdef _WIN32
+#include <io.h>                 // _chsize_s(), _commit(), _fileno(), etc...
+#elif __linux__
+#include <unistd.h>             // ftruncate(), fsync(), etc ...
+#endif
+#include "UPELIB.hpp"           // UPE library definitions
+#include "SafeCRT.h"		// replacements for Microsoft "safe" CRT functions
+#include "LogFile.hpp"          // UPE library message logging facility
+#include "CompressedImage.hpp"  // Compress() and Expand() ...
+#include "CompressedTape.hpp"   // declarations for this module
+
+//   Microsoft spells the 64 bit versions of fseek() and ftell() differently,
+// but otherwise they're the same as the POSIX ones ...
+#ifdef _WIN32
+#define fseeko(f,o,w)   _fseeki64(f,o,w)
+#define ftello(f)       _ftelli64(f)
+#endif
+
+
+CCompressedTape::CCompressedTape (uint32_t nCacheBlocks)
+{
+  //++
+  //   The constructor just initializes the members.  The cache slots grow as
+  // needed to hold whatever blocks are loaded into them.
+  //--
+  assert(nCacheBlocks > 0);
+  m_pFile = NULL;  m_fReadOnly = true;  m_cbBlock = 0;
+  m_llTailStart = m_llTailFile = 0;  m_cbTailRecords = 0;
+  m_fDirty = m_fRecordIndex = false;
+  m_llRecordIndex = 0;  m_nRecords = m_nMarks = 0;
+  m_llClock = m_llHits = m_llMisses = 0;
+  m_vecSlots.resize(nCacheBlocks);
+  for (size_t i = 0;  i < m_vecSlots.size();  ++i) {
+    m_vecSlots[i].nBlock = 0;  m_vecSlots[i].fValid = false;
+    m_vecSlots[i].llLastUsed = 0;
+  }
+}
+
+
+bool CCompressedTape::Error (const char *pszMsg, int nError) const
+{
+  //++
+  // Print a compressed tape error message and then always return false ...
+  //--
+  char sz[80];
+  LOGS(ERROR, "error (" << nError << ") " << pszMsg << " compressed tape " << m_sFileName);
+  if (nError > 0) {
+    strerror_s(sz, sizeof(sz), nError);
+    LOGS(ERROR, sz);
+  }
+  return false;
+}
+
+
+/*static*/ uint32_t CCompressedTape::Checksum (uint32_t cbData, uint32_t cbStored, const uint8_t *pabStored)
+{
+  //++
+  //   Compute a block checksum - FNV-1a, eight bytes at a time, over the two
+  // lengths and then the stored data, folded to 32 bits.  Just like the disk
+  // journal, this is only meant to catch torn and stale blocks ...
+  //--
+  const uint64_t llPrime = 0x100000001B3ULL;
+  uint64_t llHash = (0xCBF29CE484222325ULL ^ (((uint64_t) cbStored << 32) | cbData)) * llPrime;
+  size_t cb = cbStored;
+  for (;  cb >= sizeof(uint64_t);  cb -= sizeof(uint64_t), pabStored += sizeof(uint64_t)) {
+    uint64_t llWord;  memcpy(&llWord, pabStored, sizeof(llWord));
+    llHash = (llHash ^ llWord) * llPrime;
+  }
+  for (;  cb > 0;  --cb, ++pabStored) llHash = (llHash ^ *pabStored) * llPrime;
+  return (uint32_t) (llHash ^ (llHash >> 32));
+}
+
+
+/*static*/ bool CCompressedTape::IsCompressed (FILE *pFile)
+{
+  //++
+  //   Return TRUE if this file starts with a compressed tape header.  The
+  // file position is left at the beginning, either way.  Note that the magic
+  // number has non-zero reserved bits, so it can never be the first metadata
+  // word of an ordinary TAP file.
+  //--
+  assert(pFile != NULL);
+  uint32_t lMagic = 0;
+  rewind(pFile);
+  bool fCompressed = (fread(&lMagic, 1, sizeof(lMagic), pFile) == sizeof(lMagic))
+                  && (lMagic == TAPE_MAGIC);
+  rewind(pFile);
+  return fCompressed;
+}
+
+
+bool CCompressedTape::WriteHeader (uint64_t llIndex, uint32_t nBlocks, uint32_t nRecords, uint32_t nMarks)
+{
+  //++
+  //   Write the file header.  An llIndex of zero means that the file is being
+  // changed and the block index isn't there.  The caller must hold m_Lock ...
+  //--
+  TAPE_HEADER hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.lMagic = TAPE_MAGIC;  hdr.lVersion = TAPE_VERSION;  hdr.cbBlock = m_cbBlock;
+  hdr.nBlocks = nBlocks;  hdr.llLength = GetTapeLength();  hdr.llIndex = llIndex;
+  hdr.nRecords = nRecords;  hdr.nMarks = nMarks;
+  if ((fseeko(m_pFile, 0, SEEK_SET) != 0) || (fwrite(&hdr, sizeof(hdr), 1, m_pFile) != 1))
+    return Error("writing header", errno);
+  return true;
+}
+
+
+bool CCompressedTape::MarkDirty()
+{
+  //++
+  //   Called before the first change to the file after a Flush().  The blocks
+  // and the tail are about to overwrite the old block index, so the header
+  // has to stop pointing at it first.  The caller must hold m_Lock ...
+  //--
+  if (m_fDirty) return true;
+  m_fDirty = true;  m_fRecordIndex = false;
+  return WriteHeader(0, 0, NOINDEX, 0);
+}
+
+
+bool CCompressedTape::Create (FILE *pFile, const string &sFileName, uint32_t cbBlock)
+{
+  //++
+  //   Turn an empty file into an empty compressed tape.  The header and an
+  // empty block index are written right away, so the file is a valid (empty!)
+  // compressed tape even if nothing is ever written to it.
+  //--
+  assert(pFile != NULL);
+  m_pFile = pFile;  m_sFileName = sFileName;  m_fReadOnly = false;
+  m_cbBlock = MAX(MIN(cbBlock, (uint32_t) MAX_BLOCK_SIZE), (uint32_t) MIN_BLOCK_SIZE);
+  m_vecBlocks.clear();  m_vecTail.clear();  m_cbTailRecords = 0;
+  m_llTailStart = 0;  m_llTailFile = sizeof(TAPE_HEADER);
+  m_fDirty = m_fRecordIndex = false;
+  m_Lock.Enter();
+  bool fOK = WriteHeader(sizeof(TAPE_HEADER), 0, NOINDEX, 0) && (fflush(m_pFile) == 0);
+  m_Lock.Leave();
+  if (fOK) LOGS(DEBUG, "created compressed tape " << sFileName << " with " << m_cbBlock << " byte blocks");
+  return fOK;
+}
+
+
+bool CCompressedTape::Open (FILE *pFile, const string &sFileName, bool fReadOnly)
+{
+  //++
+  //   Read and check the header, then read the block index into memory.  The
+  // blocks have to be contiguous and in ascending order, and they can't
+  // overlap the index or run past the end of the file.  If the header says
+  // there's no block index, then the last Flush() never happened and we
+  // have to find the blocks the hard way.  The record index isn't read now,
+  // but we make sure it'll fit in the file so LoadRecordIndex() can trust
+  // the counts.
+  //--
+  assert(pFile != NULL);
+  m_pFile = pFile;  m_sFileName = sFileName;  m_fReadOnly = fReadOnly;
+  m_vecBlocks.clear();  m_vecTail.clear();  m_cbTailRecords = 0;
+  m_fDirty = m_fRecordIndex = false;
+  TAPE_HEADER hdr;
+  rewind(m_pFile);
+  if (fread(&hdr, sizeof(hdr), 1, m_pFile) != 1) return Error("reading header", errno);
+  if ((hdr.lMagic != TAPE_MAGIC) || (hdr.lVersion != TAPE_VERSION)
+   || (hdr.cbBlock < MIN_BLOCK_SIZE) || (hdr.cbBlock > MAX_BLOCK_SIZE)) return Error("bad header in", 0);
+  m_cbBlock = hdr.cbBlock;
+  if (fseeko(m_pFile, 0, SEEK_END) != 0) return Error("seeking", errno);
+  uint64_t cbFile = (uint64_t) ftello(m_pFile);
+
+  if (hdr.llIndex == 0) {
+    if (!Recover(cbFile)) return false;
+  } else {
+    uint64_t cbIndex = (uint64_t) hdr.nBlocks * sizeof(BLOCK);
+    if ((hdr.llIndex < sizeof(hdr)) || (hdr.llIndex > cbFile) || (cbIndex > cbFile-hdr.llIndex))
+      return Error("bad index in", 0);
+    m_vecBlocks.resize(hdr.nBlocks);
+    if (   (fseeko(m_pFile, hdr.llIndex, SEEK_SET) != 0)
+        || (fread(m_vecBlocks.data(), sizeof(BLOCK), m_vecBlocks.size(), m_pFile) != m_vecBlocks.size()))
+      return Error("reading index", errno);
+    uint64_t llStart = 0, llFile = sizeof(hdr);
+    for (uint32_t i = 0;  i < hdr.nBlocks;  ++i) {
+      const BLOCK &blk = m_vecBlocks[i];
+      if ((blk.llStart != llStart) || (blk.llFile < llFile) || (blk.cbData == 0)
+       || (blk.cbData > MAX_BLOCK_SIZE) || (blk.cbStored > blk.cbData)
+       || (blk.llFile + sizeof(BLOCK_HEADER) + blk.cbStored > hdr.llIndex))
+        return Error("bad index in", 0);
+      llStart += blk.cbData;  llFile = blk.llFile + sizeof(BLOCK_HEADER) + blk.cbStored;
+    }
+    if (llStart != hdr.llLength) return Error("bad index in", 0);
+    m_llRecordIndex = hdr.llIndex + cbIndex;
+    uint64_t cbRecords = ((uint64_t) hdr.nRecords+1)*sizeof(uint64_t) + (uint64_t) hdr.nMarks*sizeof(uint32_t);
+    if ((hdr.nRecords != NOINDEX) && (cbRecords <= cbFile-m_llRecordIndex)) {
+      m_fRecordIndex = true;  m_nRecords = hdr.nRecords;  m_nMarks = hdr.nMarks;
+    }
+  }
+
+  //   The tail is empty to start with, and the next block goes right after
+  // the last one (on top of the old block index) ...
+  if (m_vecBlocks.empty()) {
+    m_llTailStart = 0;  m_llTailFile = sizeof(hdr);
+  } else {
+    const BLOCK &blk = m_vecBlocks.back();
+    m_llTailStart = blk.llStart + blk.cbData;
+    m_llTailFile = blk.llFile + sizeof(BLOCK_HEADER) + blk.cbStored;
+  }
+  LOGS(DEBUG, "compressed tape " << sFileName << " has " << m_vecBlocks.size() << " blocks, " << GetTapeLength() << " bytes");
+  return true;
+}
+
+
+bool CCompressedTape::Recover (uint64_t cbFile)
+{
+  //++
+  //   The file was being written when the program died, and the header says
+  // there's no block index.  Every block starts with a BLOCK_HEADER, so we
+  // can follow them from the beginning of the file until we find one that
+  // doesn't have the right magic number or checksum, or runs past the end of
+  // the file.  That might be a torn block, or the remains of an old block
+  // index, or anything else.  Anything after that is lost, and the next
+  // Flush() (if the tape is writable) will fix up the file.
+  //--
+  uint64_t llStart = 0, llFile = sizeof(TAPE_HEADER);
+  while (llFile + sizeof(BLOCK_HEADER) <= cbFile) {
+    BLOCK_HEADER bh;
+    if ((fseeko(m_pFile, llFile, SEEK_SET) != 0) || (fread(&bh, sizeof(bh), 1, m_pFile) != 1))
+      return Error("reading", errno);
+    if ((bh.lMagic != BLOCK_MAGIC) || (bh.cbData == 0) || (bh.cbData > MAX_BLOCK_SIZE)
+     || (bh.cbStored > bh.cbData) || (bh.cbStored > cbFile - llFile - sizeof(bh))) break;
+    m_vecBuffer.resize(bh.cbStored);
+    if (fread(m_vecBuffer.data(), 1, bh.cbStored, m_pFile) != bh.cbStored)
+      return Error("reading", errno);
+    if (Checksum(bh.cbData, bh.cbStored, m_vecBuffer.data()) != bh.lChecksum) break;
+    BLOCK blk;
+    blk.llStart = llStart;  blk.llFile = llFile;
+    blk.cbData = bh.cbData;  blk.cbStored = bh.cbStored;
+    m_vecBlocks.push_back(blk);
+    llStart += bh.cbData;  llFile += sizeof(bh) + bh.cbStored;
+  }
+  LOGS(WARNING, "compressed tape " << m_sFileName << " was not closed - recovered " << m_vecBlocks.size() << " blocks");
+  m_fDirty = true;
+  return true;
+}
+
+
+bool CCompressedTape::LoadRecordIndex (vector<uint64_t> &vecRecords, vector<uint32_t> &vecMarks)
+{
+  //++
+  //   Read the record index saved by the last Flush(), if there is one.  It
+  // has to start at offset zero, but it might end before the end of the tape
+  // (e.g. if there's an end of medium marker) ...
+  //--
+  if (!m_fRecordIndex || m_fDirty) return false;
+  m_Lock.Enter();
+  vecRecords.resize((size_t) m_nRecords+1);  vecMarks.resize(m_nMarks);
+  bool fOK = (fseeko(m_pFile, m_llRecordIndex, SEEK_SET) == 0)
+          && (fread(vecRecords.data(), sizeof(uint64_t), vecRecords.size(), m_pFile) == vecRecords.size())
+          && (fread(vecMarks.data(), sizeof(uint32_t), vecMarks.size(), m_pFile) == vecMarks.size())
+          && (vecRecords[0] == 0) && (vecRecords[m_nRecords] <= GetTapeLength())
+          && (m_nMarks <= m_nRecords);
+  m_Lock.Leave();
+  if (!fOK) {
+    LOGS(WARNING, "ignoring bad record index in compressed tape " << m_sFileName);
+    vecRecords.clear();  vecMarks.clear();
+  }
+  return fOK;
+}
+
+
+uint32_t CCompressedTape::FindBlock (uint64_t llOffset) const
+{
+  //++
+  //   Return the number of the block that contains llOffset.  The offset
+  // must be before the tail, so there's always an answer ...
+  //--
+  assert(!m_vecBlocks.empty() && (llOffset < m_llTailStart));
+  uint32_t nLow = 0, nHigh = MKINT32(m_vecBlocks.size()) - 1;
+  while (nLow < nHigh) {
+    uint32_t nMiddle = (nLow + nHigh + 1) / 2;
+    if (m_vecBlocks[nMiddle].llStart <= llOffset)
+      nLow = nMiddle;
+    else
+      nHigh = nMiddle - 1;
+  }
+  return nLow;
+}
+
+
+bool CCompressedTape::LoadBlock (uint32_t nBlock, vector<uint8_t> &vecData)
+{
+  //++
+  //   Read one block from the file and decompress it into vecData.  Blocks
+  // that didn't compress are read directly into vecData.  The block header
+  // has to agree with the block index, and the checksum has to match.
+  //--
+  const BLOCK &blk = m_vecBlocks[nBlock];
+  vecData.resize(blk.cbData);
+  bool fVerbatim = (blk.cbStored == blk.cbData);
+  if (!fVerbatim) m_vecBuffer.resize(blk.cbStored);
+  uint8_t *pabRead = fVerbatim ? vecData.data() : m_vecBuffer.data();
+  BLOCK_HEADER bh;
+  if (fseeko(m_pFile, blk.llFile, SEEK_SET) != 0) return Error("seeking", errno);
+  if (   (fread(&bh, sizeof(bh), 1, m_pFile) != 1)
+      || (fread(pabRead, 1, blk.cbStored, m_pFile) != blk.cbStored)) return Error("reading", errno);
+  if (   (bh.lMagic != BLOCK_MAGIC) || (bh.cbData != blk.cbData) || (bh.cbStored != blk.cbStored)
+      || (Checksum(bh.cbData, bh.cbStored, pabRead) != bh.lChecksum))
+    return Error("bad block checksum in", 0);
+  if (fVerbatim) return true;
+  if (!CCompressedImage::Expand(pabRead, blk.cbStored, vecData.data(), blk.cbData))
+    return Error("expanding block in", 0);
+  return true;
+}
+
+
+const uint8_t *CCompressedTape::GetBlock (uint32_t nBlock)
+{
+  //++
+  //   Return a pointer to the decompressed data for a block, loading it into
+  // the least recently used cache slot if it isn't there already.  Reading a
+  // tape in either direction stays in the same block for a long time, so this
+  // nearly always hits.  The caller must be holding m_Lock!
+  //--
+  BLOCK_SLOT *pVictim = &m_vecSlots[0];
+  for (size_t i = 0;  i < m_vecSlots.size();  ++i) {
+    BLOCK_SLOT *pSlot = &m_vecSlots[i];
+    if (pSlot->fValid && (pSlot->nBlock == nBlock)) {
+      pSlot->llLastUsed = ++m_llClock;  ++m_llHits;
+      return pSlot->vecData.data();
+    }
+    if (!pSlot->fValid || (pSlot->llLastUsed < pVictim->llLastUsed)) pVictim = pSlot;
+  }
+  ++m_llMisses;
+  pVictim->fValid = false;
+  if (!LoadBlock(nBlock, pVictim->vecData)) return NULL;
+  pVictim->nBlock = nBlock;  pVictim->fValid = true;
+  pVictim->llLastUsed = ++m_llClock;
+  return pVictim->vecData.data();
+}
+
+
+void CCompressedTape::DiscardBlocks (uint32_t nFirst)
+{
+  //++
+  //   Block nFirst and everything after it has been truncated, so forget any
+  // of them that are in the cache.  The block numbers will be used again for
+  // different data!  The caller must be holding m_Lock ...
+  //--
+  for (size_t i = 0;  i < m_vecSlots.size();  ++i)
+    if (m_vecSlots[i].nBlock >= nFirst) m_vecSlots[i].fValid = false;
+}
+
+
+bool CCompressedTape::Read (uint64_t llOffset, void *pData, size_t cbData)
+{
+  //++
+  //   Read cbData bytes of the uncompressed tape image starting at llOffset.
+  // The range may cross block boundaries and it may include the tail, but
+  // unlike disk images there's nothing past the end of a tape - trying to
+  // read there is an error.
+  //--
+  assert(m_pFile != NULL);
+  uint8_t *pab = (uint8_t *) pData;
+  bool fOK = true;
+  m_Lock.Enter();
+  while (cbData > 0) {
+    if (llOffset >= m_llTailStart) {
+      uint64_t ib = llOffset - m_llTailStart;
+      fOK = (ib <= m_vecTail.size()) && (cbData <= m_vecTail.size()-ib);
+      if (fOK) memcpy(pab, m_vecTail.data()+ib, cbData);
+      break;
+    }
+    uint32_t nBlock = FindBlock(llOffset);
+    const uint8_t *pabBlock = GetBlock(nBlock);
+    if (pabBlock == NULL) {
+      fOK = false;  break;
+    }
+    const BLOCK &blk = m_vecBlocks[nBlock];
+    size_t ib = (size_t) (llOffset - blk.llStart);
+    size_t cb = MIN(cbData, (size_t) blk.cbData-ib);
+    memcpy(pab, pabBlock+ib, cb);
+    pab += cb;  llOffset += cb;  cbData -= cb;
+  }
+  m_Lock.Leave();
+  return fOK;
+}
+
+
+bool CCompressedTape::WriteTail (BLOCK &blk, size_t cbData)
+{
+  //++
+  //   Compress the first cbData bytes of the tail and write them as a block
+  // at m_llTailFile, and fill in blk to describe it.  If it doesn't get any
+  // smaller then it's written verbatim.  Nothing else is changed - that's up
+  // to the caller, who must also be holding m_Lock ...
+  //--
+  assert((cbData > 0) && (cbData <= m_vecTail.size()) && (cbData <= MAX_BLOCK_SIZE));
+  BLOCK_HEADER bh;
+  bh.lMagic = BLOCK_MAGIC;  bh.cbData = MKINT32(cbData);
+  m_vecBuffer.resize(cbData);
+  bh.cbStored = MKINT32(CCompressedImage::Compress(m_vecTail.data(), cbData, m_vecBuffer.data(), cbData-1));
+  const uint8_t *pabStored = m_vecBuffer.data();
+  if (bh.cbStored == 0) {
+    bh.cbStored = bh.cbData;  pabStored = m_vecTail.data();
+  }
+  bh.lChecksum = Checksum(bh.cbData, bh.cbStored, pabStored);
+  if (   (fseeko(m_pFile, m_llTailFile, SEEK_SET) != 0)
+      || (fwrite(&bh, sizeof(bh), 1, m_pFile) != 1)
+      || (fwrite(pabStored, 1, bh.cbStored, m_pFile) != bh.cbStored))
+    return Error("writing block", errno);
+  blk.llStart = m_llTailStart;  blk.llFile = m_llTailFile;
+  blk.cbData = bh.cbData;  blk.cbStored = bh.cbStored;
+  return true;
+}
+
+
+bool CCompressedTape::EndBlock (size_t cbData)
+{
+  //++
+  //   Write the first cbData bytes of the tail as a new block and remove them
+  // from the tail, which then starts right after that block.  The caller must
+  // be holding m_Lock ...
+  //--
+  BLOCK blk;
+  if (!WriteTail(blk, cbData)) return false;
+  m_vecBlocks.push_back(blk);
+  m_llTailStart += blk.cbData;  m_llTailFile += sizeof(BLOCK_HEADER) + blk.cbStored;
+  m_vecTail.erase(m_vecTail.begin(), m_vecTail.begin()+cbData);
+  m_cbTailRecords -= MIN(m_cbTailRecords, cbData);
+  return true;
+}
+
+
+bool CCompressedTape::Truncate (uint64_t llLength)
+{
+  //++
+  //   Truncate the tape image to llLength bytes.  If that's in the tail then
+  // it's easy, but if it's in one of the blocks then that block becomes the
+  // new tail (minus whatever is past llLength) and all the blocks after it
+  // are gone.  That's the only time we ever decompress anything to write.
+  //--
+  assert(m_pFile != NULL);
+  if (llLength == GetTapeLength()) return true;
+  if (m_fReadOnly || (llLength > GetTapeLength())) return false;
+  m_Lock.Enter();
+  bool fOK = MarkDirty();
+  if (fOK && (llLength >= m_llTailStart)) {
+    m_vecTail.resize((size_t) (llLength - m_llTailStart));
+  } else if (fOK) {
+    uint32_t nBlock = FindBlock(llLength);
+    BLOCK blk = m_vecBlocks[nBlock];
+    const uint8_t *pabBlock = (llLength > blk.llStart) ? GetBlock(nBlock) : NULL;
+    if ((llLength > blk.llStart) && (pabBlock == NULL)) {
+      fOK = false;
+    } else {
+      m_vecTail.assign(pabBlock, pabBlock + (size_t) (llLength - blk.llStart));
+      m_llTailStart = blk.llStart;  m_llTailFile = blk.llFile;
+      m_vecBlocks.resize(nBlock);  DiscardBlocks(nBlock);
+    }
+  }
+  m_cbTailRecords = m_vecTail.size();
+  m_Lock.Leave();
+  return fOK;
+}
+
+
+bool CCompressedTape::Append (const void *pData, size_t cbData)
+{
+  //++
+  //   Add some bytes to the end of the tape (which is always the tail).  The
+  // tail can never be allowed to grow past MAX_BLOCK_SIZE, or Open() and
+  // Recover() would reject the block it turns into.  EndRecord() only ends a
+  // block once the tail reaches m_cbBlock, so with big blocks a big record
+  // can still overflow it.  In that case the whole records already in the
+  // tail are written out as a block first, and only a single record that's
+  // bigger than MAX_BLOCK_SIZE all by itself ever gets split.
+  //--
+  assert(m_pFile != NULL);
+  if (m_fReadOnly) return false;
+  const uint8_t *pabData = (const uint8_t *) pData;
+  m_Lock.Enter();
+  bool fOK = MarkDirty();
+  while (fOK && (m_vecTail.size()+cbData > MAX_BLOCK_SIZE)) {
+    if (m_cbTailRecords > 0) {
+      fOK = EndBlock(m_cbTailRecords);
+    } else {
+      size_t cb = MAX_BLOCK_SIZE - m_vecTail.size();
+      m_vecTail.insert(m_vecTail.end(), pabData, pabData+cb);
+      pabData += cb;  cbData -= cb;
+      fOK = EndBlock(m_vecTail.size());
+    }
+  }
+  if (fOK) m_vecTail.insert(m_vecTail.end(), pabData, pabData+cbData);
+  m_Lock.Leave();
+  return fOK;
+}
+
+
+bool CCompressedTape::EndRecord()
+{
+  //++
+  //   The caller has just finished appending a record (or a tape mark) and
+  // this is a good place to end a block.  If the tail has grown to the block
+  // size, then compress it and write it out as a new block ...
+  //--
+  m_Lock.Enter();
+  m_cbTailRecords = m_vecTail.size();
+  bool fOK = (m_vecTail.size() < m_cbBlock) || EndBlock(m_vecTail.size());
+  m_Lock.Leave();
+  return fOK;
+}
+
+
+bool CCompressedTape::Flush (const vector<uint64_t> *pvecRecords, const vector<uint32_t> *pvecMarks)
+{
+  //++
+  //   Bring the file up to date - write the tail as the last block, then the
+  // block index and, if the caller gave us one, the record index after that.
+  // The header goes last of all, since until it's written the file still
+  // says there's no block index.  The tail stays in memory, and if anything
+  // else is written it'll just be written again here next time.
+  //
+  //   The checkpoint thread calls this (thru CTapeImageFile::Flush()) without
+  // a record index, and the tape saves its record index when it's closed.  If
+  // the file hasn't changed and there's nothing new to save, we don't touch
+  // it at all.
+  //--
+  assert((m_pFile != NULL) && ((pvecRecords == NULL) == (pvecMarks == NULL)));
+  if (m_fReadOnly) return true;
+  m_Lock.Enter();
+  bool fOK = true;
+  if (m_fDirty || ((pvecRecords != NULL) && !m_fRecordIndex)) {
+    fOK = MarkDirty();
+    BLOCK blkTail;
+    uint64_t llFile = m_llTailFile;
+    uint32_t nBlocks = MKINT32(m_vecBlocks.size());
+    if (fOK && !m_vecTail.empty()) {
+      fOK = WriteTail(blkTail, m_vecTail.size());
+      llFile += sizeof(BLOCK_HEADER) + blkTail.cbStored;  ++nBlocks;
+    }
+    uint64_t llIndex = llFile;
+    fOK = fOK && (fseeko(m_pFile, llIndex, SEEK_SET) == 0)
+              && (fwrite(m_vecBlocks.data(), sizeof(BLOCK), m_vecBlocks.size(), m_pFile) == m_vecBlocks.size())
+              && (m_vecTail.empty() || (fwrite(&blkTail, sizeof(BLOCK), 1, m_pFile) == 1));
+    llFile += (uint64_t) nBlocks * sizeof(BLOCK);
+    uint32_t nRecords = NOINDEX, nMarks = 0;
+    if (fOK && (pvecRecords != NULL)) {
+      fOK = (fwrite(pvecRecords->data(), sizeof(uint64_t), pvecRecords->size(), m_pFile) == pvecRecords->size())
+         && (fwrite(pvecMarks->data(), sizeof(uint32_t), pvecMarks->size(), m_pFile) == pvecMarks->size());
+      m_llRecordIndex = llFile;
+      nRecords = MKINT32(pvecRecords->size()-1);  nMarks = MKINT32(pvecMarks->size());
+      llFile += pvecRecords->size()*sizeof(uint64_t) + pvecMarks->size()*sizeof(uint32_t);
+    }
+    //   Get rid of anything left over past the end (e.g. the tape was just
+    // truncated) and then finally update the header ...
+    fOK = fOK && (fflush(m_pFile) == 0);
+#ifdef _WIN32
+    fOK = fOK && (_chsize_s(_fileno(m_pFile), llFile) == 0);
+#elif __linux__
+    fOK = fOK && (ftruncate(fileno(m_pFile), (off_t) llFile) == 0);
+#endif
+    fOK = fOK && WriteHeader(llIndex, nBlocks, nRecords, nMarks) && (fflush(m_pFile) == 0);
+    if (fOK) {
+      m_fDirty = false;  m_fRecordIndex = (pvecRecords != NULL);
+      m_nRecords = nRecords;  m_nMarks = nMarks;
+    } else
+      Error("updating", errno);
+  }
+#ifdef _WIN32
+  _commit(_fileno(m_pFile));
+#elif __linux__
+  fsync(fileno(m_pFile));
+#endif
+  m_Lock.Leave();
+  return fOK;
+}
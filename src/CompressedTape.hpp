@@ -0,0 +1,203 @@
+//++
+// CompressedTape.hpp -> CCompressedTape (compressed tape image) class
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the UPE LIBRARY project.  UPELIB is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    UPELIB is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   A CCompressedTape object stores a TAP tape image in a compressed container
+// file.  CTapeImageFile::Open() recognizes these files and reads and writes
+// them thru one of these objects, so the rest of the world never knows the
+// difference.  See CompressedTape.cpp for the details.
+//
+// REVISION HISTORY:
+// 16-OCT-26        New file.
+//--
+#pragma once
+#include <stdio.h>              // FILE, fread(), etc ...
+#include <string>               // C++ std::string class, et al ...
+#include <vector>               // C++ std::vector template
+using std::string;              // ...
+using std::vector;              // ...
+#include "Mutex.hpp"            // needed for CMutex ...
+
+
+class CCompressedTape {
+  //++
+  //--
+
+  // Constants ...
+public:
+  enum {
+    TAPE_MAGIC          = 0x5A545055UL, // "UPTZ" - magic number in the header
+    TAPE_VERSION        = 2,            // current file format version
+    BLOCK_MAGIC         = 0x4B4C4254UL, // "TBLK" - magic number for each block
+    MIN_BLOCK_SIZE      = 4*1024,       // smallest block size we'll use
+    MAX_BLOCK_SIZE      = 32*1024*1024, // largest block we'll accept
+    DEFAULT_CACHE_BLOCKS= 4,            // decompressed blocks to keep around
+    NOINDEX             = 0xFFFFFFFFUL, // no record index in the file
+  };
+
+  //   A compressed tape file starts with this header.  The compressed blocks
+  // follow it, and after the last block comes the block index (nBlocks
+  // BLOCK entries) and then, if nRecords isn't NOINDEX, the tape's record
+  // index - nRecords+1 record offsets followed by nMarks tape mark record
+  // numbers, exactly as CTapeImageFile keeps them.  llIndex is zero whenever
+  // the file is being changed, and then the block index isn't there at all.
+protected:
+  struct _TAPE_HEADER {
+    uint32_t  lMagic;           // always TAPE_MAGIC
+    uint32_t  lVersion;         // file format version
+    uint32_t  cbBlock;          // preferred uncompressed block size
+    uint32_t  nBlocks;          // number of blocks in the block index
+    uint64_t  llLength;         // length of the uncompressed tape image
+    uint64_t  llIndex;          // file offset of the block index (or zero)
+    uint32_t  nRecords;         // number of records in the record index
+    uint32_t  nMarks;           // number of tape marks in the record index
+  };
+  typedef struct _TAPE_HEADER TAPE_HEADER;
+
+  //   Every block in the file starts with this little header, so the blocks
+  // can still be found if the block index is lost.  If cbStored equals cbData
+  // then the block is stored verbatim, and otherwise it's compressed.  The
+  // checksum covers the two lengths and the stored data, so a torn or stale
+  // block can't be mistaken for a good one.
+  struct _BLOCK_HEADER {
+    uint32_t  lMagic;           // always BLOCK_MAGIC
+    uint32_t  cbData;           // uncompressed length of this block
+    uint32_t  cbStored;         // length of the data stored in the file
+    uint32_t  lChecksum;        // checksum of the lengths and stored data
+  };
+  typedef struct _BLOCK_HEADER BLOCK_HEADER;
+
+  //   And the block index has one of these for each block.  Blocks always
+  // contain whole records (except, perhaps, for junk at the end of a bad
+  // tape) and they're contiguous, so llStart of block n+1 is always llStart
+  // plus cbData of block n.
+  struct _BLOCK {
+    uint64_t  llStart;          // offset of this block in the tape image
+    uint64_t  llFile;           // offset of the BLOCK_HEADER in the file
+    uint32_t  cbData;           // uncompressed length of this block
+    uint32_t  cbStored;         // length of the data stored in the file
+  };
+  typedef struct _BLOCK BLOCK;
+
+  //   Each slot in the block cache holds one decompressed block, and they're
+  // managed exactly the same way as the CCompressedImage chunk cache.
+  struct _BLOCK_SLOT {
+    uint32_t  nBlock;           // block number in this slot
+    bool      fValid;           // TRUE if this slot contains anything
+    uint64_t  llLastUsed;       // "time" this slot was last used
+    vector<uint8_t> vecData;    // decompressed block data
+  };
+  typedef struct _BLOCK_SLOT BLOCK_SLOT;
+
+  // Constructor and destructor ...
+public:
+  CCompressedTape (uint32_t nCacheBlocks=DEFAULT_CACHE_BLOCKS);
+  virtual ~CCompressedTape() {};
+private:
+  // Disallow copy and assignment operations with CCompressedTape objects...
+  CCompressedTape (const CCompressedTape &c) = delete;
+  CCompressedTape& operator= (const CCompressedTape &c) = delete;
+
+  // Public properties ...
+public:
+  // Return the length of the uncompressed tape image ...
+  uint64_t GetTapeLength() const {return m_llTailStart + m_vecTail.size();}
+  // Return the block size and the number of blocks written so far ...
+  uint32_t GetBlockSize() const {return m_cbBlock;}
+  uint32_t GetBlockCount() const {return MKINT32(m_vecBlocks.size());}
+  // Return the block cache statistics ...
+  uint64_t GetHits() const {return m_llHits;}
+  uint64_t GetMisses() const {return m_llMisses;}
+
+  // Public methods ...
+public:
+  // Return TRUE if the file is a compressed tape ...
+  static bool IsCompressed (FILE *pFile);
+  //   Open an existing compressed tape, or turn an empty file into a new
+  // one.  Either way, the file still belongs to the caller ...
+  bool Open (FILE *pFile, const string &sFileName, bool fReadOnly);
+  bool Create (FILE *pFile, const string &sFileName, uint32_t cbBlock);
+  //   Fetch the record index saved in the file, if there is one.  Call this
+  // right after Open(), before the tape is changed ...
+  bool LoadRecordIndex (vector<uint64_t> &vecRecords, vector<uint32_t> &vecMarks);
+  // Read bytes from anywhere in the uncompressed tape image ...
+  bool Read (uint64_t llOffset, void *pData, size_t cbData);
+  //   Truncate the tape image, add bytes to the end of it, and mark the end
+  // of a record (which is where a new block may begin) ...
+  bool Truncate (uint64_t llLength);
+  bool Append (const void *pData, size_t cbData);
+  bool EndRecord();
+  //   Write the last partial block, the block index and (if one is given)
+  // the record index, and then update the header ...
+  bool Flush (const vector<uint64_t> *pvecRecords=NULL, const vector<uint32_t> *pvecMarks=NULL);
+
+  // Local methods ...
+protected:
+  // Find the block containing a tape offset ...
+  uint32_t FindBlock (uint64_t llOffset) const;
+  // Find a block in the cache, or read and decompress it ...
+  const uint8_t *GetBlock (uint32_t nBlock);
+  bool LoadBlock (uint32_t nBlock, vector<uint8_t> &vecData);
+  // Forget any cached blocks from nFirst on ...
+  void DiscardBlocks (uint32_t nFirst);
+  //   Compress part of the tail and write it as a block at m_llTailFile, or
+  // do that and then remove it from the tail ...
+  bool WriteTail (BLOCK &blk, size_t cbData);
+  bool EndBlock (size_t cbData);
+  // Write the header, or mark the file as being changed ...
+  bool WriteHeader (uint64_t llIndex, uint32_t nBlocks, uint32_t nRecords, uint32_t nMarks);
+  bool MarkDirty();
+  // Find all the blocks the hard way when there's no block index ...
+  bool Recover (uint64_t cbFile);
+  // Compute the checksum for a block header and its data ...
+  static uint32_t Checksum (uint32_t cbData, uint32_t cbStored, const uint8_t *pabStored);
+  // Print an error message and return false ...
+  bool Error (const char *pszMsg, int nError) const;
+
+  // Local members ...
+protected:
+  FILE       *m_pFile;          // the tape image file (owned by CTapeImageFile!)
+  string      m_sFileName;      // name of the compressed tape
+  bool        m_fReadOnly;      // TRUE if the tape can't be written
+  uint32_t    m_cbBlock;        // preferred uncompressed block size
+  vector<BLOCK> m_vecBlocks;    // every block written so far
+  //   The end of the tape, after the last block, is always kept in memory
+  // uncompressed.  That's where records are added, and when it grows past
+  // m_cbBlock it's compressed and written as a new block.  Flush() writes it
+  // as a block too, but keeps it here so that it can still be added to.
+  vector<uint8_t> m_vecTail;    // uncompressed data after the last block
+  uint64_t    m_llTailStart;    // tape offset of the first byte in the tail
+  uint64_t    m_llTailFile;     // file offset where the tail will be written
+  size_t      m_cbTailRecords;  // bytes in the tail up to the last EndRecord()
+  //   m_fDirty is TRUE if the tape has changed since the last Flush(), and
+  // m_fRecordIndex is TRUE if the file contains a record index (it's at
+  // m_llRecordIndex, and has m_nRecords records and m_nMarks marks).
+  bool        m_fDirty;         // TRUE if the file needs to be updated
+  bool        m_fRecordIndex;   // TRUE if the file has a record index
+  uint64_t    m_llRecordIndex;  // file offset of the record index
+  uint32_t    m_nRecords;       // number of records in the record index
+  uint32_t    m_nMarks;         // number of tape marks in the record index
+  vector<BLOCK_SLOT> m_vecSlots;// decompressed block cache
+  vector<uint8_t> m_vecBuffer;  // buffer for compressed blocks
+  uint64_t    m_llClock;        // "time" for LRU replacement
+  uint64_t    m_llHits;         // number of block cache hits
+  uint64_t    m_llMisses;       // number of block cache misses
+  //   The checkpoint thread can call Flush() at any time, so everything that
+  // touches the file or the blocks holds this lock ...
+  CMutex      m_Lock;           // serializes access to the file and the cache
+};
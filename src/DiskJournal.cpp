@@ -0,0 +1,522 @@
+//++
+// DiskJournal.cpp -> CDiskJournal (disk image write ahead journal) methods
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the UPE LIBRARY project.  UPELIB is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    UPELIB is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   Without a journal, a crash in the middle of a multi sector transfer can
+// leave a disk image with some of the new sectors and some of the old ones.
+// Worse, the checkpoint thread only syncs the image every so often, and the
+// host file system is free to write the dirty pages in any order it likes, so
+// even sectors from different transfers can end up out of order.
+//
+//   CDiskJournal fixes that by grouping sector writes into transactions.  A
+// controller can call BeginTransaction() and CommitTransaction() around all
+// the sectors of one transfer, and otherwise every WriteSector(), WriteSectors()
+// or WriteSectorsV() call is a transaction all by itself.  When a transaction
+// commits, all its sectors are appended to the journal file as one record,
+// with a checksum, and then they're kept in memory.  Nothing is written to
+// the image file yet!  Reads of those sectors are satisfied from memory.
+//
+//   Every so often we do a "group commit" - fsync() the journal, write all
+// the committed sectors to the image, fsync() the image, and then truncate
+// the journal.  This happens when the checkpoint thread calls Flush(), when
+// the journal gets bigger than its limit, and when the image is closed.  So
+// the cost is two fsync() calls per group commit, no matter how many
+// transactions are in the group, and that's no worse than the checkpoint
+// thread's periodic fsync() of the image.
+//
+//   If we crash, then the next time the image is opened the journal is read
+// back and every complete record (i.e. one with the right checksum) is
+// applied to the image.  A torn record at the end is simply ignored, and so
+// either all of a transaction's sectors make it to the image, or none do.
+//
+//   One thing to note is that there's only one transaction in progress for
+// each image at any time.  If several threads write the same image, their
+// writes all become part of the same transaction.
+//
+// REVISION HISTORY:
+// 16-OCT-26        New file.
+//--
+//000000001111111111222222222233333333334444444444555555555566666666667777777777
+//234567890123456789012345678901234567890123456789012345678901234567890123456789
+#include <stdlib.h>             // exit(), system(), etc ...
+#include <stdint.h>	        // uint8_t, uint32_t, etc ...
+#include <assert.h>             // assert() (what else??)
+#include <errno.h>              // ENOENT, EACCESS, etc ...
+#include <string.h>             // memcpy(), memset(), etc ...
+#include <algorithm>            // std::sort() ...
+#ifdef _WIN32
+#include <io.h>                 // _commit(), _chsize(), etc...
+#elif __linux__
+#include <unistd.h>             // fsync(), ftruncate(), etc ...
+#endif
+#include "UPELIB.hpp"           // UPE library definitions
+#include "SafeCRT.h"		// replacements for Microsoft "safe" CRT functions
+#include "LogFile.hpp"          // UPE library message logging facility
+#include "ImageFile.hpp"        // CDiskImageFile raw sector I/O
+#include "SectorCache.hpp"      // we may have to write thru the cache
+#include "DiskJournal.hpp"      // declarations for this module
+
+//   Microsoft spells the 64 bit versions of fseek() and ftell() differently,
+// but otherwise they're the same as the POSIX ones ...
+#ifdef _WIN32
+#define fseeko(f,o,w)   _fseeki64(f,o,w)
+#define ftello(f)       _ftelli64(f)
+#endif
+
+
+CDiskJournal::CDiskJournal (CDiskImageFile *pImage, uint64_t cbLimit)
+{
+  //++
+  //   The constructor just initializes all the members - it DOES NOT open
+  // the journal file!  You'll have to call the Open() method to do that ...
+  //--
+  assert((pImage != NULL) && (cbLimit > 0));
+  m_pImage = pImage;  m_nSectorSize = pImage->GetSectorSize();
+  m_pFile = NULL;  m_cbLimit = cbLimit;  m_cbJournal = 0;
+  m_llSequence = 1;  m_fInTransaction = false;
+  m_llTransactions = m_llGroupCommits = 0;
+}
+
+
+CDiskJournal::~CDiskJournal()
+{
+  //++
+  //   Note that the destructor DOES NOT do a group commit - the image file may
+  // not be open anymore.  It's up to CDiskImageFile to call Close() first.
+  //--
+  if (m_pFile != NULL) fclose(m_pFile);
+  m_pFile = NULL;
+}
+
+
+bool CDiskJournal::Error (const char *pszMsg, int nError) const
+{
+  //++
+  // Print a journal file error message and then always return false ...
+  //--
+  char sz[80];
+  LOGS(ERROR, "error (" << nError << ") " << pszMsg << " journal " << m_sFileName);
+  if (nError > 0) {
+    strerror_s(sz, sizeof(sz), nError);
+    LOGS(ERROR, sz);
+  }
+  return false;
+}
+
+
+/*static*/ uint64_t CDiskJournal::Checksum (uint64_t llHash, const void *pData, size_t cbData)
+{
+  //++
+  //   Compute a 64 bit FNV-1a style checksum, eight bytes at a time.  This
+  // isn't a cryptographic hash, but it's plenty good enough to detect a torn
+  // record, and it's fast.  Start with llHash = 0xCBF29CE484222325 ...
+  //--
+  const uint64_t llPrime = 0x100000001B3ULL;
+  const uint8_t *pab = (const uint8_t *) pData;
+  for (;  cbData >= sizeof(uint64_t);  cbData -= sizeof(uint64_t), pab += sizeof(uint64_t)) {
+    uint64_t llWord;  memcpy(&llWord, pab, sizeof(llWord));
+    llHash = (llHash ^ llWord) * llPrime;
+  }
+  for (;  cbData > 0;  --cbData, ++pab) llHash = (llHash ^ *pab) * llPrime;
+  return llHash;
+}
+
+
+void CDiskJournal::AddSector (SECTOR_BUFFER &buf, uint32_t lLBA, const void *pData)
+{
+  //++
+  //   Add one sector to a SECTOR_BUFFER.  If the buffer already has a copy
+  // of this sector, then just overwrite the old data ...
+  //--
+  unordered_map<uint32_t, size_t>::iterator it = buf.mapIndex.find(lLBA);
+  if (it != buf.mapIndex.end()) {
+    memcpy(&buf.vecData[it->second * m_nSectorSize], pData, m_nSectorSize);
+    return;
+  }
+  size_t iSector = buf.vecLBA.size();
+  buf.mapIndex[lLBA] = iSector;  buf.vecLBA.push_back(lLBA);
+  const uint8_t *pab = (const uint8_t *) pData;
+  buf.vecData.insert(buf.vecData.end(), pab, pab+m_nSectorSize);
+}
+
+
+/*static*/ void CDiskJournal::ClearBuffer (SECTOR_BUFFER &buf)
+{
+  //++
+  // Empty a SECTOR_BUFFER ...
+  //--
+  buf.mapIndex.clear();  buf.vecLBA.clear();  buf.vecData.clear();
+}
+
+
+bool CDiskJournal::Open (const string &sFileName)
+{
+  //++
+  //   Open the journal file, creating it if necessary, and then replay any
+  // transactions that were committed to it but never applied to the image.
+  // That can only happen if we crashed, of course!
+  //--
+  assert(m_pFile == NULL);
+  m_sFileName = sFileName;
+  m_pFile = fopen(sFileName.c_str(), "rb+");
+  if ((m_pFile == NULL) && (errno == ENOENT)) {
+    LOGS(DEBUG, "creating empty journal " << sFileName);
+    m_pFile = fopen(sFileName.c_str(), "wb+");
+  }
+  if (m_pFile == NULL) return Error("opening", errno);
+  setvbuf(m_pFile, NULL, _IONBF, 0);
+  return Replay();
+}
+
+
+bool CDiskJournal::Close()
+{
+  //++
+  //   Close the journal.  Any transaction in progress is aborted (it was
+  // never committed, after all) and then everything else is written to the
+  // image with one last group commit.
+  //--
+  m_JournalLock.Enter();
+  if (m_fInTransaction) {
+    LOGS(WARNING, "uncommitted transaction aborted for " << m_pImage->GetFileName());
+    ClearBuffer(m_bufStaged);  m_fInTransaction = false;
+  }
+  bool fOK = GroupCommitLocked();
+  if (m_pFile != NULL) fclose(m_pFile);
+  m_pFile = NULL;
+  m_JournalLock.Leave();
+  return fOK;
+}
+
+
+bool CDiskJournal::Begin()
+{
+  //++
+  //   Begin an explicit transaction.  All sector writes from now until the
+  // next Commit() or Abort() are part of the same transaction ...
+  //--
+  m_JournalLock.Enter();
+  bool fOK = !m_fInTransaction;
+  m_fInTransaction = true;
+  m_JournalLock.Leave();
+  if (!fOK) LOGS(WARNING, "nested transaction for " << m_pImage->GetFileName());
+  return fOK;
+}
+
+
+bool CDiskJournal::Commit()
+{
+  //++
+  // Commit the current transaction ...
+  //--
+  m_JournalLock.Enter();
+  bool fOK = CommitLocked();
+  m_JournalLock.Leave();
+  return fOK;
+}
+
+
+void CDiskJournal::Abort()
+{
+  //++
+  // Throw away all the sectors written in the current transaction ...
+  //--
+  m_JournalLock.Enter();
+  ClearBuffer(m_bufStaged);  m_fInTransaction = false;
+  m_JournalLock.Leave();
+}
+
+
+bool CDiskJournal::Write (const CDiskImageFile::SECTOR_IOV aIOV[], size_t nIOV)
+{
+  //++
+  //   Add some sectors to the current transaction.  If there's no explicit
+  // transaction in progress, then these sectors are a transaction all by
+  // themselves and we commit them right away.
+  //--
+  m_JournalLock.Enter();
+  for (size_t i = 0;  i < nIOV;  ++i)
+    AddSector(m_bufStaged, aIOV[i].lLBA, aIOV[i].pData);
+  bool fOK = m_fInTransaction || CommitLocked();
+  m_JournalLock.Leave();
+  return fOK;
+}
+
+
+bool CDiskJournal::Lookup (uint32_t lLBA, void *pData)
+{
+  //++
+  //   If we have a copy of this sector, either in the current transaction or
+  // committed but not yet applied to the image, then copy it to the caller's
+  // buffer and return TRUE.  The current transaction is checked first, since
+  // it's always the most recent copy.
+  //--
+  bool fFound = false;
+  m_JournalLock.Enter();
+  const SECTOR_BUFFER *apbuf[2] = {&m_bufStaged, &m_bufCommitted};
+  for (int i = 0;  (i < 2) && !fFound;  ++i) {
+    unordered_map<uint32_t, size_t>::const_iterator it = apbuf[i]->mapIndex.find(lLBA);
+    if (it == apbuf[i]->mapIndex.end()) continue;
+    memcpy(pData, &apbuf[i]->vecData[it->second * m_nSectorSize], m_nSectorSize);
+    fFound = true;
+  }
+  m_JournalLock.Leave();
+  return fFound;
+}
+
+
+bool CDiskJournal::CommitLocked()
+{
+  //++
+  //   Commit the current transaction by appending it to the journal file and
+  // then moving its sectors to the committed buffer.  If the journal has now
+  // grown past the limit, then do a group commit too.  Note that the journal
+  // is NOT synced here - that's what makes group commit cheap.  A crash before
+  // the next group commit loses the transaction, but it loses ALL of it.
+  //--
+  m_fInTransaction = false;
+  if (m_bufStaged.vecLBA.empty()) return true;
+  if (!AppendRecord(m_bufStaged)) {
+    ClearBuffer(m_bufStaged);  return false;
+  }
+  for (size_t i = 0;  i < m_bufStaged.vecLBA.size();  ++i)
+    AddSector(m_bufCommitted, m_bufStaged.vecLBA[i], &m_bufStaged.vecData[i * m_nSectorSize]);
+  ClearBuffer(m_bufStaged);
+  ++m_llTransactions;
+  if (m_cbJournal >= m_cbLimit) return GroupCommitLocked();
+  return true;
+}
+
+
+bool CDiskJournal::AppendRecord (const SECTOR_BUFFER &buf)
+{
+  //++
+  //   Build a journal record for all the sectors in buf and append it to the
+  // journal file with a single write ...
+  //--
+  assert(m_pFile != NULL);
+  size_t nSectors = buf.vecLBA.size();
+  size_t cbLBAs = nSectors * sizeof(uint32_t);
+  vector<uint8_t> vecRecord(sizeof(JOURNAL_HEADER) + cbLBAs + buf.vecData.size());
+  JOURNAL_HEADER hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.lMagic = JOURNAL_MAGIC;  hdr.nSectorSize = m_nSectorSize;
+  hdr.nSectors = MKINT32(nSectors);  hdr.llSequence = m_llSequence;
+  memcpy(&vecRecord[0], &hdr, sizeof(hdr));
+  memcpy(&vecRecord[sizeof(hdr)], buf.vecLBA.data(), cbLBAs);
+  memcpy(&vecRecord[sizeof(hdr)+cbLBAs], buf.vecData.data(), buf.vecData.size());
+  hdr.llChecksum = Checksum(0xCBF29CE484222325ULL, vecRecord.data(), vecRecord.size());
+  memcpy(&vecRecord[0], &hdr, sizeof(hdr));
+  if (fseeko(m_pFile, (off_t) m_cbJournal, SEEK_SET) != 0) return Error("seeking", errno);
+  if (fwrite(vecRecord.data(), 1, vecRecord.size(), m_pFile) != vecRecord.size())
+    return Error("writing", errno);
+  m_cbJournal += vecRecord.size();  ++m_llSequence;
+  return true;
+}
+
+
+bool CDiskJournal::SyncJournal()
+{
+  //++
+  // Force the journal file all the way to the disk ...
+  //--
+  if (fflush(m_pFile) != 0) return Error("flushing", errno);
+#ifdef _WIN32
+  if (_commit(_fileno(m_pFile)) != 0) return Error("syncing", errno);
+#elif __linux__
+  if (fsync(fileno(m_pFile)) != 0) return Error("syncing", errno);
+#endif
+  return true;
+}
+
+
+bool CDiskJournal::TruncateJournal (uint64_t cbLength)
+{
+  //++
+  //   Truncate the journal file to cbLength bytes (normally zero, which
+  // empties it).  This doesn't need to be synced - if we crash and the
+  // truncation is lost, then the same transactions will just be applied
+  // again, which is harmless.
+  //--
+#ifdef _WIN32
+  if (_chsize_s(_fileno(m_pFile), cbLength) != 0) return Error("truncating", errno);
+#elif __linux__
+  if (ftruncate(fileno(m_pFile), (off_t) cbLength) != 0) return Error("truncating", errno);
+#endif
+  rewind(m_pFile);  m_cbJournal = cbLength;
+  return true;
+}
+
+
+bool CDiskJournal::GroupCommit()
+{
+  //++
+  // Apply all committed transactions to the image ...
+  //--
+  m_JournalLock.Enter();
+  bool fOK = GroupCommitLocked();
+  m_JournalLock.Leave();
+  return fOK;
+}
+
+
+static bool CompareLBA (const CDiskImageFile::SECTOR_IOV &a, const CDiskImageFile::SECTOR_IOV &b)
+{
+  //++
+  // Compare two scatter/gather entries for std::sort() ...
+  //--
+  return a.lLBA < b.lLBA;
+}
+
+
+bool CDiskJournal::GroupCommitLocked()
+{
+  //++
+  //   This is the group commit.  First the journal is synced, and once that's
+  // done all the committed transactions are safe.  Then all the committed
+  // sectors are written to the image, sorted by LBA so that adjacent ones are
+  // coalesced, and the image is synced.  Only after THAT can the journal be
+  // emptied.  If the image has a sector cache, the sectors are written to the
+  // cache instead and FlushImage() writes back the cache.
+  //
+  //   If anything fails, the committed sectors stay in memory and in the
+  // journal, and we'll try again next time.
+  //--
+  if (m_bufCommitted.vecLBA.empty()) return m_pImage->FlushImage();
+  if (!SyncJournal()) return false;
+  size_t nSectors = m_bufCommitted.vecLBA.size();
+  vector<CDiskImageFile::SECTOR_IOV> vecIOV(nSectors);
+  for (size_t i = 0;  i < nSectors;  ++i) {
+    vecIOV[i].lLBA = m_bufCommitted.vecLBA[i];
+    vecIOV[i].pData = &m_bufCommitted.vecData[i * m_nSectorSize];
+  }
+  std::sort(vecIOV.begin(), vecIOV.end(), &CompareLBA);
+  bool fOK = true;
+  if (m_pImage->IsCached()) {
+    for (size_t i = 0;  (i < nSectors) && fOK;  ++i)
+      fOK = m_pImage->m_pCache->Write(vecIOV[i].lLBA, vecIOV[i].pData);
+  } else {
+    fOK = m_pImage->WriteSectorsVDirect(vecIOV.data(), nSectors);
+  }
+  if (!fOK || !m_pImage->FlushImage()) return false;
+  if (!TruncateJournal()) return false;
+  ClearBuffer(m_bufCommitted);
+  ++m_llGroupCommits;
+  return true;
+}
+
+
+bool CDiskJournal::IsEmpty() const
+{
+  //++
+  // Return TRUE if there are no staged or committed sectors at all ...
+  //--
+  m_JournalLock.Enter();
+  bool fEmpty = m_bufStaged.vecLBA.empty() && m_bufCommitted.vecLBA.empty();
+  m_JournalLock.Leave();
+  return fEmpty;
+}
+
+
+bool CDiskJournal::Freeze()
+{
+  //++
+  //   Apply everything to the image and then hold the journal lock, which
+  // blocks every writer (and the checkpoint thread) until Thaw().  That's
+  // what lets CDiskImageFile::Snapshot() take a point in time copy ...
+  //--
+  m_JournalLock.Enter();
+  return GroupCommitLocked();
+}
+
+
+bool CDiskJournal::DiscardAndFreeze()
+{
+  //++
+  //   Throw away the current transaction AND everything that's been committed
+  // but not yet applied to the image, and then keep the lock just like
+  // Freeze() does.  This is only useful just before the entire image is
+  // replaced, as by CDiskImageFile::Restore(), and it has to be done in one
+  // step - otherwise some other thread could commit a transaction after the
+  // discard and before the freeze, and its group commit would then be
+  // applied on top of the restored image ...
+  //--
+  m_JournalLock.Enter();
+  ClearBuffer(m_bufStaged);  ClearBuffer(m_bufCommitted);
+  m_fInTransaction = false;
+  return TruncateJournal();
+}
+
+
+bool CDiskJournal::Replay()
+{
+  //++
+  //   Read the journal file from the start and collect every complete record
+  // in the committed buffer.  The first record that's incomplete, or has the
+  // wrong magic number, sector size or checksum, marks the end of the good
+  // part of the journal and anything after that is ignored.  If we found any
+  // transactions, then do a group commit to apply them.  Either way the
+  // journal is empty when we're done.
+  //--
+  m_JournalLock.Enter();
+  if (fseeko(m_pFile, 0, SEEK_END) != 0) {
+    m_JournalLock.Leave();  return Error("seeking", errno);
+  }
+  uint64_t cbFile = (uint64_t) ftello(m_pFile);
+  rewind(m_pFile);
+  uint64_t cbDone = 0;  uint32_t nRecovered = 0;
+  vector<uint8_t> vecRecord;
+  while (cbDone + sizeof(JOURNAL_HEADER) <= cbFile) {
+    JOURNAL_HEADER hdr;
+    if (fread(&hdr, 1, sizeof(hdr), m_pFile) != sizeof(hdr)) break;
+    if ((hdr.lMagic != JOURNAL_MAGIC) || (hdr.nSectorSize != m_nSectorSize) || (hdr.nSectors == 0)) break;
+    uint64_t cbRecord = sizeof(hdr) + (uint64_t) hdr.nSectors * (sizeof(uint32_t) + m_nSectorSize);
+    if (cbDone + cbRecord > cbFile) break;
+    vecRecord.resize((size_t) cbRecord);
+    uint64_t llChecksum = hdr.llChecksum;  hdr.llChecksum = 0;
+    memcpy(&vecRecord[0], &hdr, sizeof(hdr));
+    size_t cbBody = (size_t) cbRecord - sizeof(hdr);
+    if (fread(&vecRecord[sizeof(hdr)], 1, cbBody, m_pFile) != cbBody) break;
+    if (Checksum(0xCBF29CE484222325ULL, vecRecord.data(), vecRecord.size()) != llChecksum) break;
+    const uint8_t *pabLBAs = &vecRecord[sizeof(hdr)];
+    const uint8_t *pabData = pabLBAs + hdr.nSectors * sizeof(uint32_t);
+    for (uint32_t i = 0;  i < hdr.nSectors;  ++i) {
+      uint32_t lLBA;  memcpy(&lLBA, pabLBAs + i*sizeof(uint32_t), sizeof(lLBA));
+      AddSector(m_bufCommitted, lLBA, pabData + (size_t) i*m_nSectorSize);
+    }
+    cbDone += cbRecord;  ++nRecovered;
+    m_llSequence = hdr.llSequence + 1;
+  }
+  //   Anything after the last good record is garbage (most likely a record
+  // that was only partly written when we crashed) and it has to go NOW.  If
+  // the group commit below fails, then new records get appended to the
+  // journal, and if they went after the garbage then the next Replay() would
+  // stop at the garbage and never see them ...
+  m_cbJournal = cbDone;
+  bool fOK = true;
+  if (cbDone < cbFile) {
+    LOGS(WARNING, "discarding " << (cbFile-cbDone) << " bytes of incomplete journal " << m_sFileName);
+    fOK = TruncateJournal(cbDone);
+  }
+  if (nRecovered > 0) {
+    LOGS(WARNING, "recovering " << nRecovered << " transactions from journal " << m_sFileName);
+    fOK = GroupCommitLocked() && fOK;
+  }
+  m_JournalLock.Leave();
+  return fOK;
+}
@@ -0,0 +1,156 @@
+//++
+// DiskJournal.hpp -> CDiskJournal (disk image write ahead journal) class
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the UPE LIBRARY project.  UPELIB is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    UPELIB is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   A CDiskJournal object is a write ahead journal for a single disk image.
+// It's created by CDiskImageFile::EnableJournal(), and from then on all
+// sector writes are grouped into atomic transactions and recorded in the
+// journal file before they're applied to the image.  See DiskJournal.cpp for
+// the details.
+//
+// REVISION HISTORY:
+// 16-OCT-26        New file.
+//--
+#pragma once
+#include <string>               // C++ std::string class, et al ...
+#include <vector>               // C++ std::vector template
+#include <unordered_map>        // C++ std::unordered_map (aka hash table) template
+using std::string;              // ...
+using std::vector;              // ...
+using std::unordered_map;       // ...
+#include "Mutex.hpp"            // needed for CMutex ...
+#include "ImageFile.hpp"        // needed for CDiskImageFile::SECTOR_IOV
+
+
+class CDiskJournal {
+  //++
+  //--
+
+  // Constants ...
+public:
+  enum {
+    DEFAULT_LIMIT   = 4*1024*1024,  // default journal size for group commit
+    JOURNAL_MAGIC   = 0x4A524E4CUL, // "JRNL" - magic number for each record
+  };
+
+  //   Every transaction is written to the journal as one record.  The record
+  // starts with this header, followed by nSectors 32 bit sector numbers and
+  // then the data for all those sectors.  The checksum covers the header
+  // (with llChecksum set to zero) and everything after it, so a torn record
+  // at the end of the journal is easy to detect.
+protected:
+  struct _JOURNAL_HEADER {
+    uint32_t  lMagic;           // always JOURNAL_MAGIC
+    uint32_t  nSectorSize;      // sector size of this image
+    uint32_t  nSectors;         // number of sectors in this transaction
+    uint32_t  lReserved;        // (unused - always zero)
+    uint64_t  llSequence;       // transaction sequence number
+    uint64_t  llChecksum;       // checksum of the entire record
+  };
+  typedef struct _JOURNAL_HEADER JOURNAL_HEADER;
+
+  //   A SECTOR_BUFFER holds the data for a set of sectors - the sectors in
+  // the current (uncommitted) transaction, or all the committed sectors that
+  // haven't been applied to the image yet.  If the same sector is written
+  // more than once, only the last copy is kept.
+  struct _SECTOR_BUFFER {
+    unordered_map<uint32_t, size_t> mapIndex; // LBA -> index in vecLBA
+    vector<uint32_t>  vecLBA;   // sector numbers, in the order first written
+    vector<uint8_t>   vecData;  // data for each sector in vecLBA
+  };
+  typedef struct _SECTOR_BUFFER SECTOR_BUFFER;
+
+  // Constructor and destructor ...
+public:
+  CDiskJournal (CDiskImageFile *pImage, uint64_t cbLimit=DEFAULT_LIMIT);
+  virtual ~CDiskJournal();
+private:
+  // Disallow copy and assignment operations with CDiskJournal objects...
+  CDiskJournal (const CDiskJournal &j) = delete;
+  CDiskJournal& operator= (const CDiskJournal &j) = delete;
+
+  // Public properties ...
+public:
+  // Return the journal file name ...
+  string GetFileName() const {return m_sFileName;}
+  // Return TRUE if a transaction is in progress ...
+  bool IsInTransaction() const {return m_fInTransaction;}
+  // Return TRUE if there are no staged or committed sectors ...
+  bool IsEmpty() const;
+  // Return the journal statistics ...
+  uint64_t GetTransactions() const {return m_llTransactions;}
+  uint64_t GetGroupCommits() const {return m_llGroupCommits;}
+
+  // Public methods ...
+public:
+  // Open the journal file (and replay it), or close it ...
+  bool Open (const string &sFileName);
+  bool Close();
+  // Begin, commit or abort an explicit transaction ...
+  bool Begin();
+  bool Commit();
+  void Abort();
+  // Write sectors (as part of the current transaction, or as a new one) ...
+  bool Write (const CDiskImageFile::SECTOR_IOV aIOV[], size_t nIOV);
+  // Return the journaled copy of a sector, if there is one ...
+  bool Lookup (uint32_t lLBA, void *pData);
+  // Apply all committed transactions to the image and empty the journal ...
+  bool GroupCommit();
+  //   Do a group commit, or throw away everything committed or not (used by
+  // Restore()), and then block all writes until Thaw() is called.  Note that
+  // Thaw() MUST be called, even if either one returns false!
+  bool Freeze();
+  bool DiscardAndFreeze();
+  void Thaw() {m_JournalLock.Leave();}
+
+  // Local methods ...
+protected:
+  // Add sectors to a SECTOR_BUFFER, or empty it ...
+  void AddSector (SECTOR_BUFFER &buf, uint32_t lLBA, const void *pData);
+  static void ClearBuffer (SECTOR_BUFFER &buf);
+  // Commit, group commit or discard without taking the lock ...
+  bool CommitLocked();
+  bool GroupCommitLocked();
+  // Append a record to the journal file ...
+  bool AppendRecord (const SECTOR_BUFFER &buf);
+  // Read the journal file and recover any committed transactions ...
+  bool Replay();
+  // Truncate the journal file, or force it to the disk ...
+  bool TruncateJournal (uint64_t cbLength=0);
+  bool SyncJournal();
+  // Compute a record checksum ...
+  static uint64_t Checksum (uint64_t llHash, const void *pData, size_t cbData);
+  // Print a journal error message and return false ...
+  bool Error (const char *pszMsg, int nError) const;
+
+  // Local members ...
+protected:
+  CDiskImageFile *m_pImage;     // the disk image we're journaling
+  string      m_sFileName;      // name of the journal file
+  FILE       *m_pFile;          // handle of the journal file
+  uint32_t    m_nSectorSize;    // size of each sector, in bytes
+  uint64_t    m_cbLimit;        // journal size that forces a group commit
+  uint64_t    m_cbJournal;      // current size of the journal file
+  uint64_t    m_llSequence;     // next transaction sequence number
+  bool        m_fInTransaction; // TRUE if Begin() has been called
+  SECTOR_BUFFER m_bufStaged;    // sectors in the current transaction
+  SECTOR_BUFFER m_bufCommitted; // committed but not yet applied sectors
+  mutable CMutex m_JournalLock; // interlock with the checkpoint thread
+  uint64_t    m_llTransactions; // number of transactions committed
+  uint64_t    m_llGroupCommits; // number of group commits done
+};
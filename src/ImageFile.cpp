@@ -41,6 +41,41 @@
 // to the CDiskImage constructor - that's required by SeekSector() to calculate
 // the correct offset.
 //
+//   Disk images may optionally be opened in ACCESS_MAPPED mode.  In this case
+// the entire image file is mapped into our address space with mmap() and
+// ReadSector() and WriteSector() become simple memcpy() operations, without
+// any stdio locks, system calls or file positioning.  Better yet, the caller
+// can use GetSectorPointer() to work with the sector data in place and avoid
+// the copy entirely.  Since the image isn't preallocated, writing a sector
+// past the current end of the mapping will extend the file and remap it, and
+// that may move the mapping!  Any pointer returned by GetSectorPointer() is
+// only good until the next WriteSector() or GetSectorPointer() call.  Mapped
+// images are registered with the CCheckpointFiles thread, which msync()s them
+// to the disk periodically (and Close() does the same, of course).
+//
+//   Disk controllers frequently transfer a whole track, or some other run of
+// sectors, at once and ReadSectors() and WriteSectors() let them do that with
+// a single call.  ReadSectorsV() and WriteSectorsV() take a scatter/gather
+// list of sector numbers and buffers, and any adjacent sectors in the list are
+// coalesced into one preadv() or pwritev().  Since those go straight to the
+// file descriptor, behind the back of stdio, disk images are always opened
+// with stdio buffering disabled.  That costs nothing - every transfer is a
+// whole sector anyway, and there's no point in copying it twice.
+//
+//   Images opened in ACCESS_POSITIONAL mode use pread() and pwrite(), with
+// 64 bit offsets, for single sectors too.  Nothing ever touches the shared
+// file position (or the stdio lock) and so ReadSector() and WriteSector() are
+// stateless and thread safe - several drive or controller threads can use the
+// same image at the same time without any mutex.  Note that this applies ONLY
+// to the sector I/O methods; Open(), Close() and friends are not thread safe.
+//
+//   Any disk image, other than a mapped one, may also have a write back sector
+// cache (see SectorCache.cpp) enabled by calling EnableCache().  After that
+// ReadSector(), WriteSector() and all the other public sector I/O methods go
+// thru the cache, and the xxxDirect() versions are used by the cache itself
+// to actually transfer data to and from the image file.  Positional images
+// lose their lock free property when cached, since the cache has a mutex.
+//
 //   The tape image format is identical to the simh TAP format, with a single
 // 32 bit header record stored at the start and end of each logical record.
 // Nine track tape images are always stored as eight bit bytes - the ninth bit
@@ -53,9 +88,68 @@
 // although one common usage is to always set the MSB to zero and then store
 // seven track tape frames as eight bit bytes.  In that usage a seven track
 // image and a nine track tape image are indistinguishable, which is probably
-// OK for practical purposes.  There's no special code in this class to support
-// seven track tapes, although if you handle them this way then you don't need
-// any.
+// OK for practical purposes.  That's what we do - a seven track tape clears
+// bit 7 of every byte read or written and, if SetParity() asks for it, also
+// checks and strips the lateral parity bit (bit 6) on reads and generates it
+// on writes.  Frames with bad parity make the record a bad record, just like
+// the simh bad data class.  The conversion is done a 64 bit word at a time,
+// so it costs next to nothing even for the longest records.
+//
+//   Read only tape images can be mapped into memory with EnableMapping().
+// Records in both directions are then parsed straight out of the mapping, so
+// reading in reverse costs no more than reading forward, and the zero copy
+// versions of ReadForwardRecord() and ReadReverseRecord() just return a
+// pointer to the record data in the mapping.
+//
+//   CTapeImageFile::Open() also recognizes compressed tapes (see the file
+// CompressedTape.cpp) and reads and writes them transparently, and if
+// SetCompression() is called first then new tapes are created compressed.
+// A compressed tape is always "streaming" - the file offsets are offsets in
+// the uncompressed image and the stdio file is never used directly.  The
+// static CompressTape() and ExpandTape() methods convert an existing tape.
+//
+//   Disk images may also be put into sparse mode with SetSparse().  In sparse
+// mode every sector written is checked, and all zero sectors are never
+// actually written.  Instead a hole is punched in the image file (with
+// fallocate()) or, if the sector lies past the EOF, the file is just extended
+// without allocating anything.  Either way the sector still reads as zeros,
+// but it doesn't take up any space on the host disk.  CompactImage() does the
+// same for an existing image - it makes a copy with a hole for every zero
+// sector, and it uses SEEK_DATA and SEEK_HOLE so that it never even reads any
+// holes already in the original.  Sparse mode is supported on Linux only.
+//
+//   A disk image can also be opened as a copy on write overlay with
+// OpenOverlay().  The overlay has a base image, which is opened read only and
+// shared so that any number of emulator instances can use the same golden
+// pack, and a private delta image which gets all the writes.  The delta is
+// just an ordinary image file, sparse on most host file systems, where each
+// sector lives at its natural offset.  A bitmap in a sidecar file (the delta
+// name plus ".map") records which sectors have been written to the delta,
+// and reads of any other sector go to the base image instead.  A new bit is
+// written to the sidecar file as soon as it's set (after the sector data),
+// so the map survives a crash.  Overlays work with stdio or positional
+// access, sparse mode and the sector cache, but not with mapped access.
+//
+//   A disk image opened with ACCESS_POSITIONAL may also have a write ahead
+// journal (see DiskJournal.cpp) enabled by EnableJournal().  With a journal
+// every sector write becomes part of a transaction - either an explicit one,
+// bracketed by BeginTransaction() and CommitTransaction(), or just the sectors
+// of that one call - and a transaction makes it to the image completely or
+// not at all, even if we crash.  The journal sits in front of the cache, and
+// Flush() on a journaled image does a group commit.  Snapshot() and Restore()
+// save and reload a point in time copy of a disk image.  They use FICLONE
+// where the host file system supports it, and an ordinary sparse copy where
+// it doesn't.
+//
+//   CDiskImageFile::Open() also recognizes compressed images (see the file
+// CompressedImage.cpp) and reads them transparently.  These are always read
+// only, but they make good overlay base images.  The CCompressedImage class
+// has a static CompressImage() method to convert an ordinary image.
+//
+//   All file offsets and lengths are 64 bits, so image files larger than 4Gb
+// (or 2Gb, for that matter!) are fine.  We use fseeko() and ftello() rather
+// than fseek() and ftell(), and on 32 bit Linux hosts the Makefile defines
+// _FILE_OFFSET_BITS=64 so that off_t is 64 bits too.
 //
 // IMPORTANT!
 //   Even the casual observer will notice that the read and write functions
@@ -81,18 +175,37 @@
 #include <assert.h>             // assert() (what else??)
 #include <errno.h>              // ENOENT, EACCESS, etc ...
 #include <string.h>             // strcpy(), memset(), strerror(), etc ...
+#include <sys/stat.h>           // stat(), fstat(), etc ...
+#include <algorithm>            // std::lower_bound() ...
 #ifdef _WIN32
 #include <io.h>                 // _chsize(), _fileno(), etc...
 #elif __linux__
 #include <unistd.h>             // ftruncate(), etc ...
-#include <sys/stat.h>           // needed for fstat() (what else??)
 #include <sys/file.h>           // flock(), LOCK_EX, LOCK_SH, et al ...
+#include <sys/mman.h>           // mmap(), mremap(), msync(), etc ...
+#include <sys/uio.h>            // preadv(), pwritev(), struct iovec ...
+#include <fcntl.h>              // open(), fallocate(), FALLOC_FL_PUNCH_HOLE ...
+#include <sys/ioctl.h>          // ioctl() (for FICLONE) ...
+#include <linux/fs.h>           // FICLONE (reflink copy) ...
 #endif
 #include "UPELIB.hpp"           // global declarations for this library
 #include "SafeCRT.h"		// replacements for Microsoft "safe" CRT functions
 #include "LogFile.hpp"          // message logging facility
+#include "CheckpointFiles.hpp"  // file checkpoint (flush) thread
+#include "SectorCache.hpp"      // write back disk sector cache
+#include "DiskJournal.hpp"      // write ahead journal for disk images
+#include "CompressedImage.hpp"  // compressed read only disk images
+#include "CompressedTape.hpp"   // compressed tape images
+#include "TapeReadAhead.hpp"    // read ahead buffers for tape images
 #include "ImageFile.hpp"        // declarations for this module
 
+//   Microsoft spells the 64 bit versions of fseek() and ftell() differently,
+// but otherwise they're the same as the POSIX ones ...
+#ifdef _WIN32
+#define fseeko(f,o,w)   _fseeki64(f,o,w)
+#define ftello(f)       _ftelli64(f)
+#endif
+
 
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -246,14 +359,14 @@ void CImageFile::Close ()
 }
 
 
-uint32_t CImageFile::GetFileLength() const
+uint64_t CImageFile::GetFileLength() const
 {
   //++
   // Get the current file size (in bytes!) ...
   //--
   assert(IsOpen());
 #ifdef _WIN32
-  return _filelength(_fileno(m_pFile));
+  return _filelengthi64(_fileno(m_pFile));
 #elif __linux__
   struct stat st;
   if (fstat(fileno(m_pFile), &st) == 0) return st.st_size;
@@ -262,17 +375,17 @@ uint32_t CImageFile::GetFileLength() const
 }
 
 
-uint32_t CImageFile::GetFilePosition() const
+uint64_t CImageFile::GetFilePosition() const
 {
   //++
   // Get the current file position (in bytes!) ...
   //--
   assert(IsOpen());
-  return ftell(m_pFile);
+  return ftello(m_pFile);
 }
 
 
-bool CImageFile::SetFileLength (uint32_t nNewLength)
+bool CImageFile::SetFileLength (uint64_t llNewLength)
 {
   //++
   //   This method will change the length of this file.  If the new length
@@ -282,9 +395,9 @@ bool CImageFile::SetFileLength (uint32_t nNewLength)
   //--
   if (IsReadOnly()) return false;
 #ifdef _WIN32
-  if (_chsize(_fileno(m_pFile), nNewLength) == 0) return true;
+  if (_chsize_s(_fileno(m_pFile), llNewLength) == 0) return true;
 #elif __linux__
-  if (ftruncate(fileno(m_pFile), nNewLength) == 0) return true;
+  if (ftruncate(fileno(m_pFile), (off_t) llNewLength) == 0) return true;
 #endif
   return Error("change size", errno);
 }
@@ -298,7 +411,26 @@ bool CImageFile::Truncate ()
   assert(IsOpen());
   if (IsReadOnly()) return false;
   fseek(m_pFile, 0L, SEEK_CUR);
-  return SetFileLength(ftell(m_pFile));
+  return SetFileLength(GetFilePosition());
+}
+
+
+
+bool CImageFile::Flush()
+{
+  //++
+  //   Flush the stdio buffers for this file and then commit any data buffered
+  // by the OS to the disk.  This is exactly what CCheckpointFiles does for
+  // ordinary files, but derived classes may need to do more...
+  //--
+  if (!IsOpen()) return false;
+  if (fflush(m_pFile) != 0) return Error("flushing", errno);
+#ifdef _WIN32
+  _commit(_fileno(m_pFile));
+#elif __linux__
+  fsync(fileno(m_pFile));
+#endif
+  return true;
 }
 
 
@@ -316,29 +448,259 @@ CDiskImageFile::CDiskImageFile (uint32_t nSectorSize)
   //--
   assert(nSectorSize > 0);
   SetSectorSize(nSectorSize);
+  m_nAccessMode = ACCESS_STDIO;  m_pabMap = NULL;  m_cbMap = 0;  m_nFD = -1;
+  m_pCache = NULL;  m_fSparse = false;  m_pBase = NULL;  m_pOverlayMap = NULL;
+  m_pJournal = NULL;  m_pCompressed = NULL;
+}
+
+
+bool CDiskImageFile::Open (const string &sFileName, bool fReadOnly, int nShareMode, ACCESS_MODE nMode)
+{
+  //++
+  //   Open the image file and, if ACCESS_MAPPED is requested, map the entire
+  // file into memory.  Mapped images are also registered with the checkpoint
+  // thread, if there is one, so that the mapped data gets written back to the
+  // disk on a regular basis.
+  //--
+  if (!CImageFile::Open(sFileName, fReadOnly, nShareMode)) return false;
+  setvbuf(m_pFile, NULL, _IONBF, 0);
+#ifdef __linux__
+  m_nFD = fileno(m_pFile);
+#endif
+  m_nAccessMode = nMode;
+  if (CCompressedImage::IsCompressed(m_pFile, m_sFileName)) {
+    if (!OpenCompressed()) {
+      Close();  return false;
+    }
+    return true;
+  }
+  if (m_nAccessMode == ACCESS_MAPPED) {
+    if (!MapImage()) {
+      Close();  return false;
+    }
+    if (IsMapped()) CCheckpointFiles::AddImage(this);
+  }
+#ifdef _WIN32
+  if (m_nAccessMode == ACCESS_POSITIONAL) {
+    LOGS(WARNING, "positional I/O not supported - using stdio for " << m_sFileName);
+    m_nAccessMode = ACCESS_STDIO;
+  }
+#endif
+  return true;
+}
+
+
+void CDiskImageFile::Close()
+{
+  //++
+  //   Close a disk image file.  For mapped images we have to remove the image
+  // from the checkpoint thread's list BEFORE we unmap it, and the unmap will
+  // write back any dirty sectors.  Likewise, any dirty sectors in the cache
+  // have to be written back before we close the file.  And the journal has
+  // to go first of all, since its last group commit writes to the cache.
+  //--
+  if (IsOpen() && IsJournaled()) DisableJournal();
+  if (IsOpen() && IsCached()) DeleteCache();
+  if (IsOpen() && IsMapped()) {
+    CCheckpointFiles::RemoveImage(this);
+    UnmapImage();
+  }
+  if (IsOverlay()) CloseOverlay();
+  if (IsCompressed()) {
+    delete m_pCompressed;  m_pCompressed = NULL;
+  }
+  m_nAccessMode = ACCESS_STDIO;  m_nFD = -1;  m_fSparse = false;
+  CImageFile::Close();
+}
+
+
+bool CDiskImageFile::OpenCompressed()
+{
+  //++
+  //   Called by Open() when the file turns out to be a compressed image.
+  // Compressed images are always read only, regardless of what the caller
+  // asked for, and all sector reads go thru the CCompressedImage object.  It
+  // uses the stdio file handle, so the access mode is always ACCESS_STDIO.
+  //--
+  if (!IsReadOnly()) {
+    LOGS(WARNING, m_sFileName << " is a compressed image - opening it read only");
+    m_fReadOnly = true;
+  }
+  m_nAccessMode = ACCESS_STDIO;
+  m_pCompressed = DBGNEW CCompressedImage(m_nSectorSize);
+  return m_pCompressed->Open(m_pFile, m_sFileName);
+}
+
+
+uint64_t CDiskImageFile::GetFileLength() const
+{
+  //++
+  //   Return the length of the disk image.  This hides the CImageFile version
+  // so that compressed images report the size of the original image, which
+  // is what anybody sizing the disk actually wants ...
+  //--
+  if (IsCompressed()) return m_pCompressed->GetImageLength();
+  return CImageFile::GetFileLength();
+}
+
+
+bool CDiskImageFile::MapImage()
+{
+  //++
+  //   Map the entire image file into memory.  Remember that an empty image
+  // file is perfectly legal, and mmap() won't map zero bytes, so in that case
+  // we just leave m_pabMap NULL and let GrowImage() map it later.  Note that
+  // memory mapped files aren't currently supported on Windows, and there we
+  // just fall back to stdio access.
+  //--
+  assert(IsOpen());
+  m_pabMap = NULL;  m_cbMap = 0;
+#ifdef _WIN32
+  LOGS(WARNING, "memory mapped images not supported - using stdio for " << m_sFileName);
+  m_nAccessMode = ACCESS_STDIO;
+  return true;
+#elif __linux__
+  uint64_t cbFile = GetFileLength();
+  if (cbFile == 0) return true;
+  int nProtection = IsReadOnly() ? PROT_READ : (PROT_READ|PROT_WRITE);
+  void *p = mmap(NULL, cbFile, nProtection, MAP_SHARED, fileno(m_pFile), 0);
+  if (p == MAP_FAILED) return Error("mapping", errno);
+  m_pabMap = (uint8_t *) p;  m_cbMap = cbFile;
+  LOGS(TRACE, "  -> CDiskImageFile::MapImage, length=" << m_cbMap);
+  return true;
+#endif
+}
+
+
+void CDiskImageFile::UnmapImage()
+{
+  //++
+  // Write back any dirty pages and then unmap the image file ...
+  //--
+#ifdef __linux__
+  m_MapLock.Enter();
+  if (m_pabMap != NULL) {
+    if (!IsReadOnly()) msync(m_pabMap, m_cbMap, MS_SYNC);
+    munmap(m_pabMap, m_cbMap);
+  }
+  m_pabMap = NULL;  m_cbMap = 0;
+  m_MapLock.Leave();
+#endif
+}
+
+
+bool CDiskImageFile::GrowImage (uint64_t cbNewLength)
+{
+  //++
+  //   Extend a mapped image file to cbNewLength bytes and then extend the
+  // mapping to match.  The new part of the file will read as zeros (and on
+  // most Linux file systems it won't actually occupy any space until it's
+  // written).  Note that mremap() is allowed to move the mapping, so this
+  // invalidates any pointers previously returned by GetSectorPointer()!
+  //
+  //   Callers only know that the image WAS too short when they looked, and
+  // some other thread may have extended it since then - maybe even past
+  // cbNewLength.  So check again now that we have the lock, and never make
+  // the file or the mapping smaller ...
+  //--
+  assert(IsOpen() && IsMapped());
+  if (IsReadOnly()) return false;
+#ifdef __linux__
+  m_MapLock.Enter();
+  if (cbNewLength <= m_cbMap) {
+    m_MapLock.Leave();  return true;
+  }
+  if (ftruncate(fileno(m_pFile), cbNewLength) != 0) {
+    m_MapLock.Leave();  return Error("extending", errno);
+  }
+  void *p;
+  if (m_pabMap == NULL)
+    p = mmap(NULL, cbNewLength, PROT_READ|PROT_WRITE, MAP_SHARED, fileno(m_pFile), 0);
+  else
+    p = mremap(m_pabMap, m_cbMap, cbNewLength, MREMAP_MAYMOVE);
+  if (p == MAP_FAILED) {
+    //   If mremap() fails, the old mapping is still valid.  If mmap() fails,
+    // there was no mapping before and there still isn't one now.  Either way
+    // we're still consistent, but we'll lose this write.
+    m_MapLock.Leave();  return Error("remapping", errno);
+  }
+  m_pabMap = (uint8_t *) p;  m_cbMap = cbNewLength;
+  m_MapLock.Leave();
+  return true;
+#else
+  return false;
+#endif
+}
+
+
+bool CDiskImageFile::Flush()
+{
+  //++
+  //   Flush a disk image file to the disk.  If the image is journaled, then
+  // that means a group commit (which calls FlushImage() itself, after it has
+  // applied all the committed transactions).  This is called periodically by
+  // the checkpoint thread, so be careful about thread safety here!
+  //--
+  if (!IsOpen()) return false;
+  if (IsJournaled()) return m_pJournal->GroupCommit();
+  return FlushImage();
+}
+
+
+bool CDiskImageFile::FlushImage()
+{
+  //++
+  //   Flush the image file itself to the disk.  For mapped images this means
+  // a msync() to write back any dirty pages, and for cached images it means
+  // writing back any dirty sectors.  Then we do the usual fflush() and
+  // fsync() to take care of the file metadata.
+  //--
+  if (!IsOpen()) return false;
+  if (IsCached() && !m_pCache->Flush()) return false;
+#ifdef __linux__
+  if (IsMapped() && !IsReadOnly()) {
+    m_MapLock.Enter();
+    int err = (m_pabMap != NULL) ? msync(m_pabMap, m_cbMap, MS_SYNC) : 0;
+    m_MapLock.Leave();
+    if (err != 0) return Error("syncing", errno);
+  }
+#endif
+  if (!CImageFile::Flush()) return false;
+  //   The overlay map is flushed AFTER the delta image, so that the map never
+  // claims a sector is in the delta before the data actually gets there ...
+  if (m_pOverlayMap != NULL) {
+    m_OverlayLock.Enter();
+    fflush(m_pOverlayMap);
+#ifdef _WIN32
+    _commit(_fileno(m_pOverlayMap));
+#elif __linux__
+    fsync(fileno(m_pOverlayMap));
+#endif
+    m_OverlayLock.Leave();
+  }
+  return true;
 }
 
 
 bool CDiskImageFile::SeekSector (uint32_t lLBA)
 {
   //++
-  //   This method will do an fseek() on the image file to move to the correct
+  //   This method will do an fseeko() on the image file to move to the correct
   // offset for the specified absolute sector.  The sector size is used to
   // calculate the correct byte offset - remember that disk images are always
   // stored uncompressed, so every PP word requires two bytes!
   //
-  // Note that we use the 32 bit fseek() here rather than the 64 bit fseek64().
-  // That's not really a problem at the moment, since the biggest disk we can
-  // emulate only holds about 300Mb.
+  //   Note that the offset calculation MUST be done in 64 bits - a 32 bit LBA
+  // times the sector size will overflow for any image bigger than 4Gb.
   //--
   assert(IsOpen());
-  if (fseek(m_pFile, (lLBA * m_nSectorSize), SEEK_SET) != 0)
+  if (fseeko(m_pFile, (off_t) ((uint64_t) lLBA * m_nSectorSize), SEEK_SET) != 0)
     return Error("seeking", errno);
   return true;
 }
 
 
-bool CDiskImageFile::ReadSector (uint32_t lLBA, void *pData)
+bool CDiskImageFile::ReadSectorDirect (uint32_t lLBA, void *pData)
 {
   //++
   //   This method will read a single sector from a disk image file. Note that
@@ -350,8 +712,33 @@ bool CDiskImageFile::ReadSector (uint32_t lLBA, void *pData)
   // reading past the EOF.  That's not a problem, although it's not absolutely
   // clear what should happen in that case.  This routine always returns a
   // buffer of zeros for uninitialized disk data.
+  //
+  //   For copy on write overlays, any sector that's never been written to the
+  // delta comes from the base image instead.
   //--
   assert(IsOpen());
+  if (IsOverlay() && !IsInDelta(lLBA)) return m_pBase->ReadSectorDirect(lLBA, pData);
+  if (IsCompressed()) return m_pCompressed->Read(lLBA, 1, pData);
+  if (IsMapped()) {
+    //   For mapped images, just copy the data.  Remember that the last sector
+    // in the file might be incomplete, and anything past the EOF is zeros.
+    // Another thread can extend the image, and GrowImage() may move the
+    // mapping, so hold m_MapLock while we're copying ...
+    uint64_t llOffset = (uint64_t) lLBA * m_nSectorSize;
+    m_MapLock.Enter();
+    size_t cb = (llOffset < m_cbMap) ? (size_t) MIN(m_cbMap-llOffset, m_nSectorSize) : 0;
+    if (cb > 0) memcpy(pData, m_pabMap+llOffset, cb);
+    m_MapLock.Leave();
+    if (cb < m_nSectorSize) memset(((uint8_t *) pData)+cb, 0, m_nSectorSize-cb);
+    return true;
+  }
+#ifdef __linux__
+  if (IsPositional()) {
+    struct iovec iov;
+    iov.iov_base = pData;  iov.iov_len = m_nSectorSize;
+    return ReadRun(lLBA, &iov, 1);
+  }
+#endif
   if (!SeekSector(lLBA)) return false;
   size_t count = fread(pData, 1, m_nSectorSize, m_pFile);
   if (count == 0) {
@@ -365,283 +752,2049 @@ bool CDiskImageFile::ReadSector (uint32_t lLBA, void *pData)
 }
 
 
-bool CDiskImageFile::WriteSector (uint32_t lLBA, const void *pData)
+bool CDiskImageFile::WriteSectorDirect (uint32_t lLBA, const void *pData)
 {
   //++
   // Write a single sector to the image file ...
   //--
   assert(IsOpen());
   if (IsReadOnly()) return false;
+  if (IsMapped()) {
+#ifdef __linux__
+    //   In sparse mode, an all zero sector past the EOF just extends the file
+    // (which doesn't allocate anything) and one inside the file is punched
+    // out.  Punching a hole in a shared mapping zeros the pages there too.
+    if (IsSparse() && IsZeroSector(pData, m_nSectorSize)) {
+      uint64_t llOffset = (uint64_t) lLBA * m_nSectorSize;
+      m_MapLock.Enter();
+      uint64_t llEOF = m_cbMap;
+      m_MapLock.Leave();
+      if (llOffset+m_nSectorSize > llEOF) return GrowImage(llOffset+m_nSectorSize);
+      return ZeroRange(llOffset, m_nSectorSize, llEOF);
+    }
+#endif
+    //   GetSectorPointer() extends the image if necessary, but the pointer it
+    // returns is only good until some other thread moves the mapping.  The
+    // mapping never shrinks while it's open, so just copy under m_MapLock ...
+    if (GetSectorPointer(lLBA) == NULL) return false;
+    m_MapLock.Enter();
+    memcpy(m_pabMap + (uint64_t) lLBA*m_nSectorSize, pData, m_nSectorSize);
+    m_MapLock.Leave();
+    return true;
+  }
+#ifdef __linux__
+  if (IsPositional() || IsSparse() || IsOverlay()) {
+    struct iovec iov;
+    iov.iov_base = (void *) pData;  iov.iov_len = m_nSectorSize;
+    return WriteRun(lLBA, &iov, 1);
+  }
+#endif
   if (!SeekSector(lLBA)) return false;
   if (fwrite(pData, 1, m_nSectorSize, m_pFile) != m_nSectorSize)
     return Error("writing", errno);
+  if (IsOverlay()) return MarkInDelta(lLBA);
   return true;
 }
 
 
-
-///////////////////////////////////////////////////////////////////////////////
-// CTapeImageFile members ...
-///////////////////////////////////////////////////////////////////////////////
-
-CTapeImageFile::CTapeImageFile (bool f7Track)
+/*static*/ size_t CDiskImageFile::FindRun (const SECTOR_IOV aIOV[], size_t nIOV)
 {
   //++
-  // Initialize any tape image specific flags ...
+  //   Return the number of entries at the start of aIOV[] that refer to
+  // adjacent, ascending, sectors.  This is always at least one (assuming
+  // nIOV is not zero) and never more than MAXIOV.
   //--
-  m_nRecordCount = 0;  m_fWriteLast = false;
-  m_nFileSize = 0;  m_f7Track = f7Track;
+  size_t n = 1;
+  while ((n < nIOV) && (n < MAXIOV) && (aIOV[n].lLBA == aIOV[n-1].lLBA+1)) ++n;
+  return n;
 }
 
 
-bool CTapeImageFile::Open (const string &sFileName, bool fReadOnly, int nShareMode)
+#ifdef __linux__
+bool CDiskImageFile::ReadRun (uint32_t lLBA, const struct iovec *aiov, int niov)
 {
   //++
-  //   Open the associated image file and initialize the file length and
-  // record count ...
+  //   Read a run of contiguous sectors, starting with lLBA, into the buffers
+  // described by aiov[], and do it with a single preadv().  Just like
+  // ReadSector(), any part of the run past the EOF reads as zeros.
   //--
-  if (!CImageFile::Open(sFileName, fReadOnly, nShareMode)) return false;
-  m_nFileSize = GetFileLength();  m_nRecordCount = 0;  m_fWriteLast = false;
-  LOGF(TRACE, "  -> CTapeImageFile::Open, file length=%d", m_nFileSize);
+  assert(IsOpen() && !IsMapped() && (niov > 0) && (niov <= MAXIOV));
+  ssize_t cb = preadv(m_nFD, aiov, niov, (off_t) lLBA * m_nSectorSize);
+  if (cb < 0) return Error("reading", errno);
+  //   If we got less than we asked for, then we ran into the EOF.  Skip over
+  // the part we did read and zero everything else ...
+  size_t cbDone = (size_t) cb;
+  for (int i = 0;  i < niov;  ++i) {
+    if (cbDone >= aiov[i].iov_len) {
+      cbDone -= aiov[i].iov_len;  continue;
+    }
+    memset(((uint8_t *) aiov[i].iov_base)+cbDone, 0, aiov[i].iov_len-cbDone);
+    cbDone = 0;
+  }
   return true;
 }
 
 
-bool CTapeImageFile::IsBOT() const
+bool CDiskImageFile::WriteRun (uint32_t lLBA, const struct iovec *aiov, int niov)
 {
   //++
-  // Return TRUE if the current tape position is at the BOT ...
+  //   And write a run of contiguous sectors with a single pwritev() ...
   //--
-  assert(IsOpen());
-  return ftell(m_pFile) == 0;
+  assert(IsOpen() && !IsMapped() && !IsReadOnly() && (niov > 0) && (niov <= MAXIOV));
+  size_t cbTotal = 0;
+  for (int i = 0;  i < niov;  ++i) cbTotal += aiov[i].iov_len;
+  if (IsSparse()) {
+    if (!WriteRunSparse(lLBA, aiov, niov)) return false;
+  } else {
+    ssize_t cb = pwritev(m_nFD, aiov, niov, (off_t) lLBA * m_nSectorSize);
+    if ((cb < 0) || ((size_t) cb != cbTotal)) return Error("writing", errno);
+  }
+  // For overlays, remember that these sectors now live in the delta ...
+  if (IsOverlay()) return MarkInDelta(lLBA, (uint32_t) (cbTotal / m_nSectorSize));
+  return true;
 }
 
 
-bool CTapeImageFile::IsEOT() const
+bool CDiskImageFile::WriteRunSparse (uint32_t lLBA, const struct iovec *aiov, int niov)
 {
   //++
-  // Return TRUE if the current tape position is at the EOT ...
-  //
-  //   Unfortunately, and unlike IsBOT(), there's no elegant way to do this.
-  // You're probably saying - "just return feof()!".  No dice - feof() won't
-  // work unless you've first tried to read and then failed because of EOF.
-  // feof() doesn't look ahead at what's next in the file.
-  //
-  //   Instead, we keep track of the total file length in the m_nFileSize
-  // member and compare the current position (obtained from ftell()) to that.
-  // If they're equal, then we're at the end.  This works great, and it's fast
-  // too, as long as we keep m_nFileSize current.
-  //
-  //   One more comment before going - for a real tape, EOT means the end of
-  // the physical media, but in the context of an image file it's a little
-  // different.  For a read only file, the EOT logically means the end of the
-  // data, because there's never going to be any more on that virtual tape.
-  // But for a writable image, then EOT never occurs because the image file
-  // can always be extended and more data can always be written.
+  //   Write a run of contiguous sectors in sparse mode.  Every sector is
+  // checked and the run is split up into pieces - adjacent non-zero sectors
+  // are still written with a single pwritev(), but adjacent zero sectors are
+  // handed to ZeroRange() instead.  Note that every iovec must be a whole
+  // number of sectors, which is always true for our callers.
   //
-  //   Hence, this function only has meaning for a read only image.  For a
-  // writable image, it always returns false!
-  //--
-  assert(IsOpen());
-  if (!IsReadOnly()) return false;
-  return ((uint32_t) ftell(m_pFile)) >= m_nFileSize;
-}
-
-
-bool CTapeImageFile::Rewind()
-{
-  //++
-  // Rewind the logical tape to the BOT ...
+  //   Since each new data piece starts only at a zero sector or at the start
+  // of a new iovec, there can never be more data pieces than niov.
   //--
-  assert(IsOpen());
-  if (fseek(m_pFile, 0L, SEEK_SET) != 0)
-    return CImageFile::Error("seek rewind", errno);
-  m_fWriteLast = false;  m_nRecordCount = 0;
+  uint64_t llEOF = GetFileLength();
+  uint64_t llOffset = (uint64_t) lLBA * m_nSectorSize;
+  struct iovec aData[MAXIOV];  int nData = 0;
+  uint64_t llData = 0, cbData = 0;      // pending run of data sectors
+  uint64_t llZero = 0, cbZero = 0;      // pending run of zero sectors
+  for (int i = 0;  i < niov;  ++i) {
+    assert((aiov[i].iov_len % m_nSectorSize) == 0);
+    for (size_t cb = 0;  cb < aiov[i].iov_len;  cb += m_nSectorSize, llOffset += m_nSectorSize) {
+      uint8_t *pab = ((uint8_t *) aiov[i].iov_base) + cb;
+      if (IsZeroSector(pab, m_nSectorSize)) {
+        if (nData > 0) {
+          ssize_t cbDone = pwritev(m_nFD, aData, nData, (off_t) llData);
+          if ((cbDone < 0) || ((uint64_t) cbDone != cbData)) return Error("writing", errno);
+          if (llData+cbData > llEOF) llEOF = llData+cbData;
+          nData = 0;  cbData = 0;
+        }
+        if (cbZero == 0) llZero = llOffset;
+        cbZero += m_nSectorSize;
+      } else {
+        if (cbZero > 0) {
+          if (!ZeroRange(llZero, cbZero, llEOF)) return false;
+          cbZero = 0;
+        }
+        if ((nData > 0) && (((uint8_t *) aData[nData-1].iov_base) + aData[nData-1].iov_len == pab)) {
+          aData[nData-1].iov_len += m_nSectorSize;
+        } else {
+          if (nData == 0) llData = llOffset;
+          aData[nData].iov_base = pab;  aData[nData].iov_len = m_nSectorSize;  ++nData;
+        }
+        cbData += m_nSectorSize;
+      }
+    }
+  }
+  if (nData > 0) {
+    ssize_t cbDone = pwritev(m_nFD, aData, nData, (off_t) llData);
+    if ((cbDone < 0) || ((uint64_t) cbDone != cbData)) return Error("writing", errno);
+  }
+  if (cbZero > 0) return ZeroRange(llZero, cbZero, llEOF);
   return true;
 }
 
 
-int32_t CTapeImageFile::ReadForwardRecord (uint8_t abData[], size_t cbMaxData)
+bool CDiskImageFile::ZeroRange (uint64_t llOffset, uint64_t cbLength, uint64_t &llEOF)
 {
   //++
-  //   This routine will read, in the forward direction, the next record from
-  // the tape image file.  The raw data from the record, which cannot exceed
-  // cbMaxData in length, is returned in abData.  The actual record length, in
-  // bytes, is the function return value.  This routine can also return either
-  // EOTBOT, if the tape is at the end, or BADTAPE, if any TAP file format
-  // errors are found.  Note that a record length of zero is also legal and is
-  // not an error but rather indicates a tape mark.
+  //   Make the specified part of the image file read as zeros without writing
+  // any data.  Any part of it that's inside the file (i.e. before llEOF) has
+  // a hole punched in it.  Any part past the EOF is taken care of by simply
+  // extending the file, which creates a hole automatically.  We still extend
+  // the file so that the image length is exactly what it would have been had
+  // we written the zeros.
   //
-  //   After a successful read, the logical tape is left positioned at the
-  // start (i.e. just before the header longword) of the next record.  In the
-  // event of a BADTAPE, the tape position is lost and the caller must invoke
-  // Rewind() before attempting to read again.
+  //   Remember that positional access doesn't lock anything, so another
+  // thread may have extended the file since the caller got llEOF.  Before
+  // extending we ask for the real length again, and the file is extended by
+  // writing a single zero byte at the end of the range rather than with
+  // ftruncate().  A write can never make the file shorter, so even if somebody
+  // else extends the file between our fstat() and pwrite(), their data is
+  // safe.  It costs at most one allocated block at the end of the range.
   //
-  //   One final comment - In the tape image file the metadata is always stored
-  // in little endian format and strictly speaking we should worry about that,
-  // but since our only platfrom for MBS is a PC and that's little endian, we'll
-  // take the Alfred E Neuman approach to programming...
+  //   Not every file system supports hole punching, and if this one doesn't
+  // we fall back to actually writing zeros.  llEOF is updated if the file gets
+  // longer.
   //--
-  assert(IsOpen() && (cbMaxData > 0) && (cbMaxData <= MAXRECLEN));
-  METADATA nRecLen1, nRecLen2;
-
-  //   If the last operation we did on this image was a write, then first
-  // sync the underlying file system buffers ...
-  if (m_fWriteLast) {
-    fseek(m_pFile, 0L, SEEK_CUR);  m_fWriteLast = false;
-  }
-  LOGF(TRACE, "  -> ReadForwardRecord, cbMaxData=%d, (before) pos=%d", cbMaxData, ftell(m_pFile));
-
-  // Try to read the TAP record length header ...
-  if (((uint32_t) ftell(m_pFile)) >= m_nFileSize) return EOTBOT;
-  if (fread(&nRecLen1, sizeof(METADATA), 1, m_pFile) != 1) {
-    CImageFile::Error("read forward header", errno);  return BADTAPE;
-  }
-//LOGF(TRACE, "  -> CTapeImageFile::ReadForwardRecord#1, nRecLen1=%d (0x%08X), pos=%d", nRecLen1, nRecLen1, ftell(m_pFile));
-
-  //   In TAP format, the high order bits of the record length are reserved
-  // for flagged tape errors.  We currently don't handle these...
-  if ((nRecLen1 & ~RECLENMASK) != 0) {
-    LOGF(ERROR, "forced error flag (0x%08X) on tape %s", nRecLen1, m_sFileName.c_str());
-    return BADTAPE;
-  }
-
-  //   Sanity check the record length.  Also, if the record length is zero
-  // then this is a tape mark and we can quit now ...
-  ++m_nRecordCount;
-  if (nRecLen1 == 0) return TAPEMARK;
-  if (((size_t) nRecLen1) > cbMaxData) {
-    LOGF(ERROR, "record length too long (%d bytes) on tape %s", nRecLen1, m_sFileName.c_str());
-    return BADTAPE;
+  uint64_t llEnd = llOffset + cbLength;
+  if (llEnd > llEOF) {
+    struct stat st;
+    if (fstat(m_nFD, &st) != 0) return Error("fstat", errno);
+    if ((uint64_t) st.st_size > llEOF) llEOF = (uint64_t) st.st_size;
   }
-
-  // Read the raw data ...
-  if (fread(abData, 1, nRecLen1, m_pFile) != (size_t) nRecLen1) {
-    CImageFile::Error("read forward data", errno);  return BADTAPE;
+  if (llOffset < llEOF) {
+    uint64_t cbPunch = MIN(llEnd, llEOF) - llOffset;
+    if (fallocate(m_nFD, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, (off_t) llOffset, (off_t) cbPunch) != 0) {
+      if ((errno != EOPNOTSUPP) && (errno != ENOSYS)) return Error("punching hole", errno);
+      size_t cbChunk = (size_t) MIN(cbPunch, 65536ULL);
+      uint8_t *pabZero = DBGNEW uint8_t[cbChunk];
+      memset(pabZero, 0, cbChunk);
+      for (uint64_t cbDone = 0;  cbDone < cbPunch;  ) {
+        size_t cb = (size_t) MIN(cbPunch-cbDone, (uint64_t) cbChunk);
+        ssize_t cbWritten = pwrite(m_nFD, pabZero, cb, (off_t) (llOffset+cbDone));
+        if (cbWritten <= 0) {
+          delete[] pabZero;  return Error("writing", errno);
+        }
+        cbDone += (uint64_t) cbWritten;
+      }
+      delete[] pabZero;
+    }
   }
-
-  // Read the record length trailer and see if it matches the header ...
-  if (fread(&nRecLen2, sizeof(METADATA), 1, m_pFile) != 1) {
-    CImageFile::Error("read forward trailer 1", errno);  return BADTAPE;
+  if (llEnd > llEOF) {
+    uint8_t bZero = 0;
+    if (pwrite(m_nFD, &bZero, 1, (off_t) (llEnd-1)) != 1) return Error("extending", errno);
+    llEOF = llEnd;
   }
-  if (nRecLen1 == nRecLen2) return nRecLen1;
+  return true;
+}
+#endif
 
-  //   Some misguided TAP file writers round off the actual record to an even
-  // number of bytes, even when the record length is odd.  There's no way to
-  // tell in advance whether we have one of those, but if the record lengths
-  // don't match, see if that's the problem.  Note that we just read 4 bytes,
-  // so by skipping backward 3 bytes we effectively ignore the padding byte.
-  fseek(m_pFile, -((int32_t) (sizeof(METADATA)-1)), SEEK_CUR);
-  if (fread(&nRecLen2, sizeof(METADATA), 1, m_pFile) != 1) {
-    CImageFile::Error("read forward trailer 2", errno);  return BADTAPE;
-  }
-//LOGF(TRACE, "  -> CTapeImageFile::ReadForwardRecord#2, nRecLen2=%d (0x%08X), pos=%d", nRecLen2, nRecLen2, ftell(m_pFile));
-  if (nRecLen1 == nRecLen2) return nRecLen1;
 
-  // Nope - it's a bad tape ...
-  LOGF(ERROR, "header (0x%08X) and trailer (0x%08X) mismatch on tape %s", nRecLen1, nRecLen2, m_sFileName.c_str());
-  return BADTAPE;
+/*static*/ bool CDiskImageFile::IsZeroSector (const void *pData, size_t cbData)
+{
+  //++
+  //   Return TRUE if the sector is all zeros.  The trick here is that if the
+  // first byte is zero and every byte is equal to the one after it, then
+  // they're all zero.  memcmp() is much faster than any loop we could write.
+  //--
+  const uint8_t *pab = (const uint8_t *) pData;
+  return (cbData == 0) || ((pab[0] == 0) && (memcmp(pab, pab+1, cbData-1) == 0));
 }
 
 
-int32_t CTapeImageFile::ReadReverseRecord (uint8_t abData[], size_t cbMaxData)
+bool CDiskImageFile::OpenOverlay (const string &sBaseFile, const string &sDeltaFile, ACCESS_MODE nMode)
 {
   //++
-  //   This routine is logically just like ReadForwardRecord(), except that
-  // this time we read the _previous_ record.  In this case, the virtual tape
-  // position is left at the beginning of the previous record.  The same error
-  // return conditions apply here.
-  //
-  //   Note that calling ReadForwardRecord() and then immediately calling
-  // ReadReverseRecord() should a) return exactly the same data,, and b) leave
-  // the virtual tape in exactly the same position.
-  //
-  //   IMPORTANT!  The bytes returned by this routine will be ordered in the
-  // "forward" direction - that is, they're in the same order as ReadForward
-  // Record() would return when reading this same record.  That might seem
-  // obvious, but remember that it's not what a real tape drive would do!
-  // A real tape drive would have physically read the record backward, and all
-  // the bytes would have therefore appeared in reverse order.  The host
-  // software expects that, and somebody up above us in the chain needs to
-  // compensate by reversing the order of the bytes in the record.
+  //   Open a copy on write overlay.  This object becomes the delta image, and
+  // the base image is opened read only (and shared, so any number of overlays
+  // can use the same base at once).  The overlay map lives in a sidecar file
+  // with the same name as the delta plus ".map", and both are created if they
+  // don't already exist.  Mapped overlays aren't supported - GetSectorPointer()
+  // can't know whether to return the base or delta sector.
   //--
-  assert(IsOpen() && (cbMaxData > 0) && (cbMaxData <= MAXRECLEN));
-  METADATA nRecLen1, nRecLen2;
-//LOGF(TRACE, "  -> CTapeImageFile::ReadReverseRecord, cbMaxData=%d, (before) pos=%d", cbMaxData, ftell(m_pFile));
-
-  //  If we're already at the BOT, then fail.  Otherwise back up four bytes
-  // and try to read the trailer from the previous record.  Note that since
-  // the first thing we do here is always an fseek(), regardless, there is
-  // never a need to worry about syncing the file system buffers ...
-  if (IsBOT()) return EOTBOT;
-  m_fWriteLast = false;
-  fseek(m_pFile, -((int32_t) sizeof(METADATA)), SEEK_CUR);
-  if (fread(&nRecLen2, sizeof(METADATA), 1, m_pFile) != 1) {
-    CImageFile::Error("read reverse trailer", errno);  return BADTAPE;
+  if (nMode == ACCESS_MAPPED) {
+    LOGS(WARNING, "mapped overlays not supported - using stdio for " << sDeltaFile);
+    nMode = ACCESS_STDIO;
   }
-  fseek(m_pFile, -((int32_t) sizeof(METADATA)), SEEK_CUR);
-//LOGF(TRACE, "  -> CTapeImageFile::ReadReverseRecord#1, nRecLen2=%d (0x%08X), pos=%d", nRecLen2, nRecLen2, ftell(m_pFile));
-
-  // Check the record length, just as for read forward ...
-  if ((nRecLen2 & ~RECLENMASK) != 0) {
-    LOGF(ERROR, "forced error flag (0x%08X) on tape %s", nRecLen2, m_sFileName.c_str());
-    return BADTAPE;
+  if (!Open(sDeltaFile, false, 0, nMode)) return false;
+  if (IsCompressed()) {
+    LOGS(ERROR, "compressed image " << sDeltaFile << " can't be an overlay delta");
+    Close();  return false;
   }
-  assert(m_nRecordCount > 0);  --m_nRecordCount;
-  if (nRecLen2 == 0) return TAPEMARK;
-  if (((size_t) nRecLen2) > cbMaxData) {
-    LOGF(ERROR, "record length too long (%d bytes) on tape %s", nRecLen2, m_sFileName.c_str());
-    return BADTAPE;
+  m_pBase = DBGNEW CDiskImageFile(m_nSectorSize);
+  if (!m_pBase->Open(sBaseFile, true) || !LoadOverlayMap(sDeltaFile + ".map")) {
+    Close();  return false;
   }
+  //   The overlay map isn't fsync()ed every time it changes, so overlays
+  // need the checkpoint thread to flush them once in a while ...
+  CCheckpointFiles::AddImage(this);
+  LOGS(DEBUG, "opened " << sDeltaFile << " as an overlay of " << sBaseFile);
+  return true;
+}
 
-  //   Instead of just skipping backwards and trying to read the data, we skip
-  // backwards four extra bytes and first try to read the header.  We do this
-  // just in case we have one of those funky, padded record length, TAP files.
-  // If we have one of those, we'll have to skip backwards an extra byte to get
-  // aligned properly with the header and data.
-  fseek(m_pFile, -((int32_t) (nRecLen2+sizeof(METADATA))), SEEK_CUR);
-  if (fread(&nRecLen1, sizeof(METADATA), 1, m_pFile) != 1) {
-    CImageFile::Error("read reverse header 1", errno);  return BADTAPE;
-  }
-  if (nRecLen1 != nRecLen2) {
-    // The header and trailer don't match - offset by one byte and try again.
-    fseek(m_pFile, -((int32_t) (sizeof(METADATA)+1)), SEEK_CUR);
-    if (fread(&nRecLen1, sizeof(METADATA), 1, m_pFile) != 1) {
-      CImageFile::Error("read reverse header 2", errno);  return BADTAPE;
-    }
-    if (nRecLen1 != nRecLen2) {
-      // Nope - it's a bad tape ...
-      LOGF(ERROR, "header (0x%08X) and trailer (0x%08X) mismatch on tape %s", nRecLen1, nRecLen2, m_sFileName.c_str());
-      return BADTAPE;
-    }
-  }
 
-  // Now we're ready to read the actual data (forwards, of course) ...
-  if (fread(abData, 1, nRecLen2, m_pFile) != (size_t) nRecLen2) {
-    CImageFile::Error("read reverse data", errno);  return BADTAPE;
+bool CDiskImageFile::LoadOverlayMap (const string &sMapFile)
+{
+  //++
+  //   Open the overlay map sidecar file, creating it if necessary, and read
+  // the whole thing into memory.  If the delta is read only then so is the
+  // map, and a missing map just means nothing has been written to the delta.
+  //--
+  m_abOverlayMap.clear();
+  m_pOverlayMap = fopen(sMapFile.c_str(), IsReadOnly() ? "rb" : "rb+");
+  if ((m_pOverlayMap == NULL) && (errno == ENOENT)) {
+    if (IsReadOnly()) return true;
+    m_pOverlayMap = fopen(sMapFile.c_str(), "wb+");
   }
-
-  // Skip back over the data AND the header and we're done ...
-  fseek(m_pFile, -((int32_t) (nRecLen2+sizeof(METADATA))), SEEK_CUR);
-//LOGF(TRACE, "  -> CTapeImageFile::ReadReverseRecord#2, newpos=%d", ftell(m_pFile));
-  return nRecLen2;
+  if (m_pOverlayMap == NULL) return Error("opening overlay map for", errno);
+  setvbuf(m_pOverlayMap, NULL, _IONBF, 0);
+  if (fseeko(m_pOverlayMap, 0, SEEK_END) != 0) return Error("reading overlay map for", errno);
+  uint64_t cbMap = (uint64_t) ftello(m_pOverlayMap);
+  rewind(m_pOverlayMap);
+  m_abOverlayMap.resize((size_t) cbMap, 0);
+  if ((cbMap > 0) && (fread(m_abOverlayMap.data(), 1, (size_t) cbMap, m_pOverlayMap) != cbMap))
+    return Error("reading overlay map for", errno);
+  return true;
 }
 
 
-bool CTapeImageFile::Truncate()
+void CDiskImageFile::CloseOverlay()
 {
   //++
-  // Truncate the tape image to the current position.
+  // Close the overlay map and the base image ...
   //--
-  assert(IsOpen());
-  if (IsReadOnly()) return false;
-  fseek(m_pFile, 0L, SEEK_CUR);  m_fWriteLast = true;
-  m_nFileSize = ftell(m_pFile);
-  return SetFileLength(m_nFileSize);
+  CCheckpointFiles::RemoveImage(this);
+  if (m_pOverlayMap != NULL) fclose(m_pOverlayMap);
+  m_pOverlayMap = NULL;  m_abOverlayMap.clear();
+  if (m_pBase != NULL) delete m_pBase;
+  m_pBase = NULL;
 }
 
 
-bool CTapeImageFile::WriteRecord (uint8_t abData[], size_t cbData)
+bool CDiskImageFile::IsInDelta (uint32_t lLBA)
+{
+  //++
+  // Return TRUE if this sector has been written to the overlay delta ...
+  //--
+  m_OverlayLock.Enter();
+  size_t iByte = lLBA >> 3;
+  bool fSet = (iByte < m_abOverlayMap.size()) && ((m_abOverlayMap[iByte] & (1 << (lLBA & 7))) != 0);
+  m_OverlayLock.Leave();
+  return fSet;
+}
+
+
+CDiskImageFile::OVERLAY_STATE CDiskImageFile::GetOverlayState (uint32_t lLBA, uint32_t nCount)
+{
+  //++
+  //   Return OVERLAY_DELTA if every sector in this run has been written to
+  // the delta, OVERLAY_BASE if none of them have, and OVERLAY_MIXED otherwise.
+  //--
+  uint32_t nSet = 0;
+  m_OverlayLock.Enter();
+  for (uint64_t l = lLBA;  l < (uint64_t) lLBA+nCount;  ++l) {
+    size_t iByte = (size_t) (l >> 3);
+    if ((iByte < m_abOverlayMap.size()) && ((m_abOverlayMap[iByte] & (1 << (l & 7))) != 0)) ++nSet;
+  }
+  m_OverlayLock.Leave();
+  if (nSet == 0) return OVERLAY_BASE;
+  return (nSet == nCount) ? OVERLAY_DELTA : OVERLAY_MIXED;
+}
+
+
+bool CDiskImageFile::MarkInDelta (uint32_t lLBA, uint32_t nCount)
+{
+  //++
+  //   Mark a run of sectors as written to the overlay delta.  This is called
+  // AFTER the data has been written.  Only the bytes of the map that actually
+  // change are written to the sidecar file, so once the working set of the
+  // host has been copied to the delta the map is hardly ever written at all.
+  //
+  //   The map must never reach the disk before the data it describes, or a
+  // crash in between would leave sectors in the delta that claim to have
+  // been written but really contain garbage (or zeros).  Nothing stops the
+  // kernel from writing the map back first, so whenever the map changes we
+  // force the delta data out with fdatasync() before we update it.  Like the
+  // map writes themselves, that only happens the first time a sector is
+  // written to the delta.
+  //--
+  assert(nCount > 0);
+  m_OverlayLock.Enter();
+  size_t iLast = (size_t) (((uint64_t) lLBA+nCount-1) >> 3);
+  if (iLast >= m_abOverlayMap.size()) m_abOverlayMap.resize(iLast+1, 0);
+  size_t iMin = SIZE_MAX, iMax = 0;
+  for (uint64_t l = lLBA;  l < (uint64_t) lLBA+nCount;  ++l) {
+    size_t iByte = (size_t) (l >> 3);  uint8_t bMask = (uint8_t) (1 << (l & 7));
+    if ((m_abOverlayMap[iByte] & bMask) != 0) continue;
+    m_abOverlayMap[iByte] |= bMask;
+    iMin = MIN(iMin, iByte);  iMax = iByte;
+  }
+  bool fOK = true;
+  if ((iMin <= iMax) && (m_pOverlayMap != NULL)) {
+    size_t cb = iMax-iMin+1;
+#ifdef _WIN32
+    fOK = (fflush(m_pFile) == 0) && (_commit(_fileno(m_pFile)) == 0);
+#elif __linux__
+    fOK = (fflush(m_pFile) == 0) && (fdatasync(fileno(m_pFile)) == 0);
+#endif
+    fOK = fOK && (fseeko(m_pOverlayMap, (off_t) iMin, SEEK_SET) == 0)
+       && (fwrite(&m_abOverlayMap[iMin], 1, cb, m_pOverlayMap) == cb);
+  }
+  m_OverlayLock.Leave();
+  return fOK || Error("updating overlay map for", errno);
+}
+
+
+bool CDiskImageFile::SetSparse (bool fSparse)
+{
+  //++
+  //   Enable or disable sparse mode for this image.  Hole punching requires
+  // fallocate(), which only Linux has, so on Windows this is a no-op and
+  // we return false.  Sparse mode only affects future writes - the existing
+  // contents of the image aren't touched (use CompactImage() for that).
+  //--
+  assert(IsOpen());
+#ifdef _WIN32
+  if (fSparse)
+    LOGS(WARNING, "sparse images not supported - ignored for " << m_sFileName);
+  m_fSparse = false;
+  return !fSparse;
+#elif __linux__
+  m_fSparse = fSparse;
+  return true;
+#endif
+}
+
+
+/*static*/ bool CDiskImageFile::CompactImage (const string &sOldFile, const string &sNewFile, uint32_t nSectorSize)
+{
+  //++
+  //   Copy the image file sOldFile to sNewFile, leaving holes in the new file
+  // for every all zero sector.  The new file has exactly the same length and
+  // contents as the old one, but it may take up a lot less space.  The new
+  // file is overwritten if it already exists!  That means the new file can't
+  // be the old one, under any name, or we'd truncate it before we copied a
+  // single byte.
+  //
+  //   Note that this is a static method - neither image file should be open
+  // by anybody else while we're copying it.
+  //--
+  assert(nSectorSize > 0);
+#ifdef _WIN32
+  LOGS(ERROR, "image compaction not supported on Windows");
+  return false;
+#elif __linux__
+  if (IsSameFile(sOldFile.c_str(), sNewFile.c_str())) {
+    LOGS(ERROR, "can't compact " << sOldFile << " onto itself");  return false;
+  }
+  int fdOld = open(sOldFile.c_str(), O_RDONLY);
+  if (fdOld < 0) {
+    LOGS(ERROR, "error (" << errno << ") opening " << sOldFile);  return false;
+  }
+  int fdNew = open(sNewFile.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0666);
+  if (fdNew < 0) {
+    LOGS(ERROR, "error (" << errno << ") creating " << sNewFile);
+    close(fdOld);  return false;
+  }
+  uint64_t llCopied = 0;
+  bool fOK = CopySparse(fdOld, fdNew, nSectorSize, llCopied) && (fsync(fdNew) == 0);
+  if (fOK) {
+    LOGS(DEBUG, "compacted " << sOldFile << " to " << sNewFile << ", " << llCopied << " bytes copied");
+  } else {
+    LOGS(ERROR, "error (" << errno << ") compacting " << sOldFile << " to " << sNewFile);
+  }
+  close(fdOld);  close(fdNew);
+  return fOK;
+#endif
+}
+
+
+#ifdef __linux__
+/*static*/ bool CDiskImageFile::CopySparse (int fdOld, int fdNew, uint32_t nSectorSize, uint64_t &llCopied)
+{
+  //++
+  //   Copy the entire contents of fdOld to fdNew, which should be empty, and
+  // leave a hole in the new file for every all zero sector.  We use SEEK_DATA
+  // and SEEK_HOLE to skip over any holes already in the old file, so we don't
+  // even have to read those, and only the data regions are actually examined.
+  // llCopied returns the number of bytes actually written.  Note that this
+  // DOES NOT sync the new file - that's up to the caller.
+  //--
+  struct stat st;
+  bool fOK = (fstat(fdOld, &st) == 0);
+  uint64_t llLength = fOK ? (uint64_t) st.st_size : 0;
+  llCopied = 0;
+  const size_t cbBuffer = (size_t) 256 * nSectorSize;
+  uint8_t *pabBuffer = DBGNEW uint8_t[cbBuffer];
+  off_t llData = 0;
+  while (fOK && ((uint64_t) llData < llLength)) {
+    //   Find the next data region.  ENXIO means there's no more data between
+    // here and the EOF.  Round the start of the data down to a sector boundary
+    // (it almost always is anyway).
+    llData = lseek(fdOld, llData, SEEK_DATA);
+    if (llData < 0) {
+      fOK = (errno == ENXIO);  break;
+    }
+    llData -= llData % nSectorSize;
+    off_t llHole = lseek(fdOld, llData, SEEK_HOLE);
+    if (llHole < 0) {
+      fOK = false;  break;
+    }
+    //   Copy this data region a buffer at a time, writing only the non-zero
+    // sectors.  Adjacent non-zero sectors are written together.
+    while (fOK && (llData < llHole)) {
+      size_t cbRead = (size_t) MIN((uint64_t) (llHole-llData), (uint64_t) cbBuffer);
+      ssize_t cb = pread(fdOld, pabBuffer, cbRead, llData);
+      if (cb <= 0) {
+        fOK = (cb == 0);  break;
+      }
+      size_t cbRun = 0, ibRun = 0;
+      for (size_t ib = 0;  ib < (size_t) cb;  ib += nSectorSize) {
+        size_t cbSector = MIN((size_t) cb-ib, (size_t) nSectorSize);
+        if (!IsZeroSector(pabBuffer+ib, cbSector)) {
+          if (cbRun == 0) ibRun = ib;
+          cbRun += cbSector;  continue;
+        }
+        if ((cbRun > 0) && (pwrite(fdNew, pabBuffer+ibRun, cbRun, llData+ibRun) != (ssize_t) cbRun)) {
+          fOK = false;  break;
+        }
+        llCopied += cbRun;  cbRun = 0;
+      }
+      if (fOK && (cbRun > 0) && (pwrite(fdNew, pabBuffer+ibRun, cbRun, llData+ibRun) != (ssize_t) cbRun))
+        fOK = false;
+      llCopied += cbRun;
+      llData += cb;
+    }
+  }
+  if (fOK) fOK = (ftruncate(fdNew, (off_t) llLength) == 0);
+  delete[] pabBuffer;
+  return fOK;
+}
+
+
+/*static*/ bool CDiskImageFile::CloneFile (int fdOld, int fdNew, uint32_t nSectorSize)
+{
+  //++
+  //   Copy the entire contents of fdOld to fdNew, which should be empty.  On
+  // file systems that support it (btrfs, XFS, and others) FICLONE makes the
+  // new file share all its blocks with the old one, copy on write, and that's
+  // nearly instantaneous no matter how big the image is.  Everywhere else we
+  // fall back to an ordinary (but sparse!) copy.
+  //--
+#ifdef FICLONE
+  if (ioctl(fdNew, FICLONE, fdOld) == 0) return true;
+  LOGS(TRACE, "FICLONE failed (" << errno << ") - copying instead");
+#endif
+  uint64_t llCopied;
+  return CopySparse(fdOld, fdNew, nSectorSize, llCopied);
+}
+#endif
+
+
+bool CDiskImageFile::ReadSectorsDirect (uint32_t lLBA, uint32_t nCount, void *pData)
+{
+  //++
+  //   Read nCount contiguous sectors, starting with lLBA, into the caller's
+  // buffer.  The buffer must be at least nCount*GetSectorSize() bytes!  For
+  // stdio images this is a single system call, regardless of the count.
+  //
+  //   For an overlay, the whole run can come from either the base image or
+  // the delta in one call, but if it's a mix then we go sector by sector.
+  //--
+  assert(IsOpen() && (nCount > 0));
+  OVERLAY_STATE nState = IsOverlay() ? GetOverlayState(lLBA, nCount) : OVERLAY_DELTA;
+  if (nState == OVERLAY_BASE) return m_pBase->ReadSectorsDirect(lLBA, nCount, pData);
+  if (IsCompressed()) return m_pCompressed->Read(lLBA, nCount, pData);
+#ifdef __linux__
+  if (!IsMapped() && (nState == OVERLAY_DELTA)) {
+    struct iovec iov;
+    iov.iov_base = pData;  iov.iov_len = (size_t) nCount * m_nSectorSize;
+    return ReadRun(lLBA, &iov, 1);
+  }
+#endif
+  uint8_t *pab = (uint8_t *) pData;
+  for (uint32_t i = 0;  i < nCount;  ++i, pab += m_nSectorSize)
+    if (!ReadSectorDirect(lLBA+i, pab)) return false;
+  return true;
+}
+
+
+bool CDiskImageFile::WriteSectorsDirect (uint32_t lLBA, uint32_t nCount, const void *pData)
+{
+  //++
+  // Write nCount contiguous sectors from the caller's buffer ...
+  //--
+  assert(IsOpen() && (nCount > 0));
+  if (IsReadOnly()) return false;
+#ifdef __linux__
+  if (!IsMapped()) {
+    struct iovec iov;
+    iov.iov_base = (void *) pData;  iov.iov_len = (size_t) nCount * m_nSectorSize;
+    return WriteRun(lLBA, &iov, 1);
+  }
+#endif
+  const uint8_t *pab = (const uint8_t *) pData;
+  for (uint32_t i = 0;  i < nCount;  ++i, pab += m_nSectorSize)
+    if (!WriteSectorDirect(lLBA+i, pab)) return false;
+  return true;
+}
+
+
+bool CDiskImageFile::ReadSectorsVDirect (const SECTOR_IOV aIOV[], size_t nIOV)
+{
+  //++
+  //   Read a scatter/gather list of sectors.  The list is processed in order,
+  // and any run of entries with adjacent sector numbers (e.g. 10, 11, 12, ...)
+  // is done with a single system call.  Note that the list is NOT sorted -
+  // only sectors which are already adjacent in the list get coalesced.
+  //--
+  assert(IsOpen());
+  while (nIOV > 0) {
+    size_t nRun = FindRun(aIOV, nIOV);
+    OVERLAY_STATE nState = IsOverlay() ? GetOverlayState(aIOV[0].lLBA, MKINT32(nRun)) : OVERLAY_DELTA;
+    if (nState == OVERLAY_BASE) {
+      if (!m_pBase->ReadSectorsVDirect(aIOV, nRun)) return false;
+      aIOV += nRun;  nIOV -= nRun;  continue;
+    }
+#ifdef __linux__
+    if (!IsMapped() && !IsCompressed() && (nState == OVERLAY_DELTA)) {
+      struct iovec aiov[MAXIOV];
+      for (size_t i = 0;  i < nRun;  ++i) {
+        aiov[i].iov_base = aIOV[i].pData;  aiov[i].iov_len = m_nSectorSize;
+      }
+      if (!ReadRun(aIOV[0].lLBA, aiov, MKINT32(nRun))) return false;
+      aIOV += nRun;  nIOV -= nRun;  continue;
+    }
+#endif
+    for (size_t i = 0;  i < nRun;  ++i)
+      if (!ReadSectorDirect(aIOV[i].lLBA, aIOV[i].pData)) return false;
+    aIOV += nRun;  nIOV -= nRun;
+  }
+  return true;
+}
+
+
+bool CDiskImageFile::WriteSectorsVDirect (const SECTOR_IOV aIOV[], size_t nIOV)
+{
+  //++
+  // Write a scatter/gather list of sectors, exactly like ReadSectorsV() ...
+  //--
+  assert(IsOpen());
+  if (IsReadOnly()) return false;
+  while (nIOV > 0) {
+    size_t nRun = FindRun(aIOV, nIOV);
+#ifdef __linux__
+    if (!IsMapped()) {
+      struct iovec aiov[MAXIOV];
+      for (size_t i = 0;  i < nRun;  ++i) {
+        aiov[i].iov_base = aIOV[i].pData;  aiov[i].iov_len = m_nSectorSize;
+      }
+      if (!WriteRun(aIOV[0].lLBA, aiov, MKINT32(nRun))) return false;
+      aIOV += nRun;  nIOV -= nRun;  continue;
+    }
+#endif
+    for (size_t i = 0;  i < nRun;  ++i)
+      if (!WriteSectorDirect(aIOV[i].lLBA, aIOV[i].pData)) return false;
+    aIOV += nRun;  nIOV -= nRun;
+  }
+  return true;
+}
+
+
+bool CDiskImageFile::EnableCache (uint32_t nSectors)
+{
+  //++
+  //   Enable the write back sector cache for this image, with room for
+  // nSectors sectors.  If the image already has a cache then that one is
+  // flushed and replaced, and if nSectors is zero then the cache is just
+  // disabled.  Cached images are registered with the checkpoint thread so
+  // that dirty sectors get written back on a regular basis.
+  //
+  //   Note that mapped images can't be cached - there'd be no point, since
+  // the mapping is already the best cache there is!
+  //--
+  assert(IsOpen());
+  if (IsCached() && !DeleteCache()) return false;
+  if (nSectors == 0) return true;
+  if (IsMapped()) {
+    LOGS(WARNING, "sector cache not supported for mapped image " << m_sFileName);
+    return false;
+  }
+  m_pCache = DBGNEW CSectorCache(this, nSectors);
+  CCheckpointFiles::AddImage(this);
+  return true;
+}
+
+
+bool CDiskImageFile::DeleteCache()
+{
+  //++
+  //   Write back any dirty sectors and then delete the cache.  Be sure to
+  // unregister from the checkpoint thread FIRST - once RemoveImage() returns
+  // we know that the checkpoint thread isn't in the middle of a Flush().  If
+  // the write back fails then the cache is deleted anyway, and the dirty
+  // sectors are lost, but we return false to let the caller know.
+  //--
+  assert(IsCached());
+  CCheckpointFiles::RemoveImage(this);
+  bool fOK = m_pCache->Flush();
+  delete m_pCache;  m_pCache = NULL;
+  //   A journaled image still needs its group commits, and an overlay still
+  // needs its map flushed, so put it back on the checkpoint thread's list
+  // (now that the cache is safely gone) ...
+  if (IsJournaled() || IsOverlay()) CCheckpointFiles::AddImage(this);
+  return fOK;
+}
+
+
+bool CDiskImageFile::EnableJournal (const string &sJournalFile, uint64_t cbLimit)
+{
+  //++
+  //   Enable the write ahead journal for this image.  If the journal file
+  // already exists then any transactions left in it (because we crashed) are
+  // applied to the image right now.  Journaled images are registered with
+  // the checkpoint thread, which does a group commit every time it calls
+  // Flush().
+  //
+  //   Only ACCESS_POSITIONAL images can be journaled.  Mapped images are out
+  // because GetSectorPointer() lets the caller change sectors behind our back,
+  // and stdio images because the group commit writes to the image from the
+  // checkpoint thread.  With stdio that would move the file position out from
+  // under some other thread's SeekSector() and fread(), and it would read the
+  // wrong sector.  pread() and pwrite() don't have that problem.
+  //--
+  assert(IsOpen());
+  if (IsJournaled() && !DisableJournal()) return false;
+  if (IsReadOnly()) {
+    LOGS(WARNING, "journal not needed for read only image " << m_sFileName);
+    return false;
+  }
+  if (!IsPositional()) {
+    LOGS(WARNING, "journal requires positional access for image " << m_sFileName);
+    return false;
+  }
+  CDiskJournal *pJournal = DBGNEW CDiskJournal(this, (cbLimit != 0) ? cbLimit : (uint64_t) CDiskJournal::DEFAULT_LIMIT);
+  if (!pJournal->Open(sJournalFile)) {
+    delete pJournal;  return false;
+  }
+  m_pJournal = pJournal;
+  CCheckpointFiles::AddImage(this);
+  return true;
+}
+
+
+bool CDiskImageFile::DisableJournal()
+{
+  //++
+  //   Do one last group commit, close the journal and then delete it.  As
+  // with DeleteCache(), unregister from the checkpoint thread first and then
+  // register again afterwards if we still have a cache or an overlay map.  If
+  // the group commit fails the committed transactions are still in the
+  // journal file, and they'll be recovered the next time it's enabled.
+  //--
+  assert(IsJournaled());
+  CCheckpointFiles::RemoveImage(this);
+  bool fOK = m_pJournal->Close();
+  delete m_pJournal;  m_pJournal = NULL;
+  if (IsCached() || IsOverlay()) CCheckpointFiles::AddImage(this);
+  return fOK;
+}
+
+
+bool CDiskImageFile::BeginTransaction()
+{
+  //++
+  //   Begin an explicit transaction.  Every sector written from now until
+  // CommitTransaction() will make it to the image file, or none of them will.
+  // Without a journal, this does nothing.
+  //--
+  assert(IsOpen());
+  return IsJournaled() ? m_pJournal->Begin() : true;
+}
+
+
+bool CDiskImageFile::CommitTransaction()
+{
+  //++
+  // Commit the current transaction ...
+  //--
+  assert(IsOpen());
+  return IsJournaled() ? m_pJournal->Commit() : true;
+}
+
+
+void CDiskImageFile::AbortTransaction()
+{
+  //++
+  //   Throw away every sector written since BeginTransaction().  Note that
+  // without a journal those sectors have already been written, so this can't
+  // undo anything!
+  //--
+  assert(IsOpen());
+  if (IsJournaled()) m_pJournal->Abort();
+}
+
+
+bool CDiskImageFile::Snapshot (const string &sSnapshotFile)
+{
+  //++
+  //   Save a point in time copy of this image to sSnapshotFile, which is
+  // overwritten if it already exists.  If the file system supports FICLONE
+  // the snapshot is nearly free, and otherwise we make a sparse copy.
+  //
+  //   For a journaled image all the committed transactions are applied first,
+  // and then writes are blocked until the copy is done, so the snapshot is
+  // always consistent.  Without a journal it's up to the caller to make sure
+  // that nobody writes to the image while we're copying it.
+  //--
+  assert(IsOpen());
+  if (IsOverlay()) {
+    LOGS(ERROR, "snapshots not supported for overlay " << m_sFileName);
+    return false;
+  }
+#ifdef _WIN32
+  LOGS(ERROR, "snapshots not supported on Windows");
+  return false;
+#elif __linux__
+  if (IsSameFile(m_sFileName.c_str(), sSnapshotFile.c_str())) {
+    LOGS(ERROR, "can't snapshot " << m_sFileName << " onto itself");  return false;
+  }
+  bool fOK = IsJournaled() ? m_pJournal->Freeze() : FlushImage();
+  if (fOK) {
+    int fd = open(sSnapshotFile.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    if (fd < 0) {
+      LOGS(ERROR, "error (" << errno << ") creating " << sSnapshotFile);
+      fOK = false;
+    } else {
+      fOK = CloneFile(m_nFD, fd, m_nSectorSize) && (fsync(fd) == 0);
+      if (!fOK) LOGS(ERROR, "error (" << errno << ") copying " << m_sFileName << " to " << sSnapshotFile);
+      close(fd);
+    }
+  }
+  if (IsJournaled()) m_pJournal->Thaw();
+  if (fOK) LOGS(DEBUG, "snapshot of " << m_sFileName << " saved to " << sSnapshotFile);
+  return fOK;
+#endif
+}
+
+
+bool CDiskImageFile::Restore (const string &sSnapshotFile)
+{
+  //++
+  //   Replace the entire contents of this image with the snapshot file.
+  // Everything we have that hasn't been written to the image yet - journaled
+  // transactions, and dirty sectors in the cache - is simply discarded, since
+  // it's all about to be overwritten anyway.  A mapped image has to be
+  // unmapped first and then mapped again, since its length may change.
+  //
+  //   As with Snapshot(), writes are blocked while we're working only if the
+  // image is journaled.  Reads are never blocked, so the caller really should
+  // make sure that the drive is idle!
+  //--
+  assert(IsOpen());
+  if (IsReadOnly()) return false;
+  if (IsOverlay()) {
+    LOGS(ERROR, "snapshots not supported for overlay " << m_sFileName);
+    return false;
+  }
+#ifdef _WIN32
+  LOGS(ERROR, "snapshots not supported on Windows");
+  return false;
+#elif __linux__
+  if (IsSameFile(m_sFileName.c_str(), sSnapshotFile.c_str())) {
+    LOGS(ERROR, "can't restore " << m_sFileName << " from itself");  return false;
+  }
+  int fd = open(sSnapshotFile.c_str(), O_RDONLY);
+  if (fd < 0) {
+    LOGS(ERROR, "error (" << errno << ") opening " << sSnapshotFile);
+    return false;
+  }
+  if (IsJournaled()) m_pJournal->DiscardAndFreeze();
+  if (IsCached()) m_pCache->Invalidate();
+  if (IsMapped()) UnmapImage();
+  bool fOK = (ftruncate(m_nFD, 0) == 0) && CloneFile(fd, m_nFD, m_nSectorSize) && (fsync(m_nFD) == 0);
+  if (!fOK) LOGS(ERROR, "error (" << errno << ") restoring " << m_sFileName << " from " << sSnapshotFile);
+  close(fd);
+  if (IsMapped()) {
+    m_MapLock.Enter();
+    if (!MapImage()) fOK = false;
+    m_MapLock.Leave();
+  }
+  if (IsJournaled()) m_pJournal->Thaw();
+  if (fOK) LOGS(DEBUG, m_sFileName << " restored from " << sSnapshotFile);
+  return fOK;
+#endif
+}
+
+
+bool CDiskImageFile::ReadSector (uint32_t lLBA, void *pData)
+{
+  //++
+  //   Read a single sector.  If the journal has a copy that hasn't been
+  // applied to the image yet, then that's the one we want.  Otherwise read
+  // it thru the cache, if there is one ...
+  //--
+  assert(IsOpen());
+  if (IsJournaled() && m_pJournal->Lookup(lLBA, pData)) return true;
+  if (IsCached()) return m_pCache->Read(lLBA, pData);
+  return ReadSectorDirect(lLBA, pData);
+}
+
+
+bool CDiskImageFile::WriteSector (uint32_t lLBA, const void *pData)
+{
+  //++
+  // Write a single sector, thru the journal or the cache if there is one ...
+  //--
+  assert(IsOpen());
+  if (IsReadOnly()) return false;
+  if (IsJournaled()) {
+    SECTOR_IOV iov;  iov.lLBA = lLBA;  iov.pData = (void *) pData;
+    return m_pJournal->Write(&iov, 1);
+  }
+  if (IsCached()) return m_pCache->Write(lLBA, pData);
+  return WriteSectorDirect(lLBA, pData);
+}
+
+
+bool CDiskImageFile::ReadSectors (uint32_t lLBA, uint32_t nCount, void *pData)
+{
+  //++
+  //   Read nCount contiguous sectors.  If the cache is enabled, or if the
+  // journal has any sectors that might be in this run, then every sector has
+  // to go thru ReadSector() individually.  Otherwise it's one system call.
+  //--
+  assert(IsOpen() && (nCount > 0));
+  bool fJournal = IsJournaled() && !m_pJournal->IsEmpty();
+  if (!IsCached() && !fJournal) return ReadSectorsDirect(lLBA, nCount, pData);
+  uint8_t *pab = (uint8_t *) pData;
+  for (uint32_t i = 0;  i < nCount;  ++i, pab += m_nSectorSize)
+    if (!ReadSector(lLBA+i, pab)) return false;
+  return true;
+}
+
+
+bool CDiskImageFile::WriteSectors (uint32_t lLBA, uint32_t nCount, const void *pData)
+{
+  //++
+  //   Write nCount contiguous sectors, thru the journal or the cache if there
+  // is one.  All the sectors in a journaled write are one transaction ...
+  //--
+  assert(IsOpen() && (nCount > 0));
+  if (IsReadOnly()) return false;
+  const uint8_t *pab = (const uint8_t *) pData;
+  if (IsJournaled()) {
+    vector<SECTOR_IOV> vecIOV(nCount);
+    for (uint32_t i = 0;  i < nCount;  ++i) {
+      vecIOV[i].lLBA = lLBA+i;  vecIOV[i].pData = (void *) (pab + (size_t) i*m_nSectorSize);
+    }
+    return m_pJournal->Write(vecIOV.data(), nCount);
+  }
+  if (!IsCached()) return WriteSectorsDirect(lLBA, nCount, pData);
+  for (uint32_t i = 0;  i < nCount;  ++i, pab += m_nSectorSize)
+    if (!m_pCache->Write(lLBA+i, pab)) return false;
+  return true;
+}
+
+
+bool CDiskImageFile::ReadSectorsV (const SECTOR_IOV aIOV[], size_t nIOV)
+{
+  //++
+  // Read a scatter/gather list of sectors, thru the cache if there is one ...
+  //--
+  assert(IsOpen());
+  bool fJournal = IsJournaled() && !m_pJournal->IsEmpty();
+  if (!IsCached() && !fJournal) return ReadSectorsVDirect(aIOV, nIOV);
+  for (size_t i = 0;  i < nIOV;  ++i)
+    if (!ReadSector(aIOV[i].lLBA, aIOV[i].pData)) return false;
+  return true;
+}
+
+
+bool CDiskImageFile::WriteSectorsV (const SECTOR_IOV aIOV[], size_t nIOV)
+{
+  //++
+  // Write a scatter/gather list of sectors, thru the journal or the cache ...
+  //--
+  assert(IsOpen());
+  if (IsReadOnly()) return false;
+  if (IsJournaled()) return m_pJournal->Write(aIOV, nIOV);
+  if (!IsCached()) return WriteSectorsVDirect(aIOV, nIOV);
+  for (size_t i = 0;  i < nIOV;  ++i)
+    if (!m_pCache->Write(aIOV[i].lLBA, aIOV[i].pData)) return false;
+  return true;
+}
+
+
+uint8_t *CDiskImageFile::GetSectorPointer (uint32_t lLBA)
+{
+  //++
+  //   Return a pointer to the data for the specified sector in a memory mapped
+  // image.  The caller can read (and, if the image isn't read only, write) the
+  // sector data directly without any copying.  If the sector lies beyond the
+  // current end of a writable image, then the image is extended first.  NULL
+  // is returned if this image isn't mapped, or for any sector past the end of
+  // a read only image (the caller should use ReadSector() in that case, which
+  // returns zeros).
+  //
+  //   REMEMBER - the pointer returned is only valid until the next call to
+  // WriteSector() or GetSectorPointer(), either of which may move the mapping!
+  //--
+  assert(IsOpen());
+  if (!IsMapped()) return NULL;
+  uint64_t llOffset = (uint64_t) lLBA * m_nSectorSize;
+  uint64_t llEnd = llOffset + m_nSectorSize;
+  m_MapLock.Enter();
+  bool fGrow = llEnd > m_cbMap;
+  m_MapLock.Leave();
+  if (fGrow && (IsReadOnly() || !GrowImage(llEnd))) return NULL;
+  m_MapLock.Enter();
+  uint8_t *pabSector = m_pabMap + llOffset;
+  m_MapLock.Leave();
+  return pabSector;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// CTapeImageFile members ...
+///////////////////////////////////////////////////////////////////////////////
+
+CTapeImageFile::CTapeImageFile (bool f7Track)
+{
+  //++
+  // Initialize any tape image specific flags ...
+  //--
+  m_nRecordCount = 0;  m_fWriteLast = false;
+  m_llFileSize = 0;  m_f7Track = f7Track;
+  m_nParity = PARITY_NONE;  m_llParityErrors = 0;
+  m_fIndexed = m_fIndexComplete = m_fIndexFile = false;
+  m_pReadAhead = NULL;  m_fStreaming = false;  m_llStreamPos = 0;
+  m_cbWriteBuffer = 0;  m_llWriteBase = 0;  m_fTruncatePending = false;
+  m_cbMaxRecord = MAXRECLEN;  m_fTruncateRecords = false;
+  m_fBadRecord = false;  m_llReadPos = 0;
+  m_pabMap = NULL;  m_cbMap = 0;  m_llRecordData = 0;
+  m_cbCompressBlock = 0;  m_pCompressed = NULL;
+}
+
+
+bool CTapeImageFile::Open (const string &sFileName, bool fReadOnly, int nShareMode)
+{
+  //++
+  //   Open the associated image file and initialize the file length and
+  // record count.  The record index isn't built until somebody needs it, but
+  // if there's a sidecar file with a current index we'll load that now.
+  //
+  //   If the file is a compressed tape, or if it's empty and we've been asked
+  // to create compressed tapes, then the CCompressedTape object takes over
+  // from here ...
+  //--
+  EnableWriteBehind(0);  EnableReadAhead(0);  UnmapTape();
+  if (!CImageFile::Open(sFileName, fReadOnly, nShareMode)) return false;
+  m_llFileSize = GetFileLength();  m_nRecordCount = 0;  m_fWriteLast = false;
+  m_fBadRecord = false;  m_llParityErrors = 0;  ClearIndex();
+  if (   CCompressedTape::IsCompressed(m_pFile)
+      || ((m_llFileSize == 0) && !IsReadOnly() && (m_cbCompressBlock != 0))) {
+    if (!OpenCompressed()) {
+      Close();  return false;
+    }
+  }
+  if (m_fIndexFile && !m_fIndexed) LoadIndex();
+  LOGS(TRACE, "  -> CTapeImageFile::Open, file length=" << m_llFileSize);
+  return true;
+}
+
+
+void CTapeImageFile::Close()
+{
+  //++
+  //   Close a tape image.  Anything in the write behind buffer has to be
+  // written first, and the read ahead thread has its own handle for the
+  // image file, so it has to go before we close ours.  Ditto the mapping.
+  //--
+  if (IsOpen()) EnableWriteBehind(0);
+  if (IsReadAhead()) {
+    delete m_pReadAhead;  m_pReadAhead = NULL;
+  }
+  UnmapTape();
+  if (IsCompressed()) CloseCompressed();
+  m_fStreaming = false;
+  CImageFile::Close();
+}
+
+
+bool CTapeImageFile::OpenCompressed()
+{
+  //++
+  //   Called by Open() for a compressed tape (or a new, empty, one).  The
+  // tape length is the length of the uncompressed image, and if the file has
+  // a record index then we use that.  A brand new tape is indexed right away
+  // (there's nothing to index!) so that the index is complete, and saved,
+  // when the tape is closed.  Writable compressed tapes keep the last block
+  // in memory, so they're registered with the checkpoint thread.
+  //--
+  m_pCompressed = DBGNEW CCompressedTape();
+  bool fOK = (m_llFileSize == 0) ? m_pCompressed->Create(m_pFile, m_sFileName, m_cbCompressBlock)
+                                 : m_pCompressed->Open(m_pFile, m_sFileName, IsReadOnly());
+  if (!fOK) {
+    delete m_pCompressed;  m_pCompressed = NULL;  return false;
+  }
+  m_llFileSize = m_pCompressed->GetTapeLength();
+  m_fStreaming = true;  m_llStreamPos = 0;
+  if (m_pCompressed->LoadRecordIndex(m_vecRecordOffsets, m_vecMarks))
+    m_fIndexed = m_fIndexComplete = true;
+  else if (m_llFileSize == 0)
+    BuildIndex();
+  if (!IsReadOnly()) CCheckpointFiles::AddImage(this);
+  return true;
+}
+
+
+void CTapeImageFile::CloseCompressed()
+{
+  //++
+  //   Save everything for a compressed tape, including the record index if
+  // we have a complete one, and then get rid of the CCompressedTape object.
+  // Nothing is written if the tape hasn't changed ...
+  //--
+  assert(IsCompressed());
+  if (!IsReadOnly()) {
+    CCheckpointFiles::RemoveImage(this);
+    if (m_fIndexed && m_fIndexComplete)
+      m_pCompressed->Flush(&m_vecRecordOffsets, &m_vecMarks);
+    else
+      m_pCompressed->Flush();
+  }
+  delete m_pCompressed;  m_pCompressed = NULL;
+}
+
+
+/*static*/ bool CTapeImageFile::CompressTape (const string &sRawFile, const string &sCompressedFile, uint32_t cbBlock)
+{
+  //++
+  //   Convert an ordinary TAP file to a compressed tape.  The new file is
+  // overwritten if it already exists!  The bytes are copied exactly as they
+  // are - erase gaps, markers, padding and all - and the original's record
+  // index tells us where every record ends, so that every block ends on a
+  // record boundary.  If the original has a bad record then the index stops
+  // there and the rest of the tape is just copied in block size pieces.  The
+  // record index is saved in the new file too, so it's ready to space over.
+  //--
+  assert(cbBlock > 0);
+  if (IsSameFile(sRawFile.c_str(), sCompressedFile.c_str())) {
+    LOGS(ERROR, "can't compress " << sRawFile << " onto itself");  return false;
+  }
+  CTapeImageFile tapeRaw, tapeNew;
+  if (!tapeRaw.Open(sRawFile, true) || !tapeRaw.BuildIndex()) return false;
+  if (tapeRaw.IsCompressed()) {
+    LOGS(ERROR, "tape " << sRawFile << " is already compressed");  return false;
+  }
+  FILE *pNew = fopen(sCompressedFile.c_str(), "wb");
+  if (pNew == NULL) {
+    LOGS(ERROR, "error (" << errno << ") creating " << sCompressedFile);  return false;
+  }
+  fclose(pNew);
+  tapeNew.SetCompression(cbBlock);
+  if (!tapeNew.Open(sCompressedFile, false)) return false;
+
+  //   Copy one record at a time while the index lasts, and then whatever is
+  // left after that ...
+  const vector<uint64_t> &vecOffsets = tapeRaw.m_vecRecordOffsets;
+  vector<uint8_t> vecBuffer;
+  uint64_t llPosition = 0;
+  size_t nNext = 1;
+  bool fOK = true;
+  tapeRaw.m_llReadPos = UINT64_MAX;
+  while (fOK && (llPosition < tapeRaw.m_llFileSize)) {
+    uint64_t llEnd = (nNext < vecOffsets.size()) ? vecOffsets[nNext++]
+                   : MIN(tapeRaw.m_llFileSize, llPosition+cbBlock);
+    size_t cbCopy = (size_t) (llEnd - llPosition);
+    vecBuffer.resize(cbCopy);
+    fOK = (cbCopy == 0) || (   tapeRaw.ReadAt(llPosition, vecBuffer.data(), cbCopy)
+                            && tapeNew.m_pCompressed->Append(vecBuffer.data(), cbCopy)
+                            && tapeNew.m_pCompressed->EndRecord());
+    llPosition = llEnd;
+  }
+
+  //   The new tape now has exactly the same record index as the old one, if
+  // that one was complete, so save it along with everything else ...
+  tapeNew.m_llFileSize = tapeNew.m_llStreamPos = llPosition;
+  if (fOK && tapeRaw.m_fIndexComplete) {
+    tapeNew.m_vecRecordOffsets = vecOffsets;  tapeNew.m_vecMarks = tapeRaw.m_vecMarks;
+    fOK = tapeNew.m_pCompressed->Flush(&tapeNew.m_vecRecordOffsets, &tapeNew.m_vecMarks);
+  } else {
+    tapeNew.ClearIndex();
+    fOK = fOK && tapeNew.m_pCompressed->Flush();
+  }
+  if (fOK) {
+    LOGS(DEBUG, "compressed " << sRawFile << " (" << llPosition << " bytes) to " << sCompressedFile << " (" << tapeNew.GetFileLength() << " bytes)");
+  } else {
+    LOGS(ERROR, "error (" << errno << ") compressing " << sRawFile << " to " << sCompressedFile);
+  }
+  return fOK;
+}
+
+
+/*static*/ bool CTapeImageFile::ExpandTape (const string &sCompressedFile, const string &sRawFile)
+{
+  //++
+  //   Convert a compressed tape back to an ordinary TAP file, which will be
+  // byte for byte identical to the original.  The new file is overwritten if
+  // it already exists!  This works for an uncompressed tape too, and then it
+  // just makes a copy.
+  //--
+  if (IsSameFile(sCompressedFile.c_str(), sRawFile.c_str())) {
+    LOGS(ERROR, "can't expand " << sCompressedFile << " onto itself");  return false;
+  }
+  CTapeImageFile tape;
+  if (!tape.Open(sCompressedFile, true)) return false;
+  FILE *pRaw = fopen(sRawFile.c_str(), "wb");
+  if (pRaw == NULL) {
+    LOGS(ERROR, "error (" << errno << ") creating " << sRawFile);  return false;
+  }
+  vector<uint8_t> vecBuffer(DEFAULT_WRITE_BUFFER);
+  uint64_t llPosition = 0;
+  bool fOK = true;
+  tape.m_llReadPos = UINT64_MAX;
+  while (fOK && (llPosition < tape.m_llFileSize)) {
+    size_t cbCopy = (size_t) MIN(tape.m_llFileSize-llPosition, (uint64_t) vecBuffer.size());
+    fOK = tape.ReadAt(llPosition, vecBuffer.data(), cbCopy)
+       && (fwrite(vecBuffer.data(), 1, cbCopy, pRaw) == cbCopy);
+    llPosition += cbCopy;
+  }
+  if (fclose(pRaw) != 0) fOK = false;
+  if (fOK) {
+    LOGS(DEBUG, "expanded " << sCompressedFile << " to " << sRawFile << " (" << llPosition << " bytes)");
+  } else {
+    LOGS(ERROR, "error (" << errno << ") expanding " << sCompressedFile << " to " << sRawFile);
+  }
+  return fOK;
+}
+
+
+bool CTapeImageFile::Flush()
+{
+  //++
+  //   Write out anything in the write behind buffer (including any deferred
+  // truncation) and then flush the file as usual.  Tapes with write behind
+  // enabled are registered with the checkpoint thread, which calls this
+  // from its own thread - that's why FlushWrites() takes the lock ...
+  //--
+  if (!IsOpen() || !FlushWrites()) return false;
+  if (IsCompressed()) return m_pCompressed->Flush();
+  return CImageFile::Flush();
+}
+
+
+void CTapeImageFile::SetMaxRecordLength (uint32_t cbMaxRecord)
+{
+  //++
+  //   Change the longest record we'll accept.  The TAP format can't describe
+  // anything longer than RECLENMASK.  Records that were too long before might
+  // not be now (or vice versa), so the index has to be rebuilt ...
+  //--
+  assert(cbMaxRecord > 0);
+  if (cbMaxRecord > RECLENMASK) cbMaxRecord = RECLENMASK;
+  if (cbMaxRecord != m_cbMaxRecord) ClearIndex();
+  m_cbMaxRecord = cbMaxRecord;
+}
+
+
+uint64_t CTapeImageFile::GetFilePosition() const
+{
+  //++
+  //   Return the current tape position.  If we're reading from the read ahead
+  // buffers, or if there's anything in the write behind buffer, then the
+  // stdio file position is out of date and the real position is elsewhere.
+  // The checkpoint thread might be emptying the write behind buffer right
+  // now, so we need the lock to look at it ...
+  //--
+  if (m_fStreaming) return m_llStreamPos;
+  if (!IsWriteBehind()) return CImageFile::GetFilePosition();
+  m_WriteLock.Enter();
+  uint64_t llPosition = m_vecWriteBuffer.empty() ? CImageFile::GetFilePosition()
+                      : m_llWriteBase + m_vecWriteBuffer.size();
+  m_WriteLock.Leave();
+  return llPosition;
+}
+
+
+bool CTapeImageFile::IsBOT() const
+{
+  //++
+  // Return TRUE if the current tape position is at the BOT ...
+  //--
+  assert(IsOpen());
+  return GetFilePosition() == 0;
+}
+
+
+bool CTapeImageFile::IsEOT() const
+{
+  //++
+  // Return TRUE if the current tape position is at the EOT ...
+  //
+  //   Unfortunately, and unlike IsBOT(), there's no elegant way to do this.
+  // You're probably saying - "just return feof()!".  No dice - feof() won't
+  // work unless you've first tried to read and then failed because of EOF.
+  // feof() doesn't look ahead at what's next in the file.
+  //
+  //   Instead, we keep track of the total file length in the m_llFileSize
+  // member and compare the current position (obtained from ftell()) to that.
+  // If they're equal, then we're at the end.  This works great, and it's fast
+  // too, as long as we keep m_llFileSize current.
+  //
+  //   One more comment before going - for a real tape, EOT means the end of
+  // the physical media, but in the context of an image file it's a little
+  // different.  For a read only file, the EOT logically means the end of the
+  // data, because there's never going to be any more on that virtual tape.
+  // But for a writable image, then EOT never occurs because the image file
+  // can always be extended and more data can always be written.
+  //
+  //   Hence, this function only has meaning for a read only image.  For a
+  // writable image, it always returns false!
+  //--
+  assert(IsOpen());
+  if (!IsReadOnly()) return false;
+  return GetFilePosition() >= m_llFileSize;
+}
+
+
+bool CTapeImageFile::Rewind()
+{
+  //++
+  // Rewind the logical tape to the BOT ...
+  //--
+  assert(IsOpen());
+  if (!FlushWrites()) return false;
+  if (IsCompressed())
+    m_llStreamPos = 0;
+  else {
+    m_fStreaming = false;
+    if (fseek(m_pFile, 0L, SEEK_SET) != 0)
+      return CImageFile::Error("seek rewind", errno);
+  }
+  m_fWriteLast = false;  m_nRecordCount = 0;
+  return true;
+}
+
+
+int32_t CTapeImageFile::ReadForwardRecord (uint8_t abData[], size_t cbMaxData)
+{
+  //++
+  //   This routine will read, in the forward direction, the next record from
+  // the tape image file.  The raw data from the record is returned in abData.
+  // The actual record length, in bytes, is the function return value.  This
+  // routine can also return either EOTBOT, if the tape is at the end, or
+  // BADTAPE, if any TAP file format errors are found.  Note that a record
+  // length of zero is also legal and is not an error but rather indicates a
+  // tape mark.
+  //
+  //   If the record is longer than cbMaxData then that's normally a BADTAPE,
+  // just like a record longer than the maximum length.  But if truncation is
+  // enabled (see SetTruncateRecords()) then only the first cbMaxData bytes
+  // are returned and the rest is skipped.  The return value is still the
+  // real record length, so the caller can tell.  That's what a real tape
+  // drive does when the byte count is too short, and it means the caller
+  // doesn't need a buffer big enough for the longest possible record.
+  //
+  //   If abData is NULL then the record data is skipped over rather than read.
+  // Only the header and trailer are actually read in that case, which makes
+  // spacing over big records a lot cheaper (see SkipForwardRecord()).
+  //
+  //   After a successful read, the logical tape is left positioned at the
+  // start (i.e. just before the header longword) of the next record.  In the
+  // event of a BADTAPE, the tape position is lost and the caller must invoke
+  // Rewind() before attempting to read again.
+  //
+  //   With read ahead enabled, or if the tape is mapped, the record is parsed
+  // directly out of the read ahead buffers (or the mapping) and the stdio file
+  // is never touched.  Instead, m_llStreamPos keeps track of where the tape
+  // really is and m_fStreaming says that the stdio file position is out of
+  // date.  SyncStream() will fix that as soon as some other operation needs
+  // the stdio file.
+  //
+  //   One final comment - In the tape image file the metadata is always stored
+  // in little endian format and strictly speaking we should worry about that,
+  // but since our only platfrom for MBS is a PC and that's little endian, we'll
+  // take the Alfred E Neuman approach to programming...
+  //--
+  assert(IsOpen() && (cbMaxData > 0));
+  if (!FlushWrites()) return BADTAPE;
+
+  //   If the last operation we did on this image was a write, then first
+  // sync the underlying file system buffers ...
+  if (m_fWriteLast) {
+    fseek(m_pFile, 0L, SEEK_CUR);  m_fWriteLast = false;
+  }
+  if ((IsReadAhead() || IsMapped()) && !m_fStreaming) {
+    m_llStreamPos = CImageFile::GetFilePosition();  m_fStreaming = true;
+  }
+  uint64_t llPosition = m_llReadPos = GetFilePosition();
+  LOGS(TRACE, "  -> ReadForwardRecord, cbMaxData=" << cbMaxData << ", (before) pos=" << llPosition);
+
+  //   Parse the record and then leave the tape wherever that ended up.  The
+  // stdio file is almost always there already ...
+  int32_t ret = ParseForward(llPosition, abData, cbMaxData);
+  if (ret >= 0) ++m_nRecordCount;
+  if (m_f7Track && (ret > 0) && (abData != NULL))
+    Convert7Track(abData, MIN((size_t) ret, cbMaxData));
+  if (m_fStreaming)
+    m_llStreamPos = llPosition;
+  else if ((llPosition != m_llReadPos) && (fseeko(m_pFile, llPosition, SEEK_SET) != 0)) {
+    CImageFile::Error("seek forward", errno);  return BADTAPE;
+  }
+  return ret;
+}
+
+
+int32_t CTapeImageFile::ReadForwardRecord (const uint8_t *&pabData)
+{
+  //++
+  //   This is the zero copy version of ReadForwardRecord() for mapped tapes.
+  // The record data is skipped rather than read, and then pabData is pointed
+  // at it in the mapping.  The return value is the same as always, and if
+  // it isn't a record length then pabData is NULL.  Seven track records have
+  // to be converted, so those are copied to m_vecFrames first and pabData
+  // points there instead (and is good only until the next read).
+  //
+  //   EnableMapping() succeeds for an empty tape without actually mapping
+  // anything, so in that case there's nothing to read and we're at EOT.
+  //--
+  if (!IsMapped()) {
+    assert(IsOpen() && (m_llFileSize == 0));
+    pabData = NULL;  return EOTBOT;
+  }
+  int32_t ret = ReadForwardRecord(NULL, m_cbMaxRecord);
+  pabData = (ret > 0) ? m_pabMap+m_llRecordData : NULL;
+  if (m_f7Track && (ret > 0)) pabData = CopyFrames(pabData, ret);
+  return ret;
+}
+
+
+bool CTapeImageFile::ReadAt (uint64_t llOffset, void *pData, size_t cbData)
+{
+  //++
+  //   Read cbData bytes starting at llOffset, either from the read ahead
+  // buffers or from the stdio file.  Returns false if we can't get them all.
+  //
+  //   Seeking a stdio file isn't free, even when it doesn't actually move, so
+  // m_llReadPos remembers where the stdio file is and we only seek if we have
+  // to.  Whoever calls ParseForward() or ParseReverse() must set it first.
+  //
+  //   A mapped tape is read only and the mapping covers the entire file, so
+  // the mapping is always good whether we're streaming or not.  And compressed
+  // tapes are always read thru the CCompressedTape object.
+  //--
+  if (IsCompressed()) return m_pCompressed->Read(llOffset, pData, cbData);
+  if (IsMapped()) {
+    if ((llOffset > m_cbMap) || (cbData > m_cbMap-llOffset)) return false;
+    memcpy(pData, m_pabMap+llOffset, cbData);  return true;
+  }
+  if (m_fStreaming) {
+    //   Almost everything is in the current read ahead buffer, and then we
+    // can parse it in place without locking anything ...
+    const uint8_t *pab = m_pReadAhead->Peek(llOffset, cbData);
+    if (pab != NULL) {memcpy(pData, pab, cbData);  return true;}
+    return m_pReadAhead->Read(llOffset, pData, cbData) == cbData;
+  }
+  if ((llOffset != m_llReadPos) && (fseeko(m_pFile, llOffset, SEEK_SET) != 0)) {
+    m_llReadPos = UINT64_MAX;  return false;
+  }
+  if (fread(pData, 1, cbData, m_pFile) != cbData) {
+    m_llReadPos = UINT64_MAX;  return false;
+  }
+  m_llReadPos = llOffset + cbData;
+  return true;
+}
+
+
+int32_t CTapeImageFile::ParseForward (uint64_t &llPosition, uint8_t abData[], size_t cbMaxData, bool fQuiet)
+{
+  //++
+  //   Parse the next record in the forward direction, starting at llPosition,
+  // and leave llPosition just past the end of it.  Erase gaps, markers and
+  // private or reserved records are skipped along the way.  The return value
+  // is exactly the same as ReadForwardRecord(), but the record count isn't
+  // changed.  If fQuiet is true then format errors aren't logged - BuildIndex()
+  // uses that, since a real read will complain soon enough.
+  //--
+  m_fBadRecord = false;
+  while (true) {
+    METADATA nRecLen1, nRecLen2;
+    if (llPosition >= m_llFileSize) return EOTBOT;
+    if (!ReadAt(llPosition, &nRecLen1, sizeof(METADATA))) {
+      if (!fQuiet) CImageFile::Error("read forward header", errno);
+      return BADTAPE;
+    }
+    uint32_t lMeta = (uint32_t) nRecLen1;
+    uint32_t nClass = (lMeta & CLASSMASK) >> CLASSSHIFT;
+
+    //   An end of medium marker is just like the end of the file, and we don't
+    // move past it.  Erase gaps and markers are skipped, and a half gap is
+    // only two bytes long ...
+    if (lMeta == TAP_EOM) return EOTBOT;
+    if (lMeta == TAP_HALFGAP) {
+      llPosition += sizeof(METADATA)/2;  continue;
+    }
+    llPosition += sizeof(METADATA);
+    if (   (lMeta == TAP_GAP) || (nClass == CLASS_PRIVATE_MARKER)
+        || (nClass == CLASS_RESERVED_MARKER)) continue;
+
+    //   Sanity check the record length.  Also, if the record length is zero
+    // then this is a tape mark and we can quit now ...
+    if ((lMeta & RESERVEDMASK) != 0) {
+      if (!fQuiet) LOGF(ERROR, "invalid metadata (0x%08X) on tape %s", lMeta, m_sFileName.c_str());
+      return BADTAPE;
+    }
+    uint32_t cbRecord = lMeta & RECLENMASK;
+    if ((cbRecord == 0) && (nClass == CLASS_GOOD)) return TAPEMARK;
+    if (cbRecord > m_cbMaxRecord) {
+      if (!fQuiet) LOGF(ERROR, "record length too long (%d bytes) on tape %s", cbRecord, m_sFileName.c_str());
+      return BADTAPE;
+    }
+
+    //   Read the raw data, or as much of it as will fit.  The data in private
+    // or reserved records is never read, and neither is anything if we're
+    // only skipping ...
+    bool fData = (nClass == CLASS_GOOD) || (nClass == CLASS_BAD);
+    if (fData && (abData != NULL) && (cbRecord > cbMaxData) && !m_fTruncateRecords) {
+      if (!fQuiet) LOGF(ERROR, "record length too long (%d bytes) on tape %s", cbRecord, m_sFileName.c_str());
+      return BADTAPE;
+    }
+    if (fData && (abData != NULL) && (cbRecord > 0)) {
+      size_t cbRead = MIN((size_t) cbRecord, cbMaxData);
+      if (!ReadAt(llPosition, abData, cbRead)) {
+        if (!fQuiet) CImageFile::Error("read forward data", errno);
+        return BADTAPE;
+      }
+    }
+    uint64_t llData = llPosition;
+    llPosition += cbRecord;
+
+    // Read the record length trailer and see if it matches the header ...
+    if (!ReadAt(llPosition, &nRecLen2, sizeof(METADATA))) {
+      if (!fQuiet) CImageFile::Error("read forward trailer 1", errno);
+      return BADTAPE;
+    }
+    if (nRecLen1 != nRecLen2) {
+      //   Some misguided TAP file writers round off the actual record to an
+      // even number of bytes, even when the record length is odd.  There's no
+      // way to tell in advance whether we have one of those, but if the record
+      // lengths don't match, see if skipping one padding byte fixes it.
+      ++llPosition;
+      if (!ReadAt(llPosition, &nRecLen2, sizeof(METADATA))) {
+        if (!fQuiet) CImageFile::Error("read forward trailer 2", errno);
+        return BADTAPE;
+      }
+      if (nRecLen1 != nRecLen2) {
+        // Nope - it's a bad tape ...
+        if (!fQuiet) LOGF(ERROR, "header (0x%08X) and trailer (0x%08X) mismatch on tape %s", nRecLen1, nRecLen2, m_sFileName.c_str());
+        return BADTAPE;
+      }
+    }
+    llPosition += sizeof(METADATA);
+    if (!fData) continue;
+
+    //   A bad data record with no data is a tape error with nothing at all
+    // to return, and that's as close to BADTAPE as it gets ...
+    if (cbRecord == 0) {
+      if (!fQuiet) LOGF(ERROR, "empty bad data record on tape %s", m_sFileName.c_str());
+      return BADTAPE;
+    }
+    m_fBadRecord = (nClass == CLASS_BAD);  m_llRecordData = llData;
+    return MKINT32(cbRecord);
+  }
+}
+
+
+bool CTapeImageFile::SyncStream()
+{
+  //++
+  //   If ReadForwardRecord() has been reading from the read ahead buffers (or
+  // the mapping) then the stdio file position is out of date.  Move it to
+  // where the tape really is, so that everything else can use the stdio file
+  // again.  Compressed tapes never use the stdio file, so they just keep on
+  // streaming ...
+  //--
+  if (!m_fStreaming || IsCompressed()) return true;
+  m_fStreaming = false;
+  if (fseeko(m_pFile, m_llStreamPos, SEEK_SET) != 0)
+    return CImageFile::Error("seek stream", errno);
+  return true;
+}
+
+
+bool CTapeImageFile::EnableReadAhead (size_t cbBuffer)
+{
+  //++
+  //   Enable the read ahead buffers for this tape, with two buffers of cbBuffer
+  // bytes each.  If read ahead is already enabled then the old buffers are
+  // replaced, and if cbBuffer is zero then read ahead is just disabled.  This
+  // has to be called again after every Open().  Read ahead pays off most with
+  // small records - for a read only tape EnableMapping() is faster still (see
+  // bench/TapeReadAheadBench.cpp) ...
+  //--
+  assert(IsOpen() || (cbBuffer == 0));
+  if (IsReadAhead()) {
+    SyncStream();  delete m_pReadAhead;  m_pReadAhead = NULL;
+  }
+  if (cbBuffer == 0) return true;
+  if (IsCompressed()) {
+    LOGS(WARNING, "read ahead not possible for compressed tape " << m_sFileName);
+    return false;
+  }
+  UnmapTape();
+  if (cbBuffer < CTapeReadAhead::MIN_BUFFER) cbBuffer = CTapeReadAhead::MIN_BUFFER;
+  m_pReadAhead = DBGNEW CTapeReadAhead(cbBuffer);
+  if (!m_pReadAhead->Open(m_sFileName)) {
+    delete m_pReadAhead;  m_pReadAhead = NULL;  return false;
+  }
+  return true;
+}
+
+
+bool CTapeImageFile::EnableMapping (bool fMap)
+{
+  //++
+  //   Map the entire tape image into memory (or unmap it, if fMap is false).
+  // This is only allowed for read only tapes, since writing would change the
+  // file length, and it replaces read ahead if that was enabled.  An empty
+  // tape isn't mapped at all because mmap() won't map zero bytes, so then
+  // IsMapped() is false even though we return true.  There's nothing to read
+  // anyway, and the zero copy reads just return EOTBOT.  Just like disk
+  // images, memory mapped tapes aren't currently supported on Windows.
+  //--
+  assert(IsOpen() || !fMap);
+  UnmapTape();
+  if (!fMap) return true;
+  if (!IsReadOnly() || IsCompressed()) {
+    LOGS(WARNING, "mapping not possible for " << (IsCompressed() ? "compressed" : "writable") << " tape " << m_sFileName);
+    return false;
+  }
+#ifdef _WIN32
+  LOGS(WARNING, "memory mapped tapes not supported - using stdio for " << m_sFileName);
+  return false;
+#elif __linux__
+  EnableReadAhead(0);
+  if (m_llFileSize == 0) return true;
+  void *p = mmap(NULL, m_llFileSize, PROT_READ, MAP_SHARED, fileno(m_pFile), 0);
+  if (p == MAP_FAILED) return CImageFile::Error("mapping", errno);
+  madvise(p, m_llFileSize, MADV_SEQUENTIAL);
+  m_pabMap = (const uint8_t *) p;  m_cbMap = m_llFileSize;
+  LOGS(DEBUG, "mapped " << m_cbMap << " bytes of tape " << m_sFileName);
+  return true;
+#endif
+}
+
+
+void CTapeImageFile::UnmapTape()
+{
+  //++
+  //   Unmap the tape image, if it's mapped.  If we were streaming from the
+  // mapping then move the stdio file to the current position first ...
+  //--
+  if (!IsMapped()) return;
+  SyncStream();
+#ifdef __linux__
+  munmap((void *) m_pabMap, m_cbMap);
+#endif
+  m_pabMap = NULL;  m_cbMap = 0;
+}
+
+
+//   The seven track conversions work on eight frames at once, packed in a 64
+// bit word.  Every step is done to all eight bytes in parallel and nothing
+// ever carries from one byte to the next, so byte order doesn't matter.
+// FRAMES() replicates a byte value into every byte of a word ...
+#define FRAMES(b)   ((uint64_t) (b) * 0x0101010101010101ULL)
+
+static inline uint64_t FrameParity (uint64_t llFrames, CTapeImageFile::PARITY nParity)
+{
+  //++
+  //   Return the correct parity bit for the six data bits of each frame, in
+  // bit 0 of that byte.  Folding the byte in half three times leaves the
+  // exclusive OR of bits 0 thru 5 in bit 0 (the shifts do drag bits from the
+  // next byte into the upper half, but those never reach bit 0).  Odd parity
+  // is just the complement of even ...
+  //--
+  llFrames &= FRAMES(0x3F);
+  llFrames ^= llFrames >> 4;  llFrames ^= llFrames >> 2;  llFrames ^= llFrames >> 1;
+  llFrames &= FRAMES(0x01);
+  return (nParity == CTapeImageFile::PARITY_ODD) ? (llFrames ^ FRAMES(0x01)) : llFrames;
+}
+
+static inline uint64_t StripFrames (uint64_t &llFrames, CTapeImageFile::PARITY nParity)
+{
+  //++
+  //   Strip up to eight frames in place and return a word with bit 0 set in
+  // every byte that was a bad frame - one with bit 7 set or, if we're checking
+  // parity, the wrong parity bit ...
+  //--
+  uint64_t llBad = (llFrames >> 7) & FRAMES(0x01);
+  if (nParity == CTapeImageFile::PARITY_NONE) {
+    llFrames &= FRAMES(0x7F);
+  } else {
+    llBad |= ((llFrames >> 6) & FRAMES(0x01)) ^ FrameParity(llFrames, nParity);
+    llFrames &= FRAMES(0x3F);
+  }
+  return llBad;
+}
+
+static inline uint64_t InsertFrames (uint64_t llChars, CTapeImageFile::PARITY nParity)
+{
+  //++
+  // Turn up to eight characters into frames for writing ...
+  //--
+  if (nParity == CTapeImageFile::PARITY_NONE) return llChars & FRAMES(0x7F);
+  return (llChars & FRAMES(0x3F)) | (FrameParity(llChars, nParity) << 6);
+}
+
+static inline size_t CountFrames (uint64_t llBad)
+{
+  //++
+  //   Count the bytes with bit 0 set.  Multiplying by FRAMES(1) adds all the
+  // bytes together in the top byte, and the total is never more than eight...
+  //--
+  return (size_t) ((llBad * FRAMES(0x01)) >> 56);
+}
+
+
+/*static*/ size_t CTapeImageFile::Strip7Track (uint8_t *pabData, size_t cbData, PARITY nParity)
+{
+  //++
+  //   Convert seven track frames, as read from the tape image, into characters
+  // in place.  With PARITY_NONE that just clears bit 7 of every byte, and
+  // otherwise the parity bit is checked and then cleared too.  The return
+  // value is the number of bad frames.  memcpy() to and from a uint64_t is the
+  // portable way to do an unaligned load or store, and every compiler we care
+  // about turns it into a single instruction ...
+  //--
+  size_t cbBad = 0, i = 0;
+  for (;  i+8 <= cbData;  i += 8) {
+    uint64_t llFrames;  memcpy(&llFrames, pabData+i, 8);
+    uint64_t llBad = StripFrames(llFrames, nParity);
+    memcpy(pabData+i, &llFrames, 8);
+    if (llBad != 0) cbBad += CountFrames(llBad);
+  }
+  if (i < cbData) {
+    //   Do the last few frames the same way, but zero bytes aren't always
+    // good frames so count only the bytes that are really there ...
+    uint64_t llFrames = 0;  memcpy(&llFrames, pabData+i, cbData-i);
+    uint64_t llBad = StripFrames(llFrames, nParity);
+    memcpy(pabData+i, &llFrames, cbData-i);
+    cbBad += CountFrames(llBad & (FRAMES(0xFF) >> (8*(8-(cbData-i)))));
+  }
+  return cbBad;
+}
+
+
+/*static*/ void CTapeImageFile::Insert7Track (const uint8_t *pabChars, uint8_t *pabFrames, size_t cbData, PARITY nParity)
+{
+  //++
+  //   Convert characters into seven track frames for writing.  With
+  // PARITY_NONE bit 7 of every byte is cleared, and otherwise the upper two
+  // bits are replaced by the parity bit (bit 6) and a zero ...
+  //--
+  size_t i = 0;
+  for (;  i+8 <= cbData;  i += 8) {
+    uint64_t llChars;  memcpy(&llChars, pabChars+i, 8);
+    llChars = InsertFrames(llChars, nParity);
+    memcpy(pabFrames+i, &llChars, 8);
+  }
+  if (i < cbData) {
+    uint64_t llChars = 0;  memcpy(&llChars, pabChars+i, cbData-i);
+    llChars = InsertFrames(llChars, nParity);
+    memcpy(pabFrames+i, &llChars, cbData-i);
+  }
+}
+
+
+void CTapeImageFile::Convert7Track (uint8_t *pabData, size_t cbData)
+{
+  //++
+  //   Convert a seven track record just read.  If it has any bad frames then
+  // the whole record is a bad record, just as if it was flagged that way in
+  // the tape image ...
+  //--
+  size_t cbBad = Strip7Track(pabData, cbData, m_nParity);
+  if (cbBad == 0) return;
+  m_llParityErrors += cbBad;  m_fBadRecord = true;
+  LOGF(WARNING, "%d bad frames in record %d on tape %s", MKINT32(cbBad), m_nRecordCount, m_sFileName.c_str());
+}
+
+
+const uint8_t *CTapeImageFile::CopyFrames (const uint8_t *pabData, int32_t cbData)
+{
+  //++
+  //   Copy a seven track record out of the mapping so that it can be converted
+  // for the zero copy reads, and return the address of the copy ...
+  //--
+  m_vecFrames.resize(cbData);
+  memcpy(m_vecFrames.data(), pabData, cbData);
+  Convert7Track(m_vecFrames.data(), cbData);
+  return m_vecFrames.data();
+}
+
+
+bool CTapeImageFile::EnableWriteBehind (size_t cbBuffer)
+{
+  //++
+  //   Enable the write behind buffer for this tape.  Records written after
+  // this accumulate in memory and are written in big chunks, and truncating
+  // the file is put off until the next tape mark, Rewind(), Close() or
+  // checkpoint.  Tapes with write behind are registered with the checkpoint
+  // thread so that nothing stays in memory for too long.  If cbBuffer is zero
+  // then the buffer is flushed and write behind is disabled ...
+  //--
+  assert(IsOpen() || (cbBuffer == 0));
+  if (IsWriteBehind()) {
+    CCheckpointFiles::RemoveImage(this);
+    bool fOK = FlushWrites();
+    m_cbWriteBuffer = 0;  m_vecWriteBuffer.clear();  m_fTruncatePending = false;
+    if (!fOK) return false;
+  }
+  if (cbBuffer == 0) return true;
+  if (IsReadOnly() || IsCompressed()) {
+    LOGS(WARNING, "write behind not possible for " << (IsCompressed() ? "compressed" : "read only") << " tape " << m_sFileName);
+    return false;
+  }
+  if (cbBuffer < WRITE_ALIGNMENT) cbBuffer = WRITE_ALIGNMENT;
+  m_cbWriteBuffer = cbBuffer;
+  m_vecWriteBuffer.reserve(m_cbWriteBuffer + m_cbMaxRecord + 2*sizeof(METADATA));
+  CCheckpointFiles::AddImage(this);
+  return true;
+}
+
+
+void CTapeImageFile::BufferWrite (const void *pData, size_t cbData)
+{
+  //++
+  //   Add some bytes to the write behind buffer.  If the buffer is empty then
+  // the stdio file is positioned at the current end of the tape, and that's
+  // where the buffer starts.  The write lock must be held ...
+  //--
+  if (m_vecWriteBuffer.empty()) m_llWriteBase = CImageFile::GetFilePosition();
+  const uint8_t *pabData = (const uint8_t *) pData;
+  m_vecWriteBuffer.insert(m_vecWriteBuffer.end(), pabData, pabData+cbData);
+}
+
+
+bool CTapeImageFile::WriteBuffer (bool fAll)
+{
+  //++
+  //   Write out the write behind buffer.  If fAll is false, then only write
+  // up to the last WRITE_ALIGNMENT boundary and keep the rest in the buffer,
+  // so that (after the first one) every write starts on an aligned offset.
+  // If fAll is true then write everything and also do any deferred truncate.
+  // Either way, the stdio file is left positioned at m_llWriteBase, which is
+  // where the buffer starts.  The write lock must be held ...
+  //--
+  size_t cbWrite = m_vecWriteBuffer.size();
+  if (!fAll) {
+    uint64_t llEnd = (m_llWriteBase + cbWrite) & ~((uint64_t) WRITE_ALIGNMENT-1);
+    cbWrite = (llEnd > m_llWriteBase) ? (size_t) (llEnd - m_llWriteBase) : 0;
+  }
+  if (cbWrite > 0) {
+    if (fwrite(&m_vecWriteBuffer[0], 1, cbWrite, m_pFile) != cbWrite)
+      return CImageFile::Error("writing buffer", errno);
+    m_vecWriteBuffer.erase(m_vecWriteBuffer.begin(), m_vecWriteBuffer.begin()+cbWrite);
+    m_llWriteBase += cbWrite;
+  }
+  if (fAll && m_fTruncatePending) {
+    fseek(m_pFile, 0L, SEEK_CUR);
+    if (!SetFileLength(m_llFileSize)) return false;
+    m_fTruncatePending = false;
+  }
+  return true;
+}
+
+
+bool CTapeImageFile::FlushWrites()
+{
+  //++
+  //   Empty the write behind buffer and do any deferred truncation.  This has
+  // to be called before anything that reads or moves the stdio file ...
+  //--
+  if (!IsWriteBehind()) return true;
+  m_WriteLock.Enter();
+  bool fOK = WriteBuffer(true);
+  m_WriteLock.Leave();
+  return fOK;
+}
+
+
+int32_t CTapeImageFile::ReadReverseRecord (uint8_t abData[], size_t cbMaxData)
+{
+  //++
+  //   This routine is logically just like ReadForwardRecord(), except that
+  // this time we read the _previous_ record.  In this case, the virtual tape
+  // position is left at the beginning of the previous record.  The same error
+  // return conditions apply here.
+  //
+  //   Note that calling ReadForwardRecord() and then immediately calling
+  // ReadReverseRecord() should a) return exactly the same data,, and b) leave
+  // the virtual tape in exactly the same position.
+  //
+  //   IMPORTANT!  The bytes returned by this routine will be ordered in the
+  // "forward" direction - that is, they're in the same order as ReadForward
+  // Record() would return when reading this same record.  That might seem
+  // obvious, but remember that it's not what a real tape drive would do!
+  // A real tape drive would have physically read the record backward, and all
+  // the bytes would have therefore appeared in reverse order.  The host
+  // software expects that, and somebody up above us in the chain needs to
+  // compensate by reversing the order of the bytes in the record.
+  //
+  //   And as for ReadForwardRecord(), if abData is NULL then the record data
+  // isn't read at all.  A record longer than cbMaxData is a BADTAPE unless
+  // truncation is enabled, and then we return the LAST cbMaxData bytes -
+  // that's the part a real drive reading backwards would have transferred.
+  //--
+  assert(IsOpen() && (cbMaxData > 0));
+
+  //  If we're already at the BOT, then fail.  Otherwise parse the previous
+  // record.  Reading in reverse uses the stdio file unless the tape is mapped,
+  // and since every read starts with a seek there's never a need to worry
+  // about syncing the file system buffers ...
+  if (IsBOT()) return EOTBOT;
+  if (!FlushWrites()) return BADTAPE;
+  if (IsMapped()) {
+    if (!m_fStreaming) {
+      m_llStreamPos = CImageFile::GetFilePosition();  m_fStreaming = true;
+    }
+  } else if (!SyncStream())
+    return BADTAPE;
+  m_fWriteLast = false;
+  uint64_t llPosition = m_llReadPos = GetFilePosition();
+  int32_t ret = ParseReverse(llPosition, abData, cbMaxData);
+  if (ret >= 0) {
+    assert(m_nRecordCount > 0);  --m_nRecordCount;
+  }
+  if (m_f7Track && (ret > 0) && (abData != NULL))
+    Convert7Track(abData, MIN((size_t) ret, cbMaxData));
+  if (m_fStreaming)
+    m_llStreamPos = llPosition;
+  else if ((llPosition != m_llReadPos) && (fseeko(m_pFile, llPosition, SEEK_SET) != 0)) {
+    CImageFile::Error("seek reverse", errno);  return BADTAPE;
+  }
+//LOGF(TRACE, "  -> CTapeImageFile::ReadReverseRecord, ret=%d, newpos=%lld", ret, llPosition);
+  return ret;
+}
+
+
+int32_t CTapeImageFile::ReadReverseRecord (const uint8_t *&pabData)
+{
+  //++
+  //   The zero copy version of ReadReverseRecord() for mapped tapes.  Just
+  // like ReadForwardRecord(), an empty tape isn't really mapped and we're
+  // always at BOT ...
+  //--
+  if (!IsMapped()) {
+    assert(IsOpen() && (m_llFileSize == 0));
+    pabData = NULL;  return EOTBOT;
+  }
+  int32_t ret = ReadReverseRecord(NULL, m_cbMaxRecord);
+  pabData = (ret > 0) ? m_pabMap+m_llRecordData : NULL;
+  if (m_f7Track && (ret > 0)) pabData = CopyFrames(pabData, ret);
+  return ret;
+}
+
+
+int32_t CTapeImageFile::ParseReverse (uint64_t &llPosition, uint8_t abData[], size_t cbMaxData)
+{
+  //++
+  //   Parse the record that ends at llPosition and leave llPosition at the
+  // start of it.  Just like ParseForward(), gaps, markers and private or
+  // reserved records are skipped.  The only odd case is the half gap - read
+  // in reverse it looks like a longword with 0xFFFF in the upper half, and
+  // we back up only two bytes over it.
+  //--
+  m_fBadRecord = false;
+  while (true) {
+    METADATA nRecLen1, nRecLen2;
+    if (llPosition == 0) return EOTBOT;
+    if ((llPosition < sizeof(METADATA)) || !ReadAt(llPosition-sizeof(METADATA), &nRecLen2, sizeof(METADATA))) {
+      CImageFile::Error("read reverse trailer", errno);  return BADTAPE;
+    }
+    uint32_t lMeta = (uint32_t) nRecLen2;
+    uint32_t nClass = (lMeta & CLASSMASK) >> CLASSSHIFT;
+    if ((lMeta == TAP_GAP) || (lMeta == TAP_EOM)) {
+      llPosition -= sizeof(METADATA);  continue;
+    }
+    if ((lMeta & TAP_REVGAP) == TAP_REVGAP) {
+      llPosition -= sizeof(METADATA)/2;  continue;
+    }
+    llPosition -= sizeof(METADATA);
+    if ((nClass == CLASS_PRIVATE_MARKER) || (nClass == CLASS_RESERVED_MARKER)) continue;
+
+    // Check the record length, just as for read forward ...
+    if ((lMeta & RESERVEDMASK) != 0) {
+      LOGF(ERROR, "invalid metadata (0x%08X) on tape %s", lMeta, m_sFileName.c_str());
+      return BADTAPE;
+    }
+    uint32_t cbRecord = lMeta & RECLENMASK;
+    if ((cbRecord == 0) && (nClass == CLASS_GOOD)) return TAPEMARK;
+    if (cbRecord > m_cbMaxRecord) {
+      LOGF(ERROR, "record length too long (%d bytes) on tape %s", cbRecord, m_sFileName.c_str());
+      return BADTAPE;
+    }
+
+    //   Instead of just skipping backwards and trying to read the data, we
+    // first try to read the header.  We do this just in case we have one of
+    // those funky, padded record length, TAP files.  If we have one of those,
+    // we'll have to skip backwards an extra byte to find the header.
+    uint64_t llHeader = llPosition - cbRecord - sizeof(METADATA);
+    if ((llPosition < cbRecord+sizeof(METADATA)) || !ReadAt(llHeader, &nRecLen1, sizeof(METADATA))) {
+      CImageFile::Error("read reverse header 1", errno);  return BADTAPE;
+    }
+    if (nRecLen1 != nRecLen2) {
+      // The header and trailer don't match - offset by one byte and try again.
+      if ((llHeader == 0) || !ReadAt(--llHeader, &nRecLen1, sizeof(METADATA))) {
+        CImageFile::Error("read reverse header 2", errno);  return BADTAPE;
+      }
+      if (nRecLen1 != nRecLen2) {
+        // Nope - it's a bad tape ...
+        LOGF(ERROR, "header (0x%08X) and trailer (0x%08X) mismatch on tape %s", nRecLen1, nRecLen2, m_sFileName.c_str());
+        return BADTAPE;
+      }
+    }
+
+    //   Now we're ready to read the actual data (forwards, of course), unless
+    // we're only skipping or this isn't a data record at all ...
+    bool fData = (nClass == CLASS_GOOD) || (nClass == CLASS_BAD);
+    if (fData && (abData != NULL) && (cbRecord > cbMaxData) && !m_fTruncateRecords) {
+      LOGF(ERROR, "record length too long (%d bytes) on tape %s", cbRecord, m_sFileName.c_str());
+      return BADTAPE;
+    }
+    if (fData && (abData != NULL) && (cbRecord > 0)) {
+      size_t cbRead = MIN((size_t) cbRecord, cbMaxData);
+      if (!ReadAt(llHeader+sizeof(METADATA)+(cbRecord-cbRead), abData, cbRead)) {
+        CImageFile::Error("read reverse data", errno);  return BADTAPE;
+      }
+    }
+    llPosition = llHeader;
+    if (!fData) continue;
+    if (cbRecord == 0) {
+      LOGF(ERROR, "empty bad data record on tape %s", m_sFileName.c_str());
+      return BADTAPE;
+    }
+    m_fBadRecord = (nClass == CLASS_BAD);
+    m_llRecordData = llHeader + sizeof(METADATA);
+    return MKINT32(cbRecord);
+  }
+}
+
+
+bool CTapeImageFile::Truncate()
+{
+  //++
+  // Truncate the tape image to the current position.  Anything in the read
+  // ahead buffers past this point is gone now, so throw them away too ...
+  //
+  //   With write behind enabled the file isn't actually truncated here - we
+  // just remember where the tape ends now and the next FlushWrites() takes
+  // care of it.  And if the buffer is full, then write it now.
+  //--
+  assert(IsOpen());
+  if (IsReadOnly() || !SyncStream()) return false;
+  if (IsReadAhead()) m_pReadAhead->Discard();
+  if (IsCompressed()) {
+    m_llFileSize = GetFilePosition();
+    TruncateIndex(m_nRecordCount, m_llFileSize);
+    return m_pCompressed->Truncate(m_llFileSize);
+  }
+  if (IsWriteBehind()) {
+    uint64_t llPosition = GetFilePosition();
+    m_WriteLock.Enter();
+    m_llFileSize = llPosition;  m_fTruncatePending = true;
+    TruncateIndex(m_nRecordCount, m_llFileSize);
+    bool fOK = (m_vecWriteBuffer.size() < m_cbWriteBuffer) || WriteBuffer(false);
+    m_WriteLock.Leave();
+    return fOK;
+  }
+  fseek(m_pFile, 0L, SEEK_CUR);  m_fWriteLast = true;
+  m_llFileSize = GetFilePosition();
+  TruncateIndex(m_nRecordCount, m_llFileSize);
+  return SetFileLength(m_llFileSize);
+}
+
+
+bool CTapeImageFile::WriteRecord (uint8_t abData[], size_t cbData)
 {
   //++
   //   This method writes a new data record at the current file position.
@@ -661,25 +2814,52 @@ bool CTapeImageFile::WriteRecord (uint8_t abData[], size_t cbData)
   // That won't prevent US from reading the file, since we're able to cope with
   // either format, but it might cause problems for other programs.
   //--
-  assert(IsOpen() && (cbData > 0) && (cbData <= MAXRECLEN));
+  assert(IsOpen() && (cbData > 0) && (cbData <= m_cbMaxRecord));
   METADATA nMeta = MKINT32(cbData);
-  if (IsReadOnly()) return false;
+  if (IsReadOnly() || !SyncStream()) return false;
+  if (m_fIndexed && !IsPositionIndexed()) ClearIndex();
+
+  //   Seven track records are converted to frames in m_vecFrames, since the
+  // caller's buffer isn't ours to change ...
+  if (m_f7Track) {
+    m_vecFrames.resize(cbData);
+    Insert7Track(abData, m_vecFrames.data(), cbData, m_nParity);
+    abData = m_vecFrames.data();
+  }
 
   // If the last operation was a read, flush the file buffers first...
-  if (!m_fWriteLast) {
+  if (!m_fWriteLast && !IsCompressed()) {
     fseek(m_pFile, 0L, SEEK_CUR);  m_fWriteLast = true;
   }
 
-  // Write the leading metadata, the data, and then the trailing metadata ...
-  if (fwrite(&nMeta, sizeof(METADATA), 1, m_pFile) != 1)
-    return CImageFile::Error("writing metadata (1)", errno);
-  if (fwrite(abData, sizeof(uint8_t), cbData, m_pFile) != cbData)
-    return CImageFile::Error("writing data", errno);
-  if (fwrite(&nMeta, sizeof(METADATA), 1, m_pFile) != 1)
-    return CImageFile::Error("writing metadata (2)", errno);
+  //   Write the leading metadata, the data, and then the trailing metadata.
+  // With write behind enabled, these just go into the buffer instead, and a
+  // compressed tape adds them to the end of the tape (after first discarding
+  // anything past the current position) ...
+  if (IsCompressed()) {
+    if (   !m_pCompressed->Truncate(m_llStreamPos)
+        || !m_pCompressed->Append(&nMeta, sizeof(METADATA))
+        || !m_pCompressed->Append(abData, cbData)
+        || !m_pCompressed->Append(&nMeta, sizeof(METADATA))
+        || !m_pCompressed->EndRecord()) return false;
+    m_llStreamPos += cbData + 2*sizeof(METADATA);
+  } else if (IsWriteBehind()) {
+    m_WriteLock.Enter();
+    BufferWrite(&nMeta, sizeof(METADATA));
+    BufferWrite(abData, cbData);
+    BufferWrite(&nMeta, sizeof(METADATA));
+    m_WriteLock.Leave();
+  } else {
+    if (fwrite(&nMeta, sizeof(METADATA), 1, m_pFile) != 1)
+      return CImageFile::Error("writing metadata (1)", errno);
+    if (fwrite(abData, sizeof(uint8_t), cbData, m_pFile) != cbData)
+      return CImageFile::Error("writing data", errno);
+    if (fwrite(&nMeta, sizeof(METADATA), 1, m_pFile) != 1)
+      return CImageFile::Error("writing metadata (2)", errno);
+  }
 
   // Truncate the file to the end of the new record and we're done!
-  ++m_nRecordCount;
+  IndexRecord(m_nRecordCount++, false);
   if (!Truncate()) return false;
 //LOGF(TRACE, "  -> CTapeImageFile::WriteRecord, cbData=%d, newpos=%d", cbData, ftell(m_pFile));
   return true;
@@ -697,17 +2877,30 @@ bool CTapeImageFile::WriteMark ()
   //
   //   Note that a tape mark is a special case of a record - there's no data
   // and only ONE metadata word ...
+  //
+  //   With write behind enabled, the end of a file is a good time to empty
+  // the buffer and do the deferred truncation ...
   //--
   assert(IsOpen());
   METADATA nMeta = TAPEMARK;
-  if (IsReadOnly()) return false;
-  if (!m_fWriteLast) {
+  if (IsReadOnly() || !SyncStream()) return false;
+  if (m_fIndexed && !IsPositionIndexed()) ClearIndex();
+  if (!m_fWriteLast && !IsCompressed()) {
     fseek(m_pFile, 0L, SEEK_CUR);  m_fWriteLast = true;
   }
-  if (fwrite(&nMeta, sizeof(METADATA), 1, m_pFile) != 1)
+  if (IsCompressed()) {
+    if (   !m_pCompressed->Truncate(m_llStreamPos)
+        || !m_pCompressed->Append(&nMeta, sizeof(METADATA))
+        || !m_pCompressed->EndRecord()) return false;
+    m_llStreamPos += sizeof(METADATA);
+  } else if (IsWriteBehind()) {
+    m_WriteLock.Enter();
+    BufferWrite(&nMeta, sizeof(METADATA));
+    m_WriteLock.Leave();
+  } else if (fwrite(&nMeta, sizeof(METADATA), 1, m_pFile) != 1)
     return CImageFile::Error("writing mark", errno);
-  if (!Truncate()) return false;
-  ++m_nRecordCount;
+  IndexRecord(m_nRecordCount++, true);
+  if (!Truncate() || !FlushWrites()) return false;
 //LOGF(TRACE, "  -> CTapeImageFile::WriteMark, newpos=%d", ftell(m_pFile));
   return true;
 }
@@ -716,23 +2909,42 @@ bool CTapeImageFile::WriteMark ()
 int32_t CTapeImageFile::SpaceForwardRecord (int32_t nRecords)
 {
   //++
-  //   This routine will skip forward over nCount records.  It basically just
-  // calls ReadForwardRecord() and discards the resulting data - it's no more
-  // complicated than that.  It will stop when either the record count is
-  // exhausted or a tape mark is read.  The real tape drive would also stop at
-  // the physical EOT marker, but of course that doesn't apply to us.  The
-  // number of records actually skipped, not counting the tape mark if any,
-  // is returned.
+  //   This routine will skip forward over nCount records.  It will stop when
+  // either the record count is exhausted or a tape mark is read.  The real
+  // tape drive would also stop at the physical EOT marker, but of course that
+  // doesn't apply to us.  The number of records actually skipped, not counting
+  // the tape mark if any, is returned.
+  //
+  //   If the record index covers the current position, then finding the next
+  // tape mark is a binary search and the rest is just one seek.  Otherwise
+  // (or for any part of the tape past the end of the index) we have to step
+  // thru the records one at a time, but even then only the metadata is read.
   //--
   assert(IsOpen() && (nRecords > 0));
-  uint8_t *pabData = DBGNEW uint8_t[MAXRECLEN];  METADATA ret, nCount;
+  if (!m_fIndexed) BuildIndex();
+  int32_t nSkipped = 0;
+  if (IsPositionIndexed()) {
+    uint32_t nFirst = m_nRecordCount;
+    uint32_t nIndexed = GetIndexedRecords();
+    uint64_t nLast = (uint64_t) nFirst + nRecords;
+    vector<uint32_t>::const_iterator it = std::lower_bound(m_vecMarks.begin(), m_vecMarks.end(), nFirst);
+    if ((it != m_vecMarks.end()) && (*it < nLast))
+      return SeekRecord(*it+1) ? TAPEMARK : BADTAPE;
+    if (nLast <= nIndexed)
+      return SeekRecord((uint32_t) nLast) ? nRecords : BADTAPE;
+    //   We ran off the end of the index.  If the index covers the whole tape
+    // then that's the EOT, and otherwise do the rest the hard way ...
+    if (!SeekRecord(nIndexed)) return BADTAPE;
+    if (m_fIndexComplete) return EOTBOT;
+    nSkipped = nIndexed - nFirst;  nRecords -= nSkipped;
+  }
+  METADATA ret = 0, nCount;
   for (nCount = 0;  nCount < nRecords;  ++nCount) {
-    ret = ReadForwardRecord(pabData, MAXRECLEN);
+    ret = SkipForwardRecord();
     if (ret <= 0) break;
   }
-  delete []pabData;
 //LOGF(TRACE, "  -> CTapeImageFile::SpaceForwardRecord, nRecords=%d, nCount=%d, ret=%d, newpos=%d", nRecords, nCount, ret, ftell(m_pFile));
-  return (ret <= 0) ? ret : nCount;
+  return (ret <= 0) ? ret : nCount+nSkipped;
 }
 
 
@@ -741,15 +2953,28 @@ int32_t CTapeImageFile::SpaceReverseRecord (int32_t nRecords)
   //++
   //   This routine will skip backward over nCount records.  It's just the
   // same as SpaceForwardRecord(), except that in this case we also stop
-  // at the physical BOT.
+  // at the physical BOT.  And as before, if the index covers the current
+  // position then we never need to read anything.
   //--
   assert(IsOpen() && (nRecords > 0));
-  uint8_t *pabData = DBGNEW uint8_t[MAXRECLEN];  METADATA ret, nCount;
+  if (!m_fIndexed) BuildIndex();
+  if (IsPositionIndexed()) {
+    uint32_t nFirst = m_nRecordCount;
+    if (nFirst == 0) return EOTBOT;
+    //   Find the last tape mark before the current position.  If we'd reach
+    // it before we run out of records, then stop there ...
+    vector<uint32_t>::const_iterator it = std::lower_bound(m_vecMarks.begin(), m_vecMarks.end(), nFirst);
+    if ((it != m_vecMarks.begin()) && ((uint64_t) *(it-1) + nRecords >= nFirst))
+      return SeekRecord(*(it-1)) ? TAPEMARK : BADTAPE;
+    if ((uint32_t) nRecords <= nFirst)
+      return SeekRecord(nFirst-nRecords) ? nRecords : BADTAPE;
+    return SeekRecord(0) ? EOTBOT : BADTAPE;
+  }
+  METADATA ret = 0, nCount;
   for (nCount = 0;  nCount < nRecords;  ++nCount) {
-    ret = ReadReverseRecord(pabData, MAXRECLEN);
+    ret = SkipReverseRecord();
     if (ret <= 0) break;
   }
-  delete []pabData;
 //LOGF(TRACE, "  -> CTapeImageFile::SpaceReverseRecord, nRecords=%d, nCount=%d, ret=%d, newpos=%d", nRecords, nCount, ret, ftell(m_pFile));
   return (ret <= 0) ? ret : nCount;
 }
@@ -795,6 +3020,213 @@ int32_t CTapeImageFile::SpaceReverseFile (int32_t nFiles)
 
 
 
+//   The tape index sidecar file starts with this header, and it's followed
+// by nRecords+1 record offsets and then nMarks tape mark record numbers.  The
+// index is only good if the tape file still has the same length and time
+// stamp as it did when the index was saved.
+#define TAPE_INDEX_MAGIC  0x58444954UL  // "TIDX"
+struct _TAPE_INDEX_HEADER {
+  uint32_t  lMagic;             // always TAPE_INDEX_MAGIC
+  uint32_t  nRecords;           // number of records (including tape marks)
+  uint32_t  nMarks;             // number of tape marks
+  uint32_t  lReserved;          // (unused - always zero)
+  uint64_t  llFileSize;         // length of the tape image
+  uint64_t  llModified;         // modification time of the tape image
+};
+typedef struct _TAPE_INDEX_HEADER TAPE_INDEX_HEADER;
+
+
+static uint64_t GetModifiedTime (const string &sFileName)
+{
+  //++
+  // Return the last modification time of a file, or zero if we can't ...
+  //--
+#ifdef _WIN32
+  struct _stat64 st;
+  if (_stat64(sFileName.c_str(), &st) != 0) return 0;
+#else
+  struct stat st;
+  if (stat(sFileName.c_str(), &st) != 0) return 0;
+#endif
+  return (uint64_t) st.st_mtime;
+}
+
+
+void CTapeImageFile::ClearIndex()
+{
+  //++
+  // Throw away the record index.  It'll be rebuilt when it's needed ...
+  //--
+  m_fIndexed = m_fIndexComplete = false;
+  m_vecRecordOffsets.clear();  m_vecMarks.clear();
+}
+
+
+bool CTapeImageFile::IsPositionIndexed() const
+{
+  //++
+  //   Return TRUE if the index covers the current record AND the current file
+  // position is where the index thinks that record starts.  The latter might
+  // not be true if, for example, the last read returned BADTAPE and the caller
+  // hasn't rewound yet.
+  //--
+  if (!m_fIndexed || (m_nRecordCount >= m_vecRecordOffsets.size())) return false;
+  return GetFilePosition() == m_vecRecordOffsets[m_nRecordCount];
+}
+
+
+bool CTapeImageFile::SeekRecord (uint32_t nRecord)
+{
+  //++
+  //   Position the tape at the start of an indexed record.  If we're reading
+  // from the read ahead buffers then there's no need to move the stdio file
+  // at all ...
+  //--
+  assert(m_fIndexed && (nRecord < m_vecRecordOffsets.size()));
+  if (!FlushWrites()) return false;
+  if (m_fStreaming)
+    m_llStreamPos = m_vecRecordOffsets[nRecord];
+  else if (fseeko(m_pFile, m_vecRecordOffsets[nRecord], SEEK_SET) != 0)
+    return CImageFile::Error("seek record", errno);
+  m_nRecordCount = nRecord;  m_fWriteLast = false;
+  return true;
+}
+
+
+bool CTapeImageFile::BuildIndex()
+{
+  //++
+  //   Scan the entire tape image and build the record index.  Only the
+  // metadata is read - we seek over the record data - so this goes about as
+  // fast as the host can seek.  If we find a bad record then the index stops
+  // there, and anything past that point will be read the hard way (and
+  // presumably get the same error!).  An end of medium marker ends the tape
+  // just like the end of the file does.  The current tape position isn't
+  // changed.
+  //--
+  assert(IsOpen());
+  if (!FlushWrites() || !SyncStream()) return false;
+  ClearIndex();
+  uint64_t llSave = GetFilePosition();
+  uint64_t llPosition = 0;
+  bool fBadRecord = m_fBadRecord;
+  int32_t ret;
+  m_llReadPos = UINT64_MAX;
+  m_vecRecordOffsets.push_back(0);
+  while ((ret = ParseForward(llPosition, NULL, m_cbMaxRecord, true)) >= 0) {
+    if (ret == TAPEMARK) m_vecMarks.push_back(MKINT32(m_vecRecordOffsets.size()-1));
+    m_vecRecordOffsets.push_back(llPosition);
+  }
+  m_fBadRecord = fBadRecord;
+  m_fIndexed = true;  m_fIndexComplete = (ret == EOTBOT);
+  clearerr(m_pFile);
+  if (!IsCompressed() && (fseeko(m_pFile, llSave, SEEK_SET) != 0)) {
+    ClearIndex();  return CImageFile::Error("seek restore", errno);
+  }
+  m_fWriteLast = false;
+  if (!m_fIndexComplete)
+    LOGS(WARNING, "tape " << m_sFileName << " index stops at bad record " << GetIndexedRecords());
+  LOGS(DEBUG, "indexed " << GetIndexedRecords() << " records and " << m_vecMarks.size() << " marks on " << m_sFileName);
+  if (m_fIndexComplete && m_fIndexFile) SaveIndex();
+  return true;
+}
+
+
+void CTapeImageFile::IndexRecord (uint32_t nRecord, bool fMark)
+{
+  //++
+  //   Record nRecord has just been written, and that means everything after
+  // it is gone.  Throw away any tape marks from that point on, and then add
+  // this one if it's a tape mark too.  The record offsets are taken care of
+  // by TruncateIndex(), which Truncate() calls next.
+  //--
+  if (!m_fIndexed || (nRecord >= m_vecRecordOffsets.size())) return;
+  m_vecMarks.erase(std::lower_bound(m_vecMarks.begin(), m_vecMarks.end(), nRecord), m_vecMarks.end());
+  if (fMark) m_vecMarks.push_back(nRecord);
+}
+
+
+void CTapeImageFile::TruncateIndex (uint32_t nRecords, uint64_t llEnd)
+{
+  //++
+  //   The tape has been truncated (or written, which amounts to the same
+  // thing) and now it ends after record nRecords-1, at file offset llEnd.  If
+  // that's within the index, or just one record past the end of it, then the
+  // index now covers the entire tape.  Otherwise the tape still ends somewhere
+  // we've never indexed and we leave well enough alone.
+  //--
+  if (!m_fIndexed) return;
+  size_t nIndexed = m_vecRecordOffsets.size() - 1;
+  if (nRecords > nIndexed+1) {
+    m_fIndexComplete = false;  return;
+  }
+  m_vecRecordOffsets.resize((size_t) nRecords+1);
+  m_vecRecordOffsets[nRecords] = llEnd;
+  m_vecMarks.erase(std::lower_bound(m_vecMarks.begin(), m_vecMarks.end(), nRecords), m_vecMarks.end());
+  m_fIndexComplete = true;
+}
+
+
+bool CTapeImageFile::SaveIndex() const
+{
+  //++
+  //   Save a (complete!) record index to the sidecar file.  If we can't, it's
+  // not fatal - we'll just have to build the index again next time.
+  //--
+  assert(m_fIndexed && m_fIndexComplete);
+  string sIndexFile = m_sFileName + ".idx";
+  FILE *pFile = fopen(sIndexFile.c_str(), "wb");
+  if (pFile == NULL) {
+    LOGS(WARNING, "unable to create tape index " << sIndexFile);  return false;
+  }
+  TAPE_INDEX_HEADER hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.lMagic = TAPE_INDEX_MAGIC;  hdr.nRecords = GetIndexedRecords();
+  hdr.nMarks = MKINT32(m_vecMarks.size());  hdr.llFileSize = m_llFileSize;
+  hdr.llModified = GetModifiedTime(m_sFileName);
+  bool fOK = (fwrite(&hdr, sizeof(hdr), 1, pFile) == 1)
+          && (fwrite(m_vecRecordOffsets.data(), sizeof(uint64_t), m_vecRecordOffsets.size(), pFile) == m_vecRecordOffsets.size())
+          && (fwrite(m_vecMarks.data(), sizeof(uint32_t), m_vecMarks.size(), pFile) == m_vecMarks.size());
+  if (fclose(pFile) != 0) fOK = false;
+  if (!fOK) {
+    LOGS(WARNING, "error writing tape index " << sIndexFile);
+    remove(sIndexFile.c_str());
+  }
+  return fOK;
+}
+
+
+bool CTapeImageFile::LoadIndex()
+{
+  //++
+  //   Load the record index from the sidecar file, if there is one and if it
+  // still matches the tape image.  If not, then return false and the index
+  // will be built the usual way.
+  //--
+  string sIndexFile = m_sFileName + ".idx";
+  FILE *pFile = fopen(sIndexFile.c_str(), "rb");
+  if (pFile == NULL) return false;
+  TAPE_INDEX_HEADER hdr;
+  bool fOK = (fread(&hdr, sizeof(hdr), 1, pFile) == 1)
+          && (hdr.lMagic == TAPE_INDEX_MAGIC) && (hdr.llFileSize == m_llFileSize)
+          && (hdr.llModified == GetModifiedTime(m_sFileName)) && (hdr.nMarks <= hdr.nRecords);
+  if (fOK) {
+    m_vecRecordOffsets.resize((size_t) hdr.nRecords+1);  m_vecMarks.resize(hdr.nMarks);
+    fOK = (fread(m_vecRecordOffsets.data(), sizeof(uint64_t), m_vecRecordOffsets.size(), pFile) == m_vecRecordOffsets.size())
+       && (fread(m_vecMarks.data(), sizeof(uint32_t), m_vecMarks.size(), pFile) == m_vecMarks.size())
+       && (m_vecRecordOffsets[0] == 0) && (m_vecRecordOffsets[hdr.nRecords] == m_llFileSize);
+  }
+  fclose(pFile);
+  if (!fOK) {
+    LOGS(DEBUG, "ignoring out of date tape index " << sIndexFile);
+    ClearIndex();  return false;
+  }
+  m_fIndexed = m_fIndexComplete = true;
+  LOGS(DEBUG, "loaded " << hdr.nRecords << " records and " << hdr.nMarks << " marks from " << sIndexFile);
+  return true;
+}
+
+
 ///////////////////////////////////////////////////////////////////////////////
 // CTextInputFile members ...
 ///////////////////////////////////////////////////////////////////////////////
@@ -39,7 +39,15 @@
 //--
 #pragma once
 #include <string>               // C++ std::string class, et al ...
+#include <vector>               // C++ std::vector template
 using std::string;              // ...
+using std::vector;              // ...
+#include "Mutex.hpp"            // needed for CMutex ...
+class CSectorCache;             // write back sector cache for disk images
+class CDiskJournal;             // write ahead journal for disk images
+class CCompressedImage;         // compressed read only disk images
+class CCompressedTape;          // compressed tape images
+class CTapeReadAhead;           // read ahead buffers for tape images
 
 
 class CImageFile {
@@ -93,12 +101,14 @@ public:
   // Return true if we've hit the end of file ...
   bool IsEOF() const {return feof(m_pFile) != 0;}
   // Get the current file size or relative position (in bytes!) ...
-  uint32_t GetFileLength() const;
-  uint32_t GetFilePosition() const;
+  uint64_t GetFileLength() const;
+  uint64_t GetFilePosition() const;
   // Set the file size, and truncate if necessary!
-  bool SetFileLength (uint32_t nNewLength);
+  bool SetFileLength (uint64_t llNewLength);
   // Truncate the file to the current position ...
   bool Truncate();
+  // Flush any buffered data all the way to the disk ...
+  virtual bool Flush();
 
   // Local methods ...
 protected:
@@ -122,11 +132,45 @@ class CDiskImageFile : public CImageFile {
   // have fixed length block/sector sizes, are block/sector rewritable, and
   // are random access.
   //--
+  friend class CSectorCache;    // the cache needs our uncached I/O methods
+  friend class CDiskJournal;    // and so does the journal
+
+  // Public constants ...
+public:
+  //   These are the ways a disk image file may be accessed.  ACCESS_STDIO is
+  // the original (and default) mode, where every sector is read or written
+  // thru the stdio library.  ACCESS_MAPPED maps the entire image file into
+  // our address space, and sector reads and writes become simple memcpy()s.
+  // It also allows the caller to get a pointer directly to the sector data
+  // with GetSectorPointer() and avoid copying the data at all.  Lastly,
+  // ACCESS_POSITIONAL uses pread() and pwrite() directly on the file
+  // descriptor.  These never use the shared file position and so sector
+  // reads and writes are stateless and may be done from several threads at
+  // once (e.g. for dual ported drives) without any locking.
+  enum ACCESS_MODE {
+    ACCESS_STDIO      = 0,      // use stdio fread() and fwrite()
+    ACCESS_MAPPED     = 1,      // map the entire image into memory
+    ACCESS_POSITIONAL = 2,      // use pread() and pwrite()
+  };
+  //   This is the maximum number of sectors that will be coalesced into a
+  // single preadv() or pwritev() call by the scatter/gather methods.  Longer
+  // runs are legal - they just take more than one system call.
+  enum {
+    MAXIOV        = 64,         // maximum sectors per system call
+  };
+  //   A SECTOR_IOV is one element of a scatter/gather list for ReadSectorsV()
+  // and WriteSectorsV().  Each one describes exactly one sector and a buffer,
+  // which must be at least GetSectorSize() bytes, for its data.
+  struct _SECTOR_IOV {
+    uint32_t  lLBA;             // sector to be transferred
+    void     *pData;            // buffer for this sector
+  };
+  typedef struct _SECTOR_IOV SECTOR_IOV;
 
 public:
   // Constructor and destructor ...
   CDiskImageFile (uint32_t nSectorSize);
-  virtual ~CDiskImageFile() {};
+  virtual ~CDiskImageFile() {Close();}
   // Disallow copy and assignment operations with CDiskImageFile objects...
 private:
   CDiskImageFile (const CDiskImageFile &f) = delete;
@@ -134,6 +178,22 @@ private:
 
   // Public methods ...
 public:
+  // Open the image file, optionally selecting the access mode ...
+  virtual bool Open (const string &sFileName, bool fReadOnly=false, int nShareMode=0)
+    {return Open(sFileName, fReadOnly, nShareMode, ACCESS_STDIO);}
+  bool Open (const string &sFileName, bool fReadOnly, int nShareMode, ACCESS_MODE nMode);
+  virtual void Close();
+  // Flush the image file (or group commit the journal) to disk ...
+  virtual bool Flush();
+  // Return the current access mode ...
+  ACCESS_MODE GetAccessMode() const {return m_nAccessMode;}
+  bool IsMapped() const {return m_nAccessMode == ACCESS_MAPPED;}
+  bool IsPositional() const {return m_nAccessMode == ACCESS_POSITIONAL;}
+  // Return TRUE if this is a compressed (and read only!) image ...
+  bool IsCompressed() const {return m_pCompressed != NULL;}
+  //   Return the image length.  For a compressed image that's the length of
+  // the original, uncompressed, image and not the length of the file ...
+  uint64_t GetFileLength() const;
   //   Return or change the sector size.  Note that changing the sector size
   // of an image file after it's been opened is a doubtful idea, but that's
   // up to the caller...
@@ -142,15 +202,126 @@ public:
   // Read or write sectors ...
   bool ReadSector  (uint32_t lLBA, void *pData);
   bool WriteSector (uint32_t lLBA, const void *pData);
+  // Read or write a run of contiguous sectors with one call ...
+  bool ReadSectors  (uint32_t lLBA, uint32_t nCount, void *pData);
+  bool WriteSectors (uint32_t lLBA, uint32_t nCount, const void *pData);
+  // Read or write a scatter/gather list of sectors ...
+  bool ReadSectorsV  (const SECTOR_IOV aIOV[], size_t nIOV);
+  bool WriteSectorsV (const SECTOR_IOV aIOV[], size_t nIOV);
+  // Return a pointer to the sector data (ACCESS_MAPPED only!) ...
+  uint8_t *GetSectorPointer (uint32_t lLBA);
+  //   Open a copy on write overlay - a read only (and shared!) base image plus
+  // a private delta image that receives all the writes ...
+  bool OpenOverlay (const string &sBaseFile, const string &sDeltaFile, ACCESS_MODE nMode=ACCESS_STDIO);
+  bool IsOverlay() const {return m_pBase != NULL;}
+  const CDiskImageFile *GetBaseImage() const {return m_pBase;}
+  //   Enable or disable sparse mode.  In sparse mode all zero sectors are
+  // never written - holes are punched in the image file instead ...
+  bool SetSparse (bool fSparse=true);
+  bool IsSparse() const {return m_fSparse;}
+  // Copy an image file, leaving out all the unused (all zero) sectors ...
+  static bool CompactImage (const string &sOldFile, const string &sNewFile, uint32_t nSectorSize);
+  // Enable (or disable, if nSectors is zero) the write back sector cache ...
+  bool EnableCache (uint32_t nSectors);
+  bool IsCached() const {return m_pCache != NULL;}
+  const CSectorCache *GetCache() const {return m_pCache;}
+  //   Enable or disable the write ahead journal (ACCESS_POSITIONAL images
+  // only).  If cbLimit is zero then the default journal size limit is used ...
+  bool EnableJournal (const string &sJournalFile, uint64_t cbLimit=0);
+  bool DisableJournal();
+  bool IsJournaled() const {return m_pJournal != NULL;}
+  const CDiskJournal *GetJournal() const {return m_pJournal;}
+  // Group sector writes into an atomic transaction (journaled images only) ...
+  bool BeginTransaction();
+  bool CommitTransaction();
+  void AbortTransaction();
+  // Save a point in time copy of the image, or restore one ...
+  bool Snapshot (const string &sSnapshotFile);
+  bool Restore (const string &sSnapshotFile);
 
   // Local methods ...
 protected:
+  // Sector I/O methods that bypass the cache ...
+  bool ReadSectorDirect  (uint32_t lLBA, void *pData);
+  bool WriteSectorDirect (uint32_t lLBA, const void *pData);
+  bool ReadSectorsDirect  (uint32_t lLBA, uint32_t nCount, void *pData);
+  bool WriteSectorsDirect (uint32_t lLBA, uint32_t nCount, const void *pData);
+  bool ReadSectorsVDirect  (const SECTOR_IOV aIOV[], size_t nIOV);
+  bool WriteSectorsVDirect (const SECTOR_IOV aIOV[], size_t nIOV);
+  // Flush the image file itself, bypassing the journal ...
+  bool FlushImage();
+  // Set up a compressed image after Open() ...
+  bool OpenCompressed();
+  // Flush the sector cache and then delete it ...
+  bool DeleteCache();
+  // Load, update or close the copy on write overlay map ...
+  bool LoadOverlayMap (const string &sMapFile);
+  bool MarkInDelta (uint32_t lLBA, uint32_t nCount=1);
+  void CloseOverlay();
+  // Return TRUE if a sector has been written to the overlay delta ...
+  bool IsInDelta (uint32_t lLBA);
+  // Find out where a run of sectors lives in an overlay ...
+  enum OVERLAY_STATE {OVERLAY_BASE, OVERLAY_DELTA, OVERLAY_MIXED};
+  OVERLAY_STATE GetOverlayState (uint32_t lLBA, uint32_t nCount);
   // Seek to a particular sector ...
   bool SeekSector (uint32_t lLBA);
+  // Map, unmap or extend the memory mapped image ...
+  bool MapImage();
+  void UnmapImage();
+  bool GrowImage (uint64_t cbNewLength);
+  // Find the length of the next run of adjacent sectors in a SECTOR_IOV list ...
+  static size_t FindRun (const SECTOR_IOV aIOV[], size_t nIOV);
+#ifdef __linux__
+  // Transfer a run of contiguous sectors with a single system call ...
+  bool ReadRun  (uint32_t lLBA, const struct iovec *aiov, int niov);
+  bool WriteRun (uint32_t lLBA, const struct iovec *aiov, int niov);
+  // Write a run in sparse mode, skipping or punching out zero sectors ...
+  bool WriteRunSparse (uint32_t lLBA, const struct iovec *aiov, int niov);
+  bool ZeroRange (uint64_t llOffset, uint64_t cbLength, uint64_t &llEOF);
+  // Copy one image file to another, leaving holes for all zero sectors ...
+  static bool CopySparse (int fdOld, int fdNew, uint32_t nSectorSize, uint64_t &llCopied);
+  // Copy an image file by cloning it, if the file system allows ...
+  static bool CloneFile (int fdOld, int fdNew, uint32_t nSectorSize);
+#endif
+  // Return TRUE if a sector contains nothing but zeros ...
+  static bool IsZeroSector (const void *pData, size_t cbData);
 
   // Local members ...
 protected:
-  uint32_t m_nSectorSize;       // disk sector/block size (in PP words)
+  uint32_t    m_nSectorSize;    // disk sector/block size (in PP words)
+  ACCESS_MODE m_nAccessMode;    // how this image file is accessed
+  //   This is the file descriptor used by ReadRun() and WriteRun().  It's the
+  // same as fileno(m_pFile), but fileno() takes the stdio lock and the whole
+  // point of positional I/O is to avoid that!
+  int         m_nFD;            // file descriptor for preadv()/pwritev()
+  //   These members are used only for ACCESS_MAPPED images.  m_pabMap points
+  // to the start of the mapping (which may be NULL if the image file is empty)
+  // and m_cbMap is its length.  The mapping always covers the entire file.
+  // m_MapLock interlocks the checkpoint thread, which calls Flush(), and any
+  // sector reads and writes against GrowImage(), which may move the mapping.
+  // Both m_pabMap and m_cbMap must only be used while holding it.
+  uint8_t    *m_pabMap;         // address of the image file in memory
+  uint64_t    m_cbMap;          // size of the mapping, in bytes
+  CMutex      m_MapLock;        // interlock for access vs GrowImage()
+  //   If the sector cache is enabled, this points to it.  ALL sector reads and
+  // writes go thru the cache when it exists.
+  CSectorCache *m_pCache;       // write back sector cache (or NULL)
+  bool        m_fSparse;        // TRUE to punch holes for zero sectors
+  //   These members are used only for copy on write overlays.  This object is
+  // the delta image, and m_pBase is the read only base image.  The overlay map
+  // has one bit for every sector, and the bit is set if that sector has been
+  // written to the delta.  The map is kept in memory and also in a sidecar
+  // file, which is updated every time a new bit is set.
+  CDiskImageFile *m_pBase;      // base image for copy on write overlays
+  FILE       *m_pOverlayMap;    // overlay map sidecar file
+  vector<uint8_t> m_abOverlayMap; // in memory copy of the overlay map
+  CMutex      m_OverlayLock;    // interlock for the overlay map
+  //   If the write ahead journal is enabled, this points to it.  ALL sector
+  // writes go thru the journal when it exists, and reads check it first.
+  CDiskJournal *m_pJournal;     // write ahead journal (or NULL)
+  //   If this is a compressed image then this object reads the sectors for
+  // us.  Compressed images are always read only.
+  CCompressedImage *m_pCompressed; // compressed image reader (or NULL)
 };
 
 
@@ -161,6 +332,7 @@ class CTapeImageFile : public CImageFile {
   // blocks cannot be rewritten.  Well, OK - a record can be overwritten but
   // doing so truncates the tape at that point.
   //--
+  friend class CTapeValidator;  // the validator reads the raw tape image
 
   // Public constants ...
 public:
@@ -181,11 +353,50 @@ public:
     EOTBOT      = -1L,          // tape is at EOT or BOT
     BADTAPE     = -2L           // bad TAP file format
   };
+  //   The extended simh format uses the upper four bits of the metadata for a
+  // record class, and the lower 28 bits are the record length (or a marker
+  // value).  Class 0 is a normal record and class 8 is a record with a data
+  // error.  The other data record classes (1-6 are private, 9-E are reserved)
+  // are skipped over, as are the private (7) and reserved (F) markers.  Erase
+  // gaps are also skipped, and an end of medium marker is reported as EOT.
+  // Only the lower 24 bits of the length are actually used - the rest must
+  // be zero.
+  enum : uint32_t {
+    CLASSMASK   = 0xF0000000UL, // mask for the record class
+    CLASSSHIFT  = 28,           // shift for the record class
+    CLASS_GOOD  = 0x0,          // good data record
+    CLASS_PRIVATE_MARKER = 0x7, // private marker (no data)
+    CLASS_BAD   = 0x8,          // bad data record
+    CLASS_RESERVED_MARKER = 0xF,// reserved marker (no data)
+    RESERVEDMASK= 0x0F000000UL, // length bits that must be zero
+    TAP_EOM     = 0xFFFFFFFFUL, // end of medium
+    TAP_GAP     = 0xFFFFFFFEUL, // erase gap
+    TAP_HALFGAP = 0xFFFEFFFFUL, // half gap (forward)
+    TAP_REVGAP  = 0xFFFF0000UL, // half gap (reverse) if upper 16 bits match
+  };
+  //   These are the defaults for the write behind buffer.  The buffer is
+  // written whenever it fills up, but only up to the last WRITE_ALIGNMENT
+  // boundary so that the file is always written in aligned chunks ...
+  enum {
+    DEFAULT_WRITE_BUFFER = 1024*1024, // default write behind buffer size
+    WRITE_ALIGNMENT      = 64*1024,   // alignment for write behind
+    DEFAULT_COMPRESS_BLOCK = 64*1024, // default block size for compressed tapes
+  };
+  //   A seven track tape frame is six data bits plus a lateral parity bit,
+  // and each one is stored in the TAP file as a byte with the parity in bit 6
+  // and bit 7 always zero.  With PARITY_NONE the parity bit is passed thru
+  // untouched (only bit 7 is cleared), and otherwise it's checked and stripped
+  // when reading and generated when writing ...
+  enum PARITY {
+    PARITY_NONE,                // seven bit frames - just clear bit 7
+    PARITY_ODD,                 // odd parity (binary mode)
+    PARITY_EVEN,                // even parity (BCD mode)
+  };
 
 public:
   //  Constructor and destructor ...
   CTapeImageFile (bool f7Track=false);
-  virtual ~CTapeImageFile() {};
+  virtual ~CTapeImageFile() {Close();}
   // Disallow copy and assignment operations with CTapeImageFile objects...
 private:
   CTapeImageFile(const CTapeImageFile &f) = delete;
@@ -193,8 +404,15 @@ private:
 
   // Public methods ...
 public:
-  // Open the associated disk file ...
+  // Open or close the associated disk file ...
   virtual bool Open (const string &sFileName, bool fReadOnly=false, int nShareMode=0);
+  virtual void Close();
+  // Flush the write behind buffer and the file ...
+  virtual bool Flush();
+  //   Return the current file position.  With read ahead or write behind the
+  // stdio file position may be out of date, so this hides the CImageFile
+  // version ...
+  uint64_t GetFilePosition() const;
   // Test current tape position for EOT/BOT ...
   bool IsBOT() const;
   bool IsEOT() const;
@@ -202,9 +420,36 @@ public:
   uint32_t GetRecordCount() const {return m_nRecordCount;}
   // Return the 7 track flag for this image ...
   bool Is7Track() const {return m_f7Track;}
+  //   Set or return the parity mode for 7 track tapes, and return the total
+  // number of bad frames (parity errors, or bit 7 set) read so far ...
+  void SetParity (PARITY nParity) {m_nParity = nParity;}
+  PARITY GetParity() const {return m_nParity;}
+  uint64_t GetParityErrors() const {return m_llParityErrors;}
+  //   Set or return the longest record we'll accept.  The default is
+  // MAXRECLEN, but tapes from other emulators may need more (up to
+  // RECLENMASK).  Note that the caller's buffer has to be that big too,
+  // unless record truncation is enabled ...
+  void SetMaxRecordLength (uint32_t cbMaxRecord);
+  uint32_t GetMaxRecordLength() const {return m_cbMaxRecord;}
+  //   Normally a record longer than the caller's buffer is a BADTAPE error.
+  // With truncation enabled, the part that fits is returned along with the
+  // real record length instead - see ReadForwardRecord() ...
+  void SetTruncateRecords (bool fTruncate=true) {m_fTruncateRecords = fTruncate;}
+  bool IsTruncateRecords() const {return m_fTruncateRecords;}
+  // Return TRUE if the last record read was flagged as bad (class 8) ...
+  bool IsBadRecord() const {return m_fBadRecord;}
   // Read and write records ...
   int32_t ReadForwardRecord (uint8_t pabData[], size_t cbMaxData);
   int32_t ReadReverseRecord (uint8_t pabData[], size_t cbMaxData);
+  //   Read a record without copying it (mapped tapes only!).  pabData points
+  // to the record in the mapping, and stays valid until the tape is closed.
+  // An empty tape is never really mapped, and these just return EOTBOT ...
+  int32_t ReadForwardRecord (const uint8_t *&pabData);
+  int32_t ReadReverseRecord (const uint8_t *&pabData);
+  //   Skip one record, reading only the metadata.  The return value is the
+  // same as ReadForwardRecord() or ReadReverseRecord() ...
+  int32_t SkipForwardRecord() {return ReadForwardRecord(NULL, m_cbMaxRecord);}
+  int32_t SkipReverseRecord() {return ReadReverseRecord(NULL, m_cbMaxRecord);}
   bool Truncate();
   bool WriteMark();
   bool WriteRecord (uint8_t pabData[], size_t cbData);
@@ -215,9 +460,79 @@ public:
   int32_t SpaceReverseRecord (int32_t nRecords=1);
   int32_t SpaceForwardFile (int32_t nFiles=1);
   int32_t SpaceReverseFile (int32_t nFiles=1);
+  //   Build the record index now, rather than waiting for the first space
+  // operation to do it ...
+  bool BuildIndex();
+  bool IsIndexed() const {return m_fIndexed;}
+  uint32_t GetIndexedRecords() const {return m_fIndexed ? MKINT32(m_vecRecordOffsets.size()-1) : 0;}
+  //   Save the record index in a sidecar file (the tape name plus ".idx") and
+  // reload it the next time the tape is opened.  Call this before Open() ...
+  void SetIndexFile (bool fIndexFile=true) {m_fIndexFile = fIndexFile;}
+  //   Enable (or disable, if cbBuffer is zero) the read ahead buffers for
+  // sequential reading.  Call this after Open() ...
+  bool EnableReadAhead (size_t cbBuffer);
+  bool IsReadAhead() const {return m_pReadAhead != NULL;}
+  const CTapeReadAhead *GetReadAhead() const {return m_pReadAhead;}
+  //   Enable (or disable, if cbBuffer is zero) the write behind buffer.  Call
+  // this after Open() ...
+  bool EnableWriteBehind (size_t cbBuffer=DEFAULT_WRITE_BUFFER);
+  bool IsWriteBehind() const {return m_cbWriteBuffer != 0;}
+  //   Map (or unmap) a read only tape image into memory.  Call this after
+  // Open(), and note that it replaces read ahead ...
+  bool EnableMapping (bool fMap=true);
+  bool IsMapped() const {return m_pabMap != NULL;}
+  //   Create new tapes as compressed tapes, with blocks of about cbBlock bytes
+  // (or don't, if cbBlock is zero).  This only matters when Open() finds an
+  // empty file - existing compressed tapes are always recognized.  Call this
+  // before Open() ...
+  void SetCompression (uint32_t cbBlock=DEFAULT_COMPRESS_BLOCK) {m_cbCompressBlock = cbBlock;}
+  bool IsCompressed() const {return m_pCompressed != NULL;}
+  const CCompressedTape *GetCompressedTape() const {return m_pCompressed;}
+  // Convert an ordinary tape image to a compressed one, or vice versa ...
+  static bool CompressTape (const string &sRawFile, const string &sCompressedFile, uint32_t cbBlock=DEFAULT_COMPRESS_BLOCK);
+  static bool ExpandTape (const string &sCompressedFile, const string &sRawFile);
+  //   Convert seven track frames read from a tape into characters, returning
+  // the number of bad frames, or characters into frames for writing.  These
+  // work a 64 bit word at a time and the buffers may overlap exactly ...
+  static size_t Strip7Track (uint8_t *pabData, size_t cbData, PARITY nParity);
+  static void Insert7Track (const uint8_t *pabChars, uint8_t *pabFrames, size_t cbData, PARITY nParity);
 
   // Local methods ...
 protected:
+  //   Read bytes at an absolute file offset, either from the read ahead
+  // buffers (if we're streaming) or from the stdio file ...
+  bool ReadAt (uint64_t llOffset, void *pData, size_t cbData);
+  //   Parse one record starting at (or, for reverse, ending at) llPosition
+  // and update llPosition.  These do all the real work for ReadForwardRecord(),
+  // ReadReverseRecord() and BuildIndex() ...
+  int32_t ParseForward (uint64_t &llPosition, uint8_t abData[], size_t cbMaxData, bool fQuiet=false);
+  int32_t ParseReverse (uint64_t &llPosition, uint8_t abData[], size_t cbMaxData);
+  // Bring the stdio file position up to date after streaming ...
+  bool SyncStream();
+  // Unmap a mapped tape image ...
+  void UnmapTape();
+  // Convert a seven track record just read, or a copy of a mapped one ...
+  void Convert7Track (uint8_t *pabData, size_t cbData);
+  const uint8_t *CopyFrames (const uint8_t *pabData, int32_t cbData);
+  // Set up a compressed tape after Open(), or save and close it ...
+  bool OpenCompressed();
+  void CloseCompressed();
+  // Add to, write or flush the write behind buffer ...
+  void BufferWrite (const void *pData, size_t cbData);
+  bool WriteBuffer (bool fAll);
+  bool FlushWrites();
+  // Throw away the record index ...
+  void ClearIndex();
+  // Return TRUE if the current tape position is covered by the index ...
+  bool IsPositionIndexed() const;
+  // Position the tape at the start of an indexed record ...
+  bool SeekRecord (uint32_t nRecord);
+  // Update the index after writing a record or truncating the tape ...
+  void IndexRecord (uint32_t nRecord, bool fMark);
+  void TruncateIndex (uint32_t nRecords, uint64_t llEnd);
+  // Load or save the index sidecar file ...
+  bool LoadIndex();
+  bool SaveIndex() const;
 
   // Local members ...
 protected:
@@ -235,16 +550,67 @@ protected:
   bool      m_fWriteLast;       // TRUE if the last operation was a write
   //   And this local keeps track of the current file size.  It's updated every
   // time we write or truncate, and it's used to determine EOT when reading.
-  uint32_t  m_nFileSize;        // total number of bytes in this file
+  uint64_t  m_llFileSize;       // total number of bytes in this file
   //   Seven track image files are treated EXACTLY the same as 9 track, except
-  // that the upper bit of every byte is zeroed when reading or writing.  The
-  // file format is exactly the same otherwise.
-  //
-  //   Actually to be honest at the moment this flag isn't even used, but it
-  // is carried thru correctly in the rest of the CDC code (the only thing that
-  // currently supports 7 track drives!) so it could be implemented someday
-  // should we need it.
+  // that the upper bit of every byte is zeroed when reading or writing and,
+  // depending on m_nParity, the parity bit may be checked or generated.  The
+  // file format is exactly the same otherwise.  Writes are converted in
+  // m_vecFrames, and so are zero copy reads from a mapped tape (since we can't
+  // change the mapping).
   bool      m_f7Track;          // TRUE for 7 track images
+  PARITY    m_nParity;          // parity mode for 7 track images
+  uint64_t  m_llParityErrors;   // bad frames read so far
+  vector<uint8_t> m_vecFrames;  // buffer for converting 7 track records
+  //   Records longer than m_cbMaxRecord are treated as a bad tape, and so
+  // are records longer than the caller's buffer unless m_fTruncateRecords is
+  // set.  m_fBadRecord is TRUE if the last record read had the simh bad data
+  // class.
+  uint32_t  m_cbMaxRecord;      // longest record we'll accept
+  bool      m_fTruncateRecords; // TRUE to truncate records that don't fit
+  bool      m_fBadRecord;       // TRUE if the last record was flagged bad
+  //   The record index lets us space forward or backward over any number of
+  // records or files without reading them.  m_vecRecordOffsets[n] is the file
+  // offset of record n (counting tape marks as records, just like
+  // m_nRecordCount) and the last entry is the offset just past the last
+  // indexed record.  m_vecMarks is a sorted list of the record numbers of
+  // all the tape marks.  The index always covers the tape from the BOT up to
+  // some point - if m_fIndexComplete is TRUE then that's the end of the tape,
+  // and if not then there's a bad record there.
+  bool      m_fIndexed;         // TRUE if the index has been built
+  bool      m_fIndexComplete;   // TRUE if the index covers the entire tape
+  bool      m_fIndexFile;       // TRUE to keep a copy in a sidecar file
+  vector<uint64_t> m_vecRecordOffsets; // file offset of every record
+  vector<uint32_t> m_vecMarks;  // record numbers of all the tape marks
+  //   When read ahead is enabled, ReadForwardRecord() reads records from the
+  // CTapeReadAhead buffers and leaves the stdio file alone.  As long as that's
+  // going on m_fStreaming is TRUE and the real tape position is m_llStreamPos.
+  CTapeReadAhead *m_pReadAhead; // read ahead buffers (NULL if disabled)
+  bool      m_fStreaming;       // TRUE if the stdio position is out of date
+  uint64_t  m_llStreamPos;      // current tape position while streaming
+  uint64_t  m_llReadPos;        // stdio file position as ReadAt() knows it
+  //   A read only tape can also be mapped into memory, and then ReadAt() just
+  // copies from the mapping instead.  Both read directions stream while the
+  // tape is mapped, and m_llRecordData (set by ParseForward() and friends) is
+  // the file offset of the last record's data, for the zero copy reads.
+  const uint8_t *m_pabMap;      // address of the tape image in memory
+  uint64_t  m_cbMap;            // size of the mapping, in bytes
+  uint64_t  m_llRecordData;     // file offset of the last record's data
+  //   Compressed tapes are read and written thru a CCompressedTape object and
+  // the stdio file is never touched directly.  They're always "streaming",
+  // and all the file offsets are offsets in the uncompressed tape image.
+  uint32_t  m_cbCompressBlock;  // block size for new compressed tapes (or 0)
+  CCompressedTape *m_pCompressed; // compressed tape container (or NULL)
+  //   With write behind enabled, WriteRecord() and WriteMark() just add to
+  // m_vecWriteBuffer.  Whenever the buffer isn't empty the stdio file is
+  // positioned at m_llWriteBase and the buffer contains everything after
+  // that.  If m_fTruncatePending is TRUE then the file still has to be
+  // truncated to m_llFileSize.  The checkpoint thread can flush the buffer
+  // at any time, so all of this is protected by m_WriteLock.
+  size_t    m_cbWriteBuffer;    // write behind buffer size (0 if disabled)
+  vector<uint8_t> m_vecWriteBuffer; // data waiting to be written
+  uint64_t  m_llWriteBase;      // file offset of the first buffered byte
+  bool      m_fTruncatePending; // TRUE if the file needs to be truncated
+  mutable CMutex m_WriteLock;   // interlock with the checkpoint thread
 };
 
 
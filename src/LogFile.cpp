@@ -63,10 +63,18 @@
 #include "CheckpointFiles.hpp"  // UPE library file checkpoint thread
 #include "LogFile.hpp"          // declarations for this module
 #include "MessageQueue.hpp"     // log file queueing functions
+#include "LogFormat.hpp"        // deferred printf() formatting
+#include "TraceFile.hpp"        // binary log files
 
 
 // Initialize the pointer to the one and only CLog instance ...
 CLog *CLog::m_pLog = NULL;
+//   And the per-thread logging level cache.  Note that the generation starts
+// at one, so that every thread's cache starts out invalid ...
+std::atomic<uint32_t> CLog::m_nLevelGeneration(1);
+THREAD_LOCAL CLog::SEVERITY CLog::m_lvlMyConsole = CLog::NOLOG;
+THREAD_LOCAL CLog::SEVERITY CLog::m_lvlMyFile = CLog::NOLOG;
+THREAD_LOCAL uint32_t CLog::m_nMyGeneration = 0;
 
 
 CLog::CLog (const char *pszProgram, CConsoleWindow *pConsole)
@@ -87,9 +95,10 @@ CLog::CLog (const char *pszProgram, CConsoleWindow *pConsole)
   m_pLog = this;
 
   // Initialize all the members ...
-  m_pLogFile = NULL;  m_sLogName.clear();  m_lvlFile = NOLOG;
+  m_pLogFile = NULL;  m_pTrace = NULL;  m_sLogName.clear();  m_lvlFile = NOLOG;
   m_mapConsoleLevel.clear();  m_mapFileLevel.clear();  m_setQueued.clear();
-  m_pQueue = DBGNEW CMessageQueue();
+  m_pQueue = DBGNEW CMessageQueue();  m_fDeferFormat = false;
+  ++m_nLevelGeneration;
 #ifdef _DEBUG
   m_lvlConsole = DEBUG;
 #else
@@ -142,13 +151,20 @@ void CLog::SetThreadQueued (bool fQueued, THREAD_ID idThread)
   //   If fQueued is TRUE, then add the thread ID to the set of queued threads.
   // If fQueued is FALSE, then remove the thread ID.  Either way, no errors
   // are ever returned...
+  //
+  //   Queued threads also get a private ring in the message queue, so they
+  // never have to compete with each other for space in the queue.  If we run
+  // out of rings the thread just shares the common ring instead, which is
+  // slower but works just the same ...
   //--
   if (idThread == 0) idThread = CThread::GetCurrentThreadID();
   if (fQueued) {
     m_setQueued.insert(idThread);
+    if (m_pQueue != NULL) m_pQueue->RegisterThread(idThread);
   } else {
     QUEUE_SET::iterator it = m_setQueued.find(idThread);
     if (it != m_setQueued.end()) m_setQueued.erase(it);
+    if (m_pQueue != NULL) m_pQueue->UnregisterThread(idThread);
   }
 }
 
@@ -173,7 +189,7 @@ void CLog::SetThreadConsoleLevel(SEVERITY nLevel, THREAD_ID idThread)
   // exist then we just change the existing level).
   //--
   if (idThread == 0) idThread = CThread::GetCurrentThreadID();
-  m_mapConsoleLevel[idThread] = nLevel;
+  m_mapConsoleLevel[idThread] = nLevel;  ++m_nLevelGeneration;
 }
 
 
@@ -183,7 +199,7 @@ void CLog::SetThreadFileLevel(SEVERITY nLevel, THREAD_ID idThread)
   // Ditto, but for the file log level instead ...
   //--
   if (idThread == 0) idThread = CThread::GetCurrentThreadID();
-  m_mapFileLevel[idThread] = nLevel;
+  m_mapFileLevel[idThread] = nLevel;  ++m_nLevelGeneration;
 }
 
 
@@ -223,6 +239,27 @@ void CLog::RemoveThreadLevels (THREAD_ID idThread)
   if (it != m_mapConsoleLevel.end()) m_mapConsoleLevel.erase(it);
   it = m_mapFileLevel.find(idThread);
   if (it != m_mapFileLevel.end()) m_mapFileLevel.erase(it);
+  ++m_nLevelGeneration;
+}
+
+
+void CLog::LoadThreadLevels() const
+{
+  //++
+  //   Make sure this thread's cached copy of its own logging levels is up to
+  // date.  Nearly all the time the generation hasn't changed and this costs
+  // one load and a compare.  Otherwise we have to search both maps again.
+  //
+  //   Notice that we remember the generation we saw BEFORE searching the
+  // maps - if somebody changes the levels while we're looking, then the
+  // generation changes again and the next call will catch it.
+  //--
+  uint32_t nGeneration = m_nLevelGeneration.load(std::memory_order_acquire);
+  if (m_nMyGeneration == nGeneration) return;
+  THREAD_ID idThread = CThread::GetCurrentThreadID();
+  m_lvlMyConsole = GetThreadConsoleLevel(idThread);
+  m_lvlMyFile = GetThreadFileLevel(idThread);
+  m_nMyGeneration = nGeneration;
 }
 
 
@@ -231,10 +268,11 @@ CLog::SEVERITY CLog::GetConsoleLevel() const
   //++
   //   This returns the current console message level.  This is either the 
   // thread specific level for this thread, if one is defined, or the default
-  // console level if no thread specific one exists.
+  // console level if no thread specific one exists.  This is called for
+  // every LOGx(), so it uses the cached thread level ...
   //--
-  SEVERITY lvl = GetThreadConsoleLevel();
-  return (lvl != NOLOG) ? lvl : GetDefaultConsoleLevel();
+  LoadThreadLevels();
+  return (m_lvlMyConsole != NOLOG) ? m_lvlMyConsole : GetDefaultConsoleLevel();
 }
 
 
@@ -243,8 +281,8 @@ CLog::SEVERITY CLog::GetFileLevel() const
   //++
   // Ditto, but for the current file message level ...
   //--
-  SEVERITY lvl = GetThreadFileLevel();
-  return (lvl != NOLOG) ? lvl : GetDefaultFileLevel();
+  LoadThreadLevels();
+  return (m_lvlMyFile != NOLOG) ? m_lvlMyFile : GetDefaultFileLevel();
 }
 
 
@@ -347,7 +385,7 @@ void CLog::StopLoggingThread()
 }
 
 
-bool CLog::OpenLog (const string &sFileName, SEVERITY nLevel, bool fAppend)
+bool CLog::OpenLog (const string &sFileName, SEVERITY nLevel, bool fAppend, bool fBinary)
 {
   //++
   //   This method opens a new log file and sets the default message level for
@@ -355,17 +393,26 @@ bool CLog::OpenLog (const string &sFileName, SEVERITY nLevel, bool fAppend)
   // instead.  Normally new text is appended to any existsing file, however
   // if fAppend is false then any existing log will be overwritten.  In either
   // case a new, empty, file will be created if one does not exist.
+  //
+  //   If fBinary is true then the log is written as a binary trace file (see
+  // TraceFile.cpp) rather than text.  That's a lot smaller and faster, but it
+  // has to be decoded by CTraceFile::Decode() before anybody can read it.
   //--
   if (IsLogFileOpen()) CloseLog();
   m_sLogName = sFileName.empty() ? GetDefaultLogFileName() : sFileName;
-  m_sLogName = CCmdParser::SetDefaultExtension(m_sLogName, ".log");
-  const char *pszMode = fAppend ? "a+t" : "w+t";
+  m_sLogName = CCmdParser::SetDefaultExtension(m_sLogName, fBinary ? ".trc" : ".log");
+  const char *pszMode = fBinary ? (fAppend ? "a+b" : "w+b") : (fAppend ? "a+t" : "w+t");
 //m_pLogFile = _fsopen(m_sLogName.c_str(), pszMode, _SH_DENYWR);
   int err = fopen_s(&m_pLogFile, m_sLogName.c_str(), pszMode);
   if (err != 0) {
     CMDERRS("error (" << errno << ") opening log " << m_sLogName);
     m_sLogName.clear();  return false;
   }
+  if (fBinary) {
+    TIMESTAMP tmNow;  GetTimeStamp(&tmNow);
+    m_pTrace = DBGNEW CTraceFile(m_pLogFile);
+    m_pTrace->WriteHeader(&tmNow);
+  }
   SetDefaultFileLevel(nLevel);
   LOGS(DEBUG, "log " << m_sLogName << " opened");
   if (CCheckpointFiles::IsEnabled())
@@ -384,6 +431,9 @@ void CLog::CloseLog()
   LOGS(DEBUG, "log " << m_sLogName << " closed");
   if (CCheckpointFiles::IsEnabled())
     CCheckpointFiles::GetCheckpoint()->RemoveFile(m_pLogFile);
+  if (m_pTrace != NULL) {
+    delete m_pTrace;  m_pTrace = NULL;
+  }
   fclose(m_pLogFile);
   m_pLogFile = NULL;  m_sLogName.clear();  SetDefaultFileLevel(NOLOG);
 }
@@ -410,8 +460,18 @@ void CLog::Print (SEVERITY nLevel, const char *pszFormat, ...)
   //   And this method does the work for the LOGF() macro - it sends printf()
   // formatted output to the console and/or log file.  This takes a tiny bit
   // more work than the I/O streams version ...
+  //
+  //   If deferred formatting is enabled and this thread is queued, then we
+  // don't format anything here.  The message queue just saves the format
+  // and the arguments, and the logging thread does the rest ...
   //--
   char szBuffer[MAXMSG];  va_list args;
+  if (m_fDeferFormat && IsLoggingThreadRunning() && IsThreadQueued()) {
+    va_start(args, pszFormat);
+    m_pQueue->AddDeferred(nLevel, pszFormat, args, IsLoggedToConsole(nLevel), IsLoggedToFile(nLevel));
+    va_end(args);
+    return;
+  }
   memset(szBuffer, 0, sizeof(szBuffer));
   va_start(args, pszFormat);
   vsprintf_s (szBuffer, sizeof(szBuffer), pszFormat, args);
@@ -434,6 +494,9 @@ void CLog::LogSingleLine (const TIMESTAMP *ptb, const string &sPrefix, const cha
   // message text shouldn't contain newlines!)
   //--
   if (!IsLogFileOpen()) return;
+  if (m_pTrace != NULL) {
+    m_pTrace->WriteText(ptb, sPrefix, pszText);  return;
+  }
   fprintf(m_pLogFile, "%s %s\t%s\n",
     TimeStampToString(ptb).c_str(),  sPrefix.c_str(), pszText);
 }
@@ -462,6 +525,25 @@ void CLog::SendLog (SEVERITY nLevel, const char *pszText, const TIMESTAMP *ptb)
 }
 
 
+void CLog::SendDeferred (SEVERITY nLevel, const char *pszFormat, const void *pArgs, size_t cbArgs, const TIMESTAMP *ptb)
+{
+  //++
+  //   This method sends a message that hasn't been formatted yet to the log
+  // file.  That only happens for deferred messages from the message queue,
+  // and pArgs and cbArgs are the arguments saved by CLogFormat.  A binary log
+  // saves the message as is, and otherwise we have to format it now ...
+  //--
+  if (!IsLogFileOpen()) return;
+  if (m_pTrace != NULL) {
+    m_pTrace->WriteMessage(ptb, LevelToString(nLevel), pszFormat, pArgs, cbArgs);
+  } else {
+    char szBuffer[MAXMSG];
+    CLogFormat::Format(pszFormat, pArgs, cbArgs, szBuffer, sizeof(szBuffer));
+    SendLog(nLevel, szBuffer, ptb);
+  }
+}
+
+
 void CLog::SendConsole (SEVERITY nLevel, const char *pszText)
 {
   //++
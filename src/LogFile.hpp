@@ -40,9 +40,11 @@
 #include <sstream>              // C++ std::stringstream, et al ...
 #include <unordered_set>        // C++ std::unordered_set (a simple list) template
 #include <unordered_map>        // C++ std::unordered_map (aka hash table) template
+#include <atomic>               // C++ std::atomic template
 #include "Thread.hpp"           // we need this for THREAD_ID, et al ...
 class CConsoleWindow;           // we need forward pointers for this class
 class CMessageQueue;            //  ... and this ...
+class CTraceFile;               //  ... and this one too ...
 using std::string;              // ...
 using std::ostream;             // ...
 using std::ostringstream;       // ...
@@ -50,6 +52,20 @@ using std::unordered_map;       // ...
 using std::unordered_set;       // ...
 #undef ERROR
 
+//   LOG_MIN_LEVEL is the lowest message level that's compiled into the
+// program at all.  ISLOGGED() (and hence all the LOGx() macros) compare the
+// message level against this first, and since both are constants any message
+// below this level simply vanishes - no code, no format strings, and no run
+// time test.  By default every build, release or debug, keeps everything -
+// TRACE messages are meant to be turned on in production (e.g. with SET
+// LOGGING) when there's a problem.  A build that really doesn't want them can
+// define LOG_MIN_LEVEL on the compiler command line (e.g. "-DLOG_MIN_LEVEL=
+// DEBUG").  Note that this is the name of one of the CLog::SEVERITY values,
+// without the "CLog::" ...
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL TRACE
+#endif
+
 
 // Clog class definition ...
 class CLog {
@@ -84,10 +100,10 @@ public:
   // message level, and that allows us to implement different logging levels
   // for each channel/MASSBUS/whatever thread.
   //
-  //   Oh, and yes, we could have implemented something like this using thread
-  // local storage.  That's harder in this case, though, because we have to
-  // resort to Windows specific TLS calls to determine whether a log level 
-  // has been set for the current thread or not...
+  //   Looking up the current thread in these maps for every LOGx() would be
+  // much too slow, so each thread keeps a copy of its own levels in thread
+  // local storage.  Any change to either map bumps m_nLevelGeneration, and
+  // that tells every thread to fetch its levels again ...
   typedef unordered_map<THREAD_ID, SEVERITY> THREAD_LEVEL;
 
   //   And the QUEUE_SET type implements a set of THREAD_IDs that have their
@@ -118,6 +134,8 @@ public:
   static CLog *GetLog() {assert(m_pLog != NULL);  return m_pLog;}
   // Return true if a log file is open ...
   bool IsLogFileOpen() const {return m_pLogFile != NULL;}
+  // Return TRUE if the log file is a binary trace file (see TraceFile.cpp) ...
+  bool IsBinaryLog() const {return m_pTrace != NULL;}
   // Return the current log file name ...
   string GetLogFileName() const
     {return IsLogFileOpen() ? m_sLogName : string();}
@@ -139,12 +157,20 @@ public:
   // Control whether this thread's messages are queued ...
   void SetThreadQueued(bool fQueued=true, THREAD_ID idThread=0);
   bool IsThreadQueued(THREAD_ID idThread=0) const;
+  //   Control whether LOGF() messages from queued threads are formatted by the
+  // logging thread (see MessageQueue.cpp).  Only turn this on if every LOGF()
+  // format string is a literal, because the logging thread uses it later ...
+  void SetDeferredFormat (bool fDefer=true) {m_fDeferFormat = fDefer;}
+  bool IsDeferredFormat() const {return m_fDeferFormat;}
   // Convert a log level to a string for messages ...
   static string LevelToString(SEVERITY nLevel);
 
   // Test a message level against the current logging level ...
   static bool IsLogged (SEVERITY msglvl, SEVERITY loglvl)
     {return ((msglvl <= CMDERR) || (msglvl >= loglvl));}
+  // Return true if messages of nLevel were compiled in (see LOG_MIN_LEVEL) ...
+  static bool IsCompiledIn (SEVERITY nLevel)
+    {return IsLogged(nLevel, LOG_MIN_LEVEL);}
   // Return true if a message of nLevel should be sent to the console ...
   bool IsLoggedToConsole (SEVERITY nLevel) const
     {return IsLogged(nLevel, GetConsoleLevel());}
@@ -164,7 +190,7 @@ public:
   // Public CLog methods ...
 public:
   // Open and close the log file ...
-  bool OpenLog (const string &sFileName = string(), SEVERITY nLevel=DEBUG, bool fAppend=true);
+  bool OpenLog (const string &sFileName = string(), SEVERITY nLevel=DEBUG, bool fAppend=true, bool fBinary=false);
   void CloseLog();
   // Do all the work of logging a message ...
   void Print (SEVERITY nLevel, ostringstream &osText);
@@ -173,6 +199,9 @@ public:
   void SendLog (SEVERITY nLevel, const char *pszText, const TIMESTAMP *ptb=NULL);
   void SendLog (SEVERITY nLevel, const string &sText, const TIMESTAMP *ptb=NULL)
     {SendLog(nLevel, sText.c_str(), ptb);}
+  //   Send a deferred message (see LogFormat.cpp) to the log file.  A binary
+  // log saves it unformatted, and a text log formats it first ...
+  void SendDeferred (SEVERITY nLevel, const char *pszFormat, const void *pArgs, size_t cbArgs, const TIMESTAMP *ptb);
   void SendConsole (SEVERITY nLevel, const char *pszText);
   void SendConsole (SEVERITY nLevel, const string &sText)
     {SendConsole(nLevel, sText.c_str());}
@@ -183,9 +212,14 @@ public:
   bool IsLoggingThreadRunning() const;
   bool StartLoggingThread();
   void StopLoggingThread();
+  //   Return the message queue, so the caller can change its overflow policy
+  // (see MessageQueue.hpp) ...
+  CMessageQueue *GetMessageQueue() const {return m_pQueue;}
 
   // Private CLog methods ...
 private:
+  // Refresh this thread's cached logging levels, if they've changed ...
+  void LoadThreadLevels() const;
   void LogSingleLine (const TIMESTAMP *ptb, const string &sPrefix, const char *pszText);
   void LogSingleLine (const TIMESTAMP *ptb, SEVERITY nLevel, const char *pszText)
     {LogSingleLine(ptb, LevelToString(nLevel), pszText);}
@@ -197,15 +231,24 @@ private:
   SEVERITY        m_lvlFile;      // deafult log file message level 
   string          m_sLogName;     // name of the current log file
   FILE           *m_pLogFile;     // handle of the log file
+  CTraceFile     *m_pTrace;       // binary trace file writer (or NULL)
   CConsoleWindow *m_pConsole;     // pointer to console window object
   CMessageQueue  *m_pQueue;       // pointer to message queue object
   QUEUE_SET       m_setQueued;    // set of threads which are queued
+  bool            m_fDeferFormat; // TRUE to format queued LOGF()s later
   THREAD_LEVEL m_mapFileLevel;    // per-thread file logging levels
   THREAD_LEVEL m_mapConsoleLevel; // per-thread console logging levels
 
   // Static data ...
 private:
   static CLog    *m_pLog;         // a pointer to the one and only CLog instance
+  static std::atomic<uint32_t> m_nLevelGeneration; // bumped when levels change
+  //   These are this thread's copy of its own entries in m_mapConsoleLevel
+  // and m_mapFileLevel (NOLOG if it has none), and the generation they were
+  // loaded from.  A generation of zero means they've never been loaded ...
+  static THREAD_LOCAL SEVERITY m_lvlMyConsole;
+  static THREAD_LOCAL SEVERITY m_lvlMyFile;
+  static THREAD_LOCAL uint32_t m_nMyGeneration;
 };
 
 
@@ -213,7 +256,8 @@ private:
 // appear in any log (console or file).  It's used by the LOGx macros, and it
 // can be used directly in the code (e.g. in DumpData()) as an efficiency
 // optimization...
-#define ISLOGGED(lvl) (CLog::GetLog()->IsLogged(CLog::lvl))
+#define ISLOGGED(lvl) \
+  (CLog::IsCompiledIn(CLog::lvl) && CLog::GetLog()->IsLogged(CLog::lvl))
 
 //   These macros send output to the log and ultimately should be used for
 // ALL output.  That means printf()/fprintf() and/or cout/cerr should never
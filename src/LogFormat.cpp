@@ -0,0 +1,370 @@
+//++
+// LogFormat.cpp -> deferred printf() formatting for log messages
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the UPE LIBRARY project.  UPELIB is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    UPELIB is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   Even when a LOGF() message is queued for the background logging thread,
+// the thread that logged it still has to call vsprintf() to format it, and
+// that's most of the cost of logging a message.  The methods in this module
+// let us put that off.  SaveArguments() walks the format string and copies
+// each argument from the va_list into a buffer, along with a one byte code
+// for its type.  That's just enough to find the arguments again later, and
+// it's a lot cheaper than actually formatting them.  Later, Format() walks
+// the same format string again and formats the arguments one at a time with
+// snprintf().
+//
+//   Obviously the format string has to still be there when the message is
+// finally formatted, and that's fine for a string literal (which every LOGF()
+// call in the library uses).  It's not fine for a format that's built on the
+// fly, and that's why deferred formatting is something you have to ask for
+// (see CLog::SetDeferredFormat()).  String arguments, on the other hand, are
+// always copied since the caller's buffer may be long gone.
+//
+//   Integer arguments are saved after they've been converted to the size the
+// length modifier asks for, and all the 64 bit types (long long, size_t, and
+// so on) are saved as the same thing.  When the message is formatted, the
+// length modifier is replaced with "ll" or removed, as the case may be, so
+// it all comes out the same in the end.  A long double is saved as a double,
+// which might lose a little precision, but nobody logs those anyway.  There
+// are a few things we can't save - "%n", wide characters and wide strings -
+// and for those SaveArguments() gives up and the caller just formats the
+// message right away, the old fashioned way.
+//
+// REVISION HISTORY:
+// 16-OCT-26        New file.
+//--
+//000000001111111111222222222233333333334444444444555555555566666666667777777777
+//234567890123456789012345678901234567890123456789012345678901234567890123456789
+#include <stdlib.h>             // exit(), system(), etc ...
+#include <stdint.h>	        // uint8_t, uint32_t, etc ...
+#include <stddef.h>             // size_t, ptrdiff_t, etc ...
+#include <stdio.h>              // snprintf(), et al ...
+#include <stdarg.h>             // va_list, va_arg(), et al ...
+#include <assert.h>             // assert() (what else??)
+#include <string.h>             // strchr(), memcpy(), etc ...
+#include "UPELIB.hpp"           // global declarations for this library
+#include "LogFormat.hpp"        // declarations for this class
+
+
+const char *CLogFormat::ParseSpec (const char *psz, SPEC &spec)
+{
+  //++
+  //   Parse one printf() conversion specification.  psz points to the first
+  // character AFTER the "%" and, if all goes well, we return a pointer to
+  // the first character after the specification.  If the specification is
+  // something we can't save (or isn't valid at all) then NULL is returned.
+  //--
+  spec.pszFlags = psz;  spec.nStars = 0;
+  while ((*psz != 0) && (strchr("-+ #0'", *psz) != NULL)) ++psz;
+  if (*psz == '*') {
+    ++spec.nStars;  ++psz;
+  } else {
+    while ((*psz >= '0') && (*psz <= '9')) ++psz;
+  }
+  if (*psz == '.') {
+    ++psz;
+    if (*psz == '*') {
+      ++spec.nStars;  ++psz;
+    } else {
+      while ((*psz >= '0') && (*psz <= '9')) ++psz;
+    }
+  }
+  spec.cbFlags = psz - spec.pszFlags;
+
+  // Figure out the length modifier, if any ...
+  spec.nLength = LEN_NONE;
+  switch (*psz) {
+    case 'h': ++psz;  spec.nLength = LEN_SHORT;
+              if (*psz == 'h') {++psz;  spec.nLength = LEN_CHAR;}
+              break;
+    case 'l': ++psz;  spec.nLength = LEN_LONG;
+              if (*psz == 'l') {++psz;  spec.nLength = LEN_LONGLONG;}
+              break;
+    case 'q': ++psz;  spec.nLength = LEN_LONGLONG;    break;
+    case 'L': ++psz;  spec.nLength = LEN_LONGDOUBLE;  break;
+    case 'z': ++psz;  spec.nLength = LEN_SIZE;        break;
+    case 'j': ++psz;  spec.nLength = LEN_INTMAX;      break;
+    case 't': ++psz;  spec.nLength = LEN_PTRDIFF;     break;
+    case 'I': ++psz;  spec.nLength = LEN_SIZE;
+              if ((psz[0] == '6') && (psz[1] == '4')) {psz += 2;  spec.nLength = LEN_LONGLONG;}
+              else if ((psz[0] == '3') && (psz[1] == '2')) {psz += 2;  spec.nLength = LEN_INT32;}
+              break;
+  }
+
+  // And lastly the conversion itself ...
+  spec.chConversion = *psz;
+  switch (spec.chConversion) {
+    case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+      if (spec.nLength == LEN_LONGDOUBLE) return NULL;
+      spec.nType = ((spec.nLength == LEN_NONE) || (spec.nLength == LEN_CHAR)
+                 || (spec.nLength == LEN_SHORT) || (spec.nLength == LEN_INT32))
+                 ? ARG_INT32 : ARG_INT64;
+      break;
+    case 'c':
+      if (spec.nLength != LEN_NONE) return NULL;
+      spec.nType = ARG_INT32;  break;
+    case 'e': case 'E': case 'f': case 'F':
+    case 'g': case 'G': case 'a': case 'A':
+      if ((spec.nLength != LEN_NONE) && (spec.nLength != LEN_LONG)
+       && (spec.nLength != LEN_LONGDOUBLE)) return NULL;
+      spec.nType = ARG_DOUBLE;  break;
+    case 'p':
+      if (spec.nLength != LEN_NONE) return NULL;
+      spec.nType = ARG_POINTER;  break;
+    case 's':
+      if (spec.nLength != LEN_NONE) return NULL;
+      spec.nType = ARG_STRING;  break;
+    default:
+      // "%n", "%S", "%C" and anything we've never heard of ...
+      return NULL;
+  }
+  return psz+1;
+}
+
+
+bool CLogFormat::PutArgument (uint8_t *pabArgs, size_t cbArgs, size_t &nOffset, ARG_TYPE nType, const void *pValue, size_t cbValue)
+{
+  //++
+  //   Add one argument, type code first, to the buffer.  Returns false if
+  // there isn't room for it ...
+  //--
+  if (nOffset+1+cbValue > cbArgs) return false;
+  pabArgs[nOffset++] = (uint8_t) nType;
+  if (cbValue > 0) memcpy(pabArgs+nOffset, pValue, cbValue);
+  nOffset += cbValue;
+  return true;
+}
+
+
+size_t CLogFormat::SaveArguments (const char *pszFormat, va_list args, void *pArgs, size_t cbArgs)
+{
+  //++
+  //   Walk thru the format string and save every argument it uses, and then
+  // an ARG_END.  Return the number of bytes used, or zero if there's some
+  // argument we can't save or they don't all fit.
+  //--
+  assert((pszFormat != NULL) && (pArgs != NULL));
+  uint8_t *pabArgs = (uint8_t *) pArgs;  size_t nOffset = 0;
+  const char *psz = pszFormat;
+  while (*psz != 0) {
+    if (*psz++ != '%') continue;
+    if (*psz == '%') {++psz;  continue;}
+    SPEC spec;
+    if ((psz = ParseSpec(psz, spec)) == NULL) return 0;
+
+    // Save any "*" widths and precisions first ...
+    for (int i = 0;  i < spec.nStars;  ++i) {
+      int32_t lWidth = va_arg(args, int);
+      if (!PutArgument(pabArgs, cbArgs, nOffset, ARG_INT32, &lWidth, sizeof(lWidth))) return 0;
+    }
+
+    // And then the value itself ...
+    bool fSigned = (spec.chConversion == 'd') || (spec.chConversion == 'i');
+    int64_t llValue;  int32_t lValue;  double dValue;
+    switch (spec.nType) {
+      case ARG_INT32:
+        lValue = va_arg(args, int);
+        if (spec.nLength == LEN_CHAR)
+          lValue = fSigned ? (int32_t) (signed char) lValue : (int32_t) (unsigned char) lValue;
+        else if (spec.nLength == LEN_SHORT)
+          lValue = fSigned ? (int32_t) (short) lValue : (int32_t) (unsigned short) lValue;
+        if (!PutArgument(pabArgs, cbArgs, nOffset, ARG_INT32, &lValue, sizeof(lValue))) return 0;
+        break;
+
+      case ARG_INT64:
+        switch (spec.nLength) {
+          case LEN_LONG:
+            llValue = fSigned ? (int64_t) va_arg(args, long) : (int64_t) va_arg(args, unsigned long);
+            break;
+          case LEN_SIZE:
+            llValue = fSigned ? (int64_t) (ptrdiff_t) va_arg(args, size_t) : (int64_t) va_arg(args, size_t);
+            break;
+          case LEN_INTMAX:
+            llValue = fSigned ? (int64_t) va_arg(args, intmax_t) : (int64_t) va_arg(args, uintmax_t);
+            break;
+          case LEN_PTRDIFF:
+            llValue = (int64_t) va_arg(args, ptrdiff_t);
+            break;
+          default:
+            llValue = fSigned ? (int64_t) va_arg(args, long long) : (int64_t) va_arg(args, unsigned long long);
+            break;
+        }
+        if (!PutArgument(pabArgs, cbArgs, nOffset, ARG_INT64, &llValue, sizeof(llValue))) return 0;
+        break;
+
+      case ARG_DOUBLE:
+        dValue = (spec.nLength == LEN_LONGDOUBLE) ? (double) va_arg(args, long double) : va_arg(args, double);
+        if (!PutArgument(pabArgs, cbArgs, nOffset, ARG_DOUBLE, &dValue, sizeof(dValue))) return 0;
+        break;
+
+      case ARG_POINTER:
+        llValue = (int64_t) (uintptr_t) va_arg(args, void *);
+        if (!PutArgument(pabArgs, cbArgs, nOffset, ARG_POINTER, &llValue, sizeof(llValue))) return 0;
+        break;
+
+      case ARG_STRING:
+        {
+          const char *pszString = va_arg(args, const char *);
+          if (pszString == NULL) {
+            if (!PutArgument(pabArgs, cbArgs, nOffset, ARG_NULLSTRING, NULL, 0)) return 0;
+            break;
+          }
+          //   Leave room for the type, the length and at least the ARG_END.  If
+          // the string won't fit then give up, rather than truncating it where
+          // vsprintf() wouldn't have ...
+          size_t cbString = strlen(pszString);
+          if ((cbString > UINT16_MAX) || (nOffset+4+cbString > cbArgs)) return 0;
+          uint16_t wLength = (uint16_t) cbString;
+          pabArgs[nOffset++] = (uint8_t) ARG_STRING;
+          memcpy(pabArgs+nOffset, &wLength, sizeof(wLength));  nOffset += sizeof(wLength);
+          memcpy(pabArgs+nOffset, pszString, cbString);  nOffset += cbString;
+        }
+        break;
+
+      default:
+        return 0;
+    }
+  }
+  if (!PutArgument(pabArgs, cbArgs, nOffset, ARG_END, NULL, 0)) return 0;
+  return nOffset;
+}
+
+
+CLogFormat::ARG_TYPE CLogFormat::NextArgument (const void *pArgs, size_t cbArgs, size_t &nOffset, uint64_t &llValue, const char *&pszString, size_t &cbString)
+{
+  //++
+  //   Return the next saved argument and advance nOffset past it.  ARG_INT32
+  // values are sign extended to 64 bits.  If we run off the end of the buffer
+  // (which shouldn't happen!) then ARG_END is returned ...
+  //--
+  const uint8_t *pabArgs = (const uint8_t *) pArgs;
+  llValue = 0;  pszString = NULL;  cbString = 0;
+  if (nOffset >= cbArgs) return ARG_END;
+  ARG_TYPE nType = (ARG_TYPE) pabArgs[nOffset];
+  size_t nNext = nOffset+1;
+  int32_t lValue;  uint16_t wLength;
+  switch (nType) {
+    case ARG_INT32:
+      if (nNext+sizeof(lValue) > cbArgs) return ARG_END;
+      memcpy(&lValue, pabArgs+nNext, sizeof(lValue));
+      llValue = (uint64_t) (int64_t) lValue;  nNext += sizeof(lValue);
+      break;
+    case ARG_INT64:
+    case ARG_DOUBLE:
+    case ARG_POINTER:
+      if (nNext+sizeof(llValue) > cbArgs) return ARG_END;
+      memcpy(&llValue, pabArgs+nNext, sizeof(llValue));  nNext += sizeof(llValue);
+      break;
+    case ARG_STRING:
+      if (nNext+sizeof(wLength) > cbArgs) return ARG_END;
+      memcpy(&wLength, pabArgs+nNext, sizeof(wLength));  nNext += sizeof(wLength);
+      if (nNext+wLength > cbArgs) return ARG_END;
+      pszString = (const char *) (pabArgs+nNext);  cbString = wLength;
+      nNext += wLength;
+      break;
+    case ARG_NULLSTRING:
+      break;
+    default:
+      return ARG_END;
+  }
+  nOffset = nNext;
+  return nType;
+}
+
+
+size_t CLogFormat::Format (const char *pszFormat, const void *pArgs, size_t cbArgs, char *pszText, size_t cbText)
+{
+  //++
+  //   Format a message from the format string and the arguments saved by
+  // SaveArguments().  Literal text is just copied, and each conversion is
+  // rebuilt (with any "*" replaced by its value and the length modifier
+  // fixed up to match the saved argument) and given to snprintf() along with
+  // its argument.  The result is truncated if it doesn't fit, just as
+  // vsprintf_s() would, and the length of the result is returned.
+  //
+  //   The arguments don't always come from SaveArguments() with this very
+  // format string - a trace file might have been written by some other
+  // version of the program, or be damaged - so every argument's type is
+  // checked against the conversion before it goes anywhere near snprintf().
+  // A string conversion takes either a string or a NULL, and any other
+  // mismatch (including a "*" that isn't an int) prints "(?)" instead.  If
+  // the arguments run out then that's where the message ends ...
+  //--
+  assert((pszFormat != NULL) && (pszText != NULL) && (cbText > 0));
+  size_t nText = 0, nOffset = 0;
+  const char *psz = pszFormat;
+  while ((*psz != 0) && (nText < cbText-1)) {
+    if (*psz != '%') {pszText[nText++] = *psz++;  continue;}
+    ++psz;
+    if (*psz == '%') {pszText[nText++] = '%';  ++psz;  continue;}
+    SPEC spec;
+    if ((psz = ParseSpec(psz, spec)) == NULL) break;
+
+    //   Rebuild the conversion, replacing any "*" with the saved value.  The
+    // flags, width and precision are never very long, but be careful ...
+    char szSpec[64];  size_t nSpec = 0;  uint64_t llValue;
+    const char *pszString;  size_t cbString;
+    ARG_TYPE nType = ARG_INT32;  bool fMismatch = false;
+    szSpec[nSpec++] = '%';
+    for (size_t i = 0;  (i < spec.cbFlags) && (nSpec < sizeof(szSpec)-16);  ++i) {
+      if (spec.pszFlags[i] == '*') {
+        nType = NextArgument(pArgs, cbArgs, nOffset, llValue, pszString, cbString);
+        if (nType == ARG_END) break;
+        if (nType != ARG_INT32) fMismatch = true;
+        nSpec += snprintf(szSpec+nSpec, sizeof(szSpec)-nSpec, "%d", (int) (int64_t) llValue);
+      } else
+        szSpec[nSpec++] = spec.pszFlags[i];
+    }
+    if (nType == ARG_END) break;
+    if (spec.nType == ARG_INT64) {szSpec[nSpec++] = 'l';  szSpec[nSpec++] = 'l';}
+    szSpec[nSpec++] = spec.chConversion;  szSpec[nSpec] = 0;
+
+    // Now get the argument and make sure it's what the conversion wants ...
+    nType = NextArgument(pArgs, cbArgs, nOffset, llValue, pszString, cbString);
+    if (nType == ARG_END) break;
+    if ((nType != spec.nType) && !((spec.nType == ARG_STRING) && (nType == ARG_NULLSTRING)))
+      fMismatch = true;
+
+    // And format it ...
+    char *pszOut = pszText+nText;  size_t cbOut = cbText-nText;
+    int nCount = 0;  double dValue;  char szString[256];
+    if (fMismatch)
+      nCount = snprintf(pszOut, cbOut, "%s", "(?)");
+    else switch (nType) {
+      case ARG_INT32:
+        nCount = snprintf(pszOut, cbOut, szSpec, (int) (int64_t) llValue);  break;
+      case ARG_INT64:
+        nCount = snprintf(pszOut, cbOut, szSpec, (long long) llValue);  break;
+      case ARG_DOUBLE:
+        memcpy(&dValue, &llValue, sizeof(dValue));
+        nCount = snprintf(pszOut, cbOut, szSpec, dValue);  break;
+      case ARG_POINTER:
+        nCount = snprintf(pszOut, cbOut, szSpec, (void *) (uintptr_t) llValue);  break;
+      case ARG_STRING:
+        cbString = MIN(cbString, sizeof(szString)-1);
+        memcpy(szString, pszString, cbString);  szString[cbString] = 0;
+        nCount = snprintf(pszOut, cbOut, szSpec, szString);  break;
+      case ARG_NULLSTRING:
+        nCount = snprintf(pszOut, cbOut, szSpec, "(null)");  break;
+      default:
+        break;
+    }
+    if (nCount > 0) nText += MIN((size_t) nCount, cbOut-1);
+  }
+  pszText[nText] = 0;
+  return nText;
+}
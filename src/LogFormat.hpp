@@ -0,0 +1,111 @@
+//++
+// LogFormat.hpp -> CLogFormat (deferred printf() formatting) class
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the UPE LIBRARY project.  UPELIB is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    UPELIB is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   CLogFormat saves the arguments of a printf() style call in a compact
+// binary form, so that the actual formatting can be done later by some other
+// thread.  It's used by the message queue for deferred LOGF() messages.  See
+// LogFormat.cpp for the details.
+//
+// REVISION HISTORY:
+// 16-OCT-26        New file.
+//--
+#pragma once
+#include <stdint.h>             // uint8_t, uint64_t, etc ...
+#include <stdarg.h>             // va_list, va_start(), et al ...
+
+
+class CLogFormat {
+  //++
+  //--
+
+  //   Every argument saved starts with one of these type codes, and then its
+  // value.  Integers are saved already converted to their printf() size (so
+  // "%hhx" saves a char), and all the various 64 bit types end up as just
+  // ARG_INT64.  Strings are saved as a two byte length followed by the text,
+  // without any terminating null ...
+public:
+  enum ARG_TYPE {
+    ARG_END,                    // no more arguments
+    ARG_INT32,                  // int, short or char (4 bytes)
+    ARG_INT64,                  // long, long long, size_t, etc (8 bytes)
+    ARG_DOUBLE,                 // float, double or long double (8 bytes)
+    ARG_POINTER,                // void * (8 bytes)
+    ARG_STRING,                 // char * (2 byte length + text)
+    ARG_NULLSTRING,             // NULL char * (no value)
+  };
+
+  // The printf() length modifiers we understand ...
+protected:
+  enum LENGTH {
+    LEN_NONE,                   // no length modifier at all
+    LEN_CHAR,                   // "hh"
+    LEN_SHORT,                  // "h"
+    LEN_LONG,                   // "l"
+    LEN_LONGLONG,               // "ll" (or "q", or Microsoft's "I64")
+    LEN_LONGDOUBLE,             // "L"
+    LEN_SIZE,                   // "z" (or Microsoft's "I")
+    LEN_INTMAX,                 // "j"
+    LEN_PTRDIFF,                // "t"
+    LEN_INT32,                  // Microsoft's "I32"
+  };
+
+  //   This is everything we learn from one conversion specification in the
+  // format string.  A width or precision of "*" takes an int argument of its
+  // own, before the value itself ...
+  struct _SPEC {
+    const char *pszFlags;       // the flags, width and precision
+    size_t      cbFlags;        // ... and how long they are
+    int         nStars;         // number of "*" widths and precisions
+    char        chConversion;   // the conversion character (d, x, s, etc)
+    ARG_TYPE    nType;          // the type of argument it takes
+    LENGTH      nLength;        // the length modifier
+  };
+  typedef struct _SPEC SPEC;
+
+  // This class has only static members ...
+private:
+  CLogFormat() = delete;
+
+  // Public methods ...
+public:
+  //   Save the arguments for pszFormat in pArgs and return the number of
+  // bytes used.  Zero means that something in the format can't be saved (a
+  // "%n" or a wide string, for example) and it'll have to be formatted now
+  // instead.  The va_list is used up either way ...
+  static size_t SaveArguments (const char *pszFormat, va_list args, void *pArgs, size_t cbArgs);
+  //   Format the message using the arguments saved by SaveArguments(), and
+  // return the length of the result (which is always null terminated).  An
+  // argument of the wrong type is printed as "(?)", and the message stops
+  // wherever the arguments run out ...
+  static size_t Format (const char *pszFormat, const void *pArgs, size_t cbArgs, char *pszText, size_t cbText);
+  //   Step thru the saved arguments one at a time.  NextArgument() returns
+  // ARG_END when there are no more, and otherwise it returns the type and
+  // fills in either the value (for ARG_DOUBLE, the bits of the double) or the
+  // string (which isn't null terminated!) ...
+  static ARG_TYPE NextArgument (const void *pArgs, size_t cbArgs, size_t &nOffset, uint64_t &llValue, const char *&pszString, size_t &cbString);
+  //   Add one argument to the saved arguments, and return false if there's
+  // no room.  This is only needed to rebuild arguments saved somewhere else
+  // (e.g. in a trace file) - SaveArguments() normally does all the work ...
+  static bool PutArgument (uint8_t *pabArgs, size_t cbArgs, size_t &nOffset, ARG_TYPE nType, const void *pValue, size_t cbValue);
+
+  // Local methods ...
+protected:
+  // Parse the conversion specification that starts at psz ...
+  static const char *ParseSpec (const char *psz, SPEC &spec);
+};
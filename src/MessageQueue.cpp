@@ -25,20 +25,56 @@
 // logging them in the background helps, although it doesn't completely fix
 // the problem.
 //
-//    We could use one of the nifty STL classes to implement our queue, but
-// there's really no need.  We use a simple structure, QENTRY, to hold each
-// message and singly linked list  to implement the FIFO. The member variable
-// m_pQueueHead points to the first message to remove (i.e. the oldest entry
-// in the queue) and m_pQueueTail points to the most recent queue entry. Adding
-// and removing entries takes just a tiny bit of pointer prestidigitation.
+//   The queue is a fixed size ring of QENTRY structures, allocated once by
+// the constructor, and any number of threads can add messages to it without
+// ever taking a lock.  That matters because the whole point of the queue is
+// to keep the time critical threads from waiting, and two mutexes per message
+// (one for the queue and one for a free list, which is what we used to have)
+// were a lot of waiting.  The scheme is the usual bounded queue with a
+// sequence number in every entry.  m_nAddPosition and m_nRemovePosition count
+// up forever, and position n lives in entry n modulo the queue size.  An
+// entry whose nSequence equals n is free and ready for position n to be added.
+// A thread adding a message claims the position with a compare and swap on
+// m_nAddPosition, fills in the entry, and then sets nSequence to n+1.  That
+// means "ready to remove", and removing works the same way - claim position n
+// from m_nRemovePosition, use the entry, and then set nSequence to n plus the
+// queue size so that it's ready for the next trip around the ring.
 //
-//   We keep a free list of unused QENTRY nodes so that we don't have to call
-// new and delete for every message.  When we need a new QENTRY we first check
-// the free list for one and, if none are free, only then do we allocate one.
-// We NEVER (well, almost never) call delete - free entries are simply put on
-// the free list.  That's a bit wasteful, but there's plenty of memory to go
-// around.  The only time delete is called is by the class destructor, so that
-// all memory is eventually returned.
+//   Normally only the logging thread removes entries, but removing works for
+// any number of threads and that's how OVERFLOW_DROP_OLDEST is done.  When
+// the queue is full, a thread adding a message just removes the oldest one
+// itself and throws it away.  With OVERFLOW_DROP_NEWEST the new message is
+// thrown away instead, and OVERFLOW_BLOCK waits for the logging thread to make
+// room.  Either way, the logging thread logs a warning with the number of
+// messages lost.  The logging thread never blocks on its own queue, though -
+// it would wait forever.
+//
+//   Even without a lock, every thread adding to the shared ring still fights
+// over m_nAddPosition, and with a dozen or more channel threads all tracing
+// at once that cache line never stays put.  So a queued thread (see CLog::
+// SetThreadQueued()) gets a private ring of its own.  Only that thread adds
+// to it and only the logging thread removes from it, so there's no compare
+// and swap and nothing shared with any other producer at all.  Each message
+// is stamped with a high resolution time when it's queued, and the logging
+// thread always takes the oldest message from the front of all the rings
+// (shared one included) so they still come out in the order they were logged.
+// OVERFLOW_DROP_OLDEST can't work on a private ring, since only the logging
+// thread may remove from it, so there it drops the newest message instead.
+//
+//   Formatting a LOGF() message costs a lot more than queueing it, so if CLog
+// is asked to (see CLog::SetDeferredFormat()) it calls AddDeferred() instead
+// of formatting the message itself.  That saves just the format string pointer
+// and the raw arguments in the entry's text buffer, and the logging thread
+// formats the message when it takes it out of the queue.  If the log file is
+// a binary trace file, then the message isn't formatted at all - it goes to
+// the file as is, and it's formatted when the file is decoded.
+//
+//   Waking up the logging thread (raising its CThread flag) is a system call,
+// so we only do that when the logging thread is actually asleep.  It sets
+// m_fWaiting before it checks the queue one last time and goes to sleep, and
+// a thread that adds a message checks m_fWaiting after the message is in the
+// queue.  Between the two of them, one always sees the other.  And if that
+// ever goes wrong, the logging thread only sleeps for 100ms anyway.
 //
 // Bob Armstrong <bob@jfcl.com>   [14-DEC-2015]
 //
@@ -53,26 +89,45 @@
 #include <stdint.h>	        // uint8_t, uint32_t, etc ...
 #include <assert.h>             // assert() (what else??)
 #include <string.h>             // strcpy(), memset(), strerror(), etc ...
+#include <stdio.h>              // vsnprintf(), et al ...
+#include <stdarg.h>             // va_list, va_copy(), et al ...
 #include <sys/timeb.h>          // struct __timeb, ftime(), etc ...
 #ifdef _WIN32
 #include <wtypes.h>             // Windows types for WaitForSingleObject() ... 
+#include <Windows.h>            // QueryPerformanceCounter(), et al ...
 #elif __linux__
+#include <time.h>               // clock_gettime(), struct timespec, ...
 #endif
 #include "Mutex.hpp"            // CMutex critical section lock
 #include "Thread.hpp"           // CThread portable thread library
 #include "SafeCRT.h"		// replacements for Microsoft "safe" CRT functions
 #include "UPELIB.hpp"           // global declarations for this library
 #include "LogFile.hpp"          // file and console logging methods
+#include "LogFormat.hpp"        // deferred printf() formatting
 #include "MessageQueue.hpp"     // declarations for this class
 
+// Static members ...
+std::atomic<uint32_t> CMessageQueue::m_nInstances(0);
+THREAD_LOCAL CMessageQueue::THREAD_RING *CMessageQueue::m_pMyRing = NULL;
+THREAD_LOCAL uint32_t CMessageQueue::m_nMyInstance = 0;
+THREAD_LOCAL uint32_t CMessageQueue::m_nMyRings = 0;
+
 
-CMessageQueue::CMessageQueue()
+CMessageQueue::CMessageQueue (uint32_t nEntries)
   : m_LoggingThread(&CMessageQueue::LoggingThread, "message logging", 0, 1)
 {
   //++
-  // Initialize all member variables ...
+  //   Allocate the ring and mark every entry free for its first position ...
   //--
-  m_pQueueHead = m_pQueueTail = m_pFreeList = NULL;  m_nQueueEntries = 0;
+  assert((nEntries >= 2) && ((nEntries & (nEntries-1)) == 0));
+  m_pRing = DBGNEW QENTRY[nEntries];  m_nMask = nEntries-1;
+  for (uint32_t i = 0;  i < nEntries;  ++i)
+    m_pRing[i].nSequence.store(i, std::memory_order_relaxed);
+  m_nAddPosition.store(0);  m_nRemovePosition.store(0);
+  m_fWaiting.store(false);  m_llDropped.store(0);
+  m_nPolicy = OVERFLOW_BLOCK;
+  memset(m_apRings, 0, sizeof(m_apRings));  m_nRings.store(0);
+  m_nInstance = ++m_nInstances;
   m_LoggingThread.SetParameter(this);
 }
 
@@ -80,48 +135,236 @@ CMessageQueue::CMessageQueue()
 CMessageQueue::~CMessageQueue()
 {
   //++
-  //   Dispose of this object, being sure to delete any entries on either the
-  // message queue or the free list.
+  //   Dispose of this object.  Any messages still in the queue are lost, but
+  // the logging thread empties it before it stops ...
   //--
   EndLoggingThread();
-  while (m_pQueueHead != NULL) {
-    QENTRY *p = m_pQueueHead;  m_pQueueHead = p->pNext;  delete p;
+  delete[] m_pRing;
+  for (uint32_t i = 0;  i < m_nRings.load();  ++i) {
+    delete[] m_apRings[i]->pEntries;  delete m_apRings[i];
+  }
+}
+
+
+uint64_t CMessageQueue::GetTicks()
+{
+  //++
+  //   Return a high resolution, monotonic, time.  The units don't matter -
+  // all we ever do with these is to compare them ...
+  //--
+#ifdef _WIN32
+  LARGE_INTEGER liNow;
+  QueryPerformanceCounter(&liNow);
+  return (uint64_t) liNow.QuadPart;
+#elif __linux__
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t) ts.tv_sec * 1000000000ULL) + (uint64_t) ts.tv_nsec;
+#endif
+}
+
+
+bool CMessageQueue::RegisterThread (THREAD_ID idThread)
+{
+  //++
+  //   Give a thread its own private ring.  If the thread already had one (it
+  // was registered before, or its thread ID has been reused) then it just
+  // gets that one back.  Otherwise a new ring is allocated and added to the
+  // end of m_apRings, which is safe even with the logging thread looking at
+  // it because nobody looks past m_nRings.  If all the rings are taken, the
+  // thread just keeps using the shared ring and we return false ...
+  //--
+  if (idThread == 0) idThread = CThread::GetCurrentThreadID();
+  m_RingLock.Enter();
+  uint32_t nRings = m_nRings.load(std::memory_order_relaxed);
+  for (uint32_t i = 0;  i < nRings;  ++i) {
+    if (m_apRings[i]->idThread == idThread) {
+      m_apRings[i]->fActive.store(true);  m_RingLock.Leave();  return true;
+    }
   }
-  while (m_pFreeList != NULL) {
-    QENTRY *p = m_pFreeList;  m_pFreeList = p->pNext;  delete p;
+  if (nRings >= MAXRINGS) {
+    m_RingLock.Leave();  return false;
   }
+  THREAD_RING *pRing = DBGNEW THREAD_RING;
+  pRing->idThread = idThread;  pRing->nMask = THREAD_ENTRIES-1;
+  pRing->pEntries = DBGNEW QENTRY[THREAD_ENTRIES];
+  pRing->nAddPosition.store(0);  pRing->nRemovePosition.store(0);
+  pRing->fActive.store(true);
+  m_apRings[nRings] = pRing;
+  m_nRings.store(nRings+1, std::memory_order_release);
+  m_RingLock.Leave();
+  return true;
 }
 
 
-CMessageQueue::QENTRY *CMessageQueue::NewEntry()
+void CMessageQueue::UnregisterThread (THREAD_ID idThread)
 {
   //++
-  //   This method creates a new queue entry and zeros it out.  If there's
-  // already an entry on the free list, then we can save ourselves a lot
-  // of time by just using that one.  If the free list is empty, though,
-  // then we'll allocate space for a brand new entry.
+  //   Make a thread go back to using the shared ring.  Its private ring stays
+  // around (the logging thread still has to empty it, and the thread might
+  // be in the middle of adding to it right now!) but won't be used again
+  // unless the thread is registered again ...
   //--
-  QENTRY *p;
-  m_FreeLock.Enter();
-  if (m_pFreeList != NULL) {
-    p = m_pFreeList;  m_pFreeList = p->pNext;
-    m_FreeLock.Leave();
-  } else {
-    m_FreeLock.Leave();
-    p = DBGNEW QENTRY;  ++m_nQueueEntries;
+  if (idThread == 0) idThread = CThread::GetCurrentThreadID();
+  m_RingLock.Enter();
+  uint32_t nRings = m_nRings.load(std::memory_order_relaxed);
+  for (uint32_t i = 0;  i < nRings;  ++i) {
+    if (m_apRings[i]->idThread == idThread) m_apRings[i]->fActive.store(false);
+  }
+  m_RingLock.Leave();
+}
+
+
+CMessageQueue::THREAD_RING *CMessageQueue::FindRing()
+{
+  //++
+  //   Return the current thread's private ring, or NULL if it doesn't have
+  // one (or isn't registered any more).  The answer is remembered in thread
+  // local storage, so we only have to search when this thread hasn't looked
+  // at this queue before, or when more rings have been added since it did ...
+  //--
+  uint32_t nRings = m_nRings.load(std::memory_order_acquire);
+  if ((m_nMyInstance != m_nInstance)  ||  ((m_pMyRing == NULL) && (m_nMyRings != nRings))) {
+    THREAD_ID idThread = CThread::GetCurrentThreadID();
+    m_pMyRing = NULL;  m_nMyInstance = m_nInstance;  m_nMyRings = nRings;
+    for (uint32_t i = 0;  i < nRings;  ++i) {
+      if (m_apRings[i]->idThread == idThread) {m_pMyRing = m_apRings[i];  break;}
+    }
+  }
+  if ((m_pMyRing == NULL) || !m_pMyRing->fActive.load(std::memory_order_relaxed)) return NULL;
+  return m_pMyRing;
+}
+
+
+CMessageQueue::QENTRY *CMessageQueue::ClaimPrivate (THREAD_RING *pRing, uint32_t &nPosition)
+{
+  //++
+  //   Return the next free entry in a thread's private ring, or NULL if the
+  // ring is full.  Only the owner ever calls this, so nobody else can take
+  // the entry away from us and there's nothing more to it than that ...
+  //--
+  nPosition = pRing->nAddPosition.load(std::memory_order_relaxed);
+  uint32_t nRemove = pRing->nRemovePosition.load(std::memory_order_acquire);
+  if ((nPosition - nRemove) > pRing->nMask) return NULL;
+  return &(pRing->pEntries[nPosition & pRing->nMask]);
+}
+
+
+CMessageQueue::QENTRY *CMessageQueue::ClaimEntry (uint32_t &nPosition)
+{
+  //++
+  //   Claim the next position in the queue and return its entry.  If the
+  // entry still belongs to an older position then the queue is full and we
+  // return NULL.  If somebody else claimed the position first, then just try
+  // again with the next one ...
+  //--
+  nPosition = m_nAddPosition.load(std::memory_order_relaxed);
+  while (true) {
+    QENTRY *p = &m_pRing[nPosition & m_nMask];
+    int32_t nDiff = (int32_t) (p->nSequence.load(std::memory_order_acquire) - nPosition);
+    if (nDiff == 0) {
+      if (m_nAddPosition.compare_exchange_weak(nPosition, nPosition+1, std::memory_order_relaxed)) return p;
+    } else if (nDiff < 0)
+      return NULL;
+    else
+      nPosition = m_nAddPosition.load(std::memory_order_relaxed);
+  }
+}
+
+
+CMessageQueue::QENTRY *CMessageQueue::ClaimOldest (uint32_t &nPosition)
+{
+  //++
+  //   Claim the oldest message in the queue and return its entry, or NULL if
+  // the queue is empty (or the oldest message hasn't been finished yet) ...
+  //--
+  nPosition = m_nRemovePosition.load(std::memory_order_relaxed);
+  while (true) {
+    QENTRY *p = &m_pRing[nPosition & m_nMask];
+    int32_t nDiff = (int32_t) (p->nSequence.load(std::memory_order_acquire) - (nPosition+1));
+    if (nDiff == 0) {
+      if (m_nRemovePosition.compare_exchange_weak(nPosition, nPosition+1, std::memory_order_relaxed)) return p;
+    } else if (nDiff < 0)
+      return NULL;
+    else
+      nPosition = m_nRemovePosition.load(std::memory_order_relaxed);
+  }
+}
+
+
+bool CMessageQueue::IsEmpty() const
+{
+  //++
+  // Return TRUE if there's no message ready at the head of the queue ...
+  //--
+  uint32_t nPosition = m_nRemovePosition.load(std::memory_order_relaxed);
+  const QENTRY *p = &m_pRing[nPosition & m_nMask];
+  if ((int32_t) (p->nSequence.load(std::memory_order_acquire) - (nPosition+1)) >= 0) return false;
+  uint32_t nRings = m_nRings.load(std::memory_order_acquire);
+  for (uint32_t i = 0;  i < nRings;  ++i) {
+    const THREAD_RING *pRing = m_apRings[i];
+    if (pRing->nRemovePosition.load(std::memory_order_relaxed)
+     != pRing->nAddPosition.load(std::memory_order_acquire)) return false;
+  }
+  return true;
+}
+
+
+CMessageQueue::QENTRY *CMessageQueue::AllocateEntry (THREAD_RING *&pRing, uint32_t &nPosition)
+{
+  //++
+  //   Claim a free entry for a new message.  If this thread has a private
+  // ring then the entry comes from there, and otherwise it comes from the
+  // shared ring.  Either way, if the ring is full then we do whatever the
+  // overflow policy says, and NULL is returned if the message has to be
+  // dropped.  The entry is ours until it's passed to PostEntry() ...
+  //--
+  pRing = FindRing();  QENTRY *p;
+  while ((p = (pRing != NULL) ? ClaimPrivate(pRing, nPosition) : ClaimEntry(nPosition)) == NULL) {
+    //   The queue is full.  Blocking is only possible if the logging thread is
+    // running, and it had better not be us ...
+    bool fBlock = (m_nPolicy == OVERFLOW_BLOCK) && IsLoggingThreadRunning()
+               && (CThread::GetCurrentThreadID() != m_LoggingThread.GetID());
+    if ((m_nPolicy == OVERFLOW_DROP_OLDEST) && (pRing == NULL)) {
+      uint32_t nOldest;  QENTRY *pOldest = ClaimOldest(nOldest);
+      if (pOldest != NULL) {
+        pOldest->nSequence.store(nOldest+m_nMask+1, std::memory_order_release);
+        m_llDropped.fetch_add(1, std::memory_order_relaxed);
+      }
+    } else if (fBlock) {
+      WakeLoggingThread();  _sleep_ms(1);
+    } else {
+      m_llDropped.fetch_add(1, std::memory_order_relaxed);  return NULL;
+    }
   }
-  memset(p, 0, sizeof(QENTRY));
   return p;
 }
 
 
-CMessageQueue::QENTRY *CMessageQueue::NewEntry (CLog::SEVERITY nLevel, const char *pszText, bool fToConsole, bool fToLog, const CLog::TIMESTAMP *ptm)
+void CMessageQueue::PostEntry (QENTRY *p, THREAD_RING *pRing, uint32_t nPosition)
 {
   //++
-  //   This method creates a new queue entry and initializes all the fields
-  // from the parameter values specified.  Note that we have to save the ToLog
-  // and ToConsole destination flags here rather than computing them when the
-  // message is actually logged because message levels are thread specific.
+  //   Hand a filled in entry over to the logging thread, and then wake up the
+  // logging thread, but only if it's asleep.  The fence keeps the check of
+  // m_fWaiting from happening before the entry is posted ...
+  //--
+  p->llTicks.store(GetTicks(), std::memory_order_relaxed);
+  if (pRing != NULL)
+    pRing->nAddPosition.store(nPosition+1, std::memory_order_release);
+  else
+    p->nSequence.store(nPosition+1, std::memory_order_release);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (m_fWaiting.load(std::memory_order_relaxed) && m_fWaiting.exchange(false))
+    WakeLoggingThread();
+}
+
+
+bool CMessageQueue::AddEntry (CLog::SEVERITY nLevel, const char *pszText, bool fToConsole, bool fToLog, const CLog::TIMESTAMP *ptm)
+{
+  //++
+  //   This method adds a message to the queue.  Note that we have to save the
+  // ToLog and ToConsole destination flags here rather than computing them when
+  // the message is actually logged because message levels are thread specific.
   // We need the message level for the current thread to determine whether this
   // message should eventually be sent to the console, log file, or both.
   //
@@ -132,87 +375,134 @@ CMessageQueue::QENTRY *CMessageQueue::NewEntry (CLog::SEVERITY nLevel, const cha
   // this message is recalled.
   //
   //   Likewise note that the actual text of the message is copied into the
-  // QENTRY for the same reason.
+  // QENTRY for the same reason.  Returns false if the message was dropped
+  // because the queue is full.
   //--
   assert(pszText != NULL);
-  QENTRY *p = NewEntry();
+  THREAD_RING *pRing;  uint32_t nPosition;
+  QENTRY *p = AllocateEntry(pRing, nPosition);
+  if (p == NULL) return false;
   p->nLevel = nLevel;  p->fToConsole = fToConsole;  p->fToLog = fToLog;
+  p->pszFormat = NULL;  p->cbArgs = 0;
   strcpy_s(p->szText, CLog::MAXMSG, pszText);
   if (ptm != NULL)
     memcpy(&(p->tmNow), ptm, sizeof(CLog::TIMESTAMP));
   else
     CLog::GetTimeStamp(&(p->tmNow));
-  return p;
+  PostEntry(p, pRing, nPosition);
+  return true;
 }
 
 
-CMessageQueue::QENTRY *CMessageQueue::AddEntry (QENTRY *pEntry)
+bool CMessageQueue::AddDeferred (CLog::SEVERITY nLevel, const char *pszFormat, va_list args, bool fToConsole, bool fToLog)
 {
   //++
-  //   This method adds an entry to the message queue.  Remember that the queue
-  // tail pointer is where we add entries (the head is where we remove them)!
+  //   This is just like AddEntry(), except that the message isn't formatted
+  // yet.  Instead we save a pointer to the format string and a copy of the
+  // arguments (see LogFormat.cpp), and the logging thread formats it later.
+  // THE FORMAT STRING HAS TO STILL BE THERE WHEN THAT HAPPENS - in practice
+  // that means it had better be a string literal!  If the arguments can't
+  // be saved for some reason, then we just format the message now.
   //--
-  assert(pEntry != NULL);
-  m_QueueLock.Enter();
-  //   Usually the old tail (the previous last queue item) will now point to
-  // this one, and this one then becomes the new tail.  Be careful, though
-  // because if the queue is empty then the tail will be NULL!
-  if (m_pQueueTail != NULL) m_pQueueTail->pNext = pEntry;
-  m_pQueueTail = pEntry;
-  // If the queue is empty, then this item is now also the head ...
-  if (m_pQueueHead == NULL) m_pQueueHead = pEntry;
-  m_QueueLock.Leave();
-  WakeLoggingThread();
-  return pEntry;
+  assert(pszFormat != NULL);
+  THREAD_RING *pRing;  uint32_t nPosition;
+  QENTRY *p = AllocateEntry(pRing, nPosition);
+  if (p == NULL) return false;
+  p->nLevel = nLevel;  p->fToConsole = fToConsole;  p->fToLog = fToLog;
+  CLog::GetTimeStamp(&(p->tmNow));
+  va_list argsCopy;  va_copy(argsCopy, args);
+  size_t cbArgs = CLogFormat::SaveArguments(pszFormat, argsCopy, p->szText, CLog::MAXMSG);
+  va_end(argsCopy);
+  if (cbArgs > 0) {
+    p->pszFormat = pszFormat;  p->cbArgs = (uint16_t) cbArgs;
+  } else {
+    p->pszFormat = NULL;  p->cbArgs = 0;
+    vsprintf_s(p->szText, CLog::MAXMSG, pszFormat, args);
+  }
+  PostEntry(p, pRing, nPosition);
+  return true;
 }
 
 
 CMessageQueue::QENTRY *CMessageQueue::RemoveEntry()
 {
   //++
-  //   This routine removes an entry from the head of the queue (remember - new
-  // items are added at the tail and removed from the head!).  If the queue is
-  // currently empty, then NULL is returned.
+  //   This routine removes the oldest message from the queue.  If the queue is
+  // currently empty, then NULL is returned.  The entry still belongs to us
+  // (nobody can add to it) until it's freed.
   //
   //  BE SURE TO CALL FreeEntry() WHEN YOU'RE DONE PROCESSING THIS ENTRY!
   //--
-  m_QueueLock.Enter();
-  if (m_pQueueHead == NULL) {
-    // If the head is NULL, then the queue is empty ...
-    m_QueueLock.Leave();  return NULL;
-  }
-  //   Pull the next entry off the head of the list, and then the old second
-  // item on the list becomes the new head.  Note that if the list currently
-  // has only one item then the queue head and tail both point to the same
-  // thing.  When we remove the first item the queue head will become null and
-  // it's important to make sure the tail becomes null too!
-  QENTRY *p = m_pQueueHead;  m_pQueueHead = p->pNext;
-  if (m_pQueueHead == NULL) m_pQueueTail = NULL;
-  m_QueueLock.Leave();
-  //   This item isn't part of the list anymore, so zero the next pointer
-  // just so it isn't left still pointing to the item behind it.  This reallly
-  // shouldn't be necessary, but just in case...
-  p->pNext = NULL;
-  return p;
+  uint32_t nPosition;
+  return ClaimOldest(nPosition);
 }
 
 
 void CMessageQueue::FreeEntry (QENTRY *pEntry)
 {
   //++
-  //   This routine will free a queue entry.  It simply adds the item to the
-  // free list - note that we never, ever, delete queue entries once they've
-  // been allocated!
+  //   This routine gives an entry back to the ring.  Its nSequence is still
+  // one more than the position it was removed from, so adding the rest of
+  // the queue size makes it free for its next trip around ...
+  //--
+  assert(pEntry != NULL);
+  uint32_t nSequence = pEntry->nSequence.load(std::memory_order_relaxed);
+  pEntry->nSequence.store(nSequence+m_nMask, std::memory_order_release);
+}
+
+
+CMessageQueue::QENTRY *CMessageQueue::RemoveOldest (THREAD_RING *&pRing)
+{
+  //++
+  //   This routine looks at the first message in every ring, private and
+  // shared, and removes the oldest one.  pRing is set to the private ring
+  // it came from, or NULL if it came from the shared ring, and either way
+  // it has to be passed to FreeEntry() along with the entry.  NULL is
+  // returned if all the rings are empty.
   //
-  //   One subtle point - while the message queue is a LIFO structure, the
-  // free list is actually a FIFO.  That means if there are several free
-  // entries then the same message entry keeps getting used over and over
-  // again.  That's harmless and makes the code a little easier.
+  //   Only the logging thread may call this, since it's the only thread
+  // allowed to remove anything from a private ring.  And note that a message
+  // can still come out a little out of order if its thread is interrupted
+  // between stamping it and putting it in the ring - there's not much we
+  // can do about that without making the producers wait for each other.
+  //--
+  pRing = NULL;  QENTRY *pOldest = NULL;
+  uint32_t nPosition = m_nRemovePosition.load(std::memory_order_relaxed);
+  QENTRY *p = &m_pRing[nPosition & m_nMask];
+  if (p->nSequence.load(std::memory_order_acquire) == nPosition+1) pOldest = p;
+  uint32_t nRings = m_nRings.load(std::memory_order_acquire);
+  for (uint32_t i = 0;  i < nRings;  ++i) {
+    THREAD_RING *pThis = m_apRings[i];
+    nPosition = pThis->nRemovePosition.load(std::memory_order_relaxed);
+    if (nPosition == pThis->nAddPosition.load(std::memory_order_acquire)) continue;
+    p = &(pThis->pEntries[nPosition & pThis->nMask]);
+    if ((pOldest == NULL) || (p->llTicks.load(std::memory_order_relaxed)
+                           < pOldest->llTicks.load(std::memory_order_relaxed))) {
+      pOldest = p;  pRing = pThis;
+    }
+  }
+  //   If the oldest message is in the shared ring then we still have to claim
+  // it.  Somebody might have thrown it away (OVERFLOW_DROP_OLDEST) while we
+  // were looking, but then we'll just get the next one ...
+  if ((pOldest != NULL) && (pRing == NULL)) pOldest = RemoveEntry();
+  return pOldest;
+}
+
+
+void CMessageQueue::FreeEntry (QENTRY *pEntry, THREAD_RING *pRing)
+{
+  //++
+  //   Free an entry returned by RemoveOldest().  For a private ring, that's
+  // just a matter of moving the remove position past it ...
   //--
   assert(pEntry != NULL);
-  m_FreeLock.Enter();
-  pEntry->pNext = m_pFreeList;  m_pFreeList = pEntry;
-  m_FreeLock.Leave();
+  if (pRing == NULL) {
+    FreeEntry(pEntry);
+  } else {
+    uint32_t nPosition = pRing->nRemovePosition.load(std::memory_order_relaxed);
+    assert(pEntry == &(pRing->pEntries[nPosition & pRing->nMask]));
+    pRing->nRemovePosition.store(nPosition+1, std::memory_order_release);
+  }
 }
 
 
@@ -227,17 +517,40 @@ void* THREAD_ATTRIBUTES CMessageQueue::LoggingThread (void *pParam)
   CThread *pThread = (CThread *) pParam;
   CMessageQueue *pQueue = static_cast<CMessageQueue *>(pThread->GetParameter());
 //LOGS(DEBUG, "message logging thread started");
+  uint64_t llReported = 0;  char szBuffer[CLog::MAXMSG];
   while (true) {
-    QENTRY *pEntry;
-    while ((pEntry = pQueue->RemoveEntry()) != NULL) {
-      if (pEntry->fToConsole)
-        CLog::GetLog()->SendConsole(pEntry->nLevel, pEntry->szText);
-      if (pEntry->fToLog)
-        CLog::GetLog()->SendLog(pEntry->nLevel, pEntry->szText, &(pEntry->tmNow));
-      pQueue->FreeEntry(pEntry);
+    QENTRY *pEntry;  THREAD_RING *pRing;
+    while ((pEntry = pQueue->RemoveOldest(pRing)) != NULL) {
+      CLog *pLog = CLog::GetLog();
+      if (pEntry->pszFormat == NULL) {
+        if (pEntry->fToConsole) pLog->SendConsole(pEntry->nLevel, pEntry->szText);
+        if (pEntry->fToLog) pLog->SendLog(pEntry->nLevel, pEntry->szText, &(pEntry->tmNow));
+      } else {
+        //   This message hasn't been formatted yet.  A binary log file doesn't
+        // need it formatted at all, but anything else does ...
+        bool fBinary = pEntry->fToLog && pLog->IsBinaryLog();
+        if (pEntry->fToConsole || (pEntry->fToLog && !fBinary))
+          CLogFormat::Format(pEntry->pszFormat, pEntry->szText, pEntry->cbArgs, szBuffer, sizeof(szBuffer));
+        if (pEntry->fToConsole) pLog->SendConsole(pEntry->nLevel, szBuffer);
+        if (fBinary)
+          pLog->SendDeferred(pEntry->nLevel, pEntry->pszFormat, pEntry->szText, pEntry->cbArgs, &(pEntry->tmNow));
+        else if (pEntry->fToLog)
+          pLog->SendLog(pEntry->nLevel, szBuffer, &(pEntry->tmNow));
+      }
+      pQueue->FreeEntry(pEntry, pRing);
+    }
+    uint64_t llDropped = pQueue->GetDropped();
+    if (llDropped != llReported) {
+      LOGS(WARNING, (llDropped-llReported) << " log messages lost - message queue full");
+      llReported = llDropped;
     }
     if (pThread->IsExitRequested()) break;
-    pThread->WaitForFlag(100);
+    //   Tell everybody we're going to sleep, and then make sure nothing was
+    // added while we weren't looking ...
+    pQueue->m_fWaiting.store(true);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (pQueue->IsEmpty()) pThread->WaitForFlag(100);
+    pQueue->m_fWaiting.store(false);
   }
   LOGS(DEBUG, "message logging thread terminated");
   return pThread->End();
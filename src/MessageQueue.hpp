@@ -21,6 +21,8 @@
 // 14-DEC-15  RLA   New file.
 //--
 #pragma once
+#include <stdarg.h>             // va_list, et al ...
+#include <atomic>               // C++ std::atomic template
 #include "Mutex.hpp"            // needed for CMutex ...
 #include "Thread.hpp"           // needed for THREAD_ATTRIBUTES and CThread ...
 
@@ -33,23 +35,62 @@ class CMessageQueue {
   // Constants ...
 public:
   enum {
+    DEFAULT_ENTRIES = 4096,     // default queue size (MUST be a power of 2!)
+    THREAD_ENTRIES  = 1024,     // size of each thread's private ring (ditto!)
+    MAXRINGS        = 64,       // most threads that can have a private ring
   };
 
-  // This is the structure of a message queue entry ...
+  //   This is what happens when somebody logs a message and the queue is
+  // full.  Blocking never loses anything, but the thread waits until the
+  // logging thread makes room ...
+  enum OVERFLOW_POLICY {
+    OVERFLOW_DROP_NEWEST,       // throw away the new message
+    OVERFLOW_DROP_OLDEST,       // throw away the oldest message in the queue
+    OVERFLOW_BLOCK,             // wait for the logging thread
+  };
+
+  //   This is the structure of a message queue entry.  The queue is a ring of
+  // these, allocated once, and nSequence says who owns each one - see
+  // MessageQueue.cpp for the details ...
 protected:
   struct _QENTRY {
+    std::atomic<uint32_t> nSequence; // ring position this entry is ready for
     CLog::SEVERITY nLevel;      // message level - ERROR, WARNING, DEBUG, etc
     bool fToConsole;            // TRUE to send this message to the console
     bool fToLog;                // TRUE to send this message to the log file
+    //   If pszFormat isn't NULL then this message hasn't been formatted yet,
+    // and szText holds its arguments (cbArgs bytes worth) rather than text.
+    const char *pszFormat;      // printf() format for a deferred message
+    uint16_t cbArgs;            // size of the saved arguments
     char szText[CLog::MAXMSG];  // the actual text of the message
     CLog::TIMESTAMP tmNow;      // time this message was originally logged
-    struct _QENTRY *pNext;      // next entry in the message queue
+    //   llTicks is atomic only because the logging thread peeks at it, and
+    // with OVERFLOW_DROP_OLDEST the entry might be reused while it's looking.
+    std::atomic<uint64_t> llTicks; // time this message was queued (for sorting)
   };
   typedef struct _QENTRY QENTRY;
 
+  //   Every queued thread gets a private ring of its own, so that it never
+  // has to compete with any other thread for space in the queue.  Only the
+  // owner adds to it and only the logging thread removes from it, so the two
+  // positions are all the synchronization we need.  Once registered, a ring
+  // is never freed (until the queue is) - unregistering a thread just makes
+  // it use the shared ring again ...
+  struct _THREAD_RING {
+    THREAD_ID   idThread;       // the thread that owns this ring
+    std::atomic<bool> fActive;  // TRUE if the thread is still registered
+    QENTRY     *pEntries;       // the entries in this ring
+    uint32_t    nMask;          // ring size - 1
+    uint8_t     abPad1[64];     // keep nAddPosition in its own cache line
+    std::atomic<uint32_t> nAddPosition;    // next position (owner only!)
+    uint8_t     abPad2[64];     // ... and nRemovePosition in its own too
+    std::atomic<uint32_t> nRemovePosition; // next position (logging thread only!)
+  };
+  typedef struct _THREAD_RING THREAD_RING;
+
   // Constructors and destructor ...
 public:
-  CMessageQueue();
+  CMessageQueue (uint32_t nEntries=DEFAULT_ENTRIES);
   virtual ~CMessageQueue();
 private:
   CMessageQueue (const CMessageQueue &lq);
@@ -57,15 +98,24 @@ private:
 
   // Public CMessageQueue properties ...
 public:
+  // Return the queue size ...
+  uint32_t GetSize() const {return m_nMask+1;}
+  // Set or return the overflow policy ...
+  void SetOverflowPolicy (OVERFLOW_POLICY nPolicy) {m_nPolicy = nPolicy;}
+  OVERFLOW_POLICY GetOverflowPolicy() const {return m_nPolicy;}
+  // Return the number of messages thrown away because the queue was full ...
+  uint64_t GetDropped() const {return m_llDropped.load(std::memory_order_relaxed);}
+  // Return the number of private thread rings allocated ...
+  uint32_t GetRingCount() const {return m_nRings.load(std::memory_order_acquire);}
 
   // Public CMessageQueue methods ...
 public:
-  // Create and destroy queue entries ...
-  QENTRY *NewEntry();
-  QENTRY *NewEntry (CLog::SEVERITY nLevel, const char *pszText, bool fToConsole, bool fToLog, const CLog::TIMESTAMP *ptm=NULL);
-  QENTRY *AddEntry (QENTRY *pEntry);
-  QENTRY *AddEntry (CLog::SEVERITY nLevel, const char *pszText, bool fToConsole, bool fToLog, const CLog::TIMESTAMP *ptm=NULL)
-    {return AddEntry(NewEntry(nLevel, pszText, fToConsole, fToLog, ptm));}
+  //   Add a message to the queue (any thread may call this), and remove and
+  // then free the oldest one (only the logging thread should call these) ...
+  bool AddEntry (CLog::SEVERITY nLevel, const char *pszText, bool fToConsole, bool fToLog, const CLog::TIMESTAMP *ptm=NULL);
+  //   Add a message to be formatted later, by the logging thread.  The format
+  // string MUST still exist then (i.e. it should be a string literal!) ...
+  bool AddDeferred (CLog::SEVERITY nLevel, const char *pszFormat, va_list args, bool fToConsole, bool fToLog);
   QENTRY *RemoveEntry();
   void FreeEntry (QENTRY *pEntry);
   // Start or stop the background logging thread ...
@@ -73,19 +123,69 @@ public:
   bool BeginLoggingThread();
   void EndLoggingThread();
   void WakeLoggingThread() {m_LoggingThread.RaiseFlag();}
+  //   Give a thread its own private ring, or take it away again.  Returns
+  // false if there are already MAXRINGS threads with rings ...
+  bool RegisterThread (THREAD_ID idThread=0);
+  void UnregisterThread (THREAD_ID idThread=0);
 
   // Private CMessageQueue methods ...
 private:
+  // Claim the next free entry, or return NULL if the queue is full ...
+  QENTRY *ClaimEntry (uint32_t &nPosition);
+  // Claim the oldest entry in the queue, or return NULL if it's empty ...
+  QENTRY *ClaimOldest (uint32_t &nPosition);
+  //   Claim an entry for a new message (following the overflow policy if
+  // the queue is full) and then, once it's filled in, post it ...
+  QENTRY *AllocateEntry (THREAD_RING *&pRing, uint32_t &nPosition);
+  void PostEntry (QENTRY *p, THREAD_RING *pRing, uint32_t nPosition);
+  // Find the ring that belongs to the current thread, if there is one ...
+  THREAD_RING *FindRing();
+  // Claim the next free entry in a thread's ring, or NULL if it's full ...
+  static QENTRY *ClaimPrivate (THREAD_RING *pRing, uint32_t &nPosition);
+  //   Remove the oldest message from all the rings together, and then free
+  // it (pRing says which ring it came from, or NULL for the shared one) ...
+  QENTRY *RemoveOldest (THREAD_RING *&pRing);
+  void FreeEntry (QENTRY *pEntry, THREAD_RING *pRing);
+  // Return TRUE if there's nothing in any ring ...
+  bool IsEmpty() const;
+  // Return a high resolution, monotonic, time for sorting messages ...
+  static uint64_t GetTicks();
   // The background task that manages this Channel ...
   static void* THREAD_ATTRIBUTES LoggingThread (void *pParam);
 
   // Local members ...
 private:
-  QENTRY     *m_pQueueHead;     // place where messages are removed for printing
-  QENTRY     *m_pQueueTail;     // place where messages are added when logged
-  QENTRY     *m_pFreeList;      // free list of unused QENTRY blocks
-  CMutex      m_QueueLock;      // CRITICAL_SECTION lock message queue
-  CMutex      m_FreeLock;       // CRITICAL_SECTION lock free list
-  uint32_t    m_nQueueEntries;  // count of QENTRY blocks allocated
+  QENTRY     *m_pRing;          // the queue entries themselves
+  uint32_t    m_nMask;          // queue size - 1 (for wrapping positions)
+  OVERFLOW_POLICY m_nPolicy;    // what to do when the queue is full
+  //   m_nAddPosition is where the next message goes and m_nRemovePosition is
+  // where the next one comes out.  They're always increasing (modulo 2^32)
+  // and they live in separate cache lines, since the producers hammer one
+  // and the logging thread hammers the other ...
+  uint8_t     m_abPad1[64];     // keep m_nAddPosition in its own cache line
+  std::atomic<uint32_t> m_nAddPosition;    // next position to add to
+  uint8_t     m_abPad2[64];     // ... and m_nRemovePosition in its own too
+  std::atomic<uint32_t> m_nRemovePosition; // next position to remove from
+  uint8_t     m_abPad3[64];     // ...
+  std::atomic<bool> m_fWaiting; // TRUE when the logging thread is asleep
+  std::atomic<uint64_t> m_llDropped; // messages lost to a full queue
+  //   The private thread rings.  This array is only ever added to, and
+  // m_nRings is updated after the new ring is in place, so the logging thread
+  // and FindRing() can look at it without any lock ...
+  THREAD_RING *m_apRings[MAXRINGS];// private rings for the queued threads
+  std::atomic<uint32_t> m_nRings;  // number of rings in use
+  CMutex      m_RingLock;       // serializes RegisterThread() and friends
+  uint32_t    m_nInstance;      // unique number for this queue object
   CThread     m_LoggingThread;  // background thread to do the checkpoints
+
+  // Static data ...
+private:
+  static std::atomic<uint32_t> m_nInstances;  // queue objects ever created
+  //   These remember the current thread's ring, so that FindRing() doesn't
+  // have to search for it every time.  m_nMyInstance says which queue the
+  // ring belongs to, and m_nMyRings how many rings there were the last time
+  // we looked (in case this thread is registered later) ...
+  static THREAD_LOCAL THREAD_RING *m_pMyRing;
+  static THREAD_LOCAL uint32_t     m_nMyInstance;
+  static THREAD_LOCAL uint32_t     m_nMyRings;
 };
@@ -0,0 +1,295 @@
+//++
+// SectorCache.cpp -> CSectorCache (write back disk sector cache) methods
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the UPE LIBRARY project.  UPELIB is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    UPELIB is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   The operating systems we emulate tend to hammer on a small number of
+// disk sectors - directories, allocation bitmaps, and so on - and without a
+// cache every one of those accesses goes all the way to the host kernel.  The
+// CSectorCache class keeps the most recently used sectors in memory, and when
+// the cache is full the least recently used sector is evicted to make room.
+//
+//   The cache is write back, so a WriteSector() just updates the copy in
+// memory and marks it dirty.  Dirty sectors are written to the image file
+// when they're evicted, or when Flush() is called.  CDiskImageFile registers
+// cached images with the CCheckpointFiles thread, which calls Flush() every
+// few seconds, and CDiskImageFile::Close() always flushes the cache too.  That
+// means that if the emulator crashes we'll lose at most one checkpoint
+// interval's worth of writes, which is no worse than the stdio buffering we
+// had before.
+//
+//   Flush() sorts the dirty sectors by LBA and hands them all to the image's
+// scatter/gather write, so any adjacent dirty sectors are written back with
+// a single system call.
+//
+//   All cache operations are protected by a mutex, since the checkpoint thread
+// may be flushing the cache while an emulator thread is reading or writing.
+//
+// REVISION HISTORY:
+// 16-OCT-26        New file.
+//--
+//000000001111111111222222222233333333334444444444555555555566666666667777777777
+//234567890123456789012345678901234567890123456789012345678901234567890123456789
+#include <stdlib.h>             // exit(), system(), etc ...
+#include <stdint.h>	        // uint8_t, uint32_t, etc ...
+#include <assert.h>             // assert() (what else??)
+#include <string.h>             // memcpy(), memset(), etc ...
+#include <algorithm>            // std::sort() ...
+#include "UPELIB.hpp"           // UPE library definitions
+#include "LogFile.hpp"          // UPE library message logging facility
+#include "ImageFile.hpp"        // CDiskImageFile raw sector I/O
+#include "SectorCache.hpp"      // declarations for this module
+
+
+// The set of all sector caches, for SHOW CACHE, and its lock ...
+CSectorCache::CACHE_SET CSectorCache::m_setCaches;
+CMutex CSectorCache::m_SetLock;
+
+
+CSectorCache::CSectorCache (CDiskImageFile *pImage, uint32_t nCapacity)
+{
+  //++
+  //   Allocate the buffer for all the sectors we'll ever cache and put every
+  // slot on the free list.  Note that the sector size is fixed when the cache
+  // is created - if somebody changes the image's sector size later then they
+  // need to create a new cache!
+  //--
+  assert((pImage != NULL) && (nCapacity > 0));
+  m_pImage = pImage;  m_nCapacity = nCapacity;
+  m_nSectorSize = pImage->GetSectorSize();  m_nDirty = 0;
+  m_pabBuffer = DBGNEW uint8_t[(size_t) m_nCapacity * m_nSectorSize];
+  m_vecFree.reserve(m_nCapacity);
+  for (uint32_t i = 0;  i < m_nCapacity;  ++i)
+    m_vecFree.push_back(m_pabBuffer + (size_t) i*m_nSectorSize);
+  m_mapSectors.reserve(m_nCapacity);
+  ClearStatistics();
+  m_SetLock.Enter();
+  m_setCaches.insert(this);
+  m_SetLock.Leave();
+}
+
+
+CSectorCache::~CSectorCache()
+{
+  //++
+  //   Note that the destructor DOES NOT flush the cache - the image file may
+  // not even be open anymore.  It's up to CDiskImageFile to do that first.
+  //--
+  if (m_nDirty > 0)
+    LOGF(WARNING, "%d dirty sectors discarded from cache", m_nDirty);
+  m_SetLock.Enter();
+  m_setCaches.erase(this);
+  m_SetLock.Leave();
+  delete[] m_pabBuffer;
+}
+
+
+bool CSectorCache::Allocate (uint32_t lLBA, LRU_LIST::iterator &it)
+{
+  //++
+  //   Allocate a slot for sector lLBA, which must not already be cached.  If
+  // there are no free slots then the least recently used sector is evicted,
+  // writing it back first if it's dirty.  If that write fails then nothing
+  // changes and we return false.  Otherwise the new sector is at the front of
+  // the LRU list, marked clean, and "it" points to it.
+  //--
+  assert(m_mapSectors.find(lLBA) == m_mapSectors.end());
+  if (m_vecFree.empty()) {
+    LRU_LIST::iterator itVictim = --m_lstLRU.end();
+    if (itVictim->fDirty) {
+      if (!m_pImage->WriteSectorDirect(itVictim->lLBA, itVictim->pabData)) return false;
+      --m_nDirty;  ++m_llWriteBacks;
+    }
+    m_vecFree.push_back(itVictim->pabData);
+    m_mapSectors.erase(itVictim->lLBA);
+    m_lstLRU.erase(itVictim);
+    ++m_llEvictions;
+  }
+  CACHE_ENTRY e;
+  e.lLBA = lLBA;  e.fDirty = false;  e.pabData = m_vecFree.back();
+  m_vecFree.pop_back();
+  m_lstLRU.push_front(e);
+  it = m_lstLRU.begin();
+  m_mapSectors[lLBA] = it;
+  return true;
+}
+
+
+void CSectorCache::Discard (LRU_LIST::iterator it)
+{
+  //++
+  // Remove a (clean!) entry from the cache and return its slot ...
+  //--
+  assert(!it->fDirty);
+  m_vecFree.push_back(it->pabData);
+  m_mapSectors.erase(it->lLBA);
+  m_lstLRU.erase(it);
+}
+
+
+bool CSectorCache::Read (uint32_t lLBA, void *pData)
+{
+  //++
+  //   Read a sector thru the cache.  If it's a hit, just copy the data and
+  // move this sector to the front of the LRU list.  If it's a miss, then
+  // allocate a slot and read the sector from the image file.
+  //--
+  m_CacheLock.Enter();
+  SECTOR_MAP::iterator itMap = m_mapSectors.find(lLBA);
+  if (itMap != m_mapSectors.end()) {
+    LRU_LIST::iterator it = itMap->second;
+    m_lstLRU.splice(m_lstLRU.begin(), m_lstLRU, it);
+    memcpy(pData, it->pabData, m_nSectorSize);
+    ++m_llHits;
+    m_CacheLock.Leave();  return true;
+  }
+  ++m_llMisses;
+  LRU_LIST::iterator it;
+  if (!Allocate(lLBA, it)) {
+    m_CacheLock.Leave();  return false;
+  }
+  if (!m_pImage->ReadSectorDirect(lLBA, it->pabData)) {
+    Discard(it);  m_CacheLock.Leave();  return false;
+  }
+  memcpy(pData, it->pabData, m_nSectorSize);
+  m_CacheLock.Leave();
+  return true;
+}
+
+
+bool CSectorCache::Write (uint32_t lLBA, const void *pData)
+{
+  //++
+  //   Write a sector thru the cache.  We always write complete sectors, so
+  // there's no need to read the old data on a miss - we just allocate a slot
+  // and overwrite it.  Either way the sector ends up dirty and at the front
+  // of the LRU list.
+  //--
+  m_CacheLock.Enter();
+  LRU_LIST::iterator it;
+  SECTOR_MAP::iterator itMap = m_mapSectors.find(lLBA);
+  if (itMap != m_mapSectors.end()) {
+    it = itMap->second;
+    m_lstLRU.splice(m_lstLRU.begin(), m_lstLRU, it);
+    ++m_llHits;
+  } else {
+    ++m_llMisses;
+    if (!Allocate(lLBA, it)) {
+      m_CacheLock.Leave();  return false;
+    }
+  }
+  memcpy(it->pabData, pData, m_nSectorSize);
+  if (!it->fDirty) {
+    it->fDirty = true;  ++m_nDirty;
+  }
+  m_CacheLock.Leave();
+  return true;
+}
+
+
+static bool CompareLBA (const CDiskImageFile::SECTOR_IOV &a, const CDiskImageFile::SECTOR_IOV &b)
+{
+  //++
+  // Compare two scatter/gather entries for std::sort() ...
+  //--
+  return a.lLBA < b.lLBA;
+}
+
+
+bool CSectorCache::Flush()
+{
+  //++
+  //   Write back all dirty sectors.  The dirty sectors are sorted by LBA first
+  // so that WriteSectorsVDirect() can coalesce adjacent ones.  The sectors
+  // stay in the cache (they're just not dirty anymore), and the LRU order
+  // doesn't change.  If the write fails then everything stays dirty and we'll
+  // try again next time.
+  //--
+  m_CacheLock.Enter();
+  if (m_nDirty == 0) {
+    m_CacheLock.Leave();  return true;
+  }
+  vector<CDiskImageFile::SECTOR_IOV> vecIOV;
+  vecIOV.reserve(m_nDirty);
+  for (LRU_LIST::iterator it = m_lstLRU.begin();  it != m_lstLRU.end();  ++it) {
+    if (!it->fDirty) continue;
+    CDiskImageFile::SECTOR_IOV iov;
+    iov.lLBA = it->lLBA;  iov.pData = it->pabData;
+    vecIOV.push_back(iov);
+  }
+  std::sort(vecIOV.begin(), vecIOV.end(), &CompareLBA);
+  if (!m_pImage->WriteSectorsVDirect(vecIOV.data(), vecIOV.size())) {
+    m_CacheLock.Leave();  return false;
+  }
+  for (LRU_LIST::iterator it = m_lstLRU.begin();  it != m_lstLRU.end();  ++it)
+    it->fDirty = false;
+  m_llWriteBacks += m_nDirty;  m_nDirty = 0;
+  m_CacheLock.Leave();
+  return true;
+}
+
+
+void CSectorCache::Invalidate()
+{
+  //++
+  //   Discard every sector in the cache WITHOUT writing anything back, and
+  // put all the slots back on the free list.  This is used when the entire
+  // image file is replaced behind our back (e.g. by Restore()) and whatever
+  // we have is no longer valid.
+  //--
+  m_CacheLock.Enter();
+  m_lstLRU.clear();  m_mapSectors.clear();  m_vecFree.clear();
+  for (uint32_t i = 0;  i < m_nCapacity;  ++i)
+    m_vecFree.push_back(m_pabBuffer + (size_t) i*m_nSectorSize);
+  m_nDirty = 0;
+  m_CacheLock.Leave();
+}
+
+
+void CSectorCache::GetStatistics (CACHE_STATS &stats)
+{
+  //++
+  //   Copy this cache's statistics into stats.  We hold the cache lock while
+  // we're doing it, so the counts all agree with each other even if some
+  // emulator thread is using the cache at the same time ...
+  //--
+  m_CacheLock.Enter();
+  stats.sFileName = m_pImage->GetFileName();
+  stats.nCapacity = m_nCapacity;  stats.nCount = MKINT32(m_lstLRU.size());
+  stats.nDirty = m_nDirty;  stats.llHits = m_llHits;  stats.llMisses = m_llMisses;
+  stats.llEvictions = m_llEvictions;  stats.llWriteBacks = m_llWriteBacks;
+  m_CacheLock.Leave();
+}
+
+
+/*static*/ size_t CSectorCache::GetAllStatistics (vector<CACHE_STATS> &vecStats)
+{
+  //++
+  //   Take a snapshot of the statistics for every cache and return the number
+  // of caches.  Holding m_SetLock means that no cache can be destroyed while
+  // we're looking at it (and since caches are always deleted before their
+  // image files are closed, the image is still there too) ...
+  //--
+  vecStats.clear();
+  m_SetLock.Enter();
+  vecStats.resize(m_setCaches.size());
+  size_t n = 0;
+  for (CACHE_SET::const_iterator it = m_setCaches.begin();  it != m_setCaches.end();  ++it)
+    (*it)->GetStatistics(vecStats[n++]);
+  m_SetLock.Leave();
+  return vecStats.size();
+}
@@ -0,0 +1,147 @@
+//++
+// SectorCache.hpp -> CSectorCache (write back disk sector cache) class
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the UPE LIBRARY project.  UPELIB is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    UPELIB is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   A CSectorCache object is a fixed size, write back, cache of disk sectors
+// for a single CDiskImageFile.  It's created by CDiskImageFile::EnableCache()
+// and the disk image routes all sector reads and writes thru the cache from
+// then on.  Dirty sectors are written back when they're evicted, when the
+// checkpoint thread calls Flush(), and when the image is closed.
+//
+// REVISION HISTORY:
+// 16-OCT-26        New file.
+//--
+#pragma once
+#include <list>                 // C++ std::list template
+#include <unordered_map>        // C++ std::unordered_map (aka hash table) template
+#include <unordered_set>        // C++ std::unordered_set (a simple list) template
+#include <vector>               // C++ std::vector template
+#include <string>               // C++ std::string class, et al ...
+#include "Mutex.hpp"            // needed for CMutex ...
+using std::string;              // ...
+using std::list;                // ...
+using std::vector;              // ...
+using std::unordered_map;       // ...
+using std::unordered_set;       // ...
+class CDiskImageFile;           // forward reference for the image we cache
+
+
+class CSectorCache {
+  //++
+  //--
+
+  //   Every cached sector is described by a CACHE_ENTRY.  The entries are kept
+  // in a list in LRU order - the most recently used sector is at the front of
+  // the list and the least recently used, which is the next one to be evicted,
+  // is at the back.  A hash table maps sector numbers to list entries.  The
+  // sector data itself lives in one big buffer allocated up front, and each
+  // entry just points to its slot in that buffer.
+protected:
+  struct _CACHE_ENTRY {
+    uint32_t  lLBA;             // sector number
+    bool      fDirty;           // TRUE if this sector needs to be written
+    uint8_t  *pabData;          // this sector's slot in m_pabBuffer
+  };
+  typedef struct _CACHE_ENTRY CACHE_ENTRY;
+  typedef list<CACHE_ENTRY> LRU_LIST;
+  typedef unordered_map<uint32_t, LRU_LIST::iterator> SECTOR_MAP;
+
+  //   And this is the set of all caches currently in existence.  Caches come
+  // and go whenever some thread opens or closes an image, so the set is
+  // guarded by m_SetLock and nobody outside this class ever gets to walk it.
+  // The SHOW CACHE command gets a snapshot with GetAllStatistics() instead.
+protected:
+  typedef unordered_set<CSectorCache *> CACHE_SET;
+
+  //   A CACHE_STATS is a snapshot of one cache's statistics, taken while the
+  // cache was locked, so the numbers are all consistent with each other ...
+public:
+  struct _CACHE_STATS {
+    string    sFileName;        // image file being cached
+    uint32_t  nCapacity;        // maximum number of sectors cached
+    uint32_t  nCount;           // number of sectors in the cache now
+    uint32_t  nDirty;           // number of those that are dirty
+    uint64_t  llHits;           // number of cache hits
+    uint64_t  llMisses;         // number of cache misses
+    uint64_t  llEvictions;      // number of sectors evicted
+    uint64_t  llWriteBacks;     // number of dirty sectors written back
+  };
+  typedef struct _CACHE_STATS CACHE_STATS;
+
+  // Constructor and destructor ...
+public:
+  CSectorCache (CDiskImageFile *pImage, uint32_t nCapacity);
+  virtual ~CSectorCache();
+private:
+  // Disallow copy and assignment operations with CSectorCache objects...
+  CSectorCache (const CSectorCache &c) = delete;
+  CSectorCache& operator= (const CSectorCache &c) = delete;
+
+  // Public properties ...
+public:
+  // Return the image file we're caching ...
+  CDiskImageFile *GetImage() const {return m_pImage;}
+  // Return the cache size, and the number of sectors in use ...
+  uint32_t GetCapacity() const {return m_nCapacity;}
+  uint32_t GetCount() const {return MKINT32(m_lstLRU.size());}
+  uint32_t GetDirtyCount() const {return m_nDirty;}
+  // Return the cache statistics ...
+  uint64_t GetHits() const {return m_llHits;}
+  uint64_t GetMisses() const {return m_llMisses;}
+  uint64_t GetEvictions() const {return m_llEvictions;}
+  uint64_t GetWriteBacks() const {return m_llWriteBacks;}
+  void ClearStatistics() {m_llHits = m_llMisses = m_llEvictions = m_llWriteBacks = 0;}
+  // Take a snapshot of this cache's statistics, or of every cache's ...
+  void GetStatistics (CACHE_STATS &stats);
+  static size_t GetAllStatistics (vector<CACHE_STATS> &vecStats);
+
+  // Public methods ...
+public:
+  // Read or write a sector thru the cache ...
+  bool Read (uint32_t lLBA, void *pData);
+  bool Write (uint32_t lLBA, const void *pData);
+  // Write back all dirty sectors ...
+  bool Flush();
+  // Throw away everything in the cache, dirty or not ...
+  void Invalidate();
+
+  // Local methods ...
+protected:
+  // Find a free slot for a new sector, evicting somebody if necessary ...
+  bool Allocate (uint32_t lLBA, LRU_LIST::iterator &it);
+  // Give back a slot if the read fails ...
+  void Discard (LRU_LIST::iterator it);
+
+  // Local members ...
+protected:
+  CDiskImageFile *m_pImage;     // the disk image we're caching
+  uint32_t    m_nSectorSize;    // size of each sector, in bytes
+  uint32_t    m_nCapacity;      // maximum number of sectors cached
+  uint32_t    m_nDirty;         // number of dirty sectors in the cache
+  uint8_t    *m_pabBuffer;      // data for all cached sectors
+  vector<uint8_t *> m_vecFree;  // slots in m_pabBuffer not in use
+  LRU_LIST    m_lstLRU;         // cached sectors in LRU order
+  SECTOR_MAP  m_mapSectors;     // map sector numbers to LRU entries
+  CMutex      m_CacheLock;      // interlock with the checkpoint thread
+  uint64_t    m_llHits;         // number of cache hits
+  uint64_t    m_llMisses;       // number of cache misses
+  uint64_t    m_llEvictions;    // number of sectors evicted
+  uint64_t    m_llWriteBacks;   // number of dirty sectors written back
+  static CACHE_SET m_setCaches; // set of all CSectorCache objects
+  static CMutex    m_SetLock;   // interlock for m_setCaches
+};
@@ -23,6 +23,7 @@
 //
 //      SET LOG ...
 //      SHOW LOG ...
+//      SHOW CACHE ...
 //      DO ...
 //      EXIT ...
 //
@@ -58,6 +59,8 @@
 #include "UPE.hpp"              // UPE library FPGA interface methods
 #include "LogFile.hpp"          // UPE library message logging facility
 #include "CheckpointFiles.hpp"  // UPE library file checkpoint facility
+#include "ImageFile.hpp"        // UPE library image file methods
+#include "SectorCache.hpp"      // UPE library disk sector cache
 #include "CommandLine.hpp"      // CCommandLine (argc/argv) parser
 #include "CommandParser.hpp"    // UPE library command line parsing methods
 #include "ConsoleWindow.hpp"    // WIN32 console window functions
@@ -131,6 +134,7 @@ CCmdArgNumber     CStandardUI::m_argInterval("interval (seconds)", 10, 1, 10000)
 CCmdModifier      CStandardUI::m_modVerbosity("LEV*EL", NULL, &m_argVerbosity);
 CCmdModifier      CStandardUI::m_modNoFile("NOFI*LE", "FI*LE", &m_argOptFileName);
 CCmdModifier      CStandardUI::m_modAppend("APP*END", "OVER*WRITE");
+CCmdModifier      CStandardUI::m_modBinary("BIN*ARY", "TE*XT");
 CCmdModifier      CStandardUI::m_modConsole("CON*SOLE");
 CCmdModifier      CStandardUI::m_modTitle("TIT*LE", NULL, &m_argTitle);
 CCmdModifier      CStandardUI::m_modForeground("FORE*GROUND", NULL, &m_argForeground);
@@ -145,7 +149,7 @@ CCmdModifier      CStandardUI::m_modEnable("ENA*BLE", "DISA*BLE");
 CCmdModifier      CStandardUI::m_modInterval("INT*ERVAL", NULL, &m_argInterval);
 
 // SET LOGGING and SHOW LOGGING verb definitions ...
-CCmdModifier * const CStandardUI::m_modsSetLog[] = {&m_modNoFile, &m_modConsole, &m_modVerbosity, &m_modAppend, NULL};
+CCmdModifier * const CStandardUI::m_modsSetLog[] = {&m_modNoFile, &m_modConsole, &m_modVerbosity, &m_modAppend, &m_modBinary, NULL};
 CCmdVerb CStandardUI::m_cmdSetLog("LOG*GING", &DoSetLog, NULL, m_modsSetLog);
 CCmdVerb CStandardUI::m_cmdShowLog("LOG*GING", &DoShowLog);
 
@@ -162,6 +166,9 @@ CCmdModifier * const CStandardUI::m_modsSetCheckpoint[] = {&m_modEnable, &m_modI
 CCmdVerb CStandardUI::m_cmdSetCheckpoint("CHECK*POINT", &DoSetCheckpoint, NULL, m_modsSetCheckpoint);
 CCmdVerb CStandardUI::m_cmdShowCheckpoint("CHECK*POINT", &DoShowCheckpoint, NULL, NULL);
 
+// SHOW CACHE verb definition ...
+CCmdVerb CStandardUI::m_cmdShowCache("CACHE", &DoShowCache, NULL, NULL);
+
 // SHOW ALIASES verb definition ...
 CCmdArgument * const CStandardUI::m_argsShowAliases[] = {&m_argOptAlias, NULL};
 CCmdVerb CStandardUI::m_cmdShowAliases("ALIAS*ES", &DoShowAliases, m_argsShowAliases, NULL);
@@ -475,7 +482,7 @@ bool CStandardUI::DoSetLog (CCmdParser &cmd)
   // level to be set.
   //
   // Format:
-  //    SET LOGGING /NOFILE /FILE[=xyz] /CONSOLE /LEVEL=xyz
+  //    SET LOGGING /NOFILE /FILE[=xyz] /CONSOLE /LEVEL=xyz /BINARY /TEXT
   //
   //   There are several modifiers for this command and, just between us, the
   // semantics are a bit screwy.  Of all the possible combinations, the ones
@@ -491,6 +498,9 @@ bool CStandardUI::DoSetLog (CCmdParser &cmd)
   //
   //  SET LOG/FILE=file - same as above, but the message level is unchanged.
   //
+  //  SET LOG/FILE=file/BINARY - open a binary trace file instead of a text
+  //        log (see TraceFile.cpp).  /TEXT, the default, opens a text log.
+  //
   //  SET LOG/FILE/LEVEL=lvl - if a log file is already opened, then change
   //        its message level but keep using the current log file.  If no log
   //        file is opened, generate a unique file name using the current date
@@ -506,6 +516,13 @@ bool CStandardUI::DoSetLog (CCmdParser &cmd)
   CLog::SEVERITY nLevel = static_cast<CLog::SEVERITY> (m_argVerbosity.GetKeyValue());
   CLog *pLog = CLog::GetLog();
 
+  //   Messages below LOG_MIN_LEVEL aren't even compiled into this program, so
+  // asking for them won't do anything.  Say so, rather than let the operator
+  // wonder why nothing shows up ...
+  if (m_modVerbosity.IsPresent() && !CLog::IsCompiledIn(nLevel)) {
+    LOGS(WARNING, CLog::LevelToString(nLevel) << " messages are not compiled into this program");
+  }
+
   //   If /CONSOLE and /LEVEL are both specified, then set the console message
   // level.  Note that this can be combined with the /FILE or /NOFILE option
   // (although in that case the console and file will both be set to the same
@@ -528,7 +545,8 @@ bool CStandardUI::DoSetLog (CCmdParser &cmd)
       // the log file level to be changed w/o opening a new file!
       if (m_argOptFileName.IsPresent() || !pLog->IsLogFileOpen()) {
         bool fOverwrite = m_modAppend.IsPresent() && m_modAppend.IsNegated();
-        pLog->OpenLog(m_argOptFileName.GetFullPath(), CLog::DEBUG, !fOverwrite);
+        bool fBinary = m_modBinary.IsPresent() && !m_modBinary.IsNegated();
+        pLog->OpenLog(m_argOptFileName.GetFullPath(), CLog::DEBUG, !fOverwrite, fBinary);
       }
     } else
       pLog->CloseLog();
@@ -579,7 +597,7 @@ bool CStandardUI::DoShowLog (CCmdParser &cmd)
   CMDOUTS("Default console message level set to " << CLog::LevelToString(pLog->GetDefaultConsoleLevel()));
   if (pLog->IsLogFileOpen()) {
     CMDOUTS("Default log file message level set to " << CLog::LevelToString(pLog->GetDefaultFileLevel()));
-    CMDOUTS("Logging to file " << pLog->GetLogFileName());
+    CMDOUTS("Logging to " << (pLog->IsBinaryLog() ? "binary trace " : "") << "file " << pLog->GetLogFileName());
   } else {
     CMDOUTS("No log file opened");
   }
@@ -652,6 +670,34 @@ bool CStandardUI::DoShowCheckpoint (CCmdParser &cmd)
 }
 
 
+bool CStandardUI::DoShowCache (CCmdParser &cmd)
+{
+  //++
+  //   Show the statistics for every disk sector cache.  The hit rate is the
+  // thing to watch here - if it's low and there are lots of evictions, then
+  // the cache is probably too small ...
+  //--
+  //   Caches can come and go at any time, so take a snapshot of all the
+  // statistics first and then print that ...
+  vector<CSectorCache::CACHE_STATS> vecStats;
+  if (CSectorCache::GetAllStatistics(vecStats) == 0) {
+    CMDOUTS("No sector caches enabled");  CMDOUTS("");  return true;
+  }
+  for (size_t i = 0;  i < vecStats.size();  ++i) {
+    const CSectorCache::CACHE_STATS &stats = vecStats[i];
+    uint64_t llTotal = stats.llHits + stats.llMisses;
+    unsigned nRate = (llTotal > 0) ? (unsigned) ((stats.llHits*100ULL) / llTotal) : 0;
+    CMDOUTS(stats.sFileName << ": " << stats.nCount << "/"
+      << stats.nCapacity << " sectors in use, " << stats.nDirty << " dirty");
+    CMDOUTS("  " << stats.llHits << " hits, " << stats.llMisses << " misses ("
+      << nRate << "% hit rate), " << stats.llEvictions << " evictions, "
+      << stats.llWriteBacks << " write backs");
+  }
+  CMDOUTS("");
+  return true;
+}
+
+
 bool CStandardUI::DoDefine (CCmdParser &cmd)
 {
   //++
@@ -62,7 +62,7 @@ public:
 
   // Modifier definitions ...
 public:
-  static CCmdModifier m_modVerbosity, m_modNoFile, m_modConsole, m_modAppend;
+  static CCmdModifier m_modVerbosity, m_modNoFile, m_modConsole, m_modAppend, m_modBinary;
   static CCmdModifier m_modRows, m_modColumns, m_modTitle;
 #ifdef _WIN32
   static CCmdModifier m_modX, m_modY;
@@ -72,7 +72,7 @@ public:
 
   // Verb definitions ...
 public:
-  //   SET and SHOW LOG, SET and SHOW CHECKPOINT, SET WINDOW and
+  //   SET and SHOW LOG, SET and SHOW CHECKPOINT, SET WINDOW, SHOW CACHE and
   // SHOW ALIASES verb definitions ...
   static CCmdModifier * const m_modsSetLog[];
   static CCmdModifier * const m_modsSetWindow[];
@@ -80,6 +80,7 @@ public:
   static CCmdArgument * const m_argsShowAliases[];
   static CCmdVerb m_cmdSetLog, m_cmdSetWindow, m_cmdSetCheckpoint;
   static CCmdVerb m_cmdShowLog, m_cmdShowAliases, m_cmdShowCheckpoint;
+  static CCmdVerb m_cmdShowCache;
 
   // DEFINE and UNDEFINE verb definitions ...
 public:
@@ -104,7 +105,7 @@ public:
   static bool DoSetCheckpoint(CCmdParser &cmd), DoShowAliases(CCmdParser &cmd);
   static bool DoShowOneAlias(CCmdParser &cmd, string sAlias);
   static bool DoShowLog(CCmdParser &cmd), DoShowCheckpoint(CCmdParser &cmd);
-  static bool DoShowAllAliases(CCmdParser &cmd);
+  static bool DoShowAllAliases(CCmdParser &cmd), DoShowCache(CCmdParser &cmd);
 
   // Other "helper" routines ...
 public:
@@ -0,0 +1,467 @@
+//++
+// TapeLibrary.cpp -> CTapeLibrary (tape library/autoloader) methods
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the UPE LIBRARY project.  UPELIB is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    UPELIB is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   Mounting a tape with CTapeImageFile::Open() starts from scratch every
+// time - the tape knows nothing about its own structure until the first space
+// operation reads the whole thing to build the record index.  That's fine for
+// one tape, but multi volume backup and restore jobs mount dozens of them and
+// wait for every one.
+//
+//   CTapeLibrary acts like a tape library (or an autoloader, if you prefer).
+// It's given a directory, and every file in it with the right extension is a
+// volume.  All the volumes are opened as soon as the library is, and then a
+// background thread builds the record index for each one in turn.  Loading a
+// volume just rewinds the tape and hands it over, and since the index is
+// already there the drive can space over records and files right away.  The
+// volumes are opened with the index sidecar files enabled (see
+// CTapeImageFile::SetIndexFile()), so the next time the library is opened
+// most of the indexing is just loading those.
+//
+//   If somebody loads a volume that's being indexed right now, Load() waits
+// for the background thread to finish with it.  And if the volume hasn't been
+// indexed yet then it's loaded anyway, and the background thread leaves it
+// alone - the tape will build its own index the first time it's needed.
+//
+//   The tapes always belong to the library.  The caller can do anything with
+// a loaded tape except close or delete it, and should unload it when done.
+// Close() unloads everything, whether the caller has or not.
+//
+//   If SetValidation() is called first, a read only library also hands every
+// volume to a CTapeValidator, which checks them for damage in its own threads
+// while the index is being built.  GetValidation() returns the report for a
+// volume once it's done.  Writable libraries aren't validated, since a drive
+// could be writing a volume while the validator is reading it.
+//
+// REVISION HISTORY:
+// 16-OCT-26        New file.
+//--
+//000000001111111111222222222233333333334444444444555555555566666666667777777777
+//234567890123456789012345678901234567890123456789012345678901234567890123456789
+#include <stdlib.h>             // exit(), system(), etc ...
+#include <stdint.h>	        // uint8_t, uint32_t, etc ...
+#include <assert.h>             // assert() (what else??)
+#include <errno.h>              // ENOENT, EACCESS, etc ...
+#include <string.h>             // strcpy(), memset(), strerror(), etc ...
+#include <algorithm>            // std::sort() ...
+#ifdef _WIN32
+#include <io.h>                 // _findfirst(), _findnext(), etc ...
+#elif __linux__
+#include <dirent.h>             // opendir(), readdir(), etc ...
+#endif
+#include "UPELIB.hpp"           // UPE library definitions
+#include "SafeCRT.h"		// replacements for Microsoft "safe" CRT functions
+#include "LogFile.hpp"          // UPE library message logging facility
+#include "ImageFile.hpp"        // CTapeImageFile declarations
+#include "TapeLibrary.hpp"      // declarations for this module
+
+
+CTapeLibrary::CTapeLibrary()
+{
+  //++
+  //   The constructor just initializes everything - nothing happens until the
+  // library is opened ...
+  //--
+  m_fReadOnly = true;  m_pThread = NULL;
+  m_fValidate = false;  m_pValidator = NULL;
+}
+
+
+CTapeLibrary::~CTapeLibrary()
+{
+  //++
+  // Stop the background thread and close all the volumes ...
+  //--
+  Close();
+}
+
+
+bool CTapeLibrary::ListVolumes (vector<string> &vecNames) const
+{
+  //++
+  //   Make a list of the names (without the directory, but with the extension)
+  // of all the volumes in the library directory.  The list is sorted so that
+  // the volume numbers are the same every time, no matter what order the host
+  // file system returns them in.  Returns false if the directory can't be read.
+  //--
+  vecNames.clear();
+#ifdef _WIN32
+  struct _finddata_t fd;
+  string sPattern = MakePath("", m_sDirectory.c_str(), "*", m_sExtension.c_str());
+  intptr_t hFind = _findfirst(sPattern.c_str(), &fd);
+  if (hFind == -1) return (errno == ENOENT);
+  do {
+    if ((fd.attrib & _A_SUBDIR) == 0) vecNames.push_back(fd.name);
+  } while (_findnext(hFind, &fd) == 0);
+  _findclose(hFind);
+#elif __linux__
+  DIR *pDir = opendir(m_sDirectory.c_str());
+  if (pDir == NULL) return false;
+  struct dirent *pEntry;
+  while ((pEntry = readdir(pDir)) != NULL) {
+    size_t cbName = strlen(pEntry->d_name);
+    if (cbName <= m_sExtension.length()) continue;
+    if (_stricmp(pEntry->d_name+cbName-m_sExtension.length(), m_sExtension.c_str()) != 0) continue;
+    if (pEntry->d_type == DT_DIR) continue;
+    vecNames.push_back(pEntry->d_name);
+  }
+  closedir(pDir);
+#endif
+  std::sort(vecNames.begin(), vecNames.end());
+  return true;
+}
+
+
+uint32_t CTapeLibrary::AddVolume (const string &sName)
+{
+  //++
+  //   Open one volume and add it to the library.  If there's a current index
+  // sidecar file then the tape loads it when it's opened, and in that case
+  // there's nothing for the background thread to do.  Returns the new volume
+  // number, or NOVOLUME if the tape can't be opened.
+  //--
+  string sFileName = MakePath("", m_sDirectory.c_str(), sName.c_str(), "");
+  CTapeImageFile *pTape = DBGNEW CTapeImageFile();
+  pTape->SetIndexFile(true);
+  if (!pTape->Open(sFileName, m_fReadOnly)) {
+    delete pTape;  return NOVOLUME;
+  }
+  TAPE_VOLUME vol;
+  vol.sName = sName;  vol.pTape = pTape;
+  vol.nState = pTape->IsIndexed() ? VOLUME_READY : VOLUME_PENDING;
+  vol.fFailed = false;
+  vol.nReport = (m_pValidator != NULL) ? m_pValidator->AddTape(sFileName) : NOVOLUME;
+  m_StateLock.Enter();
+  m_vecVolumes.push_back(vol);
+  uint32_t nVolume = MKINT32(m_vecVolumes.size()-1);
+  m_StateLock.Leave();
+  return nVolume;
+}
+
+
+bool CTapeLibrary::Open (const string &sDirectory, bool fReadOnly, const string &sExtension)
+{
+  //++
+  //   Open every volume in the directory and start the background thread to
+  // index them.  Any volume that can't be opened is just left out (the tape
+  // has already logged the reason), but if the directory itself can't be read
+  // then the library isn't opened at all.
+  //--
+  assert(!IsOpen());
+  m_sDirectory = sDirectory;  m_sExtension = sExtension;
+  m_fReadOnly = fReadOnly;
+  vector<string> vecNames;
+  if (!ListVolumes(vecNames)) {
+    LOGS(ERROR, "unable to read tape library " << m_sDirectory);
+    return false;
+  }
+  if (m_fValidate && !m_fReadOnly) {
+    LOGS(WARNING, "only read only tape libraries are validated - " << m_sDirectory);
+  } else if (m_fValidate) {
+    m_pValidator = DBGNEW CTapeValidator();
+    if (!m_pValidator->Start()) {
+      LOGS(ERROR, "unable to start tape validator for " << m_sDirectory);
+      delete m_pValidator;  m_pValidator = NULL;
+    }
+  }
+  for (size_t i = 0;  i < vecNames.size();  ++i) AddVolume(vecNames[i]);
+
+  m_pThread = DBGNEW CThread(&CTapeLibrary::IndexThread, "tape library", 1, 1);
+  m_pThread->SetParameter(this);
+  if (!m_pThread->Begin()) {
+    LOGS(ERROR, "unable to start tape library thread for " << m_sDirectory);
+    delete m_pThread;  m_pThread = NULL;  Close();  return false;
+  }
+  LOGS(DEBUG, "tape library " << m_sDirectory << " opened with " << GetVolumeCount() << " volumes");
+  return true;
+}
+
+
+void CTapeLibrary::Close()
+{
+  //++
+  //   Stop the background thread and then close all the volumes, including
+  // any that are still loaded.  Any pointer returned by Load() is invalid
+  // after this!
+  //--
+  if (m_pThread != NULL) {
+    m_pThread->RequestExit();  m_pThread->RaiseFlag();
+    m_pThread->Wait();
+    delete m_pThread;  m_pThread = NULL;
+  }
+  if (m_pValidator != NULL) {
+    m_pValidator->Stop(false);
+    delete m_pValidator;  m_pValidator = NULL;
+  }
+  for (size_t i = 0;  i < m_vecVolumes.size();  ++i) {
+    if (m_vecVolumes[i].nState == VOLUME_LOADED)
+      LOGS(WARNING, "tape " << m_vecVolumes[i].sName << " still loaded when library closed");
+    delete m_vecVolumes[i].pTape;
+  }
+  m_vecVolumes.clear();
+}
+
+
+uint32_t CTapeLibrary::GetVolumeCount() const
+{
+  //++
+  //   Return the number of volumes in the library.  CreateVolume() can add one
+  // at any time, so even this needs the lock ...
+  //--
+  m_StateLock.Enter();
+  uint32_t nVolumes = MKINT32(m_vecVolumes.size());
+  m_StateLock.Leave();
+  return nVolumes;
+}
+
+
+string CTapeLibrary::GetVolumeName (uint32_t nVolume) const
+{
+  //++
+  // Return the name of a volume (a copy, since the list can move!) ...
+  //--
+  assert(nVolume < GetVolumeCount());
+  m_StateLock.Enter();
+  string sName = m_vecVolumes[nVolume].sName;
+  m_StateLock.Leave();
+  return sName;
+}
+
+
+uint32_t CTapeLibrary::GetIndexedCount() const
+{
+  //++
+  //   Return the number of volumes that are indexed and ready to load.  Loaded
+  // volumes don't count, since they belong to somebody else right now ...
+  //--
+  uint32_t nIndexed = 0;
+  m_StateLock.Enter();
+  for (size_t i = 0;  i < m_vecVolumes.size();  ++i)
+    if (m_vecVolumes[i].nState == VOLUME_READY) ++nIndexed;
+  m_StateLock.Leave();
+  return nIndexed;
+}
+
+
+const CTapeValidator::TAPE_REPORT *CTapeLibrary::GetValidation (uint32_t nVolume) const
+{
+  //++
+  //   Return the validation report for a volume, or NULL if the volume isn't
+  // being validated or the validator hasn't gotten to it yet ...
+  //--
+  assert(nVolume < GetVolumeCount());
+  if (m_pValidator == NULL) return NULL;
+  m_StateLock.Enter();
+  uint32_t nReport = m_vecVolumes[nVolume].nReport;
+  m_StateLock.Leave();
+  if ((nReport == NOVOLUME) || !m_pValidator->IsDone(nReport)) return NULL;
+  return &m_pValidator->GetReport(nReport);
+}
+
+
+bool CTapeLibrary::IsLoaded (uint32_t nVolume) const
+{
+  //++
+  // Return TRUE if this volume is loaded in a drive now ...
+  //--
+  assert(nVolume < GetVolumeCount());
+  m_StateLock.Enter();
+  bool fLoaded = m_vecVolumes[nVolume].nState == VOLUME_LOADED;
+  m_StateLock.Leave();
+  return fLoaded;
+}
+
+
+uint32_t CTapeLibrary::FindVolume (const string &sName) const
+{
+  //++
+  //   Find a volume by name, with or without the extension, and return its
+  // volume number or NOVOLUME if there isn't one.  Like the extension match
+  // in ListVolumes(), this is case insensitive.
+  //--
+  string sFull = sName + m_sExtension;
+  uint32_t nVolume = NOVOLUME;
+  m_StateLock.Enter();
+  for (uint32_t i = 0;  i < m_vecVolumes.size();  ++i) {
+    const char *pszVolume = m_vecVolumes[i].sName.c_str();
+    if ((_stricmp(pszVolume, sName.c_str()) == 0) || (_stricmp(pszVolume, sFull.c_str()) == 0)) {
+      nVolume = i;  break;
+    }
+  }
+  m_StateLock.Leave();
+  return nVolume;
+}
+
+
+uint32_t CTapeLibrary::CreateVolume (const string &sName)
+{
+  //++
+  //   Create a new, empty, volume (e.g. a scratch tape for the next part of a
+  // multi volume backup) and add it to the library.  The extension is added
+  // if it isn't already there.  An empty tape doesn't need to be indexed, so
+  // it's ready to load right away.  Returns the volume number, or NOVOLUME if
+  // the library is read only or the volume already exists.
+  //--
+  assert(IsOpen());
+  if (m_fReadOnly) {
+    LOGS(ERROR, "can't create a volume in read only tape library " << m_sDirectory);
+    return NOVOLUME;
+  }
+  if (FindVolume(sName) != NOVOLUME) {
+    LOGS(ERROR, "tape volume " << sName << " already exists");
+    return NOVOLUME;
+  }
+  string sFileName = sName;
+  if (   (sFileName.length() <= m_sExtension.length())
+      || (_stricmp(sFileName.c_str()+sFileName.length()-m_sExtension.length(), m_sExtension.c_str()) != 0))
+    sFileName += m_sExtension;
+  uint32_t nVolume = AddVolume(sFileName);
+  if (nVolume == NOVOLUME) return NOVOLUME;
+  m_StateLock.Enter();
+  if (m_vecVolumes[nVolume].nState == VOLUME_PENDING) {
+    //   The tape is empty, so this takes no time at all and there's no need
+    // to bother the background thread ...
+    bool fIndexed = m_vecVolumes[nVolume].pTape->BuildIndex();
+    m_vecVolumes[nVolume].fFailed = !fIndexed;
+    m_vecVolumes[nVolume].nState = fIndexed ? VOLUME_READY : VOLUME_FAILED;
+  }
+  m_StateLock.Leave();
+  return nVolume;
+}
+
+
+CTapeImageFile *CTapeLibrary::Load (uint32_t nVolume)
+{
+  //++
+  //   Load a volume into a drive and return the tape, positioned at the BOT.
+  // If the background thread is indexing this volume right now then we wait
+  // for it to finish (the thread holds m_IndexLock the whole time, so we just
+  // have to acquire it and let it go again).  Returns NULL if the volume
+  // doesn't exist or is already loaded.
+  //--
+  if (nVolume >= GetVolumeCount()) {
+    LOGS(ERROR, "no such tape volume in library " << m_sDirectory);
+    return NULL;
+  }
+  m_StateLock.Enter();
+  while (m_vecVolumes[nVolume].nState == VOLUME_SCANNING) {
+    m_StateLock.Leave();
+    m_IndexLock.Enter();  m_IndexLock.Leave();
+    m_StateLock.Enter();
+  }
+  TAPE_VOLUME &vol = m_vecVolumes[nVolume];
+  string sName = vol.sName;
+  if (vol.nState == VOLUME_LOADED) {
+    m_StateLock.Leave();
+    LOGS(ERROR, "tape " << sName << " is already loaded");
+    return NULL;
+  }
+  vol.nState = VOLUME_LOADED;
+  CTapeImageFile *pTape = vol.pTape;
+  m_StateLock.Leave();
+  pTape->Rewind();
+  LOGS(DEBUG, "tape " << sName << " loaded" << (pTape->IsIndexed() ? "" : " (not indexed)"));
+  return pTape;
+}
+
+
+bool CTapeLibrary::Unload (uint32_t nVolume)
+{
+  //++
+  //   Unload a volume.  It's rewound (which also writes out anything in the
+  // write behind buffer) and put back in the library, ready to load again.
+  // If it was loaded before the background thread got to it then it goes
+  // back in the queue, unless the tape has indexed itself in the meantime.
+  // But if the background thread already tried and failed, then it doesn't.
+  //
+  //   Note that CreateVolume() could move the volume list while we're busy
+  // rewinding, so the volume has to be looked up again afterwards!
+  //--
+  if (nVolume >= GetVolumeCount()) return false;
+  m_StateLock.Enter();
+  if (m_vecVolumes[nVolume].nState != VOLUME_LOADED) {
+    m_StateLock.Leave();  return false;
+  }
+  CTapeImageFile *pTape = m_vecVolumes[nVolume].pTape;
+  m_StateLock.Leave();
+  bool fOK = pTape->Rewind();
+  m_StateLock.Enter();
+  TAPE_VOLUME &vol = m_vecVolumes[nVolume];
+  if (pTape->IsIndexed())
+    vol.nState = VOLUME_READY;
+  else
+    vol.nState = vol.fFailed ? VOLUME_FAILED : VOLUME_PENDING;
+  m_StateLock.Leave();
+  m_pThread->RaiseFlag();
+  return fOK;
+}
+
+
+bool CTapeLibrary::Unload (const CTapeImageFile *pTape)
+{
+  //++
+  // Unload a volume given the tape that Load() returned ...
+  //--
+  uint32_t nVolume = NOVOLUME;
+  m_StateLock.Enter();
+  for (uint32_t i = 0;  i < m_vecVolumes.size();  ++i) {
+    if (m_vecVolumes[i].pTape == pTape) {
+      nVolume = i;  break;
+    }
+  }
+  m_StateLock.Leave();
+  return (nVolume != NOVOLUME) ? Unload(nVolume) : false;
+}
+
+
+void* THREAD_ATTRIBUTES CTapeLibrary::IndexThread (void *pParam)
+{
+  //++
+  //   This is the background thread.  It finds the next volume that needs to
+  // be indexed, indexes it, and repeats until there are no more.  Then it
+  // sleeps until somebody raises its flag (Unload() might have given it more
+  // to do) or asks it to exit.
+  //--
+  assert(pParam != NULL);
+  CThread *pThread = (CThread *) pParam;
+  CTapeLibrary *pThis = (CTapeLibrary *) pThread->GetParameter();
+  while (!pThread->IsExitRequested()) {
+    pThis->m_IndexLock.Enter();
+    pThis->m_StateLock.Enter();
+    CTapeImageFile *pTape = NULL;  uint32_t nVolume;
+    for (nVolume = 0;  nVolume < pThis->m_vecVolumes.size();  ++nVolume) {
+      if (pThis->m_vecVolumes[nVolume].nState == VOLUME_PENDING) {
+        pThis->m_vecVolumes[nVolume].nState = VOLUME_SCANNING;
+        pTape = pThis->m_vecVolumes[nVolume].pTape;  break;
+      }
+    }
+    pThis->m_StateLock.Leave();
+    if (pTape != NULL) {
+      bool fIndexed = pTape->BuildIndex();
+      pThis->m_StateLock.Enter();
+      pThis->m_vecVolumes[nVolume].fFailed = !fIndexed;
+      pThis->m_vecVolumes[nVolume].nState = fIndexed ? VOLUME_READY : VOLUME_FAILED;
+      pThis->m_StateLock.Leave();
+      if (!fIndexed) LOGS(WARNING, "unable to index tape " << pTape->GetFileName());
+    }
+    pThis->m_IndexLock.Leave();
+    if (pTape == NULL) pThread->WaitForFlag(1000);
+  }
+  LOGS(DEBUG, "tape library thread terminated");
+  return pThread->End();
+}
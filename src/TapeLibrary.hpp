@@ -0,0 +1,146 @@
+//++
+// TapeLibrary.hpp -> CTapeLibrary (tape library/autoloader) class
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the UPE LIBRARY project.  UPELIB is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    UPELIB is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   A CTapeLibrary object manages a directory full of TAP tape images, much
+// like a real tape library or autoloader manages a rack of cartridges.  Every
+// volume is opened up front and a background thread builds the record index
+// for each one, so loading a volume into a drive is instant and the drive can
+// space over files on it right away.  See TapeLibrary.cpp for the details.
+//
+// REVISION HISTORY:
+// 16-OCT-26        New file.
+//--
+#pragma once
+#include <string>               // C++ std::string class, et al ...
+#include <vector>               // C++ std::vector template
+using std::string;              // ...
+using std::vector;              // ...
+#include "Mutex.hpp"            // needed for CMutex ...
+#include "Thread.hpp"           // needed for CThread and THREAD_ATTRIBUTES
+#include "TapeValidator.hpp"    // needed for CTapeValidator::TAPE_REPORT
+class CTapeImageFile;           // the volumes themselves ...
+
+
+class CTapeLibrary {
+  //++
+  //--
+
+  // Constants ...
+public:
+  enum {
+    NOVOLUME    = 0xFFFFFFFFUL, // returned by FindVolume() for no match
+  };
+
+  //   Each volume in the library has one of these.  The tape image is opened
+  // as soon as the library is, and then the background thread indexes each
+  // VOLUME_PENDING volume in turn.  Loading a volume marks it VOLUME_LOADED,
+  // and after that it belongs to the caller (and the background thread won't
+  // touch it) until it's unloaded again.  If indexing fails the volume is
+  // VOLUME_FAILED - it can still be loaded, but it's never retried.
+protected:
+  enum VOLUME_STATE {
+    VOLUME_PENDING,             // waiting to be indexed
+    VOLUME_SCANNING,            // being indexed now
+    VOLUME_READY,               // indexed and ready to load
+    VOLUME_FAILED,              // indexing failed, but can still be loaded
+    VOLUME_LOADED,              // loaded in a drive
+  };
+  struct _TAPE_VOLUME {
+    string          sName;      // volume name (the file name only)
+    CTapeImageFile *pTape;      // the tape image itself
+    VOLUME_STATE    nState;     // current state of this volume
+    bool            fFailed;    // TRUE if indexing this volume failed
+    uint32_t        nReport;    // validator tape number (or NOVOLUME)
+  };
+  typedef struct _TAPE_VOLUME TAPE_VOLUME;
+
+  // Constructor and destructor ...
+public:
+  CTapeLibrary();
+  virtual ~CTapeLibrary();
+private:
+  // Disallow copy and assignment operations with CTapeLibrary objects...
+  CTapeLibrary (const CTapeLibrary &r) = delete;
+  CTapeLibrary& operator= (const CTapeLibrary &r) = delete;
+
+  // Public properties ...
+public:
+  // Return TRUE if the library is open ...
+  bool IsOpen() const {return m_pThread != NULL;}
+  // Return the library directory and whether the volumes are read only ...
+  string GetDirectory() const {return m_sDirectory;}
+  bool IsReadOnly() const {return m_fReadOnly;}
+  //   Check every volume for damage in the background when the library is
+  // opened (read only libraries only).  Call this before Open() ...
+  void SetValidation (bool fValidate=true) {m_fValidate = fValidate;}
+  bool IsValidation() const {return m_fValidate;}
+  // Return the number of volumes and the name of any one ...
+  uint32_t GetVolumeCount() const;
+  string GetVolumeName (uint32_t nVolume) const;
+  // Return the number of volumes indexed and ready to load ...
+  uint32_t GetIndexedCount() const;
+  // Return TRUE if a volume is loaded now ...
+  bool IsLoaded (uint32_t nVolume) const;
+  // Return the validation report for a volume, or NULL if it isn't done ...
+  const CTapeValidator::TAPE_REPORT *GetValidation (uint32_t nVolume) const;
+
+  // Public methods ...
+public:
+  //   Open all the volumes (files with the given extension) in a directory and
+  // start indexing them, or close them all ...
+  bool Open (const string &sDirectory, bool fReadOnly=true, const string &sExtension=".tap");
+  void Close();
+  // Find a volume by name (with or without the extension) ...
+  uint32_t FindVolume (const string &sName) const;
+  // Create a new, empty, volume (writable libraries only) ...
+  uint32_t CreateVolume (const string &sName);
+  //   Load a volume (rewound to the BOT) and return the tape, or unload it.
+  // The tape still belongs to the library - don't delete or close it!
+  CTapeImageFile *Load (uint32_t nVolume);
+  CTapeImageFile *Load (const string &sName) {return Load(FindVolume(sName));}
+  bool Unload (uint32_t nVolume);
+  bool Unload (const CTapeImageFile *pTape);
+
+  // Local methods ...
+protected:
+  // Make a list of all the volume names in the directory ...
+  bool ListVolumes (vector<string> &vecNames) const;
+  // Open one volume and add it to the library ...
+  uint32_t AddVolume (const string &sName);
+  // Background thread ...
+  static void* THREAD_ATTRIBUTES IndexThread (void *pParam);
+
+  // Local members ...
+protected:
+  string        m_sDirectory;   // directory that holds the volumes
+  string        m_sExtension;   // file name extension for volumes
+  bool          m_fReadOnly;    // TRUE if the volumes are read only
+  vector<TAPE_VOLUME> m_vecVolumes; // all the volumes in the library
+  //   m_StateLock protects the volume states and the volume list, since
+  // CreateVolume() can add to it at any time.  That can move the whole list,
+  // so never hold on to a reference to a volume after releasing m_StateLock -
+  // use the volume number instead.  The background thread holds m_IndexLock
+  // the whole time it's indexing a volume, so Load() can wait for it to
+  // finish.  m_IndexLock is always taken first, never the other way around.
+  mutable CMutex m_StateLock;   // protects the volume states
+  CMutex        m_IndexLock;    // held while a volume is being indexed
+  CThread      *m_pThread;      // background indexing thread
+  bool          m_fValidate;    // TRUE to validate the volumes when opened
+  CTapeValidator *m_pValidator; // volume validator (or NULL if none)
+};
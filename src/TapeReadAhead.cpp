@@ -0,0 +1,330 @@
+//++
+// TapeReadAhead.cpp -> CTapeReadAhead (tape image read ahead buffer) methods
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the UPE LIBRARY project.  UPELIB is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    UPELIB is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   Reading a tape image sequentially (e.g. restoring a backup) is by far the
+// most common thing anybody does with a tape, and ReadForwardRecord() needs
+// several fread() calls and an ftell() for every record.  Worse, all of that
+// happens on the emulator's tape controller thread, so every time the stdio
+// buffer runs dry the controller waits for the host disk.
+//
+//   CTapeReadAhead fixes both problems.  It keeps two large buffers, each of
+// which holds one "window" of the tape image file.  ReadForwardRecord() parses
+// records directly out of the current buffer, and when it moves on into the
+// second buffer the first one is handed to a background thread to be refilled
+// with the window after that.  As long as the emulator reads sequentially, the
+// next buffer is always ready before it's needed and the controller thread
+// never touches the file at all.
+//
+//   The background thread uses its own handle for the image file, so it never
+// disturbs the stdio file position used by the rest of CTapeImageFile.  If the
+// caller asks for something that isn't in either window (i.e. the tape was
+// repositioned) then both buffers are restarted at the new position.  And if
+// the background thread hasn't gotten to a buffer by the time it's needed, the
+// caller just reads it itself rather than waiting.
+//
+//   The buffers are only ever read by the caller, and the caller is the only
+// one who decides what window each buffer holds, so the only things that need
+// to be protected are the buffer states.  A buffer's data is never touched
+// except by whoever is filling it until it's marked BUFFER_READY, and once it
+// is nobody changes it until the caller reassigns it.  That's also why the
+// caller can keep its own description of the current buffer (m_pabWindow et
+// al) - as long as the header, data and trailer of a record are all inside
+// that buffer, Peek() hands them out with no lock and no copy at all, and
+// only moving on to the next buffer goes thru Locate() and the state lock.
+//
+// REVISION HISTORY:
+// 16-OCT-26        New file.
+//--
+//000000001111111111222222222233333333334444444444555555555566666666667777777777
+//234567890123456789012345678901234567890123456789012345678901234567890123456789
+#include <stdlib.h>             // exit(), system(), etc ...
+#include <stdint.h>	        // uint8_t, uint32_t, etc ...
+#include <assert.h>             // assert() (what else??)
+#include <errno.h>              // ENOENT, EACCESS, etc ...
+#include <string.h>             // memcpy(), memset(), etc ...
+#include "UPELIB.hpp"           // UPE library definitions
+#include "SafeCRT.h"		// replacements for Microsoft "safe" CRT functions
+#include "LogFile.hpp"          // UPE library message logging facility
+#include "TapeReadAhead.hpp"    // declarations for this module
+
+//   Microsoft spells the 64 bit versions of fseek() and ftell() differently,
+// but otherwise they're the same as the POSIX ones ...
+#ifdef _WIN32
+#define fseeko(f,o,w)   _fseeki64(f,o,w)
+#define ftello(f)       _ftelli64(f)
+#endif
+
+
+CTapeReadAhead::CTapeReadAhead (size_t cbBuffer)
+{
+  //++
+  //   Allocate the buffers and create the background thread, but DO NOT start
+  // it running yet.  That happens when the image is opened ...
+  //--
+  assert(cbBuffer >= MIN_BUFFER);
+  m_pFile = NULL;  m_cbBuffer = cbBuffer;  m_nCurrent = 0;
+  m_pabWindow = NULL;  m_llWindow = 0;  m_cbWindow = 0;
+  m_llFills = m_llStalls = m_llRestarts = 0;
+  for (uint32_t i = 0;  i < NBUFFERS;  ++i) {
+    m_aBuffers[i].llOffset = 0;  m_aBuffers[i].cbData = 0;
+    m_aBuffers[i].nState = BUFFER_EMPTY;
+    m_aBuffers[i].pabData = DBGNEW uint8_t[m_cbBuffer];
+  }
+  m_pThread = DBGNEW CThread(&CTapeReadAhead::ReadAheadThread, "tape read ahead", 1, 1);
+  m_pThread->SetParameter(this);
+}
+
+
+CTapeReadAhead::~CTapeReadAhead()
+{
+  //++
+  // Stop the background thread, close the file and free the buffers ...
+  //--
+  Close();
+  delete m_pThread;
+  for (uint32_t i = 0;  i < NBUFFERS;  ++i) delete []m_aBuffers[i].pabData;
+}
+
+
+bool CTapeReadAhead::Error (const char *pszMsg, int nError) const
+{
+  //++
+  // Print a read ahead error message and then always return false ...
+  //--
+  char sz[80];
+  LOGS(ERROR, "error (" << nError << ") " << pszMsg << " tape " << m_sFileName);
+  if (nError > 0) {
+    strerror_s(sz, sizeof(sz), nError);
+    LOGS(ERROR, sz);
+  }
+  return false;
+}
+
+
+bool CTapeReadAhead::Open (const string &sFileName)
+{
+  //++
+  //   Open our own read only handle for the tape image and start the
+  // background thread.  Nothing is actually read until the first Read() ...
+  //--
+  assert(m_pFile == NULL);
+  m_sFileName = sFileName;
+  m_pFile = fopen(m_sFileName.c_str(), "rb");
+  if (m_pFile == NULL) return Error("opening read ahead for", errno);
+  if (!m_pThread->Begin()) {
+    fclose(m_pFile);  m_pFile = NULL;
+    return Error("starting read ahead thread for", 0);
+  }
+  LOGS(DEBUG, "read ahead enabled for " << m_sFileName << ", " << NBUFFERS << " buffers of " << m_cbBuffer << " bytes");
+  return true;
+}
+
+
+void CTapeReadAhead::Close()
+{
+  //++
+  //   Stop the background thread and close our file handle.  Whatever was
+  // buffered is gone after this ...
+  //--
+  if (m_pFile == NULL) return;
+  m_pThread->RequestExit();  m_pThread->RaiseFlag();
+  m_pThread->Wait();
+  fclose(m_pFile);  m_pFile = NULL;
+  for (uint32_t i = 0;  i < NBUFFERS;  ++i) m_aBuffers[i].nState = BUFFER_EMPTY;
+  m_pabWindow = NULL;  m_cbWindow = 0;
+}
+
+
+void CTapeReadAhead::WaitBuffer (uint32_t nBuffer)
+{
+  //++
+  //   If somebody (i.e. the background thread) is filling this buffer right
+  // now, then wait for them to finish.  The filler holds the buffer's fill
+  // lock the whole time, so we just have to acquire it and let it go again.
+  // The state lock must be held when this is called, and it's released while
+  // we wait ...
+  //--
+  while (m_aBuffers[nBuffer].nState == BUFFER_FILLING) {
+    m_StateLock.Leave();
+    m_aFillLocks[nBuffer].Enter();  m_aFillLocks[nBuffer].Leave();
+    m_StateLock.Enter();
+  }
+}
+
+
+void CTapeReadAhead::FillBuffer (uint32_t nBuffer)
+{
+  //++
+  //   Read the data for a pending buffer.  This is called by the background
+  // thread, or by Locate() if the background thread hasn't gotten around to
+  // it yet.  The state lock must NOT be held when this is called, and by the
+  // time we get it somebody else might have already filled this buffer.  The
+  // fill lock is held the whole time the buffer is BUFFER_FILLING - that's
+  // what makes WaitBuffer() work.  Notice that the fill lock is always taken
+  // before the state lock, never the other way around.
+  //
+  //   If there's an error then we just log it and mark the buffer as short.
+  // ReadForwardRecord() will find a truncated record there and return BADTAPE.
+  //--
+  STREAM_BUFFER &buf = m_aBuffers[nBuffer];
+  m_aFillLocks[nBuffer].Enter();
+  m_StateLock.Enter();
+  if (buf.nState != BUFFER_PENDING) {
+    m_StateLock.Leave();  m_aFillLocks[nBuffer].Leave();  return;
+  }
+  buf.nState = BUFFER_FILLING;
+  uint64_t llOffset = buf.llOffset;
+  m_StateLock.Leave();
+
+  size_t cbData = 0;
+  m_FileLock.Enter();
+  if (fseeko(m_pFile, llOffset, SEEK_SET) != 0)
+    Error("seek read ahead", errno);
+  else {
+    cbData = fread(buf.pabData, 1, m_cbBuffer, m_pFile);
+    if (ferror(m_pFile)) {Error("read ahead", errno);  clearerr(m_pFile);}
+  }
+  m_FileLock.Leave();
+
+  m_StateLock.Enter();
+  buf.cbData = cbData;  buf.nState = BUFFER_READY;  ++m_llFills;
+  m_StateLock.Leave();
+  m_aFillLocks[nBuffer].Leave();
+}
+
+
+void CTapeReadAhead::Assign (uint32_t nBuffer, uint64_t llOffset)
+{
+  //++
+  //   Give a buffer a new window and mark it pending.  If it's being filled
+  // now we have to wait for that to finish first, since somebody is still
+  // writing into it!  The state lock must be held ...
+  //--
+  WaitBuffer(nBuffer);
+  m_aBuffers[nBuffer].llOffset = llOffset;  m_aBuffers[nBuffer].cbData = 0;
+  m_aBuffers[nBuffer].nState = BUFFER_PENDING;
+}
+
+
+const uint8_t *CTapeReadAhead::Locate (uint64_t llOffset, size_t &cbAvailable)
+{
+  //++
+  //   Return a pointer to the buffered data for llOffset, and the number of
+  // bytes available there.  If the offset is in the window of the next
+  // buffer, then we've moved on - the next buffer becomes the current one and
+  // the old current buffer is recycled for the window after that.  If it's in
+  // neither window then we restart both buffers at this offset.  Either way,
+  // if the current buffer isn't ready yet then we wait for it (or fill it
+  // ourselves).  NULL is returned for any offset past the end of the file.
+  //--
+  m_StateLock.Enter();
+  if (!InWindow(m_nCurrent, llOffset)) {
+    uint32_t nNext = (m_nCurrent+1) % NBUFFERS;
+    if (InWindow(nNext, llOffset)) {
+      uint32_t nOld = m_nCurrent;  m_nCurrent = nNext;
+      Assign(nOld, m_aBuffers[nNext].llOffset+m_cbBuffer);
+    } else {
+      ++m_llRestarts;
+      Assign(m_nCurrent, llOffset);  Assign(nNext, llOffset+m_cbBuffer);
+    }
+    m_pThread->RaiseFlag();
+  }
+  STREAM_BUFFER &buf = m_aBuffers[m_nCurrent];
+  while (buf.nState != BUFFER_READY) {
+    WaitBuffer(m_nCurrent);
+    if (buf.nState == BUFFER_PENDING) {
+      ++m_llStalls;  m_StateLock.Leave();
+      FillBuffer(m_nCurrent);
+      m_StateLock.Enter();
+    }
+  }
+  m_StateLock.Leave();
+  m_pabWindow = buf.pabData;  m_llWindow = buf.llOffset;  m_cbWindow = buf.cbData;
+
+  uint64_t llDelta = llOffset - buf.llOffset;
+  if (llDelta >= buf.cbData) {cbAvailable = 0;  return NULL;}
+  cbAvailable = buf.cbData - (size_t) llDelta;
+  return buf.pabData + llDelta;
+}
+
+
+size_t CTapeReadAhead::Read (uint64_t llOffset, void *pData, size_t cbData)
+{
+  //++
+  //   Copy cbData bytes from the tape image, starting at llOffset, to the
+  // caller's buffer.  The data may well span two buffers, which is why this
+  // is a loop.  The number of bytes actually copied is returned, and it'll
+  // be less than cbData only if we hit the end of the file.
+  //--
+  assert(m_pFile != NULL);
+  uint8_t *pabData = (uint8_t *) pData;  size_t cbDone = 0;
+  while (cbDone < cbData) {
+    size_t cbAvailable;
+    const uint8_t *pabBuffer = Locate(llOffset+cbDone, cbAvailable);
+    if (pabBuffer == NULL) break;
+    size_t cbCopy = MIN(cbAvailable, cbData-cbDone);
+    memcpy(pabData+cbDone, pabBuffer, cbCopy);
+    cbDone += cbCopy;
+  }
+  return cbDone;
+}
+
+
+void CTapeReadAhead::Discard()
+{
+  //++
+  //   Throw away everything that's buffered.  This has to be called whenever
+  // the tape is written, since the buffers might hold the old data.  Any fill
+  // that's in progress has to finish first ...
+  //--
+  m_StateLock.Enter();
+  for (uint32_t i = 0;  i < NBUFFERS;  ++i) {
+    WaitBuffer(i);  m_aBuffers[i].nState = BUFFER_EMPTY;
+  }
+  m_StateLock.Leave();
+  m_pabWindow = NULL;  m_cbWindow = 0;
+}
+
+
+void* THREAD_ATTRIBUTES CTapeReadAhead::ReadAheadThread (void *pParam)
+{
+  //++
+  //   This is the background thread.  It fills pending buffers, starting with
+  // the current one (in case the stream was just restarted), until there are
+  // no more and then sleeps until somebody raises its flag.
+  //--
+  assert(pParam != NULL);
+  CThread *pThread = (CThread *) pParam;
+  CTapeReadAhead *pThis = (CTapeReadAhead *) pThread->GetParameter();
+  while (!pThread->IsExitRequested()) {
+    uint32_t nBuffer = NBUFFERS;
+    pThis->m_StateLock.Enter();
+    for (uint32_t i = 0;  i < NBUFFERS;  ++i) {
+      uint32_t n = (pThis->m_nCurrent+i) % NBUFFERS;
+      if (pThis->m_aBuffers[n].nState == BUFFER_PENDING) {nBuffer = n;  break;}
+    }
+    pThis->m_StateLock.Leave();
+    if (nBuffer < NBUFFERS)
+      pThis->FillBuffer(nBuffer);
+    else
+      pThread->WaitForFlag(100);
+  }
+  LOGS(DEBUG, "tape read ahead thread terminated");
+  return pThread->End();
+}
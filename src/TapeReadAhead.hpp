@@ -0,0 +1,150 @@
+//++
+// TapeReadAhead.hpp -> CTapeReadAhead (tape image read ahead buffer) class
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the UPE LIBRARY project.  UPELIB is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    UPELIB is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   A CTapeReadAhead object is a double buffered, read ahead, stream for a
+// single tape image.  It's created by CTapeImageFile::EnableReadAhead(), and
+// after that ReadForwardRecord() parses records directly out of its buffers
+// while a background thread reads the next chunk of the file.  See
+// TapeReadAhead.cpp for the details.
+//
+// REVISION HISTORY:
+// 16-OCT-26        New file.
+//--
+#pragma once
+#include <stdio.h>              // FILE, fread(), etc ...
+#include <string>               // C++ std::string class, et al ...
+using std::string;              // ...
+#include "Mutex.hpp"            // needed for CMutex ...
+#include "Thread.hpp"           // needed for CThread and THREAD_ATTRIBUTES
+
+
+class CTapeReadAhead {
+  //++
+  //--
+
+  // Constants ...
+public:
+  enum {
+    DEFAULT_BUFFER  = 256*1024,     // default size of each buffer
+    MIN_BUFFER      = 64*1024,      // smallest buffer size we'll accept
+    NBUFFERS        = 2,            // number of buffers (double buffering!)
+  };
+
+  //   Each buffer holds one window of the tape image file, cbBuffer bytes
+  // long and starting at llOffset.  The consumer (i.e. ReadForwardRecord())
+  // decides which window each buffer holds and marks it BUFFER_PENDING, and
+  // then whoever gets to it first - usually the background thread - reads
+  // the data.  BUFFER_FILLING means that somebody is reading it right now,
+  // and BUFFER_READY means the data is there and won't change until the
+  // consumer reassigns the buffer.  cbData is less than the window size only
+  // at the end of the file.
+protected:
+  enum BUFFER_STATE {
+    BUFFER_EMPTY,               // buffer not in use
+    BUFFER_PENDING,             // window assigned, needs to be read
+    BUFFER_FILLING,             // being read now
+    BUFFER_READY,               // contains valid data
+  };
+  struct _STREAM_BUFFER {
+    uint64_t      llOffset;     // file offset of the first byte
+    size_t        cbData;       // number of valid bytes in the buffer
+    BUFFER_STATE  nState;       // current state of this buffer
+    uint8_t      *pabData;      // the data itself
+  };
+  typedef struct _STREAM_BUFFER STREAM_BUFFER;
+
+  // Constructor and destructor ...
+public:
+  CTapeReadAhead (size_t cbBuffer=DEFAULT_BUFFER);
+  virtual ~CTapeReadAhead();
+private:
+  // Disallow copy and assignment operations with CTapeReadAhead objects...
+  CTapeReadAhead (const CTapeReadAhead &r) = delete;
+  CTapeReadAhead& operator= (const CTapeReadAhead &r) = delete;
+
+  // Public properties ...
+public:
+  // Return the size of each buffer ...
+  size_t GetBufferSize() const {return m_cbBuffer;}
+  //   Return the number of buffers filled, the number filled by the caller
+  // because the background thread didn't get there first, and the number of
+  // times the stream had to be restarted at a new position ...
+  uint64_t GetFills() const {return m_llFills;}
+  uint64_t GetStalls() const {return m_llStalls;}
+  uint64_t GetRestarts() const {return m_llRestarts;}
+
+  // Public methods ...
+public:
+  // Open the tape image (our own handle!) and start the background thread ...
+  bool Open (const string &sFileName);
+  void Close();
+  //   Copy cbData bytes starting at llOffset into pData.  The return value is
+  // the number of bytes actually copied, and it's less than cbData only if
+  // we hit the end of the file ...
+  size_t Read (uint64_t llOffset, void *pData, size_t cbData);
+  //   Return a pointer to cbData bytes at llOffset if they're all in the
+  // current buffer, or NULL if they're not.  This is the fast path - there's
+  // no lock and no copy, and the pointer is good until the next Read(),
+  // Discard() or Close() ...
+  const uint8_t *Peek (uint64_t llOffset, size_t cbData) const
+    {return ((llOffset >= m_llWindow) && (cbData <= m_cbWindow) && (llOffset-m_llWindow <= m_cbWindow-cbData))
+          ? m_pabWindow + (llOffset-m_llWindow) : NULL;}
+  // Forget everything that's buffered (e.g. because the tape was written) ...
+  void Discard();
+
+  // Local methods ...
+protected:
+  // Return a pointer to the buffered data at llOffset ...
+  const uint8_t *Locate (uint64_t llOffset, size_t &cbAvailable);
+  // Assign a window to a buffer ...
+  void Assign (uint32_t nBuffer, uint64_t llOffset);
+  // Wait for a buffer to finish filling, or fill it now ...
+  void WaitBuffer (uint32_t nBuffer);
+  void FillBuffer (uint32_t nBuffer);
+  // Return TRUE if a buffer's window includes this offset ...
+  bool InWindow (uint32_t nBuffer, uint64_t llOffset) const
+    {return (m_aBuffers[nBuffer].nState != BUFFER_EMPTY)
+         && (llOffset >= m_aBuffers[nBuffer].llOffset)
+         && (llOffset <  m_aBuffers[nBuffer].llOffset+m_cbBuffer);}
+  // Print an error message and return false ...
+  bool Error (const char *pszMsg, int nError) const;
+  // Background thread ...
+  static void* THREAD_ATTRIBUTES ReadAheadThread (void *pParam);
+
+  // Local members ...
+protected:
+  string        m_sFileName;    // name of the tape image file
+  FILE         *m_pFile;        // our own handle for the image file
+  size_t        m_cbBuffer;     // size of each buffer
+  uint32_t      m_nCurrent;     // buffer we're reading from now
+  //   These describe the current buffer as the caller last saw it, once it
+  // was BUFFER_READY.  Only the caller uses or changes them, so Peek() needs
+  // no lock ...
+  const uint8_t *m_pabWindow;   // data in the current buffer
+  uint64_t      m_llWindow;     // file offset of m_pabWindow[0]
+  size_t        m_cbWindow;     // number of valid bytes there
+  STREAM_BUFFER m_aBuffers[NBUFFERS]; // the buffers themselves
+  CMutex        m_StateLock;    // protects the buffer states and windows
+  CMutex        m_aFillLocks[NBUFFERS]; // held while each buffer is filling
+  CMutex        m_FileLock;     // serializes access to m_pFile
+  CThread      *m_pThread;      // background read ahead thread
+  uint64_t      m_llFills;      // number of buffers filled
+  uint64_t      m_llStalls;     // number of fills done by the caller
+  uint64_t      m_llRestarts;   // number of non-sequential restarts
+};
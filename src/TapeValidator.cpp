@@ -0,0 +1,615 @@
+//++
+// TapeValidator.cpp -> CTapeValidator (tape image integrity checker) methods
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the UPE LIBRARY project.  UPELIB is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    UPELIB is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   CTapeImageFile stops at the first thing it doesn't like - a header and
+// trailer that don't match, invalid metadata, or a tape that ends in the
+// middle of a record are all just BADTAPE, and nothing after that point can
+// be read.  That's the right thing for an emulated tape drive, but it's no
+// help at all when you want to know what's wrong with a tape, or how much of
+// it can be saved.
+//
+//   CTapeValidator walks the whole tape image, record by record, and reports
+// every problem it finds along the way.  When it finds a damaged record it
+// doesn't give up - it searches forward, one byte at a time, for the next
+// place that looks like the start of a good record and picks up from there.
+// "Looks like" means that the record at that spot and the one after it both
+// have matching headers and trailers, which is very unlikely to happen by
+// accident.  There's one special case - if the record after a header and
+// trailer mismatch starts exactly where it should, then only the trailer was
+// damaged and the record itself is fine.
+//
+//   Optionally it also writes a repaired copy of the tape.  Good records are
+// copied as is (except that padded odd length records lose their padding),
+// records with a damaged trailer get a new one, and anything that can't be
+// parsed at all becomes a single bad data (class 8) record.  That way an
+// emulated drive reading the repaired tape gets a data error in the same
+// place the damage was, rather than the end of the tape, and the rest of the
+// tape can still be read.  Anything after an end of medium marker is ignored,
+// exactly as simh does.
+//
+//   The tapes are read thru a CTapeImageFile (we're a friend, so we can use
+// ReadAt()), which means compressed tapes work too.  Tapes are memory mapped
+// when possible, so on Linux checking a tape goes about as fast as the disk
+// can read it.  Each tape is checked by a single thread because there's no
+// way to find the record boundaries in the middle of a tape without starting
+// at the beginning, but any number of tapes can be added to the validator and
+// they're checked in parallel by a pool of worker threads.  That's the same
+// scheme as CAsyncDiskIO - the workers sleep on their CThread flag when
+// there's nothing to do, and AddTape() wakes them up.  CTapeLibrary uses this
+// to check its volumes in the background when they're mounted.
+//
+// REVISION HISTORY:
+// 16-OCT-26        New file.
+//--
+//000000001111111111222222222233333333334444444444555555555566666666667777777777
+//234567890123456789012345678901234567890123456789012345678901234567890123456789
+#include <stdlib.h>             // exit(), system(), etc ...
+#include <stdint.h>	        // uint8_t, uint32_t, etc ...
+#include <stdio.h>              // fopen(), fwrite(), etc ...
+#include <errno.h>              // errno ...
+#include <assert.h>             // assert() (what else??)
+#include "UPELIB.hpp"           // UPE library definitions
+#include "LogFile.hpp"          // UPE library message logging facility
+#include "ImageFile.hpp"        // CTapeImageFile declarations
+#include "TapeValidator.hpp"    // declarations for this module
+
+
+CTapeValidator::CTapeValidator (uint32_t nThreads)
+{
+  //++
+  //   Create the worker thread objects, but DO NOT start them running yet.
+  // Somebody has to call the Start() method for that ...
+  //--
+  assert((nThreads > 0) && (nThreads <= MAXTHREADS));
+  m_fRunning = false;  m_nPending = 0;
+  m_cbMaxRecord = CTapeImageFile::MAXRECLEN;
+  for (uint32_t i = 0;  i < nThreads;  ++i) {
+    CThread *pThread = DBGNEW CThread(&CTapeValidator::WorkerThread, "tape validator", 1, 1);
+    pThread->SetParameter(this);
+    m_vecThreads.push_back(pThread);
+  }
+}
+
+
+CTapeValidator::~CTapeValidator()
+{
+  //++
+  // Stop all the worker threads and then delete them and the reports ...
+  //--
+  Stop();
+  for (size_t i = 0;  i < m_vecThreads.size();  ++i) delete m_vecThreads[i];
+  m_vecThreads.clear();
+  for (size_t i = 0;  i < m_vecReports.size();  ++i) delete m_vecReports[i];
+  m_vecReports.clear();
+}
+
+
+bool CTapeValidator::Start()
+{
+  //++
+  // Start all the worker threads running ...
+  //--
+  if (m_fRunning) return true;
+  for (size_t i = 0;  i < m_vecThreads.size();  ++i) {
+    if (!m_vecThreads[i]->Begin()) {
+      //   If we can't start them all, then stop the ones we did start.  The
+      // rest never started, so RequestExit() is harmless for them.
+      for (size_t j = 0;  j < i;  ++j) {
+        m_vecThreads[j]->RequestExit();  m_vecThreads[j]->RaiseFlag();
+        m_vecThreads[j]->Wait();
+      }
+      return false;
+    }
+  }
+  m_fRunning = true;
+  return true;
+}
+
+
+void CTapeValidator::Stop (bool fFlush)
+{
+  //++
+  //   Stop all the worker threads.  Normally any tapes still in the queue are
+  // checked first, so this is also the way to wait for all of them to finish.
+  // If fFlush is false then the tapes nobody has started on yet are dropped
+  // instead, and their reports are never done ...
+  //--
+  if (!m_fRunning) return;
+  if (!fFlush) {
+    m_QueueLock.Enter();
+    m_nPending -= MKINT32(m_qPending.size());  m_qPending.clear();
+    m_QueueLock.Leave();
+  }
+  for (size_t i = 0;  i < m_vecThreads.size();  ++i)
+    m_vecThreads[i]->RequestExit();
+  WakeWorkers();
+  for (size_t i = 0;  i < m_vecThreads.size();  ++i)
+    m_vecThreads[i]->Wait();
+  m_fRunning = false;
+}
+
+
+void CTapeValidator::WakeWorkers()
+{
+  //++
+  // Raise the flag for every worker thread ...
+  //--
+  for (size_t i = 0;  i < m_vecThreads.size();  ++i)
+    m_vecThreads[i]->RaiseFlag();
+}
+
+
+uint32_t CTapeValidator::AddTape (const string &sFileName, const string &sRepairFile)
+{
+  //++
+  //   Add a tape to the queue and wake up the workers.  This can be called
+  // before or after Start(), but nothing happens until the threads are
+  // running.  Returns the tape number, for IsDone() and GetReport() ...
+  //--
+  TAPE_REPORT *pReport = DBGNEW TAPE_REPORT;
+  pReport->sFileName = sFileName;  pReport->sRepairFile = sRepairFile;
+  pReport->fDone = pReport->fOpened = pReport->fDamaged = pReport->fRepaired = false;
+  pReport->llLength = 0;  pReport->nRecords = pReport->nMarks = 0;
+  pReport->nBadRecords = pReport->nProblems = 0;
+  m_QueueLock.Enter();
+  m_vecReports.push_back(pReport);
+  uint32_t nTape = MKINT32(m_vecReports.size()-1);
+  m_qPending.push_back(pReport);  ++m_nPending;
+  m_QueueLock.Leave();
+  if (m_fRunning) WakeWorkers();
+  return nTape;
+}
+
+
+uint32_t CTapeValidator::GetTapeCount() const
+{
+  //++
+  // Return the number of tapes ever added ...
+  //--
+  m_QueueLock.Enter();
+  uint32_t nTapes = MKINT32(m_vecReports.size());
+  m_QueueLock.Leave();
+  return nTapes;
+}
+
+
+uint32_t CTapeValidator::GetPendingCount() const
+{
+  //++
+  // Return the number of tapes added but not yet checked ...
+  //--
+  m_QueueLock.Enter();
+  uint32_t nPending = m_nPending;
+  m_QueueLock.Leave();
+  return nPending;
+}
+
+
+bool CTapeValidator::IsDone (uint32_t nTape) const
+{
+  //++
+  // Return TRUE if this tape has been checked and its report is ready ...
+  //--
+  m_QueueLock.Enter();
+  assert(nTape < m_vecReports.size());
+  bool fDone = m_vecReports[nTape]->fDone;
+  m_QueueLock.Leave();
+  return fDone;
+}
+
+
+const CTapeValidator::TAPE_REPORT &CTapeValidator::GetReport (uint32_t nTape) const
+{
+  //++
+  //   Return the report for a tape.  The worker threads are done with it once
+  // IsDone() returns true, and it doesn't change after that ...
+  //--
+  m_QueueLock.Enter();
+  assert(nTape < m_vecReports.size());
+  const TAPE_REPORT *pReport = m_vecReports[nTape];
+  assert(pReport->fDone);
+  m_QueueLock.Leave();
+  return *pReport;
+}
+
+
+CTapeValidator::TAPE_REPORT *CTapeValidator::NextTape()
+{
+  //++
+  // Take the next tape off the queue, or return NULL if there aren't any ...
+  //--
+  m_QueueLock.Enter();
+  TAPE_REPORT *pReport = NULL;
+  if (!m_qPending.empty()) {
+    pReport = m_qPending.front();  m_qPending.pop_front();
+  }
+  m_QueueLock.Leave();
+  return pReport;
+}
+
+
+void* THREAD_ATTRIBUTES CTapeValidator::WorkerThread (void *pParam)
+{
+  //++
+  //   This is the worker thread.  It checks tapes until the queue is empty,
+  // and then sleeps until more are added.  When we're asked to exit we
+  // finish up whatever's left in the queue first ...
+  //--
+  assert(pParam != NULL);
+  CThread *pThread = (CThread *) pParam;
+  CTapeValidator *pThis = (CTapeValidator *) pThread->GetParameter();
+  while (true) {
+    TAPE_REPORT *pReport = pThis->NextTape();
+    if (pReport != NULL) {
+      ValidateTape(*pReport, pThis->m_cbMaxRecord);
+      pThis->m_QueueLock.Enter();
+      pReport->fDone = true;  --pThis->m_nPending;
+      pThis->m_QueueLock.Leave();
+      continue;
+    }
+    if (pThread->IsExitRequested()) break;
+    pThread->WaitForFlag(100);
+  }
+  return pThread->End();
+}
+
+
+/*static*/ const char *CTapeValidator::ProblemToString (PROBLEM nProblem)
+{
+  //++
+  // Return a short description of a problem, for messages ...
+  //--
+  switch (nProblem) {
+    case PROBLEM_PADDED:      return "padded record";
+    case PROBLEM_MISMATCH:    return "header/trailer mismatch";
+    case PROBLEM_BADMETADATA: return "invalid metadata";
+    case PROBLEM_TRUNCATED:   return "truncated record";
+    case PROBLEM_UNREADABLE:  return "read error";
+    default:                  return "unknown problem";
+  }
+}
+
+
+/*static*/ void CTapeValidator::AddProblem (TAPE_REPORT &report, PROBLEM nProblem, uint64_t llOffset, uint64_t cbLength, uint32_t lMetadata, bool fRepaired)
+{
+  //++
+  //   Add a problem to the report.  Every problem is counted, but only the
+  // first MAXPROBLEMS are kept - a badly damaged tape could have millions ...
+  //--
+  ++report.nProblems;
+  if (nProblem != PROBLEM_PADDED) report.fDamaged = true;
+  if (report.vecProblems.size() >= MAXPROBLEMS) return;
+  TAPE_PROBLEM problem;
+  problem.nProblem = nProblem;  problem.llOffset = llOffset;
+  problem.cbLength = cbLength;  problem.lMetadata = lMetadata;
+  problem.nRecord = report.nRecords + report.nMarks;
+  problem.fRepaired = fRepaired;
+  report.vecProblems.push_back(problem);
+}
+
+
+/*static*/ CTapeValidator::SCAN_RESULT CTapeValidator::ScanRecord (CTapeImageFile &tape, uint64_t llOffset, uint32_t cbMaxRecord, uint32_t &lMetadata, uint64_t &llNext)
+{
+  //++
+  //   Examine the record at llOffset and, if it's good, set llNext to the
+  // start of the record after it.  These are the same rules that
+  // CTapeImageFile::ParseForward() uses, except that we don't skip over gaps
+  // and markers (each one is a "record" as far as we're concerned) and we're
+  // more specific about what's wrong.  An empty bad data record is reported
+  // as invalid metadata, but it's otherwise intact so llNext is still valid.
+  // For every other problem llNext is left equal to llOffset.
+  //--
+  uint64_t llEnd = tape.m_llFileSize;
+  lMetadata = 0;  llNext = llOffset;
+  if ((llOffset > llEnd) || (llEnd-llOffset < sizeof(uint32_t))) return SCAN_TRUNCATED;
+  if (!tape.ReadAt(llOffset, &lMetadata, sizeof(uint32_t))) return SCAN_UNREADABLE;
+  uint32_t nClass = (lMetadata & CTapeImageFile::CLASSMASK) >> CTapeImageFile::CLASSSHIFT;
+
+  // End of medium, erase gaps and markers ...
+  if (lMetadata == CTapeImageFile::TAP_EOM) return SCAN_EOM;
+  if (lMetadata == CTapeImageFile::TAP_HALFGAP) {
+    llNext = llOffset + sizeof(uint32_t)/2;  return SCAN_GOOD;
+  }
+  if (   (lMetadata == CTapeImageFile::TAP_GAP)
+      || (nClass == CTapeImageFile::CLASS_PRIVATE_MARKER)
+      || (nClass == CTapeImageFile::CLASS_RESERVED_MARKER)) {
+    llNext = llOffset + sizeof(uint32_t);  return SCAN_GOOD;
+  }
+
+  // Tape marks, and records that can't possibly be right ...
+  if ((lMetadata & CTapeImageFile::RESERVEDMASK) != 0) return SCAN_BADMETADATA;
+  uint32_t cbRecord = lMetadata & CTapeImageFile::RECLENMASK;
+  if ((cbRecord == 0) && (nClass == CTapeImageFile::CLASS_GOOD)) {
+    llNext = llOffset + sizeof(uint32_t);  return SCAN_GOOD;
+  }
+  if (cbRecord > cbMaxRecord) return SCAN_BADMETADATA;
+
+  //   Find the trailer, either right after the data or after one padding
+  // byte.  If the tape isn't even long enough for an unpadded trailer then
+  // it was truncated ...
+  uint64_t llTrailer = llOffset + sizeof(uint32_t) + cbRecord;
+  if (llEnd-llOffset < 2*sizeof(uint32_t) + cbRecord) return SCAN_TRUNCATED;
+  uint32_t lTrailer;  bool fPadded = false;
+  if (!tape.ReadAt(llTrailer, &lTrailer, sizeof(uint32_t))) return SCAN_UNREADABLE;
+  if (lTrailer != lMetadata) {
+    ++llTrailer;
+    if (llEnd-llTrailer < sizeof(uint32_t)) return SCAN_MISMATCH;
+    if (!tape.ReadAt(llTrailer, &lTrailer, sizeof(uint32_t))) return SCAN_UNREADABLE;
+    if (lTrailer != lMetadata) return SCAN_MISMATCH;
+    fPadded = true;
+  }
+  llNext = llTrailer + sizeof(uint32_t);
+  if (cbRecord == 0) return SCAN_BADMETADATA;
+  return fPadded ? SCAN_PADDED : SCAN_GOOD;
+}
+
+
+/*static*/ bool CTapeValidator::IsSyncPoint (CTapeImageFile &tape, uint64_t llOffset, uint32_t cbMaxRecord)
+{
+  //++
+  //   Return TRUE if llOffset looks like the start of a good record.  Marks,
+  // gaps and markers by themselves prove nothing - four zero bytes anywhere
+  // make a perfectly good tape mark, and one in eight random longwords looks
+  // like a marker!  So we walk forward over those until we find a data record
+  // with matching header and trailer, and then the thing after it has to be
+  // good too.  Running into the end of the tape (or an end of medium marker)
+  // along the way counts, and so does a long run of tape marks ...
+  //--
+  bool fRecord = false;
+  for (uint32_t n = 0;  n < MAXSYNC;  ++n) {
+    if (llOffset >= tape.m_llFileSize) return true;
+    uint32_t lMetadata;  uint64_t llNext;
+    SCAN_RESULT nResult = ScanRecord(tape, llOffset, cbMaxRecord, lMetadata, llNext);
+    if (nResult == SCAN_EOM) return true;
+    if ((nResult != SCAN_GOOD) && (nResult != SCAN_PADDED)) return false;
+    if (fRecord) return true;
+    uint32_t nClass = (lMetadata & CTapeImageFile::CLASSMASK) >> CTapeImageFile::CLASSSHIFT;
+    fRecord = ((nClass == CTapeImageFile::CLASS_GOOD) || (nClass == CTapeImageFile::CLASS_BAD))
+           && ((lMetadata & CTapeImageFile::RECLENMASK) != 0);
+    llOffset = llNext;
+  }
+  return true;
+}
+
+
+/*static*/ uint64_t CTapeValidator::Resync (CTapeImageFile &tape, uint64_t llOffset, uint32_t cbMaxRecord)
+{
+  //++
+  //   Search forward from llOffset, one byte at a time, for the next place
+  // that looks like a good record.  If there isn't one, then the rest of the
+  // tape is garbage and we return the end of the tape ...
+  //--
+  for (;  llOffset < tape.m_llFileSize;  ++llOffset)
+    if (IsSyncPoint(tape, llOffset, cbMaxRecord)) return llOffset;
+  return tape.m_llFileSize;
+}
+
+
+/*static*/ bool CTapeValidator::WriteRecord (FILE *pRepair, uint32_t lMetadata, const uint8_t *pabData, uint32_t cbData)
+{
+  //++
+  // Write one record, with its header and trailer, to the repaired copy ...
+  //--
+  return (fwrite(&lMetadata, sizeof(uint32_t), 1, pRepair) == 1)
+      && ((cbData == 0) || (fwrite(pabData, 1, cbData, pRepair) == cbData))
+      && (fwrite(&lMetadata, sizeof(uint32_t), 1, pRepair) == 1);
+}
+
+
+/*static*/ bool CTapeValidator::CopyBytes (CTapeImageFile &tape, FILE *pRepair, uint64_t llOffset, uint64_t cbLength, vector<uint8_t> &vecBuffer)
+{
+  //++
+  // Copy bytes from the tape image to the repaired copy, verbatim ...
+  //--
+  while (cbLength > 0) {
+    size_t cbCopy = (size_t) MIN(cbLength, (uint64_t) vecBuffer.size());
+    if (!tape.ReadAt(llOffset, vecBuffer.data(), cbCopy)) return false;
+    if (fwrite(vecBuffer.data(), 1, cbCopy, pRepair) != cbCopy) return false;
+    llOffset += cbCopy;  cbLength -= cbCopy;
+  }
+  return true;
+}
+
+
+/*static*/ bool CTapeValidator::WriteBadRecord (CTapeImageFile &tape, FILE *pRepair, uint64_t llOffset, uint64_t cbLength, uint32_t cbMaxRecord, vector<uint8_t> &vecBuffer)
+{
+  //++
+  //   Replace a damaged part of the tape with a single bad data record.  The
+  // record contains the damaged bytes, or as many as will fit in the longest
+  // record allowed, since that's probably the best guess at what the data
+  // was.  If there's nothing at all, then there's no record either (a bad
+  // data record can't be empty).
+  //--
+  uint32_t cbData = (uint32_t) MIN(cbLength, (uint64_t) cbMaxRecord);
+  if (cbData == 0) return true;
+  if (!tape.ReadAt(llOffset, vecBuffer.data(), cbData)) return false;
+  uint32_t lMetadata = (CTapeImageFile::CLASS_BAD << CTapeImageFile::CLASSSHIFT) | cbData;
+  return WriteRecord(pRepair, lMetadata, vecBuffer.data(), cbData);
+}
+
+
+/*static*/ bool CTapeValidator::ValidateTape (TAPE_REPORT &report, uint32_t cbMaxRecord)
+{
+  //++
+  //   Check one tape, fill in the report and, if report.sRepairFile isn't
+  // empty, write the repaired copy.  Everything in the report except the file
+  // names and fDone is set here.  Returns true only if the tape isn't damaged
+  // (padded records are OK) and the repaired copy, if any, was written.
+  //
+  //   This is the routine the worker threads call, but it's static and it
+  // can be called directly to check a tape without any threads at all.
+  //--
+  report.fOpened = report.fDamaged = report.fRepaired = false;
+  report.llLength = 0;  report.nRecords = report.nMarks = 0;
+  report.nBadRecords = report.nProblems = 0;  report.vecProblems.clear();
+
+  // Open the tape and map it, if we can (only Linux supports mapped tapes) ...
+  CTapeImageFile tape;
+  if (cbMaxRecord > CTapeImageFile::RECLENMASK) cbMaxRecord = CTapeImageFile::RECLENMASK;
+  tape.SetMaxRecordLength(cbMaxRecord);
+  if (!tape.Open(report.sFileName, true)) return false;
+  report.fOpened = true;  report.llLength = tape.m_llFileSize;
+#ifdef __linux__
+  if (!tape.IsCompressed()) tape.EnableMapping();
+#endif
+  tape.m_llReadPos = UINT64_MAX;
+
+  //   Create the repaired copy, if we're making one.  Opening it truncates
+  // it, so it had better not be the tape we're reading (which may be mapped!)
+  // under another name ...
+  FILE *pRepair = NULL;
+  if (!report.sRepairFile.empty()) {
+    if (IsSameFile(report.sFileName.c_str(), report.sRepairFile.c_str())) {
+      LOGS(ERROR, "can't repair " << report.sFileName << " onto itself");
+      return false;
+    }
+    pRepair = fopen(report.sRepairFile.c_str(), "wb");
+    if (pRepair == NULL) {
+      LOGS(ERROR, "error (" << errno << ") creating " << report.sRepairFile);
+      return false;
+    }
+  }
+  bool fWriteOK = true;
+  vector<uint8_t> vecBuffer(MAX(cbMaxRecord, (uint32_t) CTapeImageFile::WRITE_ALIGNMENT));
+
+  //   And walk the tape.  Every trip thru this loop either moves llOffset
+  // forward or ends the tape, so it always terminates ...
+  uint64_t llEnd = tape.m_llFileSize, llOffset = 0;
+  while (llOffset < llEnd) {
+    uint32_t lMetadata;  uint64_t llNext;
+    SCAN_RESULT nResult = ScanRecord(tape, llOffset, cbMaxRecord, lMetadata, llNext);
+    uint32_t nClass = (lMetadata & CTapeImageFile::CLASSMASK) >> CTapeImageFile::CLASSSHIFT;
+    uint32_t cbRecord = lMetadata & CTapeImageFile::RECLENMASK;
+    bool fData = (nClass == CTapeImageFile::CLASS_GOOD) || (nClass == CTapeImageFile::CLASS_BAD);
+
+    if ((nResult == SCAN_GOOD) || (nResult == SCAN_PADDED)) {
+      //   A good record.  Count the data records and tape marks, and copy it
+      // to the repaired copy.  Padded records are the only ones that change -
+      // those lose the padding byte ...
+      if (fData && (cbRecord == 0))
+        ++report.nMarks;
+      else if (fData) {
+        ++report.nRecords;
+        if (nClass == CTapeImageFile::CLASS_BAD) ++report.nBadRecords;
+      }
+      if (nResult == SCAN_PADDED) {
+        AddProblem(report, PROBLEM_PADDED, llOffset, llNext-llOffset, lMetadata, true);
+        if (pRepair != NULL) fWriteOK = fWriteOK
+          && tape.ReadAt(llOffset+sizeof(uint32_t), vecBuffer.data(), cbRecord)
+          && WriteRecord(pRepair, lMetadata, vecBuffer.data(), cbRecord);
+      } else if (pRepair != NULL)
+        fWriteOK = fWriteOK && CopyBytes(tape, pRepair, llOffset, llNext-llOffset, vecBuffer);
+      llOffset = llNext;
+
+    } else if (nResult == SCAN_EOM) {
+      //   End of medium - copy the marker and quit.  Whatever follows it isn't
+      // part of the tape ...
+      if (pRepair != NULL)
+        fWriteOK = fWriteOK && CopyBytes(tape, pRepair, llOffset, sizeof(uint32_t), vecBuffer);
+      break;
+
+    } else if ((nResult == SCAN_TRUNCATED) || (nResult == SCAN_UNREADABLE)) {
+      //   The tape ends (or we can't read any more of it) in the middle of a
+      // record.  Whatever data is there becomes a bad record ...
+      AddProblem(report, (nResult == SCAN_TRUNCATED) ? PROBLEM_TRUNCATED : PROBLEM_UNREADABLE,
+                 llOffset, llEnd-llOffset, lMetadata);
+      if ((pRepair != NULL) && (nResult == SCAN_TRUNCATED) && (llEnd-llOffset > sizeof(uint32_t)))
+        fWriteOK = fWriteOK && WriteBadRecord(tape, pRepair, llOffset+sizeof(uint32_t),
+                                              llEnd-llOffset-sizeof(uint32_t), cbMaxRecord, vecBuffer);
+      break;
+
+    } else {
+      //   A header and trailer mismatch, or invalid metadata.  If the header
+      // is good and the next record is right where it should be, then only
+      // the trailer is damaged and we can save this record ...
+      PROBLEM nProblem = (nResult == SCAN_MISMATCH) ? PROBLEM_MISMATCH : PROBLEM_BADMETADATA;
+      if (nResult == SCAN_MISMATCH) {
+        uint64_t llAfter = llOffset + 2*sizeof(uint32_t) + cbRecord;
+        bool fSaved = (llAfter == llEnd) || IsSyncPoint(tape, llAfter, cbMaxRecord);
+        if (!fSaved && ((cbRecord & 1) != 0)) {
+          ++llAfter;
+          fSaved = (llAfter == llEnd) || IsSyncPoint(tape, llAfter, cbMaxRecord);
+        }
+        if (fSaved) {
+          AddProblem(report, nProblem, llOffset, llAfter-llOffset, lMetadata, true);
+          ++report.nRecords;
+          if (nClass == CTapeImageFile::CLASS_BAD) ++report.nBadRecords;
+          if (pRepair != NULL) fWriteOK = fWriteOK
+            && tape.ReadAt(llOffset+sizeof(uint32_t), vecBuffer.data(), cbRecord)
+            && WriteRecord(pRepair, lMetadata, vecBuffer.data(), cbRecord);
+          llOffset = llAfter;  continue;
+        }
+      }
+
+      //   Otherwise skip forward to the next good record and turn everything
+      // in between into a bad data record.  An empty bad data record is the
+      // one case where we already know where the next record starts, and
+      // there's no data in it to save.  That one is copied unchanged - turning
+      // its metadata into an eight byte bad record would invent data that was
+      // never on the tape ...
+      if (llNext > llOffset) {
+        AddProblem(report, nProblem, llOffset, llNext-llOffset, lMetadata);
+        if (pRepair != NULL)
+          fWriteOK = fWriteOK && CopyBytes(tape, pRepair, llOffset, llNext-llOffset, vecBuffer);
+        llOffset = llNext;  continue;
+      }
+      llNext = Resync(tape, llOffset+1, cbMaxRecord);
+      AddProblem(report, nProblem, llOffset, llNext-llOffset, lMetadata);
+      if (pRepair != NULL)
+        fWriteOK = fWriteOK && WriteBadRecord(tape, pRepair, llOffset, llNext-llOffset, cbMaxRecord, vecBuffer);
+      llOffset = llNext;
+    }
+  }
+
+  // Close the repaired copy and report the results ...
+  if (pRepair != NULL) {
+    if (fclose(pRepair) != 0) fWriteOK = false;
+    report.fRepaired = fWriteOK;
+    if (!fWriteOK) LOGS(ERROR, "error (" << errno << ") writing " << report.sRepairFile);
+  }
+  if (report.fDamaged) {
+    LOGF(WARNING, "tape %s is damaged - %d problems, %d records and %d marks readable",
+         report.sFileName.c_str(), report.nProblems, report.nRecords, report.nMarks);
+  } else {
+    LOGF(DEBUG, "tape %s is OK - %d records, %d marks, %d padded",
+         report.sFileName.c_str(), report.nRecords, report.nMarks, report.nProblems);
+  }
+  return !report.fDamaged && (fWriteOK || (pRepair == NULL));
+}
+
+
+/*static*/ bool CTapeValidator::ValidateTape (const string &sFileName, const string &sRepairFile)
+{
+  //++
+  //   Check one tape, and optionally write a repaired copy, without bothering
+  // with a report.  Everything we find is logged anyway ...
+  //--
+  TAPE_REPORT report;
+  report.sFileName = sFileName;  report.sRepairFile = sRepairFile;
+  report.fDone = false;
+  bool fOK = ValidateTape(report, CTapeImageFile::MAXRECLEN);
+  for (size_t i = 0;  i < report.vecProblems.size();  ++i) {
+    const TAPE_PROBLEM &problem = report.vecProblems[i];
+    LOGS(WARNING, ProblemToString(problem.nProblem) << " at offset " << problem.llOffset
+         << " (record " << problem.nRecord << ", " << problem.cbLength << " bytes"
+         << (problem.fRepaired ? ", repaired" : "") << ") on tape " << sFileName);
+  }
+  report.fDone = true;
+  return fOK;
+}
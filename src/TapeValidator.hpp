@@ -0,0 +1,190 @@
+//++
+// TapeValidator.hpp -> CTapeValidator (tape image integrity checker) class
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the UPE LIBRARY project.  UPELIB is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    UPELIB is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   A CTapeValidator object checks the structure of TAP tape images, reports
+// every problem it finds and, optionally, writes a repaired copy of each one.
+// Any number of tapes can be checked at once by a pool of background threads.
+// See TapeValidator.cpp for the details.
+//
+// REVISION HISTORY:
+// 16-OCT-26        New file.
+//--
+#pragma once
+#include <stdio.h>              // FILE, fwrite(), etc ...
+#include <string>               // C++ std::string class, et al ...
+#include <deque>                // C++ std::deque template
+#include <vector>               // C++ std::vector template
+using std::string;              // ...
+using std::deque;               // ...
+using std::vector;              // ...
+#include "Thread.hpp"           // needed for THREAD_ATTRIBUTES ...
+#include "Mutex.hpp"            // needed for CMutex ...
+class CTapeImageFile;           // the tapes we check ...
+
+
+class CTapeValidator {
+  //++
+  //--
+
+  // Constants and defaults ...
+public:
+  enum {
+    DEFAULT_THREADS = 4,        // default number of worker threads
+    MAXTHREADS      = 32,       // maximum number of worker threads
+    MAXPROBLEMS     = 1000,     // most problems recorded for any one tape
+    MAXSYNC         = 64,       // most marks we'll cross looking for a record
+  };
+
+  //   These are the problems we can find.  A padded record isn't really an
+  // error, since CTapeImageFile reads them just fine, but it's reported anyway
+  // because it's usually a sign that some other program wrote the tape.  All
+  // the rest mean that part of the tape can't be read.
+  enum PROBLEM {
+    PROBLEM_PADDED,             // odd length record padded to an even length
+    PROBLEM_MISMATCH,           // record header and trailer don't match
+    PROBLEM_BADMETADATA,        // invalid metadata or record too long
+    PROBLEM_TRUNCATED,          // the tape ends in the middle of a record
+    PROBLEM_UNREADABLE,         // I/O error reading the tape image
+  };
+
+  //   Each problem found is described by one of these.  llOffset is where the
+  // bad record begins and cbLength is how many bytes of the tape it affects -
+  // for a mismatch or bad metadata that's everything we had to skip to find
+  // the next good record.  nRecord is the record number (counting tape marks,
+  // just like CTapeImageFile::GetRecordCount()) and lMetadata is the record
+  // header as we found it.  If fRepaired is true then the record itself is
+  // good (only the trailer was damaged) and the repaired copy has it intact.
+  struct _TAPE_PROBLEM {
+    PROBLEM   nProblem;         // what's wrong
+    uint64_t  llOffset;         // tape offset of the bad record
+    uint64_t  cbLength;         // number of bytes affected
+    uint32_t  nRecord;          // record number
+    uint32_t  lMetadata;        // record header metadata
+    bool      fRepaired;        // TRUE if the record could be saved
+  };
+  typedef struct _TAPE_PROBLEM TAPE_PROBLEM;
+
+  //   And each tape checked gets one of these.  Everything after fDone is
+  // filled in by the validation, and none of it means anything until fDone
+  // is true.  fDamaged is true if any problem other than padding was found.
+  // The repaired copy, if one was asked for, is always an ordinary TAP file
+  // even if the original tape is compressed.
+  struct _TAPE_REPORT {
+    string    sFileName;        // tape image to check
+    string    sRepairFile;      // repaired copy to write (empty for none)
+    bool      fDone;            // TRUE when this tape has been checked
+    bool      fOpened;          // FALSE if the tape couldn't even be opened
+    bool      fDamaged;         // TRUE if the tape has unreadable parts
+    bool      fRepaired;        // TRUE if the repaired copy was written
+    uint64_t  llLength;         // length of the (uncompressed) tape image
+    uint32_t  nRecords;         // data records (good and bad) found
+    uint32_t  nMarks;           // tape marks found
+    uint32_t  nBadRecords;      // records flagged as bad data (class 8)
+    uint32_t  nProblems;        // total problems found (even if not recorded)
+    vector<TAPE_PROBLEM> vecProblems; // the first MAXPROBLEMS problems
+  };
+  typedef struct _TAPE_REPORT TAPE_REPORT;
+
+  // Constructor and destructor ...
+public:
+  CTapeValidator (uint32_t nThreads=DEFAULT_THREADS);
+  virtual ~CTapeValidator();
+  // Disallow copy and assignment operations with CTapeValidator objects...
+private:
+  CTapeValidator (const CTapeValidator &v) = delete;
+  CTapeValidator& operator= (const CTapeValidator &v) = delete;
+
+  // Properties ...
+public:
+  // Return the number of worker threads ...
+  uint32_t GetThreadCount() const {return MKINT32(m_vecThreads.size());}
+  // TRUE if the worker threads are running ...
+  bool IsRunning() const {return m_fRunning;}
+  //   Set the longest record we'll accept (see CTapeImageFile::
+  // SetMaxRecordLength()).  Call this before adding any tapes ...
+  void SetMaxRecordLength (uint32_t cbMaxRecord) {m_cbMaxRecord = cbMaxRecord;}
+  uint32_t GetMaxRecordLength() const {return m_cbMaxRecord;}
+  // Return the number of tapes added and the number not yet checked ...
+  uint32_t GetTapeCount() const;
+  uint32_t GetPendingCount() const;
+  // Return TRUE if a tape has been checked, and then its report ...
+  bool IsDone (uint32_t nTape) const;
+  const TAPE_REPORT &GetReport (uint32_t nTape) const;
+
+  // Public methods ...
+public:
+  //   Start and stop the worker threads.  Stop() waits for every tape in the
+  // queue to be checked, unless fFlush is false ...
+  bool Start();
+  void Stop (bool fFlush=true);
+  //   Add a tape to be checked, and optionally repaired, by the worker threads
+  // and return its tape number ...
+  uint32_t AddTape (const string &sFileName, const string &sRepairFile=string());
+  //   Check one tape right now, without any threads.  Returns false if the
+  // tape is damaged or can't be read ...
+  static bool ValidateTape (TAPE_REPORT &report, uint32_t cbMaxRecord);
+  static bool ValidateTape (const string &sFileName, const string &sRepairFile=string());
+  // Return the name of a problem (for messages) ...
+  static const char *ProblemToString (PROBLEM nProblem);
+
+  // Local methods ...
+protected:
+  //   The results of examining one record.  For SCAN_GOOD and SCAN_PADDED,
+  // llNext is the start of the next record, and the rest are problems ...
+  enum SCAN_RESULT {
+    SCAN_GOOD,                  // a good record (or mark, gap or marker)
+    SCAN_PADDED,                // a good, but padded, record
+    SCAN_EOM,                   // end of medium marker found
+    SCAN_MISMATCH,              // header and trailer don't match
+    SCAN_BADMETADATA,           // invalid metadata
+    SCAN_TRUNCATED,             // not enough bytes left for this record
+    SCAN_UNREADABLE,            // I/O error
+  };
+  // Examine one record and find the start of the next one ...
+  static SCAN_RESULT ScanRecord (CTapeImageFile &tape, uint64_t llOffset, uint32_t cbMaxRecord, uint32_t &lMetadata, uint64_t &llNext);
+  // Return TRUE if llOffset looks like the start of a good record ...
+  static bool IsSyncPoint (CTapeImageFile &tape, uint64_t llOffset, uint32_t cbMaxRecord);
+  // Find the next good record after a damaged one ...
+  static uint64_t Resync (CTapeImageFile &tape, uint64_t llOffset, uint32_t cbMaxRecord);
+  // Add a problem to the report ...
+  static void AddProblem (TAPE_REPORT &report, PROBLEM nProblem, uint64_t llOffset, uint64_t cbLength, uint32_t lMetadata, bool fRepaired=false);
+  // Write one record to the repaired copy ...
+  static bool WriteRecord (FILE *pRepair, uint32_t lMetadata, const uint8_t *pabData, uint32_t cbData);
+  static bool CopyBytes (CTapeImageFile &tape, FILE *pRepair, uint64_t llOffset, uint64_t cbLength, vector<uint8_t> &vecBuffer);
+  static bool WriteBadRecord (CTapeImageFile &tape, FILE *pRepair, uint64_t llOffset, uint64_t cbLength, uint32_t cbMaxRecord, vector<uint8_t> &vecBuffer);
+  // Take the next tape from the queue ...
+  TAPE_REPORT *NextTape();
+  // Wake up all the idle worker threads ...
+  void WakeWorkers();
+  // The background worker thread ...
+  static void* THREAD_ATTRIBUTES WorkerThread (void *pParam);
+
+  // Local members ...
+protected:
+  vector<CThread *>     m_vecThreads;   // worker threads
+  bool                  m_fRunning;     // TRUE if Start() has been called
+  uint32_t              m_cbMaxRecord;  // longest record we'll accept
+  //   The reports are allocated one at a time so that they never move, and
+  // the worker threads can fill them in while more tapes are being added.
+  // m_QueueLock protects the list, the queue and every fDone flag ...
+  vector<TAPE_REPORT *> m_vecReports;   // reports for every tape added
+  deque<TAPE_REPORT *>  m_qPending;     // tapes waiting for a worker
+  uint32_t              m_nPending;     // tapes added but not yet checked
+  mutable CMutex        m_QueueLock;    // interlock for all the above
+};
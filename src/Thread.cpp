@@ -115,6 +115,8 @@
 #include <unistd.h>             // getpid(), etc ...
 #include <pthread.h>            // pthread_t, pthread_create(), and so on ...
 #include <semaphore.h>          // sem_init(), sem_wait(), and all the rest ...
+#include <errno.h>              // EINTR, ETIMEDOUT, etc ...
+#include <time.h>               // clock_gettime(), struct timespec, ...
 #endif
 #include "UPELIB.hpp"           // UPE library definitions
 #include "Thread.hpp"           // declarations for this module
@@ -175,6 +177,14 @@ bool CThread::Begin()
   LOGS(DEBUG, "starting thread for " << GetName());
   m_fExitRequested = false;
 #ifdef _WIN32
+  //   Note that the event flag, if one is required, has to be created BEFORE
+  // the thread starts - the thread may call WaitForFlag() right away!
+  if ((m_nFlags > 0) && (m_hFlag == 0)) {
+    m_hFlag = (intptr_t) CreateEvent(NULL, false, true, NULL);
+    if (m_hFlag == 0) {
+      LOGS(ERROR, "unable to create event flag for " << GetName());  return false;
+    }
+  }
   //   On Linux the thread routine must return a void * pointer, but on Windows
   // there is no return value.  In reality Windows doesn't care what we return,
   // so we simply re-cast the pointer to make the compiler happy ...
@@ -183,27 +193,23 @@ bool CThread::Begin()
   if ((m_hThread == -1L) || (m_idThread == 0)) {
     LOGS(ERROR, "unable to create thread for " << GetName());  return false;
   }
-  // If an event flag is required then create it now ...
-  if ((m_nFlags > 0) && (m_hFlag == 0)) {
-    m_hFlag = (intptr_t) CreateEvent(NULL, false, true, NULL);
-    if (m_hFlag == 0) {
-      LOGS(ERROR, "unable to create event flag for " << GetName());  return false;
+#elif __linux__
+  //   If a semaphore is needed, now is the time to create it.  Like the event
+  // flag on Windows, it has to exist before the thread starts.  The initial
+  // count is zero, so the first WaitForFlag() blocks until somebody raises
+  // the flag.  Note that sem_init() returns -1 and sets errno on failure ...
+  if ((m_nFlags > 0) && (m_pFlag == NULL)) {
+    m_pFlag = DBGNEW sem_t;
+    if (sem_init(m_pFlag, 0, 0) != 0) {
+      LOGS(ERROR, "error " << errno << " creating semaphore for " << GetName());
+      delete m_pFlag;  m_pFlag = NULL;  return false;
     }
   }
-#elif __linux__
   // Create the child thread ....
   int err = pthread_create(&m_idThread, NULL, m_pRoutine, (void *) this);
   if (err != 0) {
     LOGS(ERROR, "error " << err << " creating thread for " << GetName());  return false;
   }
-  // And if a semaphore is needed, now is the time to create it ...
-  if ((m_nFlags > 0) && (m_pFlag == NULL)) {
-    m_pFlag = DBGNEW sem_t;
-    err = sem_init(m_pFlag, 0, -1);
-    if (err != 0) {
-      LOGS(ERROR, "error " << err << " creating semaphore for " << GetName());  return false;
-    }
-  }
 #endif
   //   This delay isn't really necessary, but it gives the new thread a chance
   // to print out any initial debugging and startup messages before the background
@@ -255,10 +261,13 @@ void CThread::Wait()
 #ifdef _WIN32
   WaitForSingleObject((HANDLE) m_hThread, INFINITE);
 #elif __linux__
+  //   Once it's been joined the thread ID means nothing (it may even be reused
+  // by some other thread), so forget it - that's how IsRunning() knows ...
   void *pResult;
   int err = pthread_join(m_idThread, &pResult);
   if (err != 0)
     LOGS(ERROR, "error " << err << " in join for " << GetName());
+  m_idThread = 0;
 #endif
 }
 
@@ -305,7 +314,9 @@ void CThread::SetBackgroundPriority()
    //TBA NYI TODO!!
   // use pthread_setschedprio()
   // but what priority???
-  assert(false);
+  //   Until then the thread just runs at normal priority - that's no reason
+  // to stop everything (the message logging thread calls this!) ...
+  LOGS(DEBUG, GetName() << " thread running at normal priority");
 #endif
 }
 
@@ -358,8 +369,10 @@ bool CThread::WaitForFlag (uint32_t nTimeout, uint32_t nFlag)
   // next time.
   //
   //   The nTimeout parameter specifies a maximum time, in milliseconds, to
-  // wait.  If this is not zero and the time elapses with no flag, then this
-  // routine returns FALSE.  If the timeout is zero, then we'll wait forever.
+  // wait.  If the time elapses with no flag, then this routine returns FALSE.
+  // A timeout of zero just tests the flag without waiting at all, and a
+  // timeout of WAIT_FOREVER waits for as long as it takes.  These mean the
+  // same thing on Windows and Linux.
   //
   //   The potential exists to have more than one flag, and the nFlag parameter
   // specified the flag to use.  Presently only one is implemented, however,
@@ -370,10 +383,27 @@ bool CThread::WaitForFlag (uint32_t nTimeout, uint32_t nFlag)
   assert(m_hFlag != 0);
   return WaitForSingleObject((HANDLE) m_hFlag, nTimeout) != WAIT_TIMEOUT;
 #elif __linux__
+  //   sem_timedwait() wants an absolute time, and it can be interrupted by
+  // a signal, in which case we just wait again.
   assert(m_pFlag != NULL);
-  int err = sem_wait(m_pFlag);
+  int err;
+  if (nTimeout == 0) {
+    while (((err = sem_trywait(m_pFlag)) != 0) && (errno == EINTR)) ;
+    if ((err != 0) && (errno == EAGAIN)) return false;
+  } else if (nTimeout == WAIT_FOREVER) {
+    while (((err = sem_wait(m_pFlag)) != 0) && (errno == EINTR)) ;
+  } else {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += nTimeout / 1000;  ts.tv_nsec += (nTimeout % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+      ++ts.tv_sec;  ts.tv_nsec -= 1000000000L;
+    }
+    while (((err = sem_timedwait(m_pFlag, &ts)) != 0) && (errno == EINTR)) ;
+    if ((err != 0) && (errno == ETIMEDOUT)) return false;
+  }
   if (err != 0)
-    LOGS(ERROR, "error " << err << " in wait for " << GetName());
+    LOGS(ERROR, "error " << errno << " in wait for " << GetName());
   return err == 0;
 #endif
 }
@@ -86,6 +86,14 @@ class CThread {
   // declarations are platform independent, but the implementation is not!
   //--
 
+  // Constants ...
+public:
+  enum {
+    //   Pass this as the timeout to WaitForFlag() to wait for as long as it
+    // takes.  It's the same value as Windows' INFINITE on purpose ...
+    WAIT_FOREVER  = 0xFFFFFFFFUL,
+  };
+
   // Constructors and destructor ...
 public:
   CThread(THREAD_ROUTINE pThread, const char *pszName=NULL, uint32_t nParameters=1, uint32_t nFlags=0);
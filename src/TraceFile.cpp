@@ -0,0 +1,465 @@
+//++
+// TraceFile.cpp -> binary log (trace) file writer and decoder
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the UPE LIBRARY project.  UPELIB is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    UPELIB is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   At TRACE level a text log grows by gigabytes an hour, and most of that is
+// the same few format strings and time stamps over and over again.  When CLog
+// is asked for a binary log (see CLog::OpenLog()) it writes everything thru
+// one of these objects instead, and the file is a lot smaller (and a lot
+// cheaper to write).  Nobody can read it, of course, until it's been decoded
+// back into text by Decode(), but that produces exactly the same thing CLog
+// would have written to a text log in the first place.
+//
+//   A trace file is just a sequence of records.  Every record starts with a
+// one byte RECORD_TYPE and then the length of the rest of the record, and
+// all the numbers in the record are "varints" - seven bits per byte, least
+// significant first, with the high bit set in every byte but the last.
+// Signed numbers are "zigzag" encoded first, so that small negative numbers
+// are small too.  The records are -
+//
+//   REC_HEADER - lMagic (4 bytes), nVersion (2 bytes), two reserved bytes
+//      and the base time (8 bytes, milliseconds since 1970), all fixed size
+//      and little endian.  There's one of these at the start of the file, and
+//      another every time CLog opens the file to append to it.  Each header
+//      starts over - interned strings are forgotten and the time goes back to
+//      the base time.
+//
+//   REC_STRING - the ID (varint) and then the text of an interned string.
+//      Format strings and message prefixes ("DEBUG", "WARN", etc) are only
+//      written once, the first time they're used, and after that all we need
+//      is the ID.  IDs are assigned in order, starting from zero.
+//
+//   REC_TEXT - the time (signed varint, the difference in milliseconds from
+//      the last record), the prefix ID (varint), and then the text of a line
+//      that was already formatted.  LOGS() messages, and anything else that
+//      CLog doesn't have a format string for, end up here.
+//
+//   REC_MESSAGE - the time (just like REC_TEXT), the prefix ID, the format
+//      string ID and then the arguments.  Each argument is a CLogFormat::
+//      ARG_TYPE byte followed by the value - integers and pointers are varints
+//      (signed ones zigzag encoded), doubles are eight bytes (little endian)
+//      and strings are a varint length and the text.  These come from LOGF()
+//      messages that were deferred by the message queue (see MessageQueue.cpp)
+//      so the formatting is put off until the file is decoded.
+//
+//   Times can go backwards (the message queue sorts messages, but not
+// perfectly) which is why the time deltas are signed.  And since a trace
+// file is mostly going to be read after something has gone wrong, Decode()
+// doesn't complain if the last record is incomplete.
+//
+// REVISION HISTORY:
+// 16-OCT-26        New file.
+//--
+//000000001111111111222222222233333333334444444444555555555566666666667777777777
+//234567890123456789012345678901234567890123456789012345678901234567890123456789
+#include <stdlib.h>             // exit(), system(), etc ...
+#include <stdint.h>	        // uint8_t, uint32_t, etc ...
+#include <stdio.h>              // FILE, fwrite(), fread(), etc ...
+#include <assert.h>             // assert() (what else??)
+#include <string.h>             // memcpy(), memset(), etc ...
+#include <errno.h>              // errno (used by fopen_s()) ...
+#include <sys/timeb.h>          // struct __timeb, ftime(), etc ...
+#include "SafeCRT.h"		// replacements for Microsoft "safe" CRT functions
+#include "UPELIB.hpp"           // global declarations for this library
+#include "LogFile.hpp"          // CLog::TIMESTAMP, TimeStampToString(), etc ...
+#include "LogFormat.hpp"        // deferred printf() formatting
+#include "TraceFile.hpp"        // declarations for this class
+
+
+CTraceFile::CTraceFile (FILE *pFile)
+{
+  //++
+  //   The file belongs to the caller (CLog opens and closes it) and it should
+  // be opened in binary mode.  Call WriteHeader() before anything else ...
+  //--
+  assert(pFile != NULL);
+  m_pFile = pFile;  m_llLastTime = 0;  m_nStrings = 0;
+}
+
+
+void CTraceFile::PutVarint (vector<uint8_t> &vec, uint64_t llValue)
+{
+  //++
+  // Add an unsigned varint, seven bits at a time, to the record ...
+  //--
+  while (llValue >= 0x80) {
+    vec.push_back((uint8_t) ((llValue & 0x7F) | 0x80));  llValue >>= 7;
+  }
+  vec.push_back((uint8_t) llValue);
+}
+
+
+bool CTraceFile::GetVarint (const uint8_t *&pab, const uint8_t *pabEnd, uint64_t &llValue)
+{
+  //++
+  //   Get an unsigned varint from a record and advance the pointer past it.
+  // Returns false if the record ends first, or if the varint is too long ...
+  //--
+  llValue = 0;
+  for (uint32_t nShift = 0;  nShift < 64;  nShift += 7) {
+    if (pab >= pabEnd) return false;
+    uint8_t b = *pab++;
+    llValue |= (uint64_t) (b & 0x7F) << nShift;
+    if ((b & 0x80) == 0) return true;
+  }
+  return false;
+}
+
+
+bool CTraceFile::GetSigned (const uint8_t *&pab, const uint8_t *pabEnd, int64_t &llValue)
+{
+  //++
+  // Get a zigzag encoded signed varint ...
+  //--
+  uint64_t llZigzag;
+  if (!GetVarint(pab, pabEnd, llZigzag)) return false;
+  llValue = (int64_t) (llZigzag >> 1) ^ -(int64_t) (llZigzag & 1);
+  return true;
+}
+
+
+uint64_t CTraceFile::TimeToMilliseconds (const CLog::TIMESTAMP *ptb)
+{
+  //++
+  // Convert a CLog time stamp to milliseconds since 1970 ...
+  //--
+  return ((uint64_t) ptb->time * 1000ULL) + ptb->millitm;
+}
+
+
+void CTraceFile::MillisecondsToTime (uint64_t llTime, CLog::TIMESTAMP *ptb)
+{
+  //++
+  // And convert milliseconds back into a time stamp ...
+  //--
+  memset(ptb, 0, sizeof(CLog::TIMESTAMP));
+  ptb->time = llTime / 1000ULL;
+  ptb->millitm = (unsigned short) (llTime % 1000ULL);
+}
+
+
+bool CTraceFile::WriteRecord (RECORD_TYPE nType, const vector<uint8_t> &vecData)
+{
+  //++
+  //   Write one record - the type, the length and then the data.  The caller
+  // must already hold m_Lock ...
+  //--
+  uint8_t abHeader[16];  size_t cbHeader = 0;  uint64_t cbData = vecData.size();
+  abHeader[cbHeader++] = (uint8_t) nType;
+  while (cbData >= 0x80) {
+    abHeader[cbHeader++] = (uint8_t) ((cbData & 0x7F) | 0x80);  cbData >>= 7;
+  }
+  abHeader[cbHeader++] = (uint8_t) cbData;
+  if (fwrite(abHeader, 1, cbHeader, m_pFile) != cbHeader) return false;
+  if (vecData.empty()) return true;
+  return fwrite(&vecData[0], 1, vecData.size(), m_pFile) == vecData.size();
+}
+
+
+bool CTraceFile::WriteHeader (const CLog::TIMESTAMP *ptb)
+{
+  //++
+  //   Write a header record, and start over with a new base time and no
+  // interned strings ...
+  //--
+  assert(ptb != NULL);
+  m_Lock.Enter();
+  m_llLastTime = TimeToMilliseconds(ptb);
+  m_mapStrings.clear();  m_mapFormats.clear();  m_nStrings = 0;
+  vector<uint8_t> vecHeader(HEADER_LENGTH, 0);
+  for (uint32_t i = 0;  i < 4;  ++i) vecHeader[i]   = (uint8_t) (TRACE_MAGIC >> (8*i));
+  for (uint32_t i = 0;  i < 2;  ++i) vecHeader[4+i] = (uint8_t) (TRACE_VERSION >> (8*i));
+  for (uint32_t i = 0;  i < 8;  ++i) vecHeader[8+i] = (uint8_t) (m_llLastTime >> (8*i));
+  bool fOK = WriteRecord(REC_HEADER, vecHeader);
+  m_Lock.Leave();
+  return fOK;
+}
+
+
+uint32_t CTraceFile::InternString (const string &sText)
+{
+  //++
+  //   Return the ID for a string.  If we've never seen it before then assign
+  // the next ID and write a REC_STRING record for it first.  The caller must
+  // already hold m_Lock ...
+  //--
+  unordered_map<string, uint32_t>::const_iterator it = m_mapStrings.find(sText);
+  if (it != m_mapStrings.end()) return it->second;
+  uint32_t nID = m_nStrings++;
+  m_mapStrings[sText] = nID;
+  vector<uint8_t> vecString;  PutVarint(vecString, nID);
+  vecString.insert(vecString.end(), sText.begin(), sText.end());
+  WriteRecord(REC_STRING, vecString);
+  return nID;
+}
+
+
+uint32_t CTraceFile::InternFormat (const char *pszFormat)
+{
+  //++
+  //   Same as InternString(), but format strings are looked up by address.
+  // The same text at two different addresses just gets two IDs, which does
+  // no harm at all ...
+  //--
+  unordered_map<const char *, uint32_t>::const_iterator it = m_mapFormats.find(pszFormat);
+  if (it != m_mapFormats.end()) return it->second;
+  uint32_t nID = m_nStrings++;
+  m_mapFormats[pszFormat] = nID;
+  vector<uint8_t> vecString;  PutVarint(vecString, nID);
+  vecString.insert(vecString.end(), pszFormat, pszFormat+strlen(pszFormat));
+  WriteRecord(REC_STRING, vecString);
+  return nID;
+}
+
+
+void CTraceFile::BeginRecord (const CLog::TIMESTAMP *ptb)
+{
+  //++
+  //   Start building a new REC_TEXT or REC_MESSAGE in m_vecRecord, beginning
+  // with the time difference from the last record ...
+  //--
+  uint64_t llTime = TimeToMilliseconds(ptb);
+  m_vecRecord.clear();
+  PutSigned(m_vecRecord, (int64_t) (llTime - m_llLastTime));
+  m_llLastTime = llTime;
+}
+
+
+bool CTraceFile::WriteText (const CLog::TIMESTAMP *ptb, const string &sPrefix, const char *pszText)
+{
+  //++
+  //   Write a single line of text (it shouldn't contain any newlines!) along
+  // with its time and prefix.  This is the binary equivalent of CLog::
+  // LogSingleLine() ...
+  //--
+  assert((ptb != NULL) && (pszText != NULL));
+  m_Lock.Enter();
+  uint32_t nPrefix = InternString(sPrefix);
+  BeginRecord(ptb);
+  PutVarint(m_vecRecord, nPrefix);
+  m_vecRecord.insert(m_vecRecord.end(), pszText, pszText+strlen(pszText));
+  bool fOK = WriteRecord(REC_TEXT, m_vecRecord);
+  m_Lock.Leave();
+  return fOK;
+}
+
+
+bool CTraceFile::WriteMessage (const CLog::TIMESTAMP *ptb, const string &sPrefix, const char *pszFormat, const void *pArgs, size_t cbArgs)
+{
+  //++
+  //   Write a message that hasn't been formatted yet.  The arguments come
+  // from CLogFormat::SaveArguments(), and we just convert each one to its
+  // varint form ...
+  //--
+  assert((ptb != NULL) && (pszFormat != NULL) && (pArgs != NULL));
+  m_Lock.Enter();
+  uint32_t nPrefix = InternString(sPrefix);
+  uint32_t nFormat = InternFormat(pszFormat);
+  BeginRecord(ptb);
+  PutVarint(m_vecRecord, nPrefix);  PutVarint(m_vecRecord, nFormat);
+  size_t nOffset = 0;  uint64_t llValue;  const char *pszString;  size_t cbString;
+  CLogFormat::ARG_TYPE nType;
+  while ((nType = CLogFormat::NextArgument(pArgs, cbArgs, nOffset, llValue, pszString, cbString)) != CLogFormat::ARG_END) {
+    m_vecRecord.push_back((uint8_t) nType);
+    switch (nType) {
+      case CLogFormat::ARG_INT32:
+      case CLogFormat::ARG_INT64:
+        PutSigned(m_vecRecord, (int64_t) llValue);  break;
+      case CLogFormat::ARG_POINTER:
+        PutVarint(m_vecRecord, llValue);  break;
+      case CLogFormat::ARG_DOUBLE:
+        for (uint32_t i = 0;  i < 8;  ++i) m_vecRecord.push_back((uint8_t) (llValue >> (8*i)));
+        break;
+      case CLogFormat::ARG_STRING:
+        PutVarint(m_vecRecord, cbString);
+        m_vecRecord.insert(m_vecRecord.end(), pszString, pszString+cbString);
+        break;
+      default:
+        break;
+    }
+  }
+  bool fOK = WriteRecord(REC_MESSAGE, m_vecRecord);
+  m_Lock.Leave();
+  return fOK;
+}
+
+
+void CTraceFile::DecodeMessage (FILE *pText, uint64_t llTime, const string &sPrefix, const string &sFormat, const uint8_t *pab, const uint8_t *pabEnd)
+{
+  //++
+  //   Rebuild the saved arguments for a REC_MESSAGE, format the message, and
+  // then write it out one line at a time just like CLog::SendLog() does.  If
+  // the arguments are garbled we just format whatever we've got ...
+  //--
+  uint8_t abArgs[CLog::MAXMSG];  size_t cbArgs = 0;
+  bool fOK = true;
+  while (fOK && (pab < pabEnd)) {
+    CLogFormat::ARG_TYPE nType = (CLogFormat::ARG_TYPE) *pab++;
+    uint64_t llValue = 0;  int64_t llSigned = 0;  int32_t lValue;
+    switch (nType) {
+      case CLogFormat::ARG_INT32:
+        fOK = GetSigned(pab, pabEnd, llSigned);  lValue = (int32_t) llSigned;
+        fOK = fOK && CLogFormat::PutArgument(abArgs, sizeof(abArgs), cbArgs, nType, &lValue, sizeof(lValue));
+        break;
+      case CLogFormat::ARG_INT64:
+        fOK = GetSigned(pab, pabEnd, llSigned);
+        fOK = fOK && CLogFormat::PutArgument(abArgs, sizeof(abArgs), cbArgs, nType, &llSigned, sizeof(llSigned));
+        break;
+      case CLogFormat::ARG_POINTER:
+        fOK = GetVarint(pab, pabEnd, llValue);
+        fOK = fOK && CLogFormat::PutArgument(abArgs, sizeof(abArgs), cbArgs, nType, &llValue, sizeof(llValue));
+        break;
+      case CLogFormat::ARG_DOUBLE:
+        if (pabEnd-pab < 8) {fOK = false;  break;}
+        for (uint32_t i = 0;  i < 8;  ++i) llValue |= (uint64_t) *pab++ << (8*i);
+        fOK = CLogFormat::PutArgument(abArgs, sizeof(abArgs), cbArgs, nType, &llValue, sizeof(llValue));
+        break;
+      case CLogFormat::ARG_STRING:
+        {
+          uint16_t wLength;
+          fOK = GetVarint(pab, pabEnd, llValue) && (llValue <= (uint64_t) (pabEnd-pab))
+             && (cbArgs+3+llValue <= sizeof(abArgs));
+          if (!fOK) break;
+          wLength = (uint16_t) llValue;
+          abArgs[cbArgs++] = (uint8_t) nType;
+          memcpy(abArgs+cbArgs, &wLength, sizeof(wLength));  cbArgs += sizeof(wLength);
+          memcpy(abArgs+cbArgs, pab, wLength);  cbArgs += wLength;  pab += wLength;
+        }
+        break;
+      case CLogFormat::ARG_NULLSTRING:
+        fOK = CLogFormat::PutArgument(abArgs, sizeof(abArgs), cbArgs, nType, NULL, 0);
+        break;
+      default:
+        fOK = false;  break;
+    }
+  }
+  CLogFormat::PutArgument(abArgs, sizeof(abArgs), cbArgs, CLogFormat::ARG_END, NULL, 0);
+
+  // Format it and write it out, one line at a time ...
+  char szText[CLog::MAXMSG];  CLog::TIMESTAMP tb;
+  CLogFormat::Format(sFormat.c_str(), abArgs, cbArgs, szText, sizeof(szText));
+  MillisecondsToTime(llTime, &tb);
+  string sTime = CLog::TimeStampToString(&tb);
+  const char *pszLine = szText, *pszEnd;
+  while ((pszEnd = strchr(pszLine, '\n')) != NULL) {
+    fprintf(pText, "%s %s\t%.*s\n", sTime.c_str(), sPrefix.c_str(), (int) (pszEnd-pszLine), pszLine);
+    pszLine = pszEnd+1;
+  }
+  fprintf(pText, "%s %s\t%s\n", sTime.c_str(), sPrefix.c_str(), pszLine);
+}
+
+
+bool CTraceFile::Decode (FILE *pTrace, FILE *pText)
+{
+  //++
+  //   Read a trace file record by record and write the equivalent text log.
+  // Returns false if the file doesn't start with a valid header.  After that
+  // anything strange (an unknown string ID, a bad record, or a record that's
+  // cut off at the end of the file) just stops the decoding or is skipped.
+  //--
+  assert((pTrace != NULL) && (pText != NULL));
+  vector<string> vecStrings;  vector<uint8_t> vecRecord;
+  uint64_t llTime = 0;  bool fHeader = false;
+  int nType;
+  while ((nType = fgetc(pTrace)) != EOF) {
+    // Read the record length and then the rest of the record ...
+    uint64_t cbRecord = 0;  int ch;  uint32_t nShift = 0;
+    do {
+      if ((ch = fgetc(pTrace)) == EOF) return fHeader;
+      cbRecord |= (uint64_t) (ch & 0x7F) << nShift;  nShift += 7;
+    } while (((ch & 0x80) != 0) && (nShift < 64));
+    if (cbRecord > 0x7FFFFFFFULL) return fHeader;
+    vecRecord.resize((size_t) cbRecord);
+    if ((cbRecord > 0) && (fread(&vecRecord[0], 1, (size_t) cbRecord, pTrace) != cbRecord)) return fHeader;
+    const uint8_t *pab = vecRecord.empty() ? NULL : &vecRecord[0];
+    const uint8_t *pabEnd = pab + vecRecord.size();
+
+    // The first record had better be a header ...
+    if (!fHeader && (nType != REC_HEADER)) return false;
+    uint64_t llID, llFormat;  int64_t llDelta;
+    switch (nType) {
+      case REC_HEADER:
+        {
+          if (cbRecord < HEADER_LENGTH) return false;
+          uint32_t lMagic = 0;  uint16_t nVersion = 0;
+          for (uint32_t i = 0;  i < 4;  ++i) lMagic   |= (uint32_t) pab[i] << (8*i);
+          for (uint32_t i = 0;  i < 2;  ++i) nVersion |= (uint16_t) (pab[4+i] << (8*i));
+          if ((lMagic != TRACE_MAGIC) || (nVersion > TRACE_VERSION)) return false;
+          llTime = 0;
+          for (uint32_t i = 0;  i < 8;  ++i) llTime |= (uint64_t) pab[8+i] << (8*i);
+          vecStrings.clear();  fHeader = true;
+        }
+        break;
+
+      case REC_STRING:
+        if (!GetVarint(pab, pabEnd, llID) || (llID > vecStrings.size())) break;
+        if (llID == vecStrings.size()) vecStrings.push_back(string());
+        vecStrings[(size_t) llID].assign((const char *) pab, pabEnd-pab);
+        break;
+
+      case REC_TEXT:
+        if (!GetSigned(pab, pabEnd, llDelta) || !GetVarint(pab, pabEnd, llID)) break;
+        llTime += llDelta;
+        if (llID < vecStrings.size()) {
+          CLog::TIMESTAMP tb;  MillisecondsToTime(llTime, &tb);
+          fprintf(pText, "%s %s\t%.*s\n", CLog::TimeStampToString(&tb).c_str(),
+            vecStrings[(size_t) llID].c_str(), (int) (pabEnd-pab), (const char *) pab);
+        }
+        break;
+
+      case REC_MESSAGE:
+        if (!GetSigned(pab, pabEnd, llDelta) || !GetVarint(pab, pabEnd, llID)
+         || !GetVarint(pab, pabEnd, llFormat)) break;
+        llTime += llDelta;
+        if ((llID < vecStrings.size()) && (llFormat < vecStrings.size()))
+          DecodeMessage(pText, llTime, vecStrings[(size_t) llID], vecStrings[(size_t) llFormat], pab, pabEnd);
+        break;
+
+      default:
+        // Some record type from the future - just skip it ...
+        break;
+    }
+  }
+  return fHeader;
+}
+
+
+bool CTraceFile::Decode (const string &sTraceFile, const string &sTextFile)
+{
+  //++
+  //   Decode a trace file into a text file.  If the text file name is empty,
+  // then the text goes to stdout instead ...
+  //--
+  if (IsSameFile(sTraceFile.c_str(), sTextFile.c_str())) {
+    LOGS(ERROR, "can't decode " << sTraceFile << " onto itself");  return false;
+  }
+  FILE *pTrace, *pText = stdout;
+  if (fopen_s(&pTrace, sTraceFile.c_str(), "rb") != 0) {
+    LOGS(ERROR, "unable to open trace file " << sTraceFile);
+    return false;
+  }
+  if (!sTextFile.empty() && (fopen_s(&pText, sTextFile.c_str(), "wt") != 0)) {
+    LOGS(ERROR, "unable to create " << sTextFile);
+    fclose(pTrace);  return false;
+  }
+  bool fOK = Decode(pTrace, pText);
+  if (!fOK) LOGS(ERROR, sTraceFile << " is not a valid trace file");
+  fclose(pTrace);
+  if (pText != stdout) fclose(pText);
+  return fOK;
+}
@@ -0,0 +1,125 @@
+//++
+// TraceFile.hpp -> CTraceFile (binary log file) class
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the UPE LIBRARY project.  UPELIB is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    UPELIB is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   A CTraceFile object writes log messages to a compact binary file instead
+// of a text log, and the Decode() method turns one of those files back into
+// an ordinary text log.  See TraceFile.cpp for the details.
+//
+// REVISION HISTORY:
+// 16-OCT-26        New file.
+//--
+#pragma once
+#include <stdio.h>              // FILE, fwrite(), etc ...
+#include <string>               // C++ std::string class, et al ...
+#include <vector>               // C++ std::vector template
+#include <unordered_map>        // C++ std::unordered_map template
+using std::string;              // ...
+using std::vector;              // ...
+using std::unordered_map;       // ...
+#include "Mutex.hpp"            // needed for CMutex ...
+#include "LogFile.hpp"          // needed for CLog::TIMESTAMP ...
+
+
+class CTraceFile {
+  //++
+  //--
+
+  // Constants ...
+public:
+  enum {
+    TRACE_MAGIC   = 0x4C545055UL, // "UPTL" - magic number in every header
+    TRACE_VERSION = 1,            // current file format version
+  };
+
+  //   Every record in the file starts with one of these, followed by the
+  // length of the rest of the record (as a varint).  A decoder skips any
+  // record type it doesn't know about.
+  enum RECORD_TYPE {
+    REC_HEADER    = 1,          // file header (magic, version, base time)
+    REC_STRING    = 2,          // define an interned string
+    REC_TEXT      = 3,          // a message that's already formatted
+    REC_MESSAGE   = 4,          // a format string ID and its arguments
+  };
+
+  //   The header record is the only one with a fixed layout, and it's all
+  // little endian.  There's one at the start of the file, and another one
+  // every time the file is opened again to append to it.  Each one starts
+  // over - new base time, and no interned strings.
+  enum {
+    HEADER_LENGTH = 4+2+2+8,    // lMagic, nVersion, nReserved, llBaseTime
+  };
+
+  // Constructor and destructor ...
+public:
+  CTraceFile (FILE *pFile);
+  virtual ~CTraceFile() {};
+private:
+  // Disallow copy and assignment operations with CTraceFile objects...
+  CTraceFile (const CTraceFile &t) = delete;
+  CTraceFile& operator= (const CTraceFile &t) = delete;
+
+  // Public methods ...
+public:
+  // Write the header that starts the file (or starts appending to it) ...
+  bool WriteHeader (const CLog::TIMESTAMP *ptb);
+  // Write one line of text, exactly as CLog would write it to a text log ...
+  bool WriteText (const CLog::TIMESTAMP *ptb, const string &sPrefix, const char *pszText);
+  //   Write a message that hasn't been formatted yet, with its arguments as
+  // saved by CLogFormat::SaveArguments() ...
+  bool WriteMessage (const CLog::TIMESTAMP *ptb, const string &sPrefix, const char *pszFormat, const void *pArgs, size_t cbArgs);
+  //   Turn a trace file into a text log, in exactly the same format CLog
+  // uses.  Returns false if the file isn't a trace file or can't be read ...
+  static bool Decode (FILE *pTrace, FILE *pText);
+  static bool Decode (const string &sTraceFile, const string &sTextFile);
+
+  // Local methods ...
+protected:
+  // Add varints (unsigned and zigzag signed) to a record ...
+  static void PutVarint (vector<uint8_t> &vec, uint64_t llValue);
+  static void PutSigned (vector<uint8_t> &vec, int64_t llValue)
+    {PutVarint(vec, ((uint64_t) llValue << 1) ^ (uint64_t) (llValue >> 63));}
+  // Get varints from a record, or return false if we run off the end ...
+  static bool GetVarint (const uint8_t *&pab, const uint8_t *pabEnd, uint64_t &llValue);
+  static bool GetSigned (const uint8_t *&pab, const uint8_t *pabEnd, int64_t &llValue);
+  // Convert a timestamp to milliseconds and back ...
+  static uint64_t TimeToMilliseconds (const CLog::TIMESTAMP *ptb);
+  static void MillisecondsToTime (uint64_t llTime, CLog::TIMESTAMP *ptb);
+  // Return the ID of an interned string, writing it out if it's new ...
+  uint32_t InternString (const string &sText);
+  uint32_t InternFormat (const char *pszFormat);
+  // Start a record with its time delta, and write the finished record ...
+  void BeginRecord (const CLog::TIMESTAMP *ptb);
+  bool WriteRecord (RECORD_TYPE nType, const vector<uint8_t> &vecData);
+  // Decode one message and write it to the text file ...
+  static void DecodeMessage (FILE *pText, uint64_t llTime, const string &sPrefix, const string &sFormat, const uint8_t *pab, const uint8_t *pabEnd);
+
+  // Local members ...
+protected:
+  FILE       *m_pFile;          // the trace file (owned by CLog!)
+  uint64_t    m_llLastTime;     // time of the last record, in milliseconds
+  uint32_t    m_nStrings;       // number of strings interned so far
+  //   Format strings are interned by address (they're all literals, and that
+  // is much faster than hashing them) and everything else by content ...
+  unordered_map<string, uint32_t>       m_mapStrings;
+  unordered_map<const char *, uint32_t> m_mapFormats;
+  vector<uint8_t> m_vecRecord;  // the record being built
+  //   More than one thread can write to the log file at the same time, so
+  // everything that touches the members above holds this lock ...
+  CMutex      m_Lock;           // serializes access to everything
+};
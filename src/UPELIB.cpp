@@ -48,6 +48,7 @@
 #pragma comment(lib, "Winmm.lib")   // force the multimedia library to be loaded
 #elif __linux__
 #include <unistd.h>             // usleep(), access(), R_OK, etc ...
+#include <sys/stat.h>           // stat(), struct stat, etc ...
 #include <netinet/in.h>         // Internet in_addr definitions
 #include <libgen.h>
 #endif
@@ -274,6 +275,37 @@ bool FileExists (const char *pszPath)
 }
 
 
+bool IsSameFile (const char *pszPath1, const char *pszPath2)
+{
+  //++
+  //   Return TRUE if both paths refer to the same file.  Comparing the names
+  // isn't good enough - there are relative paths, symbolic and hard links,
+  // and (on Windows) case insensitive names to worry about - so we ask the
+  // file system instead.  If either file doesn't exist, then they can't be
+  // the same file!
+  //--
+#ifdef _WIN32
+  HANDLE h1 = CreateFileA(pszPath1, 0, FILE_SHARE_READ|FILE_SHARE_WRITE|FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+  if (h1 == INVALID_HANDLE_VALUE) return false;
+  HANDLE h2 = CreateFileA(pszPath2, 0, FILE_SHARE_READ|FILE_SHARE_WRITE|FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+  if (h2 == INVALID_HANDLE_VALUE) {
+    CloseHandle(h1);  return false;
+  }
+  BY_HANDLE_FILE_INFORMATION fi1, fi2;
+  bool fSame = GetFileInformationByHandle(h1, &fi1) && GetFileInformationByHandle(h2, &fi2)
+            && (fi1.dwVolumeSerialNumber == fi2.dwVolumeSerialNumber)
+            && (fi1.nFileIndexHigh == fi2.nFileIndexHigh)
+            && (fi1.nFileIndexLow == fi2.nFileIndexLow);
+  CloseHandle(h1);  CloseHandle(h2);
+  return fSame;
+#elif __linux__
+  struct stat st1, st2;
+  if ((stat(pszPath1, &st1) != 0) || (stat(pszPath2, &st2) != 0)) return false;
+  return (st1.st_dev == st2.st_dev) && (st1.st_ino == st2.st_ino);
+#endif
+}
+
+
 string FormatIPaddress (uint32_t lIP, uint16_t nPort)
 {
   //++
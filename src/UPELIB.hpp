@@ -101,6 +101,15 @@ using std::string;            // this is used EVERYWHERE!
 #define DBGNEW new
 #endif
 
+//   Declare a thread local variable.  Visual Studio 2013 doesn't know about
+// the C++11 thread_local keyword, but both compilers have their own way of
+// saying the same thing.  Either way, it only works for simple types ...
+#ifdef _WIN32
+#define THREAD_LOCAL __declspec(thread)
+#elif __linux__
+#define THREAD_LOCAL __thread
+#endif
+
 // Prototypes for routines declared in upelib.cpp ...
 extern "C" void _sleep_ms (uint32_t nDelay);
 extern "C" void CheckAffinity (void);
@@ -110,6 +119,7 @@ extern bool SplitPath (const char *pszPath, string &sDrive, string &sDirectory,
 extern string MakePath (const char *pszDrive, const char *pszDirectory, const char *pszFileName, const char *pszExtension);
 extern string FullPath (const char *pszRelativePath);
 extern bool FileExists (const char *pszPath);
+extern bool IsSameFile (const char *pszPath1, const char *pszPath2);
 extern bool ParseIPaddress (const char *pszAddr, uint32_t &lIP, uint16_t &nPort);
 extern string FormatIPaddress (uint32_t lIP, uint16_t nPort=0);
 extern string FormatIPaddress (const struct sockaddr_in *p);
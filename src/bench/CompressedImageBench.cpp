@@ -0,0 +1,214 @@
+//++
+// CompressedImageBench.cpp -> compressed vs raw disk image benchmark
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the UPE LIBRARY project.  UPELIB is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    UPELIB is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   This program compares reading a compressed disk image with reading the
+// same image raw.  It builds a synthetic image that looks roughly like a
+// real distribution pack - a mix of empty space, repetitive text and binary
+// records, and some incompressible data - and compresses it with
+// CCompressedImage::CompressImage().  Then it reads both images sequentially,
+// a track at a time, and at random, one sector at a time, and checks that
+// every sector of the compressed image matches the raw one.
+//
+//   It prints the compression time and ratio plus the read throughput for
+// both images, and exits with status 1 if anything failed to verify.
+//
+// Usage:
+//    CompressedImageBench [image-file [megabytes [random-sectors]]]
+//
+// REVISION HISTORY:
+// 16-OCT-26        New file.
+//--
+//000000001111111111222222222233333333334444444444555555555566666666667777777777
+//234567890123456789012345678901234567890123456789012345678901234567890123456789
+#include <stdio.h>              // printf(), et al ...
+#include <stdlib.h>             // atoi(), rand(), etc ...
+#include <stdint.h>             // uint8_t, uint32_t, etc ...
+#include <string.h>             // memset(), memcmp(), etc ...
+#include <unistd.h>             // unlink() ...
+#include <time.h>               // clock_gettime() ...
+#include <sys/stat.h>           // stat() ...
+#include <assert.h>             // assert() (what else??)
+#include <string>               // C++ std::string class, et al ...
+#include <vector>               // C++ std::vector template
+using std::string;              // ...
+using std::vector;              // ...
+#include "UPELIB.hpp"           // UPE library definitions
+#include "LogFile.hpp"          // UPE library message logging facility
+#include "ImageFile.hpp"        // CDiskImageFile declarations
+#include "CompressedImage.hpp"  // CCompressedImage declarations
+
+// Benchmark parameters ...
+#define SECTOR_SIZE     512                     // bytes per sector
+#define TRACK_SECTORS   64                      // sectors per sequential read
+#define DEFAULT_MB      256                     // default image size
+#define RANDOM_DEFAULT  16384                   // default random sector count
+
+
+static double Now()
+{
+  //++
+  // Return the current time, in seconds, from the monotonic clock ...
+  //--
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+
+static void FillTrack (uint8_t *pab, uint32_t nTrack)
+{
+  //++
+  //   Fill one track of the synthetic image.  Every fourth track is empty,
+  // another is repetitive text, another looks like fixed length binary
+  // records, and the last is random and won't compress at all ...
+  //--
+  static const char szText[] = "THE QUICK BROWN FOX JUMPS OVER THE LAZY DOG 0123456789\r\n";
+  const size_t cbTrack = TRACK_SECTORS * SECTOR_SIZE;
+  switch (nTrack % 4) {
+    case 0:
+      memset(pab, 0, cbTrack);  break;
+    case 1:
+      for (size_t i = 0;  i < cbTrack;  ++i) pab[i] = szText[(i + nTrack) % (sizeof(szText)-1)];
+      break;
+    case 2:
+      for (size_t i = 0;  i < cbTrack;  i += sizeof(uint32_t)) {
+        uint32_t l = (i % 64 == 0) ? (uint32_t) (nTrack*cbTrack + i) : (uint32_t) (i & 0xFF);
+        memcpy(pab+i, &l, sizeof(l));
+      }
+      break;
+    default:
+      for (size_t i = 0;  i < cbTrack;  ++i) pab[i] = (uint8_t) rand();
+      break;
+  }
+}
+
+
+static bool CreateImage (const char *pszFile, uint32_t nTracks)
+{
+  //++
+  // Write the synthetic raw image ...
+  //--
+  FILE *pFile = fopen(pszFile, "wb");
+  if (pFile == NULL) return false;
+  vector<uint8_t> vecTrack(TRACK_SECTORS * SECTOR_SIZE);
+  srand(4096);
+  bool fOK = true;
+  for (uint32_t i = 0;  fOK && (i < nTracks);  ++i) {
+    FillTrack(vecTrack.data(), i);
+    fOK = fwrite(vecTrack.data(), 1, vecTrack.size(), pFile) == vecTrack.size();
+  }
+  return (fclose(pFile) == 0) && fOK;
+}
+
+
+static bool ReadImage (CDiskImageFile *pImage, CDiskImageFile *pCheck, uint32_t nTracks,
+                       const vector<uint32_t> &vecRandom, double &tSequential, double &tRandom)
+{
+  //++
+  //   Read the whole image sequentially, then read the random sectors, and
+  // time both.  If pCheck isn't NULL, then every sector is compared with the
+  // same sector from that image (after the timing stops!) ...
+  //--
+  vector<uint8_t> vecData(TRACK_SECTORS * SECTOR_SIZE), vecCheck(vecData.size());
+  bool fOK = true;
+  tSequential = 0.0;
+  for (uint32_t i = 0;  i < nTracks;  ++i) {
+    double tStart = Now();
+    if (!pImage->ReadSectors(i*TRACK_SECTORS, TRACK_SECTORS, vecData.data())) return false;
+    tSequential += Now() - tStart;
+    if (pCheck == NULL) continue;
+    if (!pCheck->ReadSectors(i*TRACK_SECTORS, TRACK_SECTORS, vecCheck.data())
+     || (memcmp(vecData.data(), vecCheck.data(), vecData.size()) != 0)) fOK = false;
+  }
+  tRandom = 0.0;
+  for (size_t i = 0;  i < vecRandom.size();  ++i) {
+    double tStart = Now();
+    if (!pImage->ReadSector(vecRandom[i], vecData.data())) return false;
+    tRandom += Now() - tStart;
+    if (pCheck == NULL) continue;
+    if (!pCheck->ReadSector(vecRandom[i], vecCheck.data())
+     || (memcmp(vecData.data(), vecCheck.data(), SECTOR_SIZE) != 0)) fOK = false;
+  }
+  return fOK;
+}
+
+
+int main (int argc, char *argv[])
+{
+  //++
+  //--
+  string sRaw = (argc > 1) ? argv[1] : "/tmp/CompressedImageBench.img";
+  uint32_t nMB = (argc > 2) ? (uint32_t) atoi(argv[2]) : DEFAULT_MB;
+  size_t nRandom = (argc > 3) ? (size_t) atoi(argv[3]) : RANDOM_DEFAULT;
+  string sCompressed = sRaw + ".z";
+  uint32_t nTracks = (uint32_t) (((uint64_t) nMB << 20) / (TRACK_SECTORS * SECTOR_SIZE));
+  uint32_t nSectors = nTracks * TRACK_SECTORS;
+  if (nTracks == 0) {
+    fprintf(stderr, "image size must be at least 1Mb\n");  return 2;
+  }
+  CLog *pLog = DBGNEW CLog("CompressedImageBench");
+  pLog->SetDefaultConsoleLevel(CLog::WARNING);
+
+  // Create the raw image and compress it ...
+  if (!CreateImage(sRaw.c_str(), nTracks)) {
+    fprintf(stderr, "unable to create %s\n", sRaw.c_str());
+    delete pLog;  return 1;
+  }
+  double tStart = Now();
+  if (!CCompressedImage::CompressImage(sRaw, sCompressed, SECTOR_SIZE)) {
+    fprintf(stderr, "unable to compress %s\n", sRaw.c_str());
+    unlink(sRaw.c_str());  delete pLog;  return 1;
+  }
+  double tCompress = Now() - tStart;
+  struct stat stRaw, stCompressed;
+  stat(sRaw.c_str(), &stRaw);  stat(sCompressed.c_str(), &stCompressed);
+
+  // Pick the random sectors - the same ones for both images ...
+  vector<uint32_t> vecRandom;
+  srand(512);
+  for (size_t i = 0;  i < nRandom;  ++i)
+    vecRandom.push_back((uint32_t) (((uint64_t) rand() * RAND_MAX + rand()) % nSectors));
+
+  // Now read both images ...
+  CDiskImageFile *pRaw = DBGNEW CDiskImageFile(SECTOR_SIZE);
+  CDiskImageFile *pCompressed = DBGNEW CDiskImageFile(SECTOR_SIZE);
+  bool fOK = pRaw->Open(sRaw, true) && pCompressed->Open(sCompressed, true)
+          && pCompressed->IsCompressed();
+  double tRawSequential = 0, tRawRandom = 0, tSequential = 0, tRandom = 0;
+  if (fOK) fOK = ReadImage(pRaw, NULL, nTracks, vecRandom, tRawSequential, tRawRandom);
+  if (fOK) fOK = ReadImage(pCompressed, pRaw, nTracks, vecRandom, tSequential, tRandom);
+  delete pCompressed;  delete pRaw;
+  unlink(sCompressed.c_str());  unlink(sRaw.c_str());
+  if (!fOK) fprintf(stderr, "compressed image failed to verify\n");
+
+  // And report the results ...
+  double cbImage = (double) nSectors * SECTOR_SIZE / 1048576.0;
+  printf("%u Mb image, %u byte sectors, %u sectors per sequential read, %u random sectors\n\n",
+    nMB, SECTOR_SIZE, TRACK_SECTORS, (uint32_t) vecRandom.size());
+  printf("compressed %lld bytes to %lld bytes (%.1f%%) in %.2f seconds (%.1f MB/s)\n\n",
+    (long long) stRaw.st_size, (long long) stCompressed.st_size,
+    100.0 * stCompressed.st_size / stRaw.st_size, tCompress, cbImage/tCompress);
+  printf("image         seq rd     rand rd\n");
+  printf("                MB/s      sect/s\n");
+  printf("%-10s  %8.1f  %10.0f\n", "raw", cbImage/tRawSequential, vecRandom.size()/tRawRandom);
+  printf("%-10s  %8.1f  %10.0f  %s\n", "compressed", cbImage/tSequential, vecRandom.size()/tRandom,
+    fOK ? "OK" : "FAILED");
+  delete pLog;
+  return fOK ? 0 : 1;
+}
@@ -0,0 +1,209 @@
+//++
+// CompressedTapeBench.cpp -> compressed vs raw tape image benchmark
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the UPE LIBRARY project.  UPELIB is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    UPELIB is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   This program compares compressed tapes with ordinary TAP files.  It
+// writes the same synthetic tape both ways - records of random length full
+// of assembly language source text, which is roughly what an archived
+// software distribution looks like, with a tape mark every few hundred
+// records.  It also converts the raw tape with CTapeImageFile::CompressTape().
+// Then it reads each tape forward and in reverse, spaces over files, and
+// checks that both tapes return exactly the same records.
+//
+//   It prints the file sizes plus the write, read and spacing speeds for
+// both formats, and exits with status 1 if anything failed to verify.
+//
+// Usage:
+//    CompressedTapeBench [tape-file [megabytes [block-size]]]
+//
+// REVISION HISTORY:
+// 16-OCT-26        New file.
+//--
+//000000001111111111222222222233333333334444444444555555555566666666667777777777
+//234567890123456789012345678901234567890123456789012345678901234567890123456789
+#include <stdio.h>              // printf(), et al ...
+#include <stdlib.h>             // atoi(), rand(), etc ...
+#include <stdint.h>             // uint8_t, uint32_t, etc ...
+#include <string.h>             // memset(), memcmp(), etc ...
+#include <unistd.h>             // unlink() ...
+#include <time.h>               // clock_gettime() ...
+#include <sys/stat.h>           // stat() ...
+#include <assert.h>             // assert() (what else??)
+#include <string>               // C++ std::string class, et al ...
+#include <vector>               // C++ std::vector template
+using std::string;              // ...
+using std::vector;              // ...
+#include "UPELIB.hpp"           // UPE library definitions
+#include "LogFile.hpp"          // UPE library message logging facility
+#include "ImageFile.hpp"        // CTapeImageFile declarations
+
+// Benchmark parameters ...
+#define DEFAULT_MB      256                     // default tape size
+#define MIN_RECORD      512                     // shortest record
+#define MAX_RECORD      8192                    // longest record
+#define FILE_RECORDS    500                     // records between tape marks
+#define SPACE_PASSES    100                     // passes for the spacing test
+
+
+static double Now()
+{
+  //++
+  // Return the current time, in seconds, from the monotonic clock ...
+  //--
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+
+static uint32_t MakeRecord (uint8_t *pab)
+{
+  //++
+  //   Fill a record buffer with pseudo assembly language and return its
+  // length.  The words come from a small vocabulary, so it compresses about
+  // as well as real source text ...
+  //--
+  static const char *const apszWords[] = {
+    "LOAD ", "STORE ", "ADD ", "JUMP ", "R1,", "R2,", "0(R3) ", "\r\n",
+    "; COMMENT ", "LABEL: ", "MOVE ", "#100 "
+  };
+  const size_t nWords = sizeof(apszWords) / sizeof(apszWords[0]);
+  uint32_t cbRecord = MIN_RECORD + (uint32_t) rand() % (MAX_RECORD-MIN_RECORD+1);
+  for (uint32_t i = 0;  i < cbRecord; ) {
+    const char *psz = apszWords[rand() % nWords];
+    while ((*psz != '\0') && (i < cbRecord)) pab[i++] = (uint8_t) *psz++;
+  }
+  return cbRecord;
+}
+
+
+static bool WriteTape (const string &sFile, uint32_t cbBlock, uint64_t cbTape, uint32_t &nRecords, double &tWrite)
+{
+  //++
+  //   Write the synthetic tape, compressed if cbBlock isn't zero.  Both calls
+  // use the same random seed, so they write exactly the same records ...
+  //--
+  unlink(sFile.c_str());
+  CTapeImageFile tape;
+  if (cbBlock != 0) tape.SetCompression(cbBlock);
+  if (!tape.Open(sFile, false)) return false;
+  vector<uint8_t> vecRecord(MAX_RECORD);
+  srand(1);
+  uint64_t cbWritten = 0;
+  double tStart = Now();
+  for (nRecords = 0;  cbWritten < cbTape;  ++nRecords) {
+    uint32_t cbRecord = MakeRecord(vecRecord.data());
+    if (!tape.WriteRecord(vecRecord.data(), cbRecord)) return false;
+    cbWritten += cbRecord;
+    if (((nRecords+1) % FILE_RECORDS) == 0) {
+      if (!tape.WriteMark()) return false;
+    }
+  }
+  if (!tape.WriteMark() || !tape.WriteMark()) return false;
+  tape.Close();
+  tWrite = Now() - tStart;
+  return true;
+}
+
+
+static bool ReadTape (const string &sFile, const char *pszName, uint32_t nRecords, double tWrite, const string &sRaw)
+{
+  //++
+  //   Read a tape forward and then in reverse, space over files, and print
+  // the results.  If sRaw isn't empty then every record is also compared
+  // with the same record from that tape (outside the timed part!) ...
+  //--
+  CTapeImageFile tape, raw;
+  if (!tape.Open(sFile, true) || (!sRaw.empty() && !raw.Open(sRaw, true))) {
+    fprintf(stderr, "%s: unable to open %s\n", pszName, sFile.c_str());  return false;
+  }
+  vector<uint8_t> vecRecord(MAX_RECORD), vecRaw(MAX_RECORD);
+  uint32_t nForward = 0, nReverse = 0, nBad = 0;
+  uint64_t cbData = 0;
+  int32_t cbRecord;
+  double tForward = 0;
+  for (;;) {
+    double tStart = Now();
+    cbRecord = tape.ReadForwardRecord(vecRecord.data(), vecRecord.size());
+    tForward += Now() - tStart;
+    if (!sRaw.empty()) {
+      int32_t cbRaw = raw.ReadForwardRecord(vecRaw.data(), vecRaw.size());
+      if ((cbRaw != cbRecord) || ((cbRecord > 0) && (memcmp(vecRecord.data(), vecRaw.data(), cbRecord) != 0))) ++nBad;
+    }
+    if (cbRecord < 0) break;
+    if (cbRecord > 0) {
+      ++nForward;  cbData += cbRecord;
+    }
+  }
+  if ((cbRecord != CTapeImageFile::EOTBOT) || (nForward != nRecords)) ++nBad;
+  double tStart = Now();
+  while ((cbRecord = tape.ReadReverseRecord(vecRecord.data(), vecRecord.size())) >= 0)
+    if (cbRecord > 0) ++nReverse;
+  double tReverse = Now() - tStart;
+  if ((cbRecord != CTapeImageFile::EOTBOT) || (nReverse != nRecords)) ++nBad;
+  uint32_t nFiles = nRecords / FILE_RECORDS;
+  tStart = Now();
+  for (uint32_t i = 0;  i < SPACE_PASSES;  ++i) {
+    tape.Rewind();
+    if (tape.SpaceForwardFile(MKINT32(nFiles)) < 0) ++nBad;
+  }
+  double tSpace = (Now() - tStart) / SPACE_PASSES;
+  struct stat st;
+  stat(sFile.c_str(), &st);
+  double cbMB = cbData / 1048576.0;
+  printf("%-12s  %8.1f  %8.1f  %8.1f  %8.1f  %8.3f  %s\n", pszName, st.st_size / 1048576.0,
+    (tWrite > 0) ? cbMB/tWrite : 0.0, cbMB/tForward, cbMB/tReverse, tSpace*1000.0,
+    (nBad == 0) ? "OK" : "FAILED");
+  return nBad == 0;
+}
+
+
+int main (int argc, char *argv[])
+{
+  //++
+  //--
+  string sRaw = (argc > 1) ? argv[1] : "/tmp/CompressedTapeBench.tap";
+  uint64_t cbTape = (uint64_t) ((argc > 2) ? atoi(argv[2]) : DEFAULT_MB) << 20;
+  uint32_t cbBlock = (argc > 3) ? (uint32_t) atoi(argv[3]) : (uint32_t) CTapeImageFile::DEFAULT_COMPRESS_BLOCK;
+  string sCompressed = sRaw + ".z", sConverted = sRaw + ".c";
+  CLog *pLog = DBGNEW CLog("CompressedTapeBench");
+  pLog->SetDefaultConsoleLevel(CLog::WARNING);
+
+  // Write the raw and compressed tapes, and convert the raw one too ...
+  uint32_t nRecords = 0, nCompressed = 0;
+  double tRaw = 0, tCompressed = 0;
+  bool fOK = WriteTape(sRaw, 0, cbTape, nRecords, tRaw)
+          && WriteTape(sCompressed, cbBlock, cbTape, nCompressed, tCompressed)
+          && (nRecords == nCompressed);
+  double tStart = Now();
+  fOK = fOK && CTapeImageFile::CompressTape(sRaw, sConverted, cbBlock);
+  double tConvert = Now() - tStart;
+  if (!fOK) {
+    fprintf(stderr, "unable to create the test tapes\n");
+  } else {
+    printf("%u records of %d to %d bytes, %u byte blocks\n\n", nRecords, MIN_RECORD, MAX_RECORD, cbBlock);
+    printf("tape              size     write   fwd read  rev read     space\n");
+    printf("                    MB      MB/s      MB/s      MB/s        ms\n");
+    fOK = ReadTape(sRaw, "raw", nRecords, tRaw, "");
+    fOK = ReadTape(sCompressed, "compressed", nRecords, tCompressed, sRaw) && fOK;
+    fOK = ReadTape(sConverted, "converted", nRecords, tConvert, sRaw) && fOK;
+  }
+  unlink(sRaw.c_str());  unlink(sCompressed.c_str());  unlink(sConverted.c_str());
+  delete pLog;
+  return fOK ? 0 : 1;
+}
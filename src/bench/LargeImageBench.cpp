@@ -0,0 +1,194 @@
+//++
+// LargeImageBench.cpp -> disk image benchmark past the 4Gb boundary
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the UPE LIBRARY project.  UPELIB is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    UPELIB is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   This program stresses CDiskImageFile with sector numbers that put the
+// file offset past 4Gb.  For each access mode (stdio, positional and mapped)
+// it creates a new, sparse, image and writes a run of sectors that straddles
+// the 4Gb boundary plus a batch of random sectors scattered over the first
+// 16Gb.  Every sector is filled with its own sector number, so any offset
+// that gets truncated to 32 bits reads back the wrong data.  Then it closes
+// the image, opens it again, reads everything back and checks it.
+//
+//   It prints the sequential and random throughput for each mode, and exits
+// with status 1 if anything failed to verify.
+//
+// Usage:
+//    LargeImageBench [image-file [random-sectors]]
+//
+// REVISION HISTORY:
+// 16-OCT-26        New file.
+//--
+//000000001111111111222222222233333333334444444444555555555566666666667777777777
+//234567890123456789012345678901234567890123456789012345678901234567890123456789
+#include <stdio.h>              // printf(), et al ...
+#include <stdlib.h>             // atoi(), rand(), etc ...
+#include <stdint.h>             // uint8_t, uint32_t, etc ...
+#include <string.h>             // memset(), memcmp(), etc ...
+#include <unistd.h>             // unlink() ...
+#include <time.h>               // clock_gettime() ...
+#include <assert.h>             // assert() (what else??)
+#include <vector>               // C++ std::vector template
+using std::vector;              // ...
+#include "UPELIB.hpp"           // UPE library definitions
+#include "LogFile.hpp"          // UPE library message logging facility
+#include "ImageFile.hpp"        // CDiskImageFile declarations
+
+// Benchmark parameters ...
+#define SECTOR_SIZE     512                     // bytes per sector
+#define BOUNDARY_LBA    (0x100000000ULL / SECTOR_SIZE) // first sector past 4Gb
+#define RUN_BEFORE      4096                    // sectors before the boundary
+#define RUN_LENGTH      32768                   // length of the sequential run
+#define RANDOM_SPAN     (4 * BOUNDARY_LBA)      // random sectors land below 16Gb
+#define RANDOM_DEFAULT  8192                    // default random sector count
+
+
+static double Now()
+{
+  //++
+  // Return the current time, in seconds, from the monotonic clock ...
+  //--
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+
+static void FillSector (uint8_t *pab, uint32_t lLBA)
+{
+  //++
+  // Fill a sector buffer with copies of its own sector number ...
+  //--
+  for (size_t i = 0;  i < SECTOR_SIZE;  i += sizeof(uint32_t))
+    memcpy(pab+i, &lLBA, sizeof(uint32_t));
+}
+
+
+static bool CheckSector (const uint8_t *pab, uint32_t lLBA)
+{
+  //++
+  // Return TRUE if a sector buffer contains its own sector number ...
+  //--
+  uint8_t abExpected[SECTOR_SIZE];
+  FillSector(abExpected, lLBA);
+  return memcmp(pab, abExpected, SECTOR_SIZE) == 0;
+}
+
+
+static bool RunMode (const char *pszFile, CDiskImageFile::ACCESS_MODE nMode, const char *pszMode, const vector<uint32_t> &vecRandom)
+{
+  //++
+  //   Write, then read back and verify, all the test sectors using one access
+  // mode.  Returns false if anything went wrong ...
+  //--
+  uint32_t lStart = (uint32_t) (BOUNDARY_LBA - RUN_BEFORE);
+  uint8_t abSector[SECTOR_SIZE];
+  unlink(pszFile);
+
+  // Write the sequential run and the random sectors ...
+  CDiskImageFile *pImage = DBGNEW CDiskImageFile(SECTOR_SIZE);
+  if (!pImage->Open(pszFile, false, 0, nMode)) {
+    fprintf(stderr, "%s: unable to create %s\n", pszMode, pszFile);
+    delete pImage;  return false;
+  }
+  pImage->SetSparse(true);
+  double tStart = Now();
+  for (uint32_t i = 0;  i < RUN_LENGTH;  ++i) {
+    FillSector(abSector, lStart+i);
+    if (!pImage->WriteSector(lStart+i, abSector)) {
+      fprintf(stderr, "%s: write failed at LBA %u\n", pszMode, lStart+i);
+      delete pImage;  return false;
+    }
+  }
+  double tSequentialWrite = Now() - tStart;
+  tStart = Now();
+  for (size_t i = 0;  i < vecRandom.size();  ++i) {
+    FillSector(abSector, vecRandom[i]);
+    if (!pImage->WriteSector(vecRandom[i], abSector)) {
+      fprintf(stderr, "%s: write failed at LBA %u\n", pszMode, vecRandom[i]);
+      delete pImage;  return false;
+    }
+  }
+  pImage->Flush();
+  double tRandomWrite = Now() - tStart;
+  uint64_t llLength = pImage->GetFileLength();
+  delete pImage;
+
+  // Open it again and read everything back ...
+  pImage = DBGNEW CDiskImageFile(SECTOR_SIZE);
+  if (!pImage->Open(pszFile, true, 0, nMode)) {
+    fprintf(stderr, "%s: unable to reopen %s\n", pszMode, pszFile);
+    delete pImage;  return false;
+  }
+  bool fOK = pImage->GetFileLength() == llLength;
+  if (!fOK) fprintf(stderr, "%s: length changed after reopening\n", pszMode);
+  uint32_t nBad = 0;
+  tStart = Now();
+  for (uint32_t i = 0;  i < RUN_LENGTH;  ++i)
+    if (!pImage->ReadSector(lStart+i, abSector) || !CheckSector(abSector, lStart+i)) ++nBad;
+  double tSequentialRead = Now() - tStart;
+  tStart = Now();
+  for (size_t i = 0;  i < vecRandom.size();  ++i)
+    if (!pImage->ReadSector(vecRandom[i], abSector) || !CheckSector(abSector, vecRandom[i])) ++nBad;
+  double tRandomRead = Now() - tStart;
+  delete pImage;
+  unlink(pszFile);
+  if (nBad > 0) {
+    fprintf(stderr, "%s: %u sectors failed to verify\n", pszMode, nBad);
+    fOK = false;
+  }
+
+  // And report the results ...
+  double cbRun = (double) RUN_LENGTH * SECTOR_SIZE / 1048576.0;
+  printf("%-10s  %8.1f  %8.1f  %10.0f  %10.0f  %7.2f  %s\n", pszMode,
+    cbRun/tSequentialWrite, cbRun/tSequentialRead,
+    vecRandom.size()/tRandomWrite, vecRandom.size()/tRandomRead,
+    llLength/1073741824.0, fOK ? "OK" : "FAILED");
+  return fOK;
+}
+
+
+int main (int argc, char *argv[])
+{
+  //++
+  //--
+  const char *pszFile = (argc > 1) ? argv[1] : "/tmp/LargeImageBench.img";
+  size_t nRandom = (argc > 2) ? (size_t) atoi(argv[2]) : RANDOM_DEFAULT;
+  CLog *pLog = DBGNEW CLog("LargeImageBench");
+  pLog->SetDefaultConsoleLevel(CLog::WARNING);
+
+  //   Pick the random sectors.  Every run uses the same ones, and a fixed seed
+  // makes the results repeatable from one run to the next.  The last random
+  // sector is always the highest possible one, so that every image ends up
+  // the same size ...
+  vector<uint32_t> vecRandom;
+  srand(4096);
+  for (size_t i = 1;  i < nRandom;  ++i)
+    vecRandom.push_back((uint32_t) (((uint64_t) rand() * RAND_MAX + rand()) % RANDOM_SPAN));
+  vecRandom.push_back((uint32_t) (RANDOM_SPAN - 1));
+
+  printf("%u sectors of %d bytes starting at LBA %llu, %u random sectors below 16Gb\n\n",
+    RUN_LENGTH, SECTOR_SIZE, (unsigned long long) (BOUNDARY_LBA - RUN_BEFORE), (uint32_t) vecRandom.size());
+  printf("mode        seq wr    seq rd     rand wr     rand rd   length\n");
+  printf("              MB/s      MB/s     sect/s      sect/s      Gb\n");
+  bool fOK = RunMode(pszFile, CDiskImageFile::ACCESS_STDIO, "stdio", vecRandom);
+  fOK = RunMode(pszFile, CDiskImageFile::ACCESS_POSITIONAL, "positional", vecRandom) && fOK;
+  fOK = RunMode(pszFile, CDiskImageFile::ACCESS_MAPPED, "mapped", vecRandom) && fOK;
+  delete pLog;
+  return fOK ? 0 : 1;
+}
@@ -0,0 +1,196 @@
+//++
+// MessageQueueBench.cpp -> log message queue producer latency benchmark
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the UPE LIBRARY project.  UPELIB is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    UPELIB is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   This program measures how long a thread waits to queue a log message -
+// the time spent in CMessageQueue::AddEntry() - with 1, 4 and 16 threads all
+// logging as fast as they can.  The real logging thread is running and writes
+// every message to a scratch log file, so the queue fills and drains just as
+// it would in an emulator.  Each thread count is run twice, once with every
+// thread sharing the common ring and once with each thread registered for a
+// private ring (which is what CLog::SetThreadQueued() does).
+//
+//   Every call is timed separately and the program prints the median, 99th
+// percentile, worst case and mean latency, plus the total messages per second
+// and the number of messages dropped (which should be zero, since the default
+// overflow policy is to block).  The latencies include the cost of reading
+// the clock, which is printed first.
+//
+// Usage:
+//    MessageQueueBench [messages-per-thread [log-file]]
+//
+// REVISION HISTORY:
+// 16-OCT-26        New file.
+//--
+//000000001111111111222222222233333333334444444444555555555566666666667777777777
+//234567890123456789012345678901234567890123456789012345678901234567890123456789
+#include <stdio.h>              // printf(), et al ...
+#include <stdlib.h>             // atoi(), etc ...
+#include <stdint.h>             // uint8_t, uint32_t, etc ...
+#include <string.h>             // memset(), etc ...
+#include <unistd.h>             // unlink() ...
+#include <time.h>               // clock_gettime() ...
+#include <sys/timeb.h>          // struct timeb (for CLog::TIMESTAMP) ...
+#include <assert.h>             // assert() (what else??)
+#include <atomic>               // C++ std::atomic template
+#include <algorithm>            // std::sort() ...
+#include <string>               // C++ std::string class, et al ...
+#include <vector>               // C++ std::vector template
+using std::string;              // ...
+using std::vector;              // ...
+#include "UPELIB.hpp"           // UPE library definitions
+#include "LogFile.hpp"          // UPE library message logging facility
+#include "Thread.hpp"           // CThread declarations
+#include "MessageQueue.hpp"     // CMessageQueue declarations
+
+// Benchmark parameters ...
+#define DEFAULT_MESSAGES 20000                  // messages logged per thread
+#define MAX_THREADS      16                     // most producer threads
+
+//   Each producer thread gets one of these.  The latencies are saved in a
+// vector allocated ahead of time so that nothing but AddEntry() is timed ...
+struct _PRODUCER {
+  CMessageQueue        *pQueue;         // the queue we're testing
+  bool                  fPrivate;       // TRUE to register a private ring
+  std::atomic<bool>    *pfGo;           // set when all threads should start
+  vector<uint32_t>      vecLatency;     // nanoseconds for each AddEntry()
+  uint32_t              nDropped;       // AddEntry() calls that failed
+};
+typedef struct _PRODUCER PRODUCER;
+
+
+static inline uint64_t Nanoseconds()
+{
+  //++
+  // Return the monotonic clock, in nanoseconds ...
+  //--
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static void* THREAD_ATTRIBUTES ProducerThread (void *pParam)
+{
+  //++
+  //   Wait for the starting gun and then queue messages as fast as we can,
+  // timing every single one ...
+  //--
+  assert(pParam != NULL);
+  CThread *pThread = (CThread *) pParam;
+  PRODUCER *pProducer = (PRODUCER *) pThread->GetParameter();
+  if (pProducer->fPrivate) pProducer->pQueue->RegisterThread();
+  char szText[CLog::MAXMSG];
+  while (!pProducer->pfGo->load(std::memory_order_acquire)) ;
+  for (size_t i = 0;  i < pProducer->vecLatency.size();  ++i) {
+    snprintf(szText, sizeof(szText), "message %u from a benchmark thread", MKINT32(i));
+    uint64_t llStart = Nanoseconds();
+    bool fAdded = pProducer->pQueue->AddEntry(CLog::TRACE, szText, false, true);
+    pProducer->vecLatency[i] = (uint32_t) (Nanoseconds() - llStart);
+    if (!fAdded) ++pProducer->nDropped;
+  }
+  if (pProducer->fPrivate) pProducer->pQueue->UnregisterThread();
+  return pThread->End();
+}
+
+
+static bool RunTest (CMessageQueue *pQueue, uint32_t nThreads, bool fPrivate, uint32_t nMessages)
+{
+  //++
+  //   Start nThreads producers, let them all go at once, and then collect
+  // and print the latencies.  Returns false if a thread couldn't be started
+  // or any message was dropped ...
+  //--
+  std::atomic<bool> fGo(false);
+  vector<PRODUCER> vecProducers(nThreads);
+  vector<CThread *> vecThreads;
+  bool fOK = true;
+  for (uint32_t i = 0;  i < nThreads;  ++i) {
+    PRODUCER &producer = vecProducers[i];
+    producer.pQueue = pQueue;  producer.fPrivate = fPrivate;
+    producer.pfGo = &fGo;  producer.nDropped = 0;
+    producer.vecLatency.resize(nMessages);
+    CThread *pThread = DBGNEW CThread(&ProducerThread, "producer");
+    pThread->SetParameter(&producer);
+    if (!pThread->Begin()) {
+      delete pThread;  fOK = false;  break;
+    }
+    vecThreads.push_back(pThread);
+  }
+  uint64_t llStart = Nanoseconds();
+  fGo.store(true, std::memory_order_release);
+  for (size_t i = 0;  i < vecThreads.size();  ++i) {
+    vecThreads[i]->Wait();  delete vecThreads[i];
+  }
+  double tElapsed = (Nanoseconds() - llStart) / 1e9;
+  if (!fOK) return false;
+
+  // Merge everybody's latencies and print the statistics ...
+  vector<uint32_t> vecAll;  uint32_t nDropped = 0;
+  for (uint32_t i = 0;  i < nThreads;  ++i) {
+    vecAll.insert(vecAll.end(), vecProducers[i].vecLatency.begin(), vecProducers[i].vecLatency.end());
+    nDropped += vecProducers[i].nDropped;
+  }
+  std::sort(vecAll.begin(), vecAll.end());
+  uint64_t llTotal = 0;
+  for (size_t i = 0;  i < vecAll.size();  ++i) llTotal += vecAll[i];
+  printf("%7u  %-7s  %8u  %8u  %9u  %8.0f  %10.0f  %7u\n", nThreads, fPrivate ? "private" : "shared",
+    vecAll[vecAll.size()/2], vecAll[(vecAll.size()*99)/100], vecAll.back(),
+    (double) llTotal / vecAll.size(), vecAll.size() / tElapsed, nDropped);
+  return nDropped == 0;
+}
+
+
+int main (int argc, char *argv[])
+{
+  //++
+  //--
+  uint32_t nMessages = (argc > 1) ? (uint32_t) atoi(argv[1]) : DEFAULT_MESSAGES;
+  string sLogFile = (argc > 2) ? argv[2] : "/tmp/MessageQueueBench.log";
+  if (nMessages == 0) {
+    fprintf(stderr, "usage: %s [messages-per-thread [log-file]]\n", argv[0]);  return 2;
+  }
+  CLog *pLog = DBGNEW CLog("MessageQueueBench");
+  pLog->SetDefaultConsoleLevel(CLog::WARNING);
+  if (!pLog->OpenLog(sLogFile, CLog::TRACE, false) || !pLog->StartLoggingThread()) {
+    fprintf(stderr, "%s: unable to start logging to %s\n", argv[0], sLogFile.c_str());
+    delete pLog;  return 1;
+  }
+  CMessageQueue *pQueue = pLog->GetMessageQueue();
+
+  // Measure the clock overhead, which is included in every latency ...
+  uint64_t llStart = Nanoseconds(), llOverhead = 0;
+  for (uint32_t i = 0;  i < 100000;  ++i) llOverhead += Nanoseconds() - Nanoseconds();
+  llOverhead = (Nanoseconds() - llStart) / 200000;
+  printf("%u messages per thread, %u entry queue, clock overhead %u ns\n\n",
+    nMessages, pQueue->GetSize(), MKINT32(llOverhead));
+
+  printf("threads  rings      median       p99      worst      mean    messages  dropped\n");
+  printf("                        ns        ns         ns        ns       per s\n");
+  bool fOK = true;
+  const uint32_t anThreads[] = {1, 4, MAX_THREADS};
+  for (size_t i = 0;  i < sizeof(anThreads)/sizeof(anThreads[0]);  ++i) {
+    fOK = RunTest(pQueue, anThreads[i], false, nMessages) && fOK;
+    fOK = RunTest(pQueue, anThreads[i], true, nMessages) && fOK;
+  }
+  pLog->StopLoggingThread();
+  pLog->CloseLog();
+  unlink(sLogFile.c_str());
+  delete pLog;
+  return fOK ? 0 : 1;
+}
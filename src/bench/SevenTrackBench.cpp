@@ -0,0 +1,207 @@
+//++
+// SevenTrackBench.cpp -> seven track frame conversion benchmark
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the UPE LIBRARY project.  UPELIB is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    UPELIB is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   This program measures CTapeImageFile::Strip7Track() and Insert7Track(),
+// which convert seven track frames eight at a time in a 64 bit word, against
+// the obvious scalar version - a 256 entry table lookup for every byte.  It
+// converts the same maximum length (60000 byte) records both ways in each
+// parity mode, checks that the results and bad frame counts agree exactly,
+// and prints the speed of each along with the speedup.
+//
+//   The test data is random frames with the right parity, with a bad frame
+// (wrong parity or bit 7 set) sprinkled in about once per thousand bytes, so
+// both the good and bad paths get exercised.  The exit status is 1 if the
+// word and scalar versions ever disagree.
+//
+// Usage:
+//    SevenTrackBench [passes]
+//
+// REVISION HISTORY:
+// 16-OCT-26        New file.
+//--
+//000000001111111111222222222233333333334444444444555555555566666666667777777777
+//234567890123456789012345678901234567890123456789012345678901234567890123456789
+#include <stdio.h>              // printf(), et al ...
+#include <stdlib.h>             // atoi(), rand(), etc ...
+#include <stdint.h>             // uint8_t, uint32_t, etc ...
+#include <string.h>             // memcpy(), memcmp(), etc ...
+#include <time.h>               // clock_gettime() ...
+#include <assert.h>             // assert() (what else??)
+#include <string>               // C++ std::string class, et al ...
+#include <vector>               // C++ std::vector template
+using std::string;              // ...
+using std::vector;              // ...
+#include "UPELIB.hpp"           // UPE library definitions
+#include "LogFile.hpp"          // UPE library message logging facility
+#include "ImageFile.hpp"        // CTapeImageFile declarations
+
+// Benchmark parameters ...
+#define DEFAULT_PASSES  2000                    // records converted per test
+#define RECORD_LENGTH   CTapeImageFile::MAXRECLEN // longest possible record
+#define BAD_FRAME_ODDS  1000                    // one bad frame in this many
+
+// Scalar conversion tables, indexed by frame or character, for each parity ...
+static uint8_t g_abStrip[3][256];       // frame -> character
+static bool    g_afBad[3][256];         // frame -> TRUE if it's bad
+static uint8_t g_abInsert[3][256];      // character -> frame
+
+
+static double Now()
+{
+  //++
+  // Return the current time, in seconds, from the monotonic clock ...
+  //--
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+
+static uint8_t Parity (uint8_t bChar, CTapeImageFile::PARITY nParity)
+{
+  //++
+  //   Return the parity bit (as bit 6) for the six data bits of a character,
+  // computed the slow and obvious way ...
+  //--
+  uint32_t nOnes = 0;
+  for (uint32_t i = 0;  i < 6;  ++i)
+    if ((bChar & (1 << i)) != 0) ++nOnes;
+  bool fSet = (nParity == CTapeImageFile::PARITY_ODD) ? ((nOnes & 1) == 0) : ((nOnes & 1) != 0);
+  return fSet ? 0x40 : 0;
+}
+
+
+static void BuildTables()
+{
+  //++
+  //   Fill in the scalar conversion tables for every parity mode ...
+  //--
+  for (uint32_t p = CTapeImageFile::PARITY_NONE;  p <= CTapeImageFile::PARITY_EVEN;  ++p) {
+    CTapeImageFile::PARITY nParity = (CTapeImageFile::PARITY) p;
+    for (uint32_t b = 0;  b < 256;  ++b) {
+      if (nParity == CTapeImageFile::PARITY_NONE) {
+        g_abStrip[p][b] = b & 0x7F;  g_afBad[p][b] = (b & 0x80) != 0;
+        g_abInsert[p][b] = b & 0x7F;
+      } else {
+        g_abStrip[p][b] = b & 0x3F;
+        g_afBad[p][b] = ((b & 0x80) != 0) || ((b & 0x40) != Parity(b, nParity));
+        g_abInsert[p][b] = (b & 0x3F) | Parity(b, nParity);
+      }
+    }
+  }
+}
+
+
+static size_t ScalarStrip (uint8_t *pabData, size_t cbData, CTapeImageFile::PARITY nParity)
+{
+  //++
+  // Strip7Track(), one byte at a time ...
+  //--
+  size_t cbBad = 0;
+  for (size_t i = 0;  i < cbData;  ++i) {
+    if (g_afBad[nParity][pabData[i]]) ++cbBad;
+    pabData[i] = g_abStrip[nParity][pabData[i]];
+  }
+  return cbBad;
+}
+
+
+static void ScalarInsert (const uint8_t *pabChars, uint8_t *pabFrames, size_t cbData, CTapeImageFile::PARITY nParity)
+{
+  //++
+  // Insert7Track(), one byte at a time ...
+  //--
+  for (size_t i = 0;  i < cbData;  ++i)
+    pabFrames[i] = g_abInsert[nParity][pabChars[i]];
+}
+
+
+static bool TestParity (CTapeImageFile::PARITY nParity, const char *pszName, uint32_t nPasses)
+{
+  //++
+  //   Time both versions of both conversions for one parity mode, check that
+  // they agree, and print the results.  Each pass starts over from the same
+  // original frames so the strip always has something to do ...
+  //--
+  vector<uint8_t> vecFrames(RECORD_LENGTH), vecWord(RECORD_LENGTH), vecScalar(RECORD_LENGTH);
+  for (size_t i = 0;  i < vecFrames.size();  ++i) {
+    uint8_t b = (uint8_t) rand();
+    vecFrames[i] = g_abInsert[nParity][b];
+    if ((rand() % BAD_FRAME_ODDS) == 0) vecFrames[i] ^= (rand() & 1) ? 0x40 : 0x80;
+  }
+  size_t cbBadWord = 0, cbBadScalar = 0;
+  bool fOK = true;
+
+  // Strip the parity, both ways ...
+  double tStart = Now();
+  for (uint32_t n = 0;  n < nPasses;  ++n) {
+    memcpy(vecWord.data(), vecFrames.data(), RECORD_LENGTH);
+    cbBadWord = CTapeImageFile::Strip7Track(vecWord.data(), RECORD_LENGTH, nParity);
+  }
+  double tStripWord = Now() - tStart;
+  tStart = Now();
+  for (uint32_t n = 0;  n < nPasses;  ++n) {
+    memcpy(vecScalar.data(), vecFrames.data(), RECORD_LENGTH);
+    cbBadScalar = ScalarStrip(vecScalar.data(), RECORD_LENGTH, nParity);
+  }
+  double tStripScalar = Now() - tStart;
+  if ((cbBadWord != cbBadScalar) || (vecWord != vecScalar)) fOK = false;
+
+  // Then put the parity back, starting from the stripped characters ...
+  vector<uint8_t> vecChars(vecScalar);
+  tStart = Now();
+  for (uint32_t n = 0;  n < nPasses;  ++n)
+    CTapeImageFile::Insert7Track(vecChars.data(), vecWord.data(), RECORD_LENGTH, nParity);
+  double tInsertWord = Now() - tStart;
+  tStart = Now();
+  for (uint32_t n = 0;  n < nPasses;  ++n)
+    ScalarInsert(vecChars.data(), vecScalar.data(), RECORD_LENGTH, nParity);
+  double tInsertScalar = Now() - tStart;
+  if (vecWord != vecScalar) fOK = false;
+
+  double cbMB = (double) RECORD_LENGTH * nPasses / 1048576.0;
+  printf("%-6s strip   %8.1f  %8.1f  %6.1fx   %u bad frames\n", pszName,
+    cbMB/tStripScalar, cbMB/tStripWord, tStripScalar/tStripWord, MKINT32(cbBadWord));
+  printf("%-6s insert  %8.1f  %8.1f  %6.1fx   %s\n", pszName,
+    cbMB/tInsertScalar, cbMB/tInsertWord, tInsertScalar/tInsertWord, fOK ? "OK" : "FAILED");
+  return fOK;
+}
+
+
+int main (int argc, char *argv[])
+{
+  //++
+  //--
+  uint32_t nPasses = (argc > 1) ? (uint32_t) atoi(argv[1]) : DEFAULT_PASSES;
+  if (nPasses == 0) {
+    fprintf(stderr, "usage: %s [passes]\n", argv[0]);  return 2;
+  }
+  CLog *pLog = DBGNEW CLog("SevenTrackBench");
+  pLog->SetDefaultConsoleLevel(CLog::WARNING);
+  BuildTables();
+  srand(1);
+  printf("%u records of %u bytes\n\n", nPasses, (uint32_t) RECORD_LENGTH);
+  printf("parity  kernel   scalar      word  speedup\n");
+  printf("                   MB/s      MB/s\n");
+  bool fOK = TestParity(CTapeImageFile::PARITY_NONE, "none", nPasses);
+  fOK = TestParity(CTapeImageFile::PARITY_ODD, "odd", nPasses) && fOK;
+  fOK = TestParity(CTapeImageFile::PARITY_EVEN, "even", nPasses) && fOK;
+  delete pLog;
+  return fOK ? 0 : 1;
+}
@@ -0,0 +1,192 @@
+//++
+// TapeReadAheadBench.cpp -> sequential tape read benchmark
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the UPE LIBRARY project.  UPELIB is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    UPELIB is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   This program measures how fast CTapeImageFile::ReadForwardRecord() can
+// read a large TAP image from start to finish, which is what a restore from
+// tape does.  It writes a synthetic tape (2Gb by default) with a mix of
+// record lengths, including odd ones that need a pad byte, and a tape mark
+// every thousand records.  Then it reads the whole tape back three times -
+// with plain stdio, with the read ahead buffers, and with the tape mapped -
+// and checks every record's length and record number.  After that it does
+// the same thing again with a tape (a quarter the size) of nothing but 80
+// byte card images.  The mixed tape is mostly a test of memory bandwidth,
+// and the card images measure the overhead of each record.
+//
+//   It prints records per second and megabytes per second for each mode,
+// and exits with status 1 if anything failed to verify.  Unless the tape is
+// bigger than memory it'll be in the page cache after it's written, so this
+// really measures the per record overhead rather than the disk.
+//
+// Usage:
+//    TapeReadAheadBench [tape-file [megabytes]]
+//
+// REVISION HISTORY:
+// 16-OCT-26        New file.
+//--
+//000000001111111111222222222233333333334444444444555555555566666666667777777777
+//234567890123456789012345678901234567890123456789012345678901234567890123456789
+#include <stdio.h>              // printf(), et al ...
+#include <stdlib.h>             // atoi(), etc ...
+#include <stdint.h>             // uint8_t, uint32_t, etc ...
+#include <string.h>             // memset(), memcpy(), etc ...
+#include <unistd.h>             // unlink() ...
+#include <time.h>               // clock_gettime() ...
+#include <assert.h>             // assert() (what else??)
+#include <vector>               // C++ std::vector template
+using std::vector;              // ...
+#include "UPELIB.hpp"           // UPE library definitions
+#include "LogFile.hpp"          // UPE library message logging facility
+#include "ImageFile.hpp"        // CTapeImageFile declarations
+#include "TapeReadAhead.hpp"    // CTapeReadAhead statistics
+
+// Benchmark parameters ...
+#define DEFAULT_MB      2048                    // default tape size
+#define FILE_RECORDS    1000                    // records between tape marks
+
+//   Record lengths cycle thru one of these tables.  The mixed tape has card
+// images, a few odd lengths and some big blocks, which is about what real
+// backup tapes hold.  The other one is a deck of cards ...
+static const uint32_t g_acbMixed[] = {80, 512, 2049, 8192, 10241, 32768, 60000, 135};
+static const uint32_t g_acbCards[] = {80};
+#define COUNTOF(a)      (sizeof(a) / sizeof(a[0]))
+
+
+static double Now()
+{
+  //++
+  // Return the current time, in seconds, from the monotonic clock ...
+  //--
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+
+static uint64_t WriteTape (const char *pszFile, uint64_t cbTape, const uint32_t *pacbRecords, size_t nLengths, uint32_t &nRecords)
+{
+  //++
+  //   Write the synthetic tape and return its length in bytes (or zero if
+  // something failed).  Each record starts with its own record number, and
+  // the rest is filled with a pattern that depends on it ...
+  //--
+  unlink(pszFile);
+  CTapeImageFile tape;
+  if (!tape.Open(pszFile, false) || !tape.EnableWriteBehind()) return 0;
+  vector<uint8_t> vecRecord(CTapeImageFile::MAXRECLEN);
+  uint64_t cbWritten = 0;
+  for (nRecords = 0;  cbWritten < cbTape;  ++nRecords) {
+    uint32_t cbRecord = pacbRecords[nRecords % nLengths];
+    memset(vecRecord.data(), (uint8_t) nRecords, cbRecord);
+    memcpy(vecRecord.data(), &nRecords, sizeof(nRecords));
+    if (!tape.WriteRecord(vecRecord.data(), cbRecord)) return 0;
+    cbWritten += cbRecord + 2*sizeof(uint32_t) + (cbRecord & 1);
+    if (((nRecords+1) % FILE_RECORDS) == 0) {
+      if (!tape.WriteMark()) return 0;
+      cbWritten += sizeof(uint32_t);
+    }
+  }
+  if (!tape.WriteMark() || !tape.WriteMark() || !tape.Flush()) return 0;
+  return tape.GetFileLength();
+}
+
+
+static bool ReadTape (const char *pszFile, const char *pszMode, int nMode, const uint32_t *pacbRecords, size_t nLengths, uint32_t nRecords, uint64_t cbTape)
+{
+  //++
+  //   Read the whole tape, in one of three modes (0 = stdio, 1 = read ahead,
+  // 2 = mapped), and verify every record.  Returns false if anything went
+  // wrong ...
+  //--
+  CTapeImageFile tape;
+  if (!tape.Open(pszFile, true)) {
+    fprintf(stderr, "%s: unable to open %s\n", pszMode, pszFile);  return false;
+  }
+  if (   ((nMode == 1) && !tape.EnableReadAhead(CTapeReadAhead::DEFAULT_BUFFER))
+      || ((nMode == 2) && (!tape.EnableMapping() || !tape.IsMapped()))) {
+    fprintf(stderr, "%s: unable to enable this mode\n", pszMode);  return false;
+  }
+  vector<uint8_t> vecRecord(CTapeImageFile::MAXRECLEN);
+  uint32_t nRead = 0, nBad = 0, nMarks = 0;
+  double tStart = Now();
+  for (;;) {
+    int32_t cbRecord = tape.ReadForwardRecord(vecRecord.data(), vecRecord.size());
+    if (cbRecord == CTapeImageFile::TAPEMARK) {
+      if (++nMarks > (nRecords / FILE_RECORDS) + 1) break;
+      continue;
+    }
+    if (cbRecord < 0) {
+      fprintf(stderr, "%s: error %d after record %u\n", pszMode, cbRecord, nRead);
+      ++nBad;  break;
+    }
+    uint32_t nRecord;
+    memcpy(&nRecord, vecRecord.data(), sizeof(nRecord));
+    if ((nRecord != nRead) || ((uint32_t) cbRecord != pacbRecords[nRead % nLengths])) ++nBad;
+    ++nRead;
+  }
+  double tRead = Now() - tStart;
+  const CTapeReadAhead *pReadAhead = tape.GetReadAhead();
+  uint64_t llStalls = (pReadAhead != NULL) ? pReadAhead->GetStalls() : 0;
+  tape.Close();
+  if (nRead != nRecords) {
+    fprintf(stderr, "%s: read %u records, expected %u\n", pszMode, nRead, nRecords);  ++nBad;
+  }
+  printf("%-10s  %10.0f  %8.1f  %8llu  %s\n", pszMode, nRead/tRead,
+    cbTape/1048576.0/tRead, (unsigned long long) llStalls, (nBad == 0) ? "OK" : "FAILED");
+  return nBad == 0;
+}
+
+
+static bool RunTape (const char *pszFile, const char *pszName, uint64_t cbTape, const uint32_t *pacbRecords, size_t nLengths)
+{
+  //++
+  //   Write one synthetic tape, read it back in all three modes, and then
+  // delete it.  Returns false if anything failed ...
+  //--
+  uint32_t nRecords = 0;
+  double tStart = Now();
+  uint64_t cbWritten = WriteTape(pszFile, cbTape, pacbRecords, nLengths, nRecords);
+  if (cbWritten == 0) {
+    fprintf(stderr, "unable to write %s\n", pszFile);
+    unlink(pszFile);  return false;
+  }
+  printf("%s: wrote %u records, %.2f Gb, in %.1f seconds\n\n", pszName, nRecords,
+    cbWritten/1073741824.0, Now()-tStart);
+  printf("mode           records/s      MB/s    stalls\n");
+  bool fOK = ReadTape(pszFile, "stdio", 0, pacbRecords, nLengths, nRecords, cbWritten);
+  fOK = ReadTape(pszFile, "read ahead", 1, pacbRecords, nLengths, nRecords, cbWritten) && fOK;
+  fOK = ReadTape(pszFile, "mapped", 2, pacbRecords, nLengths, nRecords, cbWritten) && fOK;
+  printf("\n");
+  unlink(pszFile);
+  return fOK;
+}
+
+
+int main (int argc, char *argv[])
+{
+  //++
+  //--
+  const char *pszFile = (argc > 1) ? argv[1] : "/tmp/TapeReadAheadBench.tap";
+  uint64_t cbTape = (uint64_t) ((argc > 2) ? atoi(argv[2]) : DEFAULT_MB) << 20;
+  CLog *pLog = DBGNEW CLog("TapeReadAheadBench");
+  pLog->SetDefaultConsoleLevel(CLog::WARNING);
+  bool fOK = RunTape(pszFile, "mixed records", cbTape, g_acbMixed, COUNTOF(g_acbMixed));
+  fOK = RunTape(pszFile, "card images", cbTape/4, g_acbCards, COUNTOF(g_acbCards)) && fOK;
+  delete pLog;
+  return fOK ? 0 : 1;
+}
@@ -0,0 +1,74 @@
+//++
+// CompressDisk.cpp -> convert a disk image to the compressed format
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the UPE LIBRARY project.  UPELIB is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    UPELIB is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   This program converts an ordinary (simh style) disk image to a compressed,
+// read only, image using CCompressedImage::CompressImage().  The result can be
+// attached anywhere an ordinary image can - CDiskImageFile recognizes it
+// automatically.  The chunk size must be a multiple of the sector size, and
+// bigger chunks compress a little better but make random reads slower.
+//
+//   The output file is overwritten if it already exists, but it can't be
+// the same file as the input.
+//
+// Usage:
+//    CompressDisk raw-image compressed-image [sector-size [chunk-size]]
+//
+// REVISION HISTORY:
+// 16-OCT-26        New file.
+//--
+//000000001111111111222222222233333333334444444444555555555566666666667777777777
+//234567890123456789012345678901234567890123456789012345678901234567890123456789
+#include <stdio.h>              // printf(), et al ...
+#include <stdlib.h>             // strtoul(), etc ...
+#include <stdint.h>             // uint8_t, uint32_t, etc ...
+#include <sys/stat.h>           // stat() ...
+#include <assert.h>             // assert() (what else??)
+#include "UPELIB.hpp"           // UPE library definitions
+#include "LogFile.hpp"          // UPE library message logging facility
+#include "CompressedImage.hpp"  // CCompressedImage declarations
+
+// Defaults for the optional arguments ...
+#define DEFAULT_SECTOR_SIZE     512     // bytes per sector
+
+
+int main (int argc, char *argv[])
+{
+  //++
+  //--
+  if ((argc < 3) || (argc > 5)) {
+    fprintf(stderr, "usage: %s raw-image compressed-image [sector-size [chunk-size]]\n", argv[0]);
+    return 2;
+  }
+  uint32_t nSectorSize = (argc > 3) ? (uint32_t) strtoul(argv[3], NULL, 0) : DEFAULT_SECTOR_SIZE;
+  uint32_t cbChunk = (argc > 4) ? (uint32_t) strtoul(argv[4], NULL, 0)
+                                : (uint32_t) CCompressedImage::DEFAULT_CHUNK_SIZE;
+  if ((nSectorSize == 0) || (cbChunk == 0)) {
+    fprintf(stderr, "%s: invalid sector or chunk size\n", argv[0]);
+    return 2;
+  }
+  CLog *pLog = DBGNEW CLog("CompressDisk");
+  pLog->SetDefaultConsoleLevel(CLog::WARNING);
+  bool fOK = CCompressedImage::CompressImage(argv[1], argv[2], nSectorSize, cbChunk);
+  struct stat stRaw, stNew;
+  if (fOK && (stat(argv[1], &stRaw) == 0) && (stat(argv[2], &stNew) == 0) && (stRaw.st_size > 0))
+    printf("%s: %lld bytes -> %s: %lld bytes (%.1f%%)\n", argv[1], (long long) stRaw.st_size,
+      argv[2], (long long) stNew.st_size, 100.0 * stNew.st_size / stRaw.st_size);
+  delete pLog;
+  return fOK ? 0 : 1;
+}
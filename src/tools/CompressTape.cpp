@@ -0,0 +1,85 @@
+//++
+// CompressTape.cpp -> convert a TAP image to or from a compressed tape
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the UPE LIBRARY project.  UPELIB is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    UPELIB is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   This program converts an ordinary TAP tape image to a compressed tape
+// with CTapeImageFile::CompressTape(), or (with -x) converts a compressed
+// tape back to a TAP file with CTapeImageFile::ExpandTape().  Expanding
+// always gives a byte for byte copy of the original TAP file.  Compressed
+// tapes can be attached anywhere an ordinary tape can - CTapeImageFile
+// recognizes them automatically.
+//
+//   The output file is overwritten if it already exists, but it can't be
+// the same file as the input.
+//
+// Usage:
+//    CompressTape tap-file compressed-file [block-size]
+//    CompressTape -x compressed-file tap-file
+//
+// REVISION HISTORY:
+// 16-OCT-26        New file.
+//--
+//000000001111111111222222222233333333334444444444555555555566666666667777777777
+//234567890123456789012345678901234567890123456789012345678901234567890123456789
+#include <stdio.h>              // printf(), et al ...
+#include <stdlib.h>             // strtoul(), etc ...
+#include <stdint.h>             // uint8_t, uint32_t, etc ...
+#include <string.h>             // strcmp(), etc ...
+#include <sys/stat.h>           // stat() ...
+#include <assert.h>             // assert() (what else??)
+#include "UPELIB.hpp"           // UPE library definitions
+#include "LogFile.hpp"          // UPE library message logging facility
+#include "ImageFile.hpp"        // CTapeImageFile declarations
+
+
+static void Usage (const char *pszProgram)
+{
+  //++
+  // Print the usage message ...
+  //--
+  fprintf(stderr, "usage: %s tap-file compressed-file [block-size]\n", pszProgram);
+  fprintf(stderr, "       %s -x compressed-file tap-file\n", pszProgram);
+}
+
+
+int main (int argc, char *argv[])
+{
+  //++
+  //--
+  bool fExpand = (argc > 1) && (strcmp(argv[1], "-x") == 0);
+  if (fExpand ? (argc != 4) : ((argc < 3) || (argc > 4))) {
+    Usage(argv[0]);  return 2;
+  }
+  const char *pszIn = argv[fExpand ? 2 : 1];
+  const char *pszOut = argv[fExpand ? 3 : 2];
+  uint32_t cbBlock = (!fExpand && (argc > 3)) ? (uint32_t) strtoul(argv[3], NULL, 0)
+                                              : (uint32_t) CTapeImageFile::DEFAULT_COMPRESS_BLOCK;
+  if (cbBlock == 0) {
+    fprintf(stderr, "%s: invalid block size\n", argv[0]);  return 2;
+  }
+  CLog *pLog = DBGNEW CLog("CompressTape");
+  pLog->SetDefaultConsoleLevel(CLog::WARNING);
+  bool fOK = fExpand ? CTapeImageFile::ExpandTape(pszIn, pszOut)
+                     : CTapeImageFile::CompressTape(pszIn, pszOut, cbBlock);
+  struct stat stIn, stOut;
+  if (fOK && (stat(pszIn, &stIn) == 0) && (stat(pszOut, &stOut) == 0) && (stIn.st_size > 0))
+    printf("%s: %lld bytes -> %s: %lld bytes (%.1f%%)\n", pszIn, (long long) stIn.st_size,
+      pszOut, (long long) stOut.st_size, 100.0 * stOut.st_size / stIn.st_size);
+  delete pLog;
+  return fOK ? 0 : 1;
+}
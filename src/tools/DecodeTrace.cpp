@@ -0,0 +1,57 @@
+//++
+// DecodeTrace.cpp -> convert a binary trace file to a text log
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the UPE LIBRARY project.  UPELIB is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    UPELIB is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   This program turns a binary trace file, as written by CTraceFile when
+// a log is opened with CLog::OpenLog(..., fBinary=true), back into an
+// ordinary text log with CTraceFile::Decode().  The text goes to the file
+// given or, if there isn't one, to standard output.  Messages whose saved
+// arguments don't match their format string are decoded as far as possible,
+// with "(?)" standing in for any argument of the wrong type.
+//
+// Usage:
+//    DecodeTrace trace-file [text-file]
+//
+// REVISION HISTORY:
+// 16-OCT-26        New file.
+//--
+//000000001111111111222222222233333333334444444444555555555566666666667777777777
+//234567890123456789012345678901234567890123456789012345678901234567890123456789
+#include <stdio.h>              // printf(), et al ...
+#include <stdlib.h>             // exit(), etc ...
+#include <stdint.h>             // uint8_t, uint32_t, etc ...
+#include <sys/timeb.h>          // struct timeb (for CLog::TIMESTAMP) ...
+#include <assert.h>             // assert() (what else??)
+#include "UPELIB.hpp"           // UPE library definitions
+#include "LogFile.hpp"          // UPE library message logging facility
+#include "TraceFile.hpp"        // CTraceFile declarations
+
+
+int main (int argc, char *argv[])
+{
+  //++
+  //--
+  if ((argc < 2) || (argc > 3)) {
+    fprintf(stderr, "usage: %s trace-file [text-file]\n", argv[0]);  return 2;
+  }
+  CLog *pLog = DBGNEW CLog("DecodeTrace");
+  pLog->SetDefaultConsoleLevel(CLog::WARNING);
+  bool fOK = CTraceFile::Decode(argv[1], (argc > 2) ? argv[2] : "");
+  delete pLog;
+  return fOK ? 0 : 1;
+}
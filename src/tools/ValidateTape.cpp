@@ -0,0 +1,133 @@
+//++
+// ValidateTape.cpp -> check (and repair) TAP tape images
+//
+//       COPYRIGHT (C) 2015-2017 Vulcan Inc.
+//       Developed by Living Computers: Museum+Labs
+//
+// LICENSE:
+//    This file is part of the UPE LIBRARY project.  UPELIB is free software;
+// you may redistribute it and/or modify it under the terms of the GNU Affero
+// General Public License as published by the Free Software Foundation, either
+// version 3 of the License, or (at your option) any later version.
+//
+//    UPELIB is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+// more details.  You should have received a copy of the GNU Affero General
+// Public License along with MBS.  If not, see http://www.gnu.org/licenses/.
+//
+// DESCRIPTION:
+//   This program checks the structure of one or more tape images with a
+// CTapeValidator and prints what it finds - the number of records and tape
+// marks on each tape and every problem, with its offset and record number.
+// Tapes are checked in parallel by the validator's worker threads.  With -r,
+// a repaired copy of each tape is written to a file with the same name plus
+// the suffix given (e.g. "-r .fixed").  The repaired copy is always an
+// ordinary TAP file, and it can't be the same file as the original.  Padded
+// records aren't really errors, so they're only counted unless -v is used.
+//
+//   The exit status is zero if every tape is good (padded records are OK),
+// one if any tape is damaged or couldn't be read, and two for usage errors.
+//
+// Usage:
+//    ValidateTape [-v] [-t threads] [-r suffix] tape-file ...
+//
+// REVISION HISTORY:
+// 16-OCT-26        New file.
+//--
+//000000001111111111222222222233333333334444444444555555555566666666667777777777
+//234567890123456789012345678901234567890123456789012345678901234567890123456789
+#include <stdio.h>              // printf(), et al ...
+#include <stdlib.h>             // strtoul(), etc ...
+#include <stdint.h>             // uint8_t, uint32_t, etc ...
+#include <string.h>             // strcmp(), etc ...
+#include <assert.h>             // assert() (what else??)
+#include <string>               // C++ std::string class, et al ...
+using std::string;              // ...
+#include "UPELIB.hpp"           // UPE library definitions
+#include "LogFile.hpp"          // UPE library message logging facility
+#include "TapeValidator.hpp"    // CTapeValidator declarations
+
+
+static void Usage (const char *pszProgram)
+{
+  //++
+  // Print the usage message ...
+  //--
+  fprintf(stderr, "usage: %s [-v] [-t threads] [-r suffix] tape-file ...\n", pszProgram);
+}
+
+
+static bool PrintReport (const CTapeValidator::TAPE_REPORT &report, bool fVerbose)
+{
+  //++
+  //   Print the results for one tape and return TRUE if it's good.  Padded
+  // records are listed only if fVerbose is true ...
+  //--
+  if (!report.fOpened) {
+    printf("%s: unable to open\n", report.sFileName.c_str());  return false;
+  }
+  printf("%s: %s - %llu bytes, %u records (%u bad data), %u marks, %u problems\n",
+    report.sFileName.c_str(), report.fDamaged ? "DAMAGED" : "OK",
+    (unsigned long long) report.llLength, report.nRecords, report.nBadRecords,
+    report.nMarks, report.nProblems);
+  for (size_t i = 0;  i < report.vecProblems.size();  ++i) {
+    const CTapeValidator::TAPE_PROBLEM &problem = report.vecProblems[i];
+    if (!fVerbose && (problem.nProblem == CTapeValidator::PROBLEM_PADDED)) continue;
+    printf("  %s at offset %llu, record %u, %llu bytes, metadata 0x%08X%s\n",
+      CTapeValidator::ProblemToString(problem.nProblem), (unsigned long long) problem.llOffset,
+      problem.nRecord, (unsigned long long) problem.cbLength, problem.lMetadata,
+      problem.fRepaired ? " (repaired)" : "");
+  }
+  if (report.nProblems > report.vecProblems.size())
+    printf("  ... and %u more\n", MKINT32(report.nProblems - report.vecProblems.size()));
+  if (!report.sRepairFile.empty())
+    printf("  repaired copy %s %s\n", report.sRepairFile.c_str(),
+      report.fRepaired ? "written" : "FAILED");
+  return !report.fDamaged && (report.sRepairFile.empty() || report.fRepaired);
+}
+
+
+int main (int argc, char *argv[])
+{
+  //++
+  //--
+  uint32_t nThreads = CTapeValidator::DEFAULT_THREADS;
+  string sSuffix;  bool fVerbose = false;
+  int nArg = 1;
+  for (;  (nArg < argc-1) && (argv[nArg][0] == '-');  ++nArg) {
+    if (strcmp(argv[nArg], "-v") == 0)
+      fVerbose = true;
+    else if (strcmp(argv[nArg], "-t") == 0)
+      nThreads = (uint32_t) strtoul(argv[++nArg], NULL, 0);
+    else if (strcmp(argv[nArg], "-r") == 0)
+      sSuffix = argv[++nArg];
+    else
+      break;
+  }
+  if ((nArg >= argc) || (argv[nArg][0] == '-')
+   || (nThreads == 0) || (nThreads > CTapeValidator::MAXTHREADS)) {
+    Usage(argv[0]);  return 2;
+  }
+  CLog *pLog = DBGNEW CLog("ValidateTape");
+  pLog->SetDefaultConsoleLevel(CLog::ERROR);
+
+  //   Queue all the tapes and let the worker threads at them.  Stop() waits
+  // for every one to be checked ...
+  CTapeValidator *pValidator = DBGNEW CTapeValidator(nThreads);
+  for (int i = nArg;  i < argc;  ++i)
+    pValidator->AddTape(argv[i], sSuffix.empty() ? string() : string(argv[i]) + sSuffix);
+  bool fOK = pValidator->Start();
+  if (!fOK)
+    fprintf(stderr, "%s: unable to start the worker threads\n", argv[0]);
+  else {
+    pValidator->Stop();
+    for (uint32_t i = 0;  i < pValidator->GetTapeCount();  ++i) {
+      assert(pValidator->IsDone(i));
+      if (!PrintReport(pValidator->GetReport(i), fVerbose)) fOK = false;
+    }
+  }
+  delete pValidator;
+  delete pLog;
+  return fOK ? 0 : 1;
+}